@@ -4,33 +4,42 @@ layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aUV;
 layout (location = 3) in vec3 aTangent;
 layout (location = 4) in vec3 aBitangent;
+#include "grass.glsl"
 
 uniform mat4 model;
+// Inverse transpose of the model matrix, computed once per model on the CPU
+uniform mat3 normalMatrix;
 uniform mat4 view;
 uniform mat4 projection;
 
 
-out vec3 vNormal;
 out vec2 vUV;
 out vec3 vFragPos;
-out vec3 vViewPos;
-out vec3 vVertexPos;
-out mat4 vModel;
-out vec3 vTangent;
-out vec3 vBitangent;
+invariant gl_Position; // Matches depth-map.vert for the depth prepass
+#ifdef FEATURE_NORMAL_MAP
+out mat3 vTBN; // Tangent space to world space
+#else
+out vec3 vNormal;
+#endif
 
 void main() {
-    vNormal = mat3(transpose(inverse(model))) * aNormal; 
-    //vNormal = aNormal;
-    //vNormal = vec3(0);
-    vUV = aUV;
-    vViewPos = vec3(inverse(view) * vec4(0.0, 0.0, 0.0, 1.0));
-    vVertexPos = aPos;
-    vModel = model;
-    vTangent = aTangent;
-    vBitangent = aBitangent;
+#ifdef FEATURE_GRASS_INSTANCES
+    vec4 worldPos = grassWorldPosition(aPos);
+    vec3 normal = grassNormal(aNormal);
+#else
+    vec4 worldPos = model * vec4(aPos, 1.0);
+    vec3 normal = normalMatrix * aNormal;
+#endif
 
+#if defined(FEATURE_NORMAL_MAP) && defined(FEATURE_GRASS_INSTANCES)
+    vTBN = mat3(grassTangent(normal), grassBitangent(), normal);
+#elif defined(FEATURE_NORMAL_MAP)
+    vTBN = mat3(normalMatrix * aTangent, normalMatrix * aBitangent, normal);
+#else
+    vNormal = normal;
+#endif
+    vUV = aUV;
+    vFragPos = vec3(worldPos);
 
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
-    vFragPos = vec3(model * vec4(aPos, 1.0));
+    gl_Position = projection * view * worldPos;
 }
\ No newline at end of file
@@ -0,0 +1,25 @@
+#version 330 core
+out vec4 FragColor;
+
+#include "shadow-debug.glsl"
+
+// Light accumulated by the deferred passes and the G-buffer depth,
+// written to the screen so blended geometry can be drawn after.
+// With FEATURE_SHADOW_DEBUG the passes left the highest shadow
+// debug level in red instead.
+uniform sampler2D gLight;
+uniform sampler2D gDepth;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth >= 1.0) discard; // Keep the skybox
+
+    vec3 result = texelFetch(gLight, pixel, 0).rgb;
+#ifdef FEATURE_SHADOW_DEBUG
+    result = shadowDebugColor(result.r);
+#endif
+    float gamma = 1.1;
+    FragColor = vec4(pow(result, vec3(1.0/gamma)), 1.0);
+    gl_FragDepth = depth;
+}
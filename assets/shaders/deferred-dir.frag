@@ -0,0 +1,23 @@
+#version 330 core
+out vec4 FragColor;
+
+#include "deferred.glsl"
+
+// the ##CONSTANT's are replaced by a value when
+// shader is parsed in the program.
+uniform DirecitonalLight dirLights[##MAX_NUM_DIRLIGHTS];
+uniform int numDirLights;
+
+void main() {
+    Surface surface = getGBufferSurface();
+
+    vec3 lighting = vec3(0.0);
+    for (int i = 0; i < ##MAX_NUM_DIRLIGHTS; i++) {
+        if (i >= numDirLights) break;
+        lighting += getDirLightContribution(surface, dirLights[i]);
+    }
+#ifdef FEATURE_SHADOW_DEBUG
+    lighting = vec3(shadowDebugLevel(), 0.0, 0.0);
+#endif
+    FragColor = vec4(lighting, 1.0);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+#extension GL_ARB_texture_cube_map_array : enable
+out vec4 FragColor;
+
+#include "deferred.glsl"
+#include "point-shadows.glsl"
+
+uniform int lightIndex; // Record in the light clusters
+
+void main() {
+    Surface surface = getGBufferSurface();
+    ClusterLight light = fetchClusterLight(lightIndex);
+    if (!pointLightReaches(surface, light)) discard;
+
+    float shadow = 0.0;
+#if defined(FEATURE_POINT_SHADOWS) || defined(FEATURE_PARABOLOID_SHADOWS)
+    shadow = computePointShadow(light, surface.position);
+#endif
+#ifdef FEATURE_SHADOW_DEBUG
+    FragColor = vec4(shadowDebugLevel(), 0.0, 0.0, 1.0);
+#else
+    FragColor = vec4((1.0 - shadow) * getPointLightContribution(surface, light), 1.0);
+#endif
+}
@@ -0,0 +1,25 @@
+#version 330 core
+out vec4 FragColor;
+
+#include "deferred.glsl"
+
+uniform int lightIndex; // Record in the light clusters
+#ifdef FEATURE_SPOT_SHADOWS
+uniform SpotShadow spotShadow;
+#endif
+
+void main() {
+    Surface surface = getGBufferSurface();
+    ClusterLight light = fetchClusterLight(lightIndex);
+    if (!spotLightReaches(surface, light)) discard;
+
+    float shadow = 0.0;
+#ifdef FEATURE_SPOT_SHADOWS
+    shadow = computeAtlasShadow(spotShadow, surface.position);
+#endif
+#ifdef FEATURE_SHADOW_DEBUG
+    FragColor = vec4(shadowDebugLevel(), 0.0, 0.0, 1.0);
+#else
+    FragColor = vec4((1.0 - shadow) * getSpotLightContribution(surface, light), 1.0);
+#endif
+}
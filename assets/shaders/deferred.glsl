@@ -0,0 +1,32 @@
+// Reads the surface back from the G-buffer for the deferred light passes
+#include "lighting.glsl"
+
+uniform sampler2D gPosition;
+uniform sampler2D gNormal;
+uniform sampler2D gAlbedo;
+uniform sampler2D gSpecular;
+uniform sampler2D gReflection;
+uniform vec3 viewPos;
+
+Surface getGBufferSurface() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 position = texelFetch(gPosition, pixel, 0);
+    vec4 normal = texelFetch(gNormal, pixel, 0);
+
+    Surface surface;
+    surface.position = position.xyz;
+    surface.specularExponent = position.w;
+    surface.normal = normal.xyz;
+    surface.reflectiveness = normal.w;
+    surface.diffuse = texelFetch(gAlbedo, pixel, 0).rgb;
+    surface.specular = texelFetch(gSpecular, pixel, 0).rgb;
+    surface.specularStrength = 1.0; // Already applied to the specular color
+    surface.reflection = texelFetch(gReflection, pixel, 0).rgb;
+    surface.ambient = vec3(0.0);
+    surface.alpha = 1.0;
+    surface.viewDir = normalize(viewPos - surface.position);
+#if defined(FEATURE_DIR_MOMENTS) || defined(FEATURE_SPOT_MOMENTS)
+    prepareMomentShadows(surface.position);
+#endif
+    return surface;
+}
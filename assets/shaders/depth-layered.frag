@@ -0,0 +1,29 @@
+#version 330 core
+
+#include "material.glsl"
+uniform Material material;
+
+in vec2 gUV;
+
+float getAlpha() {
+    float alpha = material.alpha;
+#ifdef FEATURE_ALPHA_TEST
+#ifdef FEATURE_AMBIENT_MAP
+    alpha *= texture(material.ambientMap, gUV).a;
+#endif
+#ifdef FEATURE_DIFFUSE_MAP
+    alpha *= texture(material.diffuseMap, gUV).a;
+#endif
+#endif
+    return alpha;
+}
+
+// Same as depth-map.frag, for the layered shadow passes
+void main()
+{                
+#ifdef FEATURE_ALPHA_TEST
+    if (getAlpha() < 0.1) {
+        discard;
+    }
+#endif
+}
@@ -1,50 +1,29 @@
 
 #version 330 core
 
-struct Material {
-    int hasDiffuseMap;
-    sampler2D diffuseMap;
-    vec3 diffuseColor;
-
-    sampler2D specularMap;
-    int hasSpecularMap;
-    vec3 specularColor;
-    float specularExponent;
-    float specularStrength;
-
-    int hasAmbientMap;
-    sampler2D ambientMap;
-    vec3 ambientColor;
-
-    int hasNormalMap;
-    sampler2D normalMap;
-
-    float alpha;
-    float reflectiveness;
-
-    bool shouldCastShadow;
-};
+#include "material.glsl"
 uniform Material material;
 
 in vec2 vUV;
 
 float getAlpha() {
     float alpha = material.alpha;
-    if (material.hasAmbientMap > 0) {
-        alpha *= texture(material.ambientMap, vUV).a;
-    }
-
-    if (material.hasDiffuseMap > 0) {
-        alpha *= texture(material.diffuseMap, vUV).a;
-    }
-    
+#ifdef FEATURE_ALPHA_TEST
+#ifdef FEATURE_AMBIENT_MAP
+    alpha *= texture(material.ambientMap, vUV).a;
+#endif
+#ifdef FEATURE_DIFFUSE_MAP
+    alpha *= texture(material.diffuseMap, vUV).a;
+#endif
+#endif
     return alpha;
 }
 
 void main()
 {                
-    if (!material.shouldCastShadow || getAlpha() < 0.1) {
-        
+#ifdef FEATURE_ALPHA_TEST
+    if (getAlpha() < 0.1) {
         discard;
     }
+#endif
 }  
\ No newline at end of file
@@ -1,6 +1,7 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 2) in vec2 aUV;
+#include "grass.glsl"
 
 uniform mat4 projection;
 uniform mat4 view;
@@ -8,8 +9,17 @@ uniform mat4 model;
 
 out vec2 vUV;
 
+// Same math as blinn-phong.vert, the main pass tests
+// against the depth prepass with GL_EQUAL.
+invariant gl_Position;
+
 void main()
 {
     vUV = aUV;
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+#ifdef FEATURE_GRASS_INSTANCES
+    vec4 worldPos = grassWorldPosition(aPos);
+#else
+    vec4 worldPos = model * vec4(aPos, 1.0);
+#endif
+    gl_Position = projection * view * worldPos;
 }  
\ No newline at end of file
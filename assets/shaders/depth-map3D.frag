@@ -1,28 +1,6 @@
 #version 330 core
 
-struct Material {
-    int hasDiffuseMap;
-    sampler2D diffuseMap;
-    vec3 diffuseColor;
-
-    sampler2D specularMap;
-    int hasSpecularMap;
-    vec3 specularColor;
-    float specularExponent;
-    float specularStrength;
-
-    int hasAmbientMap;
-    sampler2D ambientMap;
-    vec3 ambientColor;
-
-    int hasNormalMap;
-    sampler2D normalMap;
-
-    float alpha;
-    float reflectiveness;
-
-    bool shouldCastShadow;
-};
+#include "material.glsl"
 uniform Material material;
 
 in vec2 gUV;
@@ -30,14 +8,14 @@ in vec4 gFragPos;
 
 float getAlpha() {
     float alpha = material.alpha;
-    if (material.hasAmbientMap > 0) {
-        alpha *= texture(material.ambientMap, gUV).a;
-    }
-
-    if (material.hasDiffuseMap > 0) {
-        alpha *= texture(material.diffuseMap, gUV).a;
-    }
-    
+#ifdef FEATURE_ALPHA_TEST
+#ifdef FEATURE_AMBIENT_MAP
+    alpha *= texture(material.ambientMap, gUV).a;
+#endif
+#ifdef FEATURE_DIFFUSE_MAP
+    alpha *= texture(material.diffuseMap, gUV).a;
+#endif
+#endif
     return alpha;
 }
 
@@ -46,12 +24,13 @@ uniform float farPlane;
 
 void main()
 {                
+#ifdef FEATURE_ALPHA_TEST
     if (getAlpha() < 0.1) {
         discard;
-    } else {
-        float lightDistance = length(gFragPos.xyz - lightPos);
-        lightDistance = lightDistance / farPlane;
-        gl_FragDepth = lightDistance;
     }
+#endif
+    float lightDistance = length(gFragPos.xyz - lightPos);
+    lightDistance = lightDistance / farPlane;
+    gl_FragDepth = lightDistance;
 
 }  
\ No newline at end of file
@@ -1,6 +1,7 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 2) in vec2 aUV;
+#include "grass.glsl"
 
 uniform mat4 model;
 
@@ -9,5 +10,9 @@ out vec2 vUV;
 void main()
 {
     vUV = aUV;
+#ifdef FEATURE_GRASS_INSTANCES
+    gl_Position = grassWorldPosition(aPos);
+#else
     gl_Position = model * vec4(aPos, 1.0);
+#endif
 }  
\ No newline at end of file
@@ -0,0 +1,48 @@
+#version 330 core
+
+#include "material.glsl"
+uniform Material material;
+
+in vec2 gUV;
+flat in vec4 gPlane;
+
+float getAlpha() {
+    float alpha = material.alpha;
+#ifdef FEATURE_ALPHA_TEST
+#ifdef FEATURE_AMBIENT_MAP
+    alpha *= texture(material.ambientMap, gUV).a;
+#endif
+#ifdef FEATURE_DIFFUSE_MAP
+    alpha *= texture(material.diffuseMap, gUV).a;
+#endif
+#endif
+    return alpha;
+}
+
+uniform float farPlane;
+uniform float mapSize; // Side of a hemisphere in texels
+
+void main()
+{
+#ifdef FEATURE_ALPHA_TEST
+    if (getAlpha() < 0.1) {
+        discard;
+    }
+#endif
+    // Direction from the light through this texel of the paraboloid
+    vec2 p = gl_FragCoord.xy / mapSize * 2.0 - 1.0;
+    float r2 = dot(p, p);
+    if (r2 > 1.0) {
+        discard;
+    }
+    vec3 dir = vec3(2.0 * p, 1.0 - r2) / (1.0 + r2);
+
+    // The distance comes from the triangle's plane, interpolating it
+    // would follow the straight edges of the tessellation
+    float facing = dot(gPlane.xyz, dir);
+    float lightDistance = -gPlane.w / facing;
+    if (facing == 0.0 || lightDistance < 0.0) {
+        discard;
+    }
+    gl_FragDepth = min(lightDistance / farPlane, 1.0);
+}
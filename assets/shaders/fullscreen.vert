@@ -0,0 +1,8 @@
+#version 330 core
+layout (location = 0) in vec2 aPos;
+
+// Covers the screen at the far plane, so a GL_GREATER depth
+// test only passes where geometry has been drawn.
+void main() {
+    gl_Position = vec4(aPos, 1.0, 1.0);
+}
@@ -0,0 +1,29 @@
+#version 330 core
+// G-buffer pass of deferred shading, the attachments
+// are listed in GBuffer.h. Lights are added on top of
+// the ambient term by the deferred light passes.
+layout (location = 0) out vec4 gPosition;
+layout (location = 1) out vec4 gNormal;
+layout (location = 2) out vec4 gAlbedo;
+layout (location = 3) out vec4 gSpecular;
+layout (location = 4) out vec4 gReflection;
+layout (location = 5) out vec4 gLight;
+
+#include "surface.glsl"
+
+uniform vec3 ambientColor;
+
+void main() {
+    Surface surface = getSurface();
+
+    // Nothing is blended here, so alpha tested surfaces
+    // get a harder cut than the 0.1 of forward shading.
+    if (surface.alpha < 0.5) discard;
+
+    gPosition = vec4(surface.position, surface.specularExponent);
+    gNormal = vec4(surface.normal, surface.reflectiveness);
+    gAlbedo = vec4(surface.diffuse, 1.0);
+    gSpecular = vec4(surface.specular * surface.specularStrength, 1.0);
+    gReflection = vec4(surface.reflection, 1.0);
+    gLight = vec4(ambientColor * surface.ambient, 1.0);
+}
@@ -0,0 +1,33 @@
+// Grass tufts drawn instanced (see GrassBatch in Quad.h). The tuft mesh is
+// in units of the tuft's size with its foot at the origin, every instance
+// scales it, turns it about the Y axis and moves it to its foot. Include
+// in the vertex shader, attributes from FIRST_INSTANCE_LOCATION on are per
+// instance.
+#ifdef FEATURE_GRASS_INSTANCES
+layout (location = 5) in vec4 aGrassInstance; // Foot position, yaw
+layout (location = 6) in vec2 aGrassSize;     // Width and height, in 1/256
+
+mat3 grassRotation() {
+    float s = sin(aGrassInstance.w);
+    float c = cos(aGrassInstance.w);
+    return mat3(c, 0.0, -s,  0.0, 1.0, 0.0,  s, 0.0, c);
+}
+
+vec4 grassWorldPosition(vec3 position) {
+    vec2 size = aGrassSize * (1.0 / 256.0);
+    return vec4(aGrassInstance.xyz + grassRotation() * (position * size.xyx), 1.0);
+}
+
+// The blades stand upright, so their normals are horizontal and only
+// turned by the yaw. U runs across the blade and V down it, which gives
+// the tangent frame without any per vertex data.
+vec3 grassNormal(vec3 normal) {
+    return grassRotation() * normal;
+}
+vec3 grassTangent(vec3 worldNormal) {
+    return cross(worldNormal, vec3(0.0, 1.0, 0.0));
+}
+vec3 grassBitangent() {
+    return vec3(0.0, -1.0, 0.0);
+}
+#endif
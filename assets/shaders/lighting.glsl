@@ -0,0 +1,384 @@
+// Light structs and the blinn-phong light math, shared by forward
+// shading (blinn-phong.frag) and the deferred light passes.
+#include "shadow-debug.glsl"
+#include "shadow-moments.glsl"
+
+// Same as ShadowFilter in Shader.h. The variant defines DIR_SHADOW_FILTER,
+// SPOT_SHADOW_FILTER and POINT_SHADOW_FILTER, all tiers but the box
+// sample the shadow maps through comparison samplers.
+#define SHADOW_FILTER_BOX 0
+#define SHADOW_FILTER_HARDWARE 1
+#define SHADOW_FILTER_POISSON_4 2
+#define SHADOW_FILTER_POISSON_8 3
+#define SHADOW_FILTER_POISSON_16 4
+#define SHADOW_FILTER_TAPS(filter) ((filter) == SHADOW_FILTER_POISSON_16 ? 16 : (filter) == SHADOW_FILTER_POISSON_8 ? 8 : (filter) == SHADOW_FILTER_POISSON_4 ? 4 : 1)
+
+// Ordered so the first 4 and the first 8 cover the disk as well
+const vec2 POISSON_DISK[16] = vec2[](
+    vec2(0.9456, -0.7689), vec2(-0.8154, -0.8791), vec2(0.9748, 0.7565), vec2(-0.8141, 0.9144),
+    vec2(-0.0942, -0.9294), vec2(-0.3828, 0.2768), vec2(0.1998, 0.7864), vec2(0.1438, -0.1410),
+    vec2(-0.9420, -0.3991), vec2(0.3450, 0.2939), vec2(-0.9159, 0.4577), vec2(0.4432, -0.9751),
+    vec2(0.5374, -0.4737), vec2(-0.2650, -0.4189), vec2(0.7920, 0.1909), vec2(-0.2419, 0.9971)
+);
+
+// The disk turns from pixel to pixel, so few taps give noise instead of banding
+mat2 shadowDiskRotation() {
+    float angle = 6.2831853 * fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+    float s = sin(angle), c = cos(angle);
+    return mat2(c, s, -s, c);
+}
+// Offset of a tap in the unit disk, the single hardware tap is centered
+vec2 shadowTapOffset(int tap, int taps, mat2 rotation) {
+    return taps == 1 ? vec2(0.0) : rotation * POISSON_DISK[tap];
+}
+
+// With FEATURE_ADAPTIVE_SHADOWS a lookup first takes the four corners of
+// its kernel. Where they agree the fragment is fully lit or fully in
+// shadow and the kernel is skipped, it only runs in the penumbra. Tiers
+// of 4 taps or fewer take the kernel right away.
+#ifdef FEATURE_ADAPTIVE_SHADOWS
+#define SHADOW_KERNEL_ADAPTIVE(filter) ((filter) == SHADOW_FILTER_BOX || (filter) >= SHADOW_FILTER_POISSON_8)
+#else
+#define SHADOW_KERNEL_ADAPTIVE(filter) false
+#endif
+const vec2 SHADOW_KERNEL_CORNERS[4] = vec2[](vec2(-1.0, -1.0), vec2(1.0, -1.0), vec2(-1.0, 1.0), vec2(1.0, 1.0));
+
+// Every lookup that gets to a surface ends here. A kernel that ran after
+// the corners disagreed counts as penumbra even if it came out 0 or 1.
+float endShadowLookup(float shadow, bool fullKernel) {
+#ifdef FEATURE_SHADOW_DEBUG
+    if (fullKernel || (shadow > 0.0 && shadow < 1.0)) shadowClasses |= SHADOW_CLASS_PENUMBRA;
+    else shadowClasses |= shadow >= 1.0 ? SHADOW_CLASS_SHADOWED : SHADOW_CLASS_LIT;
+#endif
+    return shadow;
+}
+
+// Spot light shadow, a tile of the shadow atlas. See DepthMapInfo in Scene.h
+struct SpotShadow {
+    mat4 proj;
+    mat4 view;
+    vec4 atlasRect; // Offset and size of the tile in atlas texture coordinates
+    int mapType;    // Moments are in the same tile of the moment atlas
+};
+#if SPOT_SHADOW_FILTER == SHADOW_FILTER_BOX
+uniform sampler2D shadowAtlas;
+#else
+uniform sampler2DShadow shadowAtlas;
+#endif
+#ifdef FEATURE_SPOT_MOMENTS
+uniform sampler2D shadowMomentAtlas;
+#endif
+
+// 1 where the fragment at depth is behind the atlas at coords
+float atlasShadowTap(vec2 coords, float depth) {
+#if SPOT_SHADOW_FILTER == SHADOW_FILTER_BOX
+    return depth > texture(shadowAtlas, coords).r ? 1.0 : 0.0;
+#else
+    return 1.0 - texture(shadowAtlas, vec3(coords, depth));
+#endif
+}
+
+// Same as MAX_SHADOW_CASCADES in Scene.h
+#define MAX_SHADOW_CASCADES 4
+
+// See CascadedDepthMapInfo in Scene.h
+struct CascadedDepthMapInfo {
+    bool shouldCast;
+    int numCascades;
+#if DIR_SHADOW_FILTER == SHADOW_FILTER_BOX
+    sampler2DArray shadowMap;
+#else
+    sampler2DArrayShadow shadowMap;
+#endif
+    mat4 cascades[MAX_SHADOW_CASCADES]; // World to clip space
+    float bias[MAX_SHADOW_CASCADES];
+    int mapType;
+    int momentLayer; // Of the first cascade in dirMomentMaps
+};
+#ifdef FEATURE_DIR_MOMENTS
+// Moments of all directional lights, a layer per cascade
+uniform sampler2DArray dirMomentMaps;
+#endif
+
+// 1 where the fragment at depth is behind the cascade at coords
+#if DIR_SHADOW_FILTER == SHADOW_FILTER_BOX
+float cascadeShadowTap(sampler2DArray shadowMap, vec2 coords, int cascade, float depth) {
+    return depth > texture(shadowMap, vec3(coords, float(cascade))).r ? 1.0 : 0.0;
+}
+#else
+float cascadeShadowTap(sampler2DArrayShadow shadowMap, vec2 coords, int cascade, float depth) {
+    return 1.0 - texture(shadowMap, vec4(coords, float(cascade), depth));
+}
+#endif
+
+struct DirecitonalLight {
+    float intensity;
+    vec3 diffuse;
+    vec3 specular;
+    vec3 direction;
+    CascadedDepthMapInfo depthMapInfo;
+};
+
+// Point or spot light record from the light clusters, see LightClusters.h
+struct ClusterLight {
+    vec3 position;
+    int shadowSlot;
+    vec3 diffuse;
+    float intensity;
+    vec3 specular;
+    float inner; // Inner radius, cos(cutOff) for spot lights
+    vec3 direction; // Spot lights only, x is 1 for point lights with a paraboloid shadow
+    float outer; // Outer radius, cos(outerCutOff) for spot lights
+};
+
+// Everything about the surface the lights need, evaluated once per
+// fragment before the lights. See surface.glsl for forward shading,
+// deferred.glsl reads it back from the G-buffer.
+struct Surface {
+    vec3 position;
+    vec3 diffuse;
+    vec3 specular;
+    float specularStrength;
+    float specularExponent;
+    vec3 ambient;
+    float alpha;
+    vec3 normal;
+    vec3 viewDir;
+    vec3 reflection; // Skybox reflection tinted by the specular color
+    float reflectiveness;
+};
+
+uniform float shadowFarPlane;
+uniform samplerBuffer clusterLights; // 4 texels per light
+
+ClusterLight fetchClusterLight(int index) {
+    vec4 t0 = texelFetch(clusterLights, index * 4 + 0);
+    vec4 t1 = texelFetch(clusterLights, index * 4 + 1);
+    vec4 t2 = texelFetch(clusterLights, index * 4 + 2);
+    vec4 t3 = texelFetch(clusterLights, index * 4 + 3);
+
+    ClusterLight light;
+    light.position = t0.xyz;
+    light.shadowSlot = int(t0.w);
+    light.diffuse = t1.xyz;
+    light.intensity = t1.w;
+    light.specular = t2.xyz;
+    light.inner = t2.w;
+    light.direction = t3.xyz;
+    light.outer = t3.w;
+    return light;
+}
+
+float calcDiff(Surface surface, vec3 lightDir) {
+    return max(dot(surface.normal, lightDir), 0.0);
+}
+float calcSpec(Surface surface, vec3 lightDir) {
+    vec3 halfwayDir = normalize(lightDir + surface.viewDir);
+    return pow(max(dot(surface.normal, halfwayDir), 0.0), surface.specularExponent);
+}
+
+vec3 applySkybox(Surface surface, vec3 contrib) {
+    return mix(contrib, surface.reflection, surface.reflectiveness);
+}
+
+float computeAttenuation(float distance, float innerRadius, float outerRadius) {
+    float attenuation = 1.0;
+
+    if (distance > innerRadius) {
+        float theta = clamp((distance - innerRadius) / (outerRadius - innerRadius), 0.0, 1.0);
+        attenuation = 1.0 - theta * theta * (3.0 - 2.0 * theta);
+    }
+
+    return clamp(attenuation, 0.0, 1.0); // Ensure attenuation is within valid range
+}
+
+// The filter taps are clamped to the tile, its neighbours hold other lights
+float computeAtlasShadow(SpotShadow spotShadow, vec3 fragPos) {
+    vec4 fragPosLightSpace = spotShadow.proj * spotShadow.view * vec4(fragPos, 1.0);
+    vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+    projCoords = projCoords * 0.5 + 0.5;
+    if (projCoords.x > 1.0 || projCoords.x < 0.0) return 0.0;
+    if (projCoords.y > 1.0 || projCoords.y < 0.0) return 0.0;
+    if (projCoords.z > 1.0 || projCoords.z < 0.0) return 0.0;
+    float currentDepth = projCoords.z;
+    float bias = 0.0015;
+    float shadow = 0.0;
+    vec2 texelSize = 1.0 / textureSize(shadowAtlas, 0);
+    vec2 atlasCoords = spotShadow.atlasRect.xy + projCoords.xy * spotShadow.atlasRect.zw;
+    vec2 tileMin = spotShadow.atlasRect.xy + texelSize * 0.5;
+    vec2 tileMax = spotShadow.atlasRect.xy + spotShadow.atlasRect.zw - texelSize * 0.5;
+#ifdef FEATURE_SPOT_MOMENTS
+    if (spotShadow.mapType != SHADOW_MAP_DEPTH) {
+        // One filtered tap, the mip level follows the footprint of the pixel
+        vec2 momentTexel = 1.0 / textureSize(shadowMomentAtlas, 0);
+        vec2 momentCoords = clamp(atlasCoords, spotShadow.atlasRect.xy + momentTexel * 0.5, spotShadow.atlasRect.xy + spotShadow.atlasRect.zw - momentTexel * 0.5);
+        vec4 clipDx = spotShadow.proj * spotShadow.view * vec4(fragPos + momentPositionDx, 1.0);
+        vec4 clipDy = spotShadow.proj * spotShadow.view * vec4(fragPos + momentPositionDy, 1.0);
+        vec2 gradX = (clipDx.xy / clipDx.w * 0.5 + 0.5 - projCoords.xy) * spotShadow.atlasRect.zw;
+        vec2 gradY = (clipDy.xy / clipDy.w * 0.5 + 0.5 - projCoords.xy) * spotShadow.atlasRect.zw;
+        vec4 moments = textureGrad(shadowMomentAtlas, momentCoords, gradX, gradY);
+        float depth = -(spotShadow.view * vec4(fragPos, 1.0)).z / shadowFarPlane;
+        return endShadowLookup(momentShadow(moments, depth, spotShadow.mapType), false);
+    }
+#endif
+    const int halfkernelWidth = 2;
+    if (SHADOW_KERNEL_ADAPTIVE(SPOT_SHADOW_FILTER)) {
+        float corners = 0.0;
+        for (int i = 0; i < 4; i++) {
+            vec2 tapCoords = clamp(atlasCoords + SHADOW_KERNEL_CORNERS[i] * float(halfkernelWidth) * texelSize, tileMin, tileMax);
+            corners += atlasShadowTap(tapCoords, currentDepth - bias);
+        }
+        if (corners == 0.0 || corners == 4.0) return endShadowLookup(corners * 0.25, false);
+    }
+#if SPOT_SHADOW_FILTER == SHADOW_FILTER_BOX
+    for(int x = -halfkernelWidth; x <= halfkernelWidth; ++x)
+    {
+        for(int y = -halfkernelWidth; y <= halfkernelWidth; ++y)
+        {
+            vec2 tapCoords = clamp(atlasCoords + vec2(x, y) * texelSize, tileMin, tileMax);
+            shadow += atlasShadowTap(tapCoords, currentDepth - bias);
+        }
+    }
+    shadow /= ((halfkernelWidth*2+1)*(halfkernelWidth*2+1));
+#else
+    // The disk reaches as far as the box
+    const int taps = SHADOW_FILTER_TAPS(SPOT_SHADOW_FILTER);
+    mat2 rotation = shadowDiskRotation();
+    for (int i = 0; i < taps; i++) {
+        vec2 tapCoords = clamp(atlasCoords + shadowTapOffset(i, taps, rotation) * (float(halfkernelWidth) + 0.5) * texelSize, tileMin, tileMax);
+        shadow += atlasShadowTap(tapCoords, currentDepth - bias);
+    }
+    shadow /= float(taps);
+#endif
+
+    return endShadowLookup(clamp(shadow, 0.0, 1.0), SHADOW_KERNEL_ADAPTIVE(SPOT_SHADOW_FILTER));
+}
+
+// The cascades overlap and get coarser, the first one that holds
+// the fragment and the whole filter kernel is the sharpest.
+float computeCascadeShadow(CascadedDepthMapInfo depthMapInfo, vec3 fragPos) {
+    if (!depthMapInfo.shouldCast) return 0.0;
+    const int halfkernelWidth = 2;
+    vec2 texelSize = 1.0 / textureSize(depthMapInfo.shadowMap, 0).xy;
+    vec2 margin = texelSize * float(halfkernelWidth + 1);
+    int cascade = -1;
+    vec3 projCoords = vec3(0.0);
+    for (int i = 0; i < MAX_SHADOW_CASCADES; i++) {
+        if (i >= depthMapInfo.numCascades) break;
+        projCoords = (depthMapInfo.cascades[i] * vec4(fragPos, 1.0)).xyz * 0.5 + 0.5;
+        if (all(greaterThanEqual(projCoords.xy, margin)) && all(lessThanEqual(projCoords.xy, 1.0 - margin)) && projCoords.z <= 1.0) {
+            cascade = i;
+            break;
+        }
+    }
+    if (cascade < 0) return 0.0;
+
+#ifdef FEATURE_DIR_MOMENTS
+    if (depthMapInfo.mapType != SHADOW_MAP_DEPTH) {
+        mat4 cascadeMatrix = depthMapInfo.cascades[cascade];
+        vec2 gradX = (cascadeMatrix * vec4(momentPositionDx, 0.0)).xy * 0.5;
+        vec2 gradY = (cascadeMatrix * vec4(momentPositionDy, 0.0)).xy * 0.5;
+        vec4 moments = textureGrad(dirMomentMaps, vec3(projCoords.xy, float(depthMapInfo.momentLayer + cascade)), gradX, gradY);
+        return endShadowLookup(momentShadow(moments, projCoords.z, depthMapInfo.mapType), false);
+    }
+#endif
+    float currentDepth = projCoords.z;
+    float bias = depthMapInfo.bias[cascade];
+    float shadow = 0.0;
+    if (SHADOW_KERNEL_ADAPTIVE(DIR_SHADOW_FILTER)) {
+        float corners = 0.0;
+        for (int i = 0; i < 4; i++) {
+            vec2 tapCoords = projCoords.xy + SHADOW_KERNEL_CORNERS[i] * float(halfkernelWidth) * texelSize;
+            corners += cascadeShadowTap(depthMapInfo.shadowMap, tapCoords, cascade, currentDepth - bias);
+        }
+        if (corners == 0.0 || corners == 4.0) return endShadowLookup(corners * 0.25, false);
+    }
+#if DIR_SHADOW_FILTER == SHADOW_FILTER_BOX
+    for(int x = -halfkernelWidth; x <= halfkernelWidth; ++x)
+    {
+        for(int y = -halfkernelWidth; y <= halfkernelWidth; ++y)
+        {
+            shadow += cascadeShadowTap(depthMapInfo.shadowMap, projCoords.xy + vec2(x, y) * texelSize, cascade, currentDepth - bias);
+        }
+    }
+    shadow /= ((halfkernelWidth*2+1)*(halfkernelWidth*2+1));
+#else
+    const int taps = SHADOW_FILTER_TAPS(DIR_SHADOW_FILTER);
+    mat2 rotation = shadowDiskRotation();
+    for (int i = 0; i < taps; i++) {
+        vec2 tapCoords = projCoords.xy + shadowTapOffset(i, taps, rotation) * (float(halfkernelWidth) + 0.5) * texelSize;
+        shadow += cascadeShadowTap(depthMapInfo.shadowMap, tapCoords, cascade, currentDepth - bias);
+    }
+    shadow /= float(taps);
+#endif
+
+    return endShadowLookup(clamp(shadow, 0.0, 1.0), SHADOW_KERNEL_ADAPTIVE(DIR_SHADOW_FILTER));
+}
+
+vec3 getDirLightContribution(Surface surface, DirecitonalLight light, float shadow) {
+    vec3 lightDir = normalize(-light.direction);
+
+    float diff = calcDiff(surface, lightDir);
+    vec3 diffuse = diff  * light.diffuse * surface.diffuse;
+
+    float spec = calcSpec(surface, lightDir);
+
+    vec3 specular = surface.specularStrength * spec * light.specular * surface.specular;
+
+    vec3 contrib = (1.0 - shadow) * applySkybox(surface, diffuse + specular)  * light.intensity;
+
+    return contrib;
+}
+vec3 getDirLightContribution(Surface surface, DirecitonalLight light) {
+    float shadow = 0.0;
+#ifdef FEATURE_DIR_SHADOWS
+    shadow = computeCascadeShadow(light.depthMapInfo, surface.position);
+#endif
+    return getDirLightContribution(surface, light, shadow);
+}
+
+// Point and spot light contributions without the shadow, callers check
+// the light reaches the surface first and look up the shadow themselves.
+bool pointLightReaches(Surface surface, ClusterLight light) {
+    return length(light.position - surface.position) < light.outer;
+}
+vec3 getPointLightContribution(Surface surface, ClusterLight light) {
+    vec3 lightDir = normalize(light.position - surface.position);
+
+    float diff = calcDiff(surface, lightDir);
+    vec3 diffuse = diff * light.diffuse * surface.diffuse;
+
+    float spec = calcSpec(surface, lightDir);
+    vec3 specular = surface.specularStrength * spec * light.specular * surface.specular;
+
+    float distance = length(light.position - surface.position);
+    float attenuation = computeAttenuation(distance, light.inner, light.outer);
+
+    diffuse *= attenuation;
+    specular *= attenuation;
+
+    return applySkybox(surface, diffuse + specular) * light.intensity;
+}
+
+bool spotLightReaches(Surface surface, ClusterLight light) {
+    vec3 lightDir = normalize(light.position - surface.position);
+    return dot(lightDir, normalize(-light.direction)) > light.outer;
+}
+vec3 getSpotLightContribution(Surface surface, ClusterLight light) {
+    vec3 lightDir = normalize(light.position - surface.position);
+
+    float theta = dot(lightDir, normalize(-light.direction));
+
+    float diff = calcDiff(surface, lightDir);
+    vec3 diffuse = diff  * light.diffuse * surface.diffuse;
+
+    float spec = calcSpec(surface, lightDir);
+    vec3 specular = surface.specularStrength * spec * light.specular * surface.specular;
+
+    float epsilon   = light.inner - light.outer;
+    float intensity = clamp((theta - light.outer) / epsilon, 0.0, 1.0);
+    diffuse *= intensity;
+    specular *= intensity;
+
+    return applySkybox(surface, diffuse + specular) * light.intensity;
+}
@@ -0,0 +1,19 @@
+// Material uniforms shared by every shader drawing scene geometry,
+// set by setMaterialInShader() in Material.cpp.
+struct Material {
+    sampler2D diffuseMap;
+    vec3 diffuseColor;
+
+    sampler2D specularMap;
+    vec3 specularColor;
+    float specularExponent;
+    float specularStrength;
+
+    sampler2D ambientMap;
+    vec3 ambientColor;
+
+    sampler2D normalMap;
+
+    float alpha;
+    float reflectiveness;
+};
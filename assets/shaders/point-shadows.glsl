@@ -0,0 +1,146 @@
+// Point light shadows, every light has a slot of six layers in one cube
+// map array or of two hemispheres in a paraboloid 2D array (see
+// PointShadowPool.h). FEATURE_POINT_SHADOWS is set while there are cube
+// maps, FEATURE_PARABOLOID_SHADOWS while there are paraboloids. Include
+// after lighting.glsl, the including shader enables
+// GL_ARB_texture_cube_map_array right after #version. Without it the
+// scene gives every light a paraboloid.
+#if POINT_SHADOW_FILTER == SHADOW_FILTER_BOX
+#ifdef GL_ARB_texture_cube_map_array
+uniform samplerCubeArray pointShadowMaps;
+#endif
+uniform sampler2DArray paraboloidShadowMaps;
+#else
+#ifdef GL_ARB_texture_cube_map_array
+uniform samplerCubeArrayShadow pointShadowMaps;
+#endif
+uniform sampler2DArrayShadow paraboloidShadowMaps;
+#endif
+// Where each slot was drawn from, the light may have moved since
+uniform samplerBuffer pointShadowOrigins;
+uniform samplerBuffer paraboloidShadowOrigins;
+
+// 1 where the fragment at depth (divided by the far plane) is behind
+// the map in that direction or at those coords
+#ifdef GL_ARB_texture_cube_map_array
+float cubeShadowTap(vec3 direction, int slot, float depth) {
+#if POINT_SHADOW_FILTER == SHADOW_FILTER_BOX
+    return depth > texture(pointShadowMaps, vec4(direction, float(slot))).r ? 1.0 : 0.0;
+#else
+    return 1.0 - texture(pointShadowMaps, vec4(direction, float(slot)), depth);
+#endif
+}
+#endif
+float paraboloidShadowTap(vec2 coords, float layer, float depth) {
+#if POINT_SHADOW_FILTER == SHADOW_FILTER_BOX
+    return depth > texture(paraboloidShadowMaps, vec3(coords, layer)).r ? 1.0 : 0.0;
+#else
+    return 1.0 - texture(paraboloidShadowMaps, vec4(coords, layer, depth));
+#endif
+}
+
+float computeCubeShadow(int slot, vec3 fragPos) {
+#ifdef GL_ARB_texture_cube_map_array
+    if (slot < 0) return 0.0;
+    vec3 fragToLight = fragPos - texelFetch(pointShadowOrigins, slot).xyz;
+    fragToLight.x *= -1.0;
+    float currentDepth = length(fragToLight);
+    float shadow  = 0.0;
+    float bias    = 0.2;
+    float offset  = 0.1;
+    float reference = (currentDepth - bias) / shadowFarPlane;
+    // The disk and the corners lie across the direction to the light
+    vec3 axis = abs(fragToLight.y) < 0.99 * currentDepth ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+    vec3 tangent = normalize(cross(fragToLight, axis));
+    vec3 bitangent = normalize(cross(fragToLight, tangent));
+    if (SHADOW_KERNEL_ADAPTIVE(POINT_SHADOW_FILTER)) {
+        float corners = 0.0;
+        for (int i = 0; i < 4; i++) {
+            vec2 corner = SHADOW_KERNEL_CORNERS[i] * offset;
+            corners += cubeShadowTap(fragToLight + tangent * corner.x + bitangent * corner.y, slot, reference);
+        }
+        if (corners == 0.0 || corners == 4.0) return endShadowLookup(corners * 0.25, false);
+    }
+#if POINT_SHADOW_FILTER == SHADOW_FILTER_BOX
+    float samples = 4.0;
+    for(float x = -offset; x < offset; x += offset / (samples * 0.5))
+    {
+        for(float y = -offset; y < offset; y += offset / (samples * 0.5))
+        {
+            for(float z = -offset; z < offset; z += offset / (samples * 0.5))
+            {
+                shadow += cubeShadowTap(fragToLight + vec3(x, y, z), slot, reference);
+            }
+        }
+    }
+    shadow /= (samples * samples * samples);
+#else
+    const int taps = SHADOW_FILTER_TAPS(POINT_SHADOW_FILTER);
+    mat2 rotation = shadowDiskRotation();
+    for (int i = 0; i < taps; i++) {
+        vec2 tap = shadowTapOffset(i, taps, rotation) * offset;
+        shadow += cubeShadowTap(fragToLight + tangent * tap.x + bitangent * tap.y, slot, reference);
+    }
+    shadow /= float(taps);
+#endif
+
+    return endShadowLookup(clamp(shadow, 0.0, 1.0), SHADOW_KERNEL_ADAPTIVE(POINT_SHADOW_FILTER));
+#else
+    return 0.0;
+#endif
+}
+
+// Lower hemisphere in the first layer of the slot, the projection is the
+// same as in depth-paraboloid.geo
+float computeParaboloidShadow(int slot, vec3 fragPos) {
+    if (slot < 0) return 0.0;
+    vec3 fragToLight = fragPos - texelFetch(paraboloidShadowOrigins, slot).xyz;
+    float side = fragToLight.y < 0.0 ? -1.0 : 1.0;
+    vec3 local = vec3(fragToLight.x, -side * fragToLight.z, side * fragToLight.y);
+    float currentDepth = length(fragToLight);
+    vec2 coords = local.xy / (currentDepth + local.z) * 0.5 + 0.5;
+    float layer = float(slot * 2 + (side < 0.0 ? 0 : 1));
+
+    float bias = 0.2;
+    float shadow = 0.0;
+    float reference = (currentDepth - bias) / shadowFarPlane;
+    vec2 texelSize = 1.0 / textureSize(paraboloidShadowMaps, 0).xy;
+    if (SHADOW_KERNEL_ADAPTIVE(POINT_SHADOW_FILTER)) {
+        float corners = 0.0;
+        for (int i = 0; i < 4; i++) {
+            corners += paraboloidShadowTap(coords + SHADOW_KERNEL_CORNERS[i] * texelSize, layer, reference);
+        }
+        if (corners == 0.0 || corners == 4.0) return endShadowLookup(corners * 0.25, false);
+    }
+#if POINT_SHADOW_FILTER == SHADOW_FILTER_BOX
+    for(int x = -1; x <= 1; ++x)
+    {
+        for(int y = -1; y <= 1; ++y)
+        {
+            shadow += paraboloidShadowTap(coords + vec2(x, y) * texelSize, layer, reference);
+        }
+    }
+    shadow /= 9.0;
+#else
+    const int taps = SHADOW_FILTER_TAPS(POINT_SHADOW_FILTER);
+    mat2 rotation = shadowDiskRotation();
+    for (int i = 0; i < taps; i++) {
+        vec2 tapCoords = coords + shadowTapOffset(i, taps, rotation) * 1.5 * texelSize;
+        shadow += paraboloidShadowTap(tapCoords, layer, reference);
+    }
+    shadow /= float(taps);
+#endif
+
+    return endShadowLookup(clamp(shadow, 0.0, 1.0), SHADOW_KERNEL_ADAPTIVE(POINT_SHADOW_FILTER));
+}
+
+float computePointShadow(ClusterLight light, vec3 fragPos) {
+#ifdef FEATURE_PARABOLOID_SHADOWS
+    if (light.direction.x > 0.5) return computeParaboloidShadow(light.shadowSlot, fragPos);
+#endif
+#ifdef FEATURE_POINT_SHADOWS
+    return computeCubeShadow(light.shadowSlot, fragPos);
+#else
+    return 0.0;
+#endif
+}
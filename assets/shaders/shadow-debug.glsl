@@ -0,0 +1,24 @@
+// Shadow classes of the fragment for FEATURE_SHADOW_DEBUG, the shadow
+// lookups in lighting.glsl record how they went.
+#define SHADOW_CLASS_LIT 1
+#define SHADOW_CLASS_SHADOWED 2
+#define SHADOW_CLASS_PENUMBRA 4
+int shadowClasses = 0;
+
+// 0 without shadowed lights, 1 where all lookups were lit, 2 where one
+// was in shadow and 3 where one took the penumbra. The deferred light
+// passes blend it with GL_MAX.
+float shadowDebugLevel() {
+    if ((shadowClasses & SHADOW_CLASS_PENUMBRA) != 0) return 3.0;
+    if ((shadowClasses & SHADOW_CLASS_SHADOWED) != 0) return 2.0;
+    if ((shadowClasses & SHADOW_CLASS_LIT) != 0) return 1.0;
+    return 0.0;
+}
+
+// Green lit, blue shadowed, yellow penumbra
+vec3 shadowDebugColor(float level) {
+    if (level > 2.5) return vec3(1.0, 0.85, 0.0);
+    if (level > 1.5) return vec3(0.1, 0.2, 1.0);
+    if (level > 0.5) return vec3(0.1, 0.8, 0.1);
+    return vec3(0.0);
+}
@@ -0,0 +1,73 @@
+#version 330 core
+#extension GL_ARB_texture_cube_map_array : enable
+// Same as ShadowMask::MAX_LAYERS, layers that aren't attached are dropped
+layout (location = 0) out float ShadowMaskViewDepth;
+layout (location = 1) out vec4 ShadowMask[7];
+
+// Shadows of the shadowed lights at half resolution, a channel each.
+// The channels are laid out as described in shadow-mask.glsl.
+#include "lighting.glsl"
+#include "point-shadows.glsl"
+
+uniform DirecitonalLight dirLights[##MAX_NUM_DIRLIGHTS];
+uniform int numDirLights;
+uniform SpotShadow spotShadows[##MAX_NUM_SPOTLIGHTS];
+
+uniform sampler2D shadowMaskDepth; // Full resolution
+uniform mat4 projectionInverse;
+uniform mat4 viewToWorld;
+uniform int numShadowMaskChannels;
+uniform int shadowMaskSpotBase;
+uniform int shadowMaskPointBase;
+uniform int shadowMaskRecords[28]; // Light cluster record of the spot and point channels
+
+void main() {
+    float shadows[28];
+    for (int i = 0; i < 28; i++) shadows[i] = 0.0;
+    ShadowMaskViewDepth = -1.0; // Matches no fragment
+
+    // The texel stands for the top left pixel of its 2x2
+    ivec2 depthSize = textureSize(shadowMaskDepth, 0);
+    ivec2 pixel = min(ivec2(gl_FragCoord.xy) * 2, depthSize - 1);
+    float depth = texelFetch(shadowMaskDepth, pixel, 0).r;
+    vec3 ndc = vec3((vec2(pixel) + 0.5) / vec2(depthSize), depth) * 2.0 - 1.0;
+    vec4 viewPos = projectionInverse * vec4(ndc, 1.0);
+    vec3 fragPos = (viewToWorld * vec4(viewPos.xyz / viewPos.w, 1.0)).xyz;
+#if defined(FEATURE_DIR_MOMENTS) || defined(FEATURE_SPOT_MOMENTS)
+    prepareMomentShadows(fragPos);
+#endif
+    if (depth < 1.0) {
+        ShadowMaskViewDepth = -viewPos.z / viewPos.w;
+
+        for (int channel = shadowMaskSpotBase; channel < numShadowMaskChannels; channel++) {
+            if (shadowMaskRecords[channel] < 0) continue;
+            // Only where the light reaches, like the forward pass
+            ClusterLight light = fetchClusterLight(shadowMaskRecords[channel]);
+            vec3 lightDir = normalize(light.position - fragPos);
+            if (channel < shadowMaskPointBase) {
+#ifdef FEATURE_SPOT_SHADOWS
+                bool reaches = dot(lightDir, normalize(-light.direction)) > light.outer;
+                if (reaches && light.shadowSlot >= 0 && light.shadowSlot < ##MAX_NUM_SPOTLIGHTS) {
+                    shadows[channel] = computeAtlasShadow(spotShadows[light.shadowSlot], fragPos);
+                }
+#endif
+            } else {
+#if defined(FEATURE_POINT_SHADOWS) || defined(FEATURE_PARABOLOID_SHADOWS)
+                if (length(light.position - fragPos) < light.outer) shadows[channel] = computePointShadow(light, fragPos);
+#endif
+            }
+        }
+        // Directional lights last, llvmpipe's shader compiler crashes
+        // on the cube map lookups after the cascade loop
+#ifdef FEATURE_DIR_SHADOWS
+        for (int i = 0; i < ##MAX_NUM_DIRLIGHTS; i++) {
+            if (i >= numDirLights) break;
+            shadows[i] = computeCascadeShadow(dirLights[i].depthMapInfo, fragPos);
+        }
+#endif
+    }
+
+    for (int i = 0; i < 7; i++) {
+        ShadowMask[i] = vec4(shadows[i * 4], shadows[i * 4 + 1], shadows[i * 4 + 2], shadows[i * 4 + 3]);
+    }
+}
@@ -0,0 +1,74 @@
+// Reads the screen space shadow mask back in the opaque forward pass,
+// see ShadowMask.h. A channel per shadowed light: the active directional
+// lights first, then the spot shadow slots from shadowMaskSpotBase and
+// the point shadow slots from shadowMaskPointBase. Lights past the last
+// channel look their shadow up themselves.
+uniform sampler2DArray shadowMask;
+uniform sampler2D shadowMaskViewDepth; // Of the pixels the mask texels stand for
+uniform int numShadowMaskChannels;
+uniform int shadowMaskSpotBase;
+uniform int shadowMaskPointBase;
+uniform mat4 projection;
+
+// A mask texel is used where its depth is within this fraction of the
+// fragment's, other texels lie across a depth edge
+const float SHADOW_MASK_DEPTH_TOLERANCE = 0.02;
+
+// Upsampling weights, worked out on the first read of the fragment
+bool shadowMaskPrepared = false;
+bool shadowMaskBilinear = false; // All four texels match, one filtered tap
+ivec2 shadowMaskTexel;
+vec4 shadowMaskWeights;
+vec2 shadowMaskCoords;
+
+float shadowMaskLinearDepth(float depth) {
+    return projection[3][2] / (depth * 2.0 - 1.0 + projection[2][2]);
+}
+
+void prepareShadowMask() {
+    shadowMaskPrepared = true;
+    ivec2 maskSize = textureSize(shadowMask, 0).xy;
+    // Mask texel t was looked up at pixel 2t
+    vec2 position = (gl_FragCoord.xy - 0.5) * 0.5;
+    shadowMaskTexel = ivec2(floor(position));
+    vec2 f = position - vec2(shadowMaskTexel);
+    shadowMaskCoords = (position + 0.5) / vec2(maskSize);
+
+    float depth = shadowMaskLinearDepth(gl_FragCoord.z);
+    vec4 bilinear = vec4((1.0 - f.x) * (1.0 - f.y), f.x * (1.0 - f.y), (1.0 - f.x) * f.y, f.x * f.y);
+    int matching = 0;
+    for (int i = 0; i < 4; i++) {
+        ivec2 texel = clamp(shadowMaskTexel + ivec2(i & 1, i >> 1), ivec2(0), maskSize - 1);
+        float texelDepth = texelFetch(shadowMaskViewDepth, texel, 0).r;
+        bool match = abs(texelDepth - depth) < depth * SHADOW_MASK_DEPTH_TOLERANCE;
+        shadowMaskWeights[i] = match ? bilinear[i] : 0.0;
+        if (match) matching++;
+    }
+    shadowMaskBilinear = matching == 4;
+    float total = dot(shadowMaskWeights, vec4(1.0));
+    if (total > 0.0) shadowMaskWeights /= total;
+}
+
+// False where the light has no channel or no texel around matches the
+// fragment's depth, the caller looks the shadow up itself then
+bool readShadowMask(int channel, out float shadow) {
+    shadow = 0.0;
+    if (channel < 0 || channel >= numShadowMaskChannels) return false;
+    if (!shadowMaskPrepared) prepareShadowMask();
+    if (shadowMaskWeights == vec4(0.0)) return false;
+
+    int layer = channel / 4;
+    int component = channel - layer * 4;
+    if (shadowMaskBilinear) {
+        shadow = texture(shadowMask, vec3(shadowMaskCoords, float(layer)))[component];
+    } else {
+        ivec2 maskSize = textureSize(shadowMask, 0).xy;
+        for (int i = 0; i < 4; i++) {
+            if (shadowMaskWeights[i] == 0.0) continue;
+            ivec2 texel = clamp(shadowMaskTexel + ivec2(i & 1, i >> 1), ivec2(0), maskSize - 1);
+            shadow += shadowMaskWeights[i] * texelFetch(shadowMask, ivec3(texel, layer), 0)[component];
+        }
+    }
+    endShadowLookup(shadow, false);
+    return true;
+}
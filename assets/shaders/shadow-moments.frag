@@ -0,0 +1,61 @@
+#version 330 core
+out vec4 Moments;
+
+// Turns a shadow map into moments, in two passes of a separable Gaussian
+// blur. The first reads the depth, a moment texel covers 2x2 depth texels,
+// and blurs across. The second blurs its result down into the moment map.
+// Taps are clamped to the tile, so neighbouring tiles of the atlas never
+// mix. FEATURE_DIR_SHADOWS reads a cascade, otherwise an atlas tile.
+#include "shadow-moments.glsl"
+
+#ifdef FEATURE_DIR_SHADOWS
+uniform sampler2DArray depthMap;
+uniform int layer;
+#else
+uniform sampler2D depthMap;
+uniform float shadowNearPlane;
+uniform float shadowFarPlane;
+#endif
+uniform sampler2D blurSource; // First pass result, read by the second
+
+uniform bool fromDepth;
+uniform vec2 sourceOffset;  // Tile in the source, in its texels
+uniform vec2 targetOffset;  // Tile in the target
+uniform int tileSize;       // In moment texels
+uniform int blurRadius;     // Taps each side
+uniform int mapType;
+
+float readDepth(ivec2 texel) {
+#ifdef FEATURE_DIR_SHADOWS
+    return texelFetch(depthMap, ivec3(texel, layer), 0).r;
+#else
+    // Distance along the light over the far plane
+    float ndc = texelFetch(depthMap, texel, 0).r * 2.0 - 1.0;
+    float viewDepth = 2.0 * shadowNearPlane * shadowFarPlane / (shadowFarPlane + shadowNearPlane - ndc * (shadowFarPlane - shadowNearPlane));
+    return viewDepth / shadowFarPlane;
+#endif
+}
+
+vec4 readMoments(ivec2 texel) {
+    texel = clamp(texel, ivec2(0), ivec2(tileSize - 1));
+    if (!fromDepth) return texelFetch(blurSource, ivec2(sourceOffset) + texel, 0);
+
+    ivec2 depthTexel = ivec2(sourceOffset) + texel * 2;
+    return 0.25 * (shadowMoments(readDepth(depthTexel), mapType) + shadowMoments(readDepth(depthTexel + ivec2(1, 0)), mapType)
+                 + shadowMoments(readDepth(depthTexel + ivec2(0, 1)), mapType) + shadowMoments(readDepth(depthTexel + ivec2(1, 1)), mapType));
+}
+
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy - targetOffset);
+    ivec2 direction = fromDepth ? ivec2(1, 0) : ivec2(0, 1);
+    float sigma = max(float(blurRadius) * 0.5, 0.5);
+
+    vec4 sum = vec4(0.0);
+    float totalWeight = 0.0;
+    for (int i = -blurRadius; i <= blurRadius; i++) {
+        float weight = exp(-float(i * i) / (2.0 * sigma * sigma));
+        sum += weight * readMoments(texel + direction * i);
+        totalWeight += weight;
+    }
+    Moments = sum / totalWeight;
+}
@@ -0,0 +1,71 @@
+// Moment shadow maps, see ShadowMapType in Scene.h. shadow-moments.frag
+// turns a depth map into moments, the lookups in lighting.glsl bound the
+// lit share of a filtered texel with Chebyshev's inequality.
+//
+// Depths are in [0, 1], the cascades store their orthographic depth and
+// spot lights the view space distance along the light divided by the far
+// plane, perspective depth is too crowded near 1 for 16 bit floats.
+
+// Same as ShadowMapType in Scene.h
+#define SHADOW_MAP_DEPTH 0
+#define SHADOW_MAP_VSM 1
+#define SHADOW_MAP_EVSM 2
+
+// Positive and negative exponent of EVSM. The squared warped depth has to
+// fit a 16 bit float, exp(2 * 5.54) is its largest value.
+const vec2 EVSM_EXPONENTS = vec2(5.0, 5.0);
+// Variance the moments never go below, in depth units squared. Hides
+// the acne of a surface shadowing itself.
+const float MOMENT_MIN_VARIANCE = 0.00002;
+
+// Cuts off the low end of the bound, where light bleeds through where
+// casters overlap. 0 to 1, higher darkens the penumbra as well.
+uniform float shadowBleedReduction;
+
+vec2 evsmWarp(float depth) {
+    depth = depth * 2.0 - 1.0;
+    return vec2(exp(EVSM_EXPONENTS.x * depth), -exp(-EVSM_EXPONENTS.y * depth));
+}
+
+// VSM only fills the first two components
+vec4 shadowMoments(float depth, int mapType) {
+    if (mapType == SHADOW_MAP_EVSM) {
+        vec2 warped = evsmWarp(depth);
+        return vec4(warped.x, warped.x * warped.x, warped.y, warped.y * warped.y);
+    }
+    return vec4(depth, depth * depth, 0.0, 0.0);
+}
+
+// Upper bound of the share of the texel's casters behind depth
+float chebyshevUpperBound(vec2 moments, float depth, float minVariance) {
+    if (depth <= moments.x) return 1.0;
+    float variance = max(moments.y - moments.x * moments.x, minVariance);
+    float d = depth - moments.x;
+    float pMax = variance / (variance + d * d);
+    return clamp((pMax - shadowBleedReduction) / (1.0 - shadowBleedReduction), 0.0, 1.0);
+}
+
+float momentShadow(vec4 moments, float depth, int mapType) {
+    float visibility;
+    if (mapType == SHADOW_MAP_EVSM) {
+        // The warp stretches the variance by its slope
+        vec2 warped = evsmWarp(depth);
+        vec2 slope = EVSM_EXPONENTS * warped;
+        vec2 minVariance = MOMENT_MIN_VARIANCE * slope * slope;
+        visibility = min(chebyshevUpperBound(moments.xy, warped.x, minVariance.x),
+                         chebyshevUpperBound(moments.zw, warped.y, minVariance.y));
+    } else {
+        visibility = chebyshevUpperBound(moments.xy, depth, MOMENT_MIN_VARIANCE);
+    }
+    return 1.0 - visibility;
+}
+
+// Screen space derivatives of the fragment position for the mip level
+// of the moment lookups. The lookups run in branches where implicit
+// derivatives are undefined, so these are taken up front, where the
+// surface is read.
+vec3 momentPositionDx = vec3(0.0), momentPositionDy = vec3(0.0);
+void prepareMomentShadows(vec3 fragPos) {
+    momentPositionDx = dFdx(fragPos);
+    momentPositionDy = dFdy(fragPos);
+}
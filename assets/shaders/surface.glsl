@@ -0,0 +1,82 @@
+// Surface of a fragment from the blinn-phong.vert outputs and the
+// material, shared by forward shading and the G-buffer pass.
+#include "material.glsl"
+#include "lighting.glsl"
+
+in vec2 vUV;
+in vec3 vFragPos;
+#ifdef FEATURE_NORMAL_MAP
+in mat3 vTBN;
+#else
+in vec3 vNormal;
+#endif
+
+uniform Material material;
+uniform vec3 viewPos;
+uniform samplerCube skybox;
+uniform vec3 skyboxAmbient;
+
+// The caller does the alpha test on surface.alpha
+Surface getSurface() {
+    Surface surface;
+    surface.position = vFragPos;
+
+#ifdef FEATURE_DIFFUSE_MAP
+    vec4 diffuseSample = texture(material.diffuseMap, vUV);
+    surface.diffuse = diffuseSample.rgb;
+#else
+    surface.diffuse = material.diffuseColor;
+#endif
+#ifdef FEATURE_AMBIENT_MAP
+    vec4 ambientSample = texture(material.ambientMap, vUV);
+    surface.ambient = ambientSample.rgb;
+#else
+    surface.ambient = material.ambientColor;
+#endif
+
+    surface.alpha = material.alpha;
+#ifdef FEATURE_ALPHA_TEST
+#ifdef FEATURE_AMBIENT_MAP
+    surface.alpha *= ambientSample.a;
+#endif
+#ifdef FEATURE_DIFFUSE_MAP
+    surface.alpha *= diffuseSample.a;
+#endif
+#endif
+
+#ifdef FEATURE_SPECULAR_MAP
+    surface.specular = texture(material.specularMap, vUV).rgb;
+#else
+    surface.specular = material.specularColor;
+#endif
+    surface.specularStrength = material.specularStrength;
+    surface.specularExponent = material.specularExponent;
+
+#ifdef FEATURE_NORMAL_MAP
+    vec3 normSample = texture(material.normalMap, vUV).rgb;
+    vec3 norm = normSample * 2.0 - 1.0; // Convert from [0, 1] to [-1, 1]
+    surface.normal = normalize(vTBN * norm);
+#else
+    surface.normal = normalize(vNormal);
+#endif
+
+    surface.viewDir = normalize(viewPos - vFragPos);
+
+#ifdef FEATURE_REFLECTION
+    vec3 viewDir = surface.viewDir;
+    viewDir.y *= -1;
+    vec3 reflectDir = reflect(viewDir, surface.normal);
+    reflectDir.z *= -1;
+    vec3 R = reflect(reflectDir, surface.normal);
+    surface.reflection = texture(skybox, R).rgb * skyboxAmbient * surface.specular;
+    surface.reflectiveness = material.reflectiveness;
+#else
+    surface.reflection = vec3(0.0);
+    surface.reflectiveness = 0.0;
+#endif
+
+#if defined(FEATURE_DIR_MOMENTS) || defined(FEATURE_SPOT_MOMENTS)
+    prepareMomentShadows(surface.position);
+#endif
+    return surface;
+}
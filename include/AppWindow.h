@@ -7,6 +7,7 @@
 class AppWindow {
 private:
 	GLFWwindow* m_WindowHandle;
+	GLFWwindow* m_SharedContextHandle = nullptr; // Hidden, for loading on other threads
 	bool m_Running = true;
 	bool m_Valid = false;
 public:
@@ -27,4 +28,10 @@ public:
 	void PollEvents();
 	// Swap window buffers
 	void SwapBuffers();
+
+	// Creates a second context sharing objects with the window's context,
+	// to be made current on one other thread.
+	bool CreateSharedContext();
+	void MakeSharedContextCurrent();
+	void ReleaseCurrentContext();
 };
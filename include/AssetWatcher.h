@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+
+#include "Timer.h"
+
+// Watches the asset directory for changed files and reloads only what
+// depends on them. Assets are nodes in a dependency graph keyed by file
+// path (or any unique name for assets made of several files, like a
+// shader). A changed node with a reload handler is reloaded on its own,
+// nodes without one (e.g. shader includes) pass the change on to every
+// node that depends on them.
+class AssetWatcher {
+private:
+    static AssetWatcher* s_Instance;
+
+    std::map<std::string, std::function<void()>> m_Handlers;
+    std::map<std::string, std::set<std::string>> m_Dependencies;
+
+    int m_InotifyFd = -1;
+    std::map<int, std::string> m_WatchDirs; // Watch descriptor to directory
+
+    // Editors save in several steps, changes are handled once
+    // no new events came in for a while.
+    std::set<std::string> m_Changed;
+    Timer m_LastEventTimer;
+
+public:
+    static AssetWatcher& Get();
+
+    AssetWatcher();
+
+    // Starts watching every directory under rootDir, does nothing on
+    // platforms without inotify.
+    void Init(const std::string& rootDir);
+    void Shutdown();
+
+    // Calls onChanged when the node or anything it depends on changed
+    void Watch(const std::string& node, std::function<void()> onChanged);
+    void Unwatch(const std::string& node);
+    void AddDependency(const std::string& node, const std::string& dependency);
+    void SetDependencies(const std::string& node, const std::vector<std::string>& dependencies);
+
+    // Reads file events and reloads what changed, call once per frame
+    void Poll();
+
+private:
+    void AddWatchRecursive(const std::string& dir);
+    void ProcessChanges();
+    std::set<std::string> CollectAffected(const std::set<std::string>& changed) const;
+};
+
+// Absolute, normalized form used for node names
+std::string assetPath(const std::string& path);
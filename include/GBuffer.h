@@ -0,0 +1,45 @@
+#pragma once
+
+#include <glad/glad.h>
+
+// Render targets of deferred shading. The G-buffer pass writes all
+// attachments, the light passes only add to the light accumulation
+// while testing against the depth and stencil of the G-buffer pass.
+//
+//   position    RGBA32F  world position, specular exponent
+//   normal      RGBA16F  world normal, reflectiveness
+//   albedo      RGBA8    diffuse color
+//   specular    RGBA8    specular color times specular strength
+//   reflection  RGBA16F  skybox reflection
+//   light       RGBA16F  ambient, then every light added on top
+//   depth       DEPTH24_STENCIL8
+class GBuffer {
+public:
+    enum Attachment {
+        POSITION, NORMAL, ALBEDO, SPECULAR, REFLECTION, LIGHT, NUM_ATTACHMENTS
+    };
+
+private:
+    GLuint m_FBO = 0;
+    GLuint m_Textures[NUM_ATTACHMENTS] = {};
+    GLuint m_DepthTexture = 0;
+    int m_Width = 0, m_Height = 0;
+
+public:
+    GBuffer() = default;
+    ~GBuffer();
+
+    // (Re)creates the targets when the size changed
+    void Resize(int width, int height);
+
+    // Binds the framebuffer with every attachment as draw buffer
+    void BindForGeometry();
+    // Binds the framebuffer with only the light accumulation as draw buffer
+    void BindForLighting();
+
+    GLuint GetTexture(Attachment attachment) const { return m_Textures[attachment]; }
+    GLuint GetDepthTexture() const { return m_DepthTexture; }
+
+private:
+    void Destroy();
+};
@@ -55,6 +55,44 @@ inline void checkProgram(GLuint program) {
     }
 }
 
+// Entry points and enums newer than the GL 3.3 core profile glad was
+// generated for. They are resolved at runtime by loadGLExtensions() and
+// stay NULL when the driver doesn't expose them, so check
+// getGLExtensions() before calling any of them.
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#define GL_TEXTURE_CUBE_MAP_ARRAY 0x9009
+
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void* binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+extern PFNGLGETPROGRAMBINARYPROC glext_glGetProgramBinary;
+extern PFNGLPROGRAMBINARYPROC glext_glProgramBinary;
+extern PFNGLPROGRAMPARAMETERIPROC glext_glProgramParameteri;
+extern PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glext_glMaxShaderCompilerThreadsKHR;
+#define glGetProgramBinary glext_glGetProgramBinary
+#define glProgramBinary glext_glProgramBinary
+#define glProgramParameteri glext_glProgramParameteri
+#define glMaxShaderCompilerThreadsKHR glext_glMaxShaderCompilerThreadsKHR
+
+struct GLExtensions {
+    // GL 4.1 or ARB_get_program_binary
+    bool programBinary = false;
+    // KHR_parallel_shader_compile or ARB_parallel_shader_compile
+    bool parallelShaderCompile = false;
+    // GL 4.0 or ARB_texture_cube_map_array, no entry points
+    bool textureCubeMapArray = false;
+};
+// Must be called after glad has loaded the core profile
+void loadGLExtensions(GLADloadproc load);
+const GLExtensions& getGLExtensions();
+bool isGLExtensionSupported(const char* name);
+
 #ifdef _DEBUG
 // For every OpenGL call, clear the error, make the call, and check the error
 #define GL_CALL(x) glClearError();\
@@ -68,8 +106,11 @@ inline void checkProgram(GLuint program) {
 struct Texture {
     GLuint id = 0;
     int width, height, channels;
+    bool hasAlpha = false; // Any texel with alpha below 1
 };
 Texture loadTexture(const std::string& path);
+// Uploads the image again into the same GL texture
+bool reloadTexture(Texture& texture, const std::string& path);
 void deleteTexture(const Texture& texture);
 
 GLuint loadCubemap(const std::vector<std::string>& faces);
@@ -80,6 +121,7 @@ private:
     struct Bind {
         GLenum type;
         GLuint texture;
+        GLuint sampler; // Sampler object, 0 for the texture's own parameters
     };
     static std::vector<Bind> s_Slots;
     static GLint s_MaxTextureSlots;
@@ -89,10 +131,10 @@ public:
     // Zero binds o all slots
     static void ResetAll();
     // Sets slot to be applied
-    static void Set(int slot, GLenum type, GLuint texture);
+    static void Set(int slot, GLenum type, GLuint texture, GLuint sampler = 0);
     // Same as set but shows intention of overwriting
     // so no warning message
-    static void Overwrite(int slot, GLenum type, GLuint texture);
+    static void Overwrite(int slot, GLenum type, GLuint texture, GLuint sampler = 0);
     // Apply slots in OpenGL
     static void ApplyAll();
 };
\ No newline at end of file
@@ -7,6 +7,10 @@
 
 extern bool g_ShouldDrawDepthMaps;
 extern int g_DrawDepthMapIndex;
+// Shade opaque geometry through the G-buffer instead of forward
+extern bool g_UseDeferredShading;
+// Lay down opaque depth before forward shading
+extern bool g_UseDepthPrepass;
 
 void SetMainWindow(AppWindow* window);
 AppWindow* GetMainWindow();
\ No newline at end of file
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+#include <glad/glad.h>
+
+#include "Maths.h"
+
+class Shader;
+struct PointLight;
+struct SpotLight;
+
+// Froxel grid over the view frustum for clustered forward shading. The
+// screen is split into tiles and the depth range into exponentially
+// growing slices, every cluster gets the list of point and spot lights
+// that can reach it. Clusters are built on worker threads, one depth slice
+// per job, so it can run while the shadow maps render.
+//
+// The shader reads three buffer textures: light records (4 texels per
+// light, point lights first then spot lights), the offset and count into
+// the index list for every cluster, and the index list itself.
+class LightClusters {
+public:
+    static const int GRID_X = 16, GRID_Y = 9, GRID_Z = 24;
+    static const int NUM_CLUSTERS = GRID_X * GRID_Y * GRID_Z;
+    // Light indices are 16 bit
+    static const int MAX_LIGHTS = 65535;
+
+private:
+    struct AABB {
+        Vec3 min, max;
+    };
+    struct SliceOutput {
+        std::vector<uint16_t> indices;
+        // Point lights that overlap the slice, in the same layout as the
+        // light arrays so the per cluster test can run on them directly.
+        std::vector<float> candX, candY, candZ, candRadius;
+        std::vector<uint16_t> candIndex;
+        std::vector<uint16_t> spotCandidates;
+        double milliseconds = 0.0;
+    };
+
+    // Cluster bounds in view space, only rebuilt when the projection changes
+    std::vector<AABB> m_ClusterBounds;
+    AABB m_SliceBounds[GRID_Z];
+    float m_ProjData[16] = {};
+    float m_Near = 1.0f, m_Far = 100.0f;
+
+    // Point light spheres in view space, structure of arrays padded to a
+    // multiple of 4 so they can be tested 4 at a time.
+    std::vector<float> m_PointX, m_PointY, m_PointZ, m_PointRadius;
+    std::vector<uint16_t> m_PointIndex;
+    // Spot light cones in view space, spot lights have no range so the
+    // cones are tested against the bounding spheres of the clusters.
+    struct Cone {
+        Vec3 position, direction;
+        float cosAngle, sinAngle;
+        uint16_t index;
+    };
+    std::vector<Cone> m_Cones;
+
+    // Offset into the slice's index list and count for every cluster,
+    // offsets are made global once all slices are done.
+    std::vector<uint32_t> m_Grid;
+    SliceOutput m_Slices[GRID_Z];
+
+    std::vector<std::thread> m_Workers;
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkCondition, m_DoneCondition;
+    uint64_t m_BuildGeneration = 0;
+    std::atomic<int> m_NextSlice{ GRID_Z };
+    std::atomic<int> m_SlicesDone{ GRID_Z };
+    bool m_Quit = false;
+    bool m_Building = false;
+
+    GLuint m_LightBuffer = 0, m_LightTexture = 0;
+    GLuint m_GridBuffer = 0, m_GridTexture = 0;
+    GLuint m_IndexBuffer = 0, m_IndexTexture = 0;
+    int m_LightUnit = -1, m_GridUnit = -1, m_IndexUnit = -1;
+    std::vector<float> m_LightRecords;
+    std::vector<uint16_t> m_Indices;
+
+    double m_BuildMilliseconds = 0.0, m_WaitMilliseconds = 0.0;
+    int m_MaxLightsPerCluster = 0;
+
+public:
+    LightClusters();
+    ~LightClusters();
+
+    // Starts assigning the lights to clusters on the worker threads, view
+    // transforms from world to view space and proj must be a symmetric
+    // perspective projection. Inactive lights are left out.
+    void BeginBuild(const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights, const Matrix4& view, const Matrix4& proj);
+    // Helps with the remaining slices and waits for them, then uploads the
+    // light records, cluster grid and index list. Needs the shadow slots of
+    // the lights assigned already.
+    void FinishBuild(const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights);
+
+    // Binds the buffer textures to units starting at firstUnit,
+    // returns the next free unit.
+    int BindTextures(int firstUnit);
+    // Samplers and grid parameters of the cluster lookup in the shader
+    void SetUniforms(Shader& shader, int viewportWidth, int viewportHeight) const;
+
+    // Stats of the last build. Build time is the CPU time spent on the
+    // slices by all threads, wait time how long FinishBuild() blocked.
+    double GetBuildMilliseconds() const { return m_BuildMilliseconds; }
+    double GetWaitMilliseconds() const { return m_WaitMilliseconds; }
+    size_t GetNumIndices() const { return m_Indices.size(); }
+    int GetMaxLightsPerCluster() const { return m_MaxLightsPerCluster; }
+
+private:
+    void UpdateClusterBounds(const Matrix4& proj);
+    void WorkerMain();
+    void ProcessSlices();
+    void BuildSlice(int slice);
+    void Upload();
+};
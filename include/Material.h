@@ -2,6 +2,8 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 #include "GLutils.h"
 #include "Maths.h"
 
@@ -22,6 +24,7 @@ struct Material {
     Texture ambientMap;
     Texture normalMap; 
 
+    // Leaves the shadow render layers, see getMaterialRenderLayers()
     bool shouldCastShadow = true;
 };
 
@@ -30,15 +33,60 @@ private:
     static MaterialLibrary* s_Instance;
 
     std::map<std::string, Material> materials;
+    std::map<std::string, Texture> textures; // By path, each loaded once
+    std::set<std::string> materialFiles;
+    uint32_t version = 0; // Counts reloads
+
+    std::vector<Material> ParseMaterialFile(const std::string& path, std::vector<std::string>& texturePaths);
 public:
     static MaterialLibrary& Get();
 
     MaterialLibrary();
 
+    // Loads each file once and reloads it when it changes on disk
     void LoadMaterialFile(const std::string& path);
+    void ReloadMaterialFile(const std::string& path);
     Material* GetMaterial(const std::string& name);
     void AddMaterial(const std::string& name, const Material& material);
     bool ExistsMaterial(const std::string& name);
+
+    // Loads each texture once and re-uploads it when it changes on disk
+    Texture GetTexture(const std::string& path);
+    void ReloadTexture(const std::string& path);
+
+    // Changes whenever a material file or texture is reloaded
+    uint32_t GetVersion() const { return version; }
+};
+
+// Which materials a geometry pass draws. Deferred shading draws the opaque
+// ones into the G-buffer and the blended ones (alpha below 1) forward
+// afterwards, alpha tested textures count as opaque.
+enum MaterialFilter {
+    MATERIAL_FILTER_ALL,
+    MATERIAL_FILTER_OPAQUE,
+    MATERIAL_FILTER_BLENDED,
+};
+
+// Passes geometry is drawn in. Models, meshes and the grass each have a
+// mask of them, evaluated on the CPU when a pass goes through its draws,
+// so geometry a pass leaves out never reaches the GPU.
+enum RenderLayer : uint32_t {
+    RENDER_LAYER_MAIN         = 1 << 0, // Forward, G-buffer and the depth prepass
+    RENDER_LAYER_DIR_SHADOW   = 1 << 1,
+    RENDER_LAYER_SPOT_SHADOW  = 1 << 2,
+    RENDER_LAYER_POINT_SHADOW = 1 << 3, // Cube and paraboloid maps
 };
+const int RENDER_LAYER_COUNT = 4;
+const uint32_t RENDER_LAYERS_ALL = (1u << RENDER_LAYER_COUNT) - 1;
+const uint32_t RENDER_LAYERS_SHADOWS = RENDER_LAYER_DIR_SHADOW | RENDER_LAYER_SPOT_SHADOW | RENDER_LAYER_POINT_SHADOW;
 
-void setMaterialInShader(Material& material, Shader& shader, int fromActiveTexture);
\ No newline at end of file
+// Layers the material may be drawn in, all but the shadow
+// layers without shouldCastShadow
+uint32_t getMaterialRenderLayers(const Material& material);
+// Shader variant features the material needs (see ShaderFeature)
+uint32_t getMaterialFeatures(const Material& material);
+bool materialPassesFilter(const Material& material, MaterialFilter filter);
+// Returns false while the shader variant for the material is still
+// compiling, nothing should be drawn with it then. extraFeatures are
+// added to the material's, for geometry that needs its own variant.
+bool setMaterialInShader(Material& material, Shader& shader, int fromActiveTexture, uint32_t extraFeatures = 0);
\ No newline at end of file
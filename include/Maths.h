@@ -52,6 +52,10 @@ struct Vec3 {
         return Vec3{x / len, y / len, z / len};
     }
 
+    static float Dot(const Vec3& a, const Vec3& b) {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
     static Vec3 Cross(const Vec3& a, const Vec3& b) {
         return Vec3(
             a.y * b.z - a.z * b.y,
@@ -72,6 +76,13 @@ struct Vec4 {
     float x, y, z, w;
 };
 
+// Column major like Matrix4, only used for normal matrices
+struct Matrix3 {
+    float data[9];
+
+    Matrix3();
+};
+
 struct Matrix4 {
     float data[16];
 
@@ -101,6 +112,8 @@ struct Matrix4 {
     Vec3 TransformDirection(const Vec3& v) const;
 
     Vec3 GetTranslation() const;
+    // Inverse transpose of the upper 3x3, transforms normals to world space
+    Matrix3 GetNormalMatrix() const;
 
     // Helper functions to create matrix
     static Matrix4 Identity();
@@ -15,6 +15,12 @@
 
 class Scene;
 
+// Meshes a Model::Draw() left out
+struct SkippedDraws {
+    int byLayer = 0;   // Not in the pass's layer
+    int compiling = 0; // Their shader variant is still compiling
+};
+
 
  
 
@@ -23,8 +29,12 @@ private:
     std::vector<Vertex> m_Vertices;
     std::vector<unsigned int> m_Indicies;
     GLuint m_VBO, m_VAO, m_EBO;
+    // Packed copies for the depth passes, see Shader::GetVertexStream()
+    GLuint m_PositionVBO, m_PositionVAO;
+    GLuint m_PositionUVVBO, m_PositionUVVAO;
     std::string m_Name;
     std::string m_MaterialName;
+    uint32_t m_RenderLayers = RENDER_LAYERS_ALL;
 public:
     Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::string name, std::string materialName);
     Mesh() {}
@@ -33,16 +43,50 @@ public:
     void DrawCall(Shader& shader);
 
     Material* GetMaterialPtr() const { return MaterialLibrary::Get().GetMaterial(m_MaterialName); }
+    const std::string& GetName() const { return m_Name; }
+    // Set through Model::SetMeshRenderLayers()
+    void SetRenderLayers(uint32_t layers) { m_RenderLayers = layers; }
+    uint32_t GetRenderLayers() const { return m_RenderLayers; }
     
 };
 class Model {
 private:
     std::vector<Mesh*> m_Meshes;
     Matrix4 m_Transform = Matrix4::Identity();
+    std::string m_Path; // Stored for reloading when the file changes
+    uint32_t m_Version = 0; // Counts reloads and render layer changes
+    bool m_IsDynamic = false;
+    uint32_t m_RenderLayers = RENDER_LAYERS_ALL;
+    Vec3 m_BoundsMin, m_BoundsMax; // Of every vertex, in model space
+
+    void Load();
 public:
     Model(const std::string& filepath);
     ~Model();
 
-    void Draw(Scene& scene, Shader& shader, int fromActiveTexture);
+    // Parses the file again and replaces the meshes
+    void Reload();
+    uint32_t GetVersion() const { return m_Version; }
+
+    // Dynamic models are drawn into the shadow maps every frame, static
+    // ones only when a light or a static model changes (see Scene).
+    void SetDynamic(bool dynamic) { m_IsDynamic = dynamic; }
+    bool IsDynamic() const { return m_IsDynamic; }
+
+    // Passes the model is drawn in (see RenderLayer), a mesh is drawn
+    // where the model, the mesh and its material all allow it. The
+    // shadow caches see the change through the version.
+    void SetRenderLayers(uint32_t layers);
+    uint32_t GetRenderLayers() const { return m_RenderLayers; }
+    // Meshes keep their layers across reloads by name
+    void SetMeshRenderLayers(const std::string& meshName, uint32_t layers);
+    size_t GetNumMeshes() const { return m_Meshes.size(); }
+
+    // Draws the meshes in the pass's layer, returns the ones left out.
+    // A lightMask of 0 or more is set on every draw, the lights of a
+    // layered shadow pass that see the model (see depth-layered.geo).
+    SkippedDraws Draw(Scene& scene, Shader& shader, int fromActiveTexture, RenderLayer layer, MaterialFilter filter = MATERIAL_FILTER_ALL, int lightMask = -1);
     Matrix4& GetTransform() { return m_Transform; }
+    // Axis aligned box around the transformed model bounds
+    void GetWorldBounds(Vec3& min, Vec3& max) const;
 };
\ No newline at end of file
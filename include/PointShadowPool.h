@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include <glad/glad.h>
+
+#include "Maths.h"
+
+// One layered depth texture shared by the point light shadows, a slot
+// of layers per light. Cube shadows take six layers of a cube map array,
+// dual paraboloid shadows the two hemispheres of a 2D array (see
+// PointShadowMode in Scene.h), the scene has a pool of each. A light
+// keeps its slot as long as it casts a shadow, so the slot doubles as
+// the light's shadow slot in the shaders and its cached static casters
+// stay where they are.
+//
+// The array grows by doubling when a light finds no free slot, which
+// recreates the textures and everything has to be drawn again. With
+// dynamic casters in the scene the static casters need a second array
+// of the same size (see ShadowCache in Scene.h).
+//
+// The faces of a slot are drawn over several frames (see
+// Scene::SchedulePointShadowFaces()), the light may have moved on since.
+// A buffer texture keeps where each slot was drawn from, the shaders
+// measure the fragment's distance from there.
+class PointShadowPool {
+private:
+    GLenum m_Target;
+    int m_LayersPerSlot;
+    std::vector<bool> m_SlotUsed; // One per slot of the capacity
+
+    GLuint m_FBO = 0, m_Texture = 0;
+    GLuint m_StaticFBO = 0, m_StaticTexture = 0;
+    GLuint m_OriginBuffer = 0, m_OriginTexture = 0; // RGBA32F per slot
+    int m_CreatedSlotSize = 0; // Size the textures were made with
+    bool m_HasStaticPool = false;
+
+    int m_SlotSize = 2048;
+
+public:
+    // GL_TEXTURE_CUBE_MAP_ARRAY with 6 layers per slot
+    // or GL_TEXTURE_2D_ARRAY with 2
+    PointShadowPool(GLenum target, int layersPerSlot);
+    ~PointShadowPool();
+
+    // Side of each layer in texels, takes effect at the next Reserve()
+    void SetSlotSize(int size) { m_SlotSize = size; }
+    int GetSlotSize() const { return m_SlotSize; }
+
+    // Makes room for numSlots slots in use. The textures are recreated
+    // when the capacity, slot size or the need for the static array
+    // changed, returns true then as everything drawn into them is gone.
+    // Slots in use keep their index.
+    bool Reserve(int numSlots, bool withStaticPool);
+    // Lowest free slot, -1 when they are all taken
+    int Acquire();
+    void Release(int slot);
+
+    // Binds the framebuffer of the main or the static array with all
+    // layers attached, for the geometry shader to pick the layer.
+    // clearFaces has a bit per layer of the slot to clear.
+    void Bind(int slot, bool staticPool, int clearFaces);
+    // Light position the slot's faces were drawn from
+    void SetOrigin(int slot, const Vec3& origin);
+
+    int GetCapacity() const { return (int)m_SlotUsed.size(); }
+    GLenum GetTarget() const { return m_Target; }
+    int GetLayersPerSlot() const { return m_LayersPerSlot; }
+    GLuint GetTexture() const { return m_Texture; }
+    GLuint GetStaticTexture() const { return m_StaticTexture; }
+    GLuint GetOriginTexture() const { return m_OriginTexture; }
+    size_t GetMemoryUsage() const;
+
+    // Most slots an array texture of the driver can hold
+    int GetMaxSlots() const;
+
+private:
+    void Destroy();
+};
@@ -1,22 +1,84 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
 
 #include "GLutils.h"
 #include "Maths.h"
+#include "Material.h"
 
 class Shader;
 
-class GrassQuad {
+// A grass tuft of four blades crossing at its foot, 20 bytes per instance.
+// The size is fixed point so it fits next to the yaw (see grass.glsl).
+struct GrassInstance {
+    static constexpr float SIZE_SCALE = 256.0f;
+
+    Vec3 position; // Of the foot
+    float yaw;
+    uint16_t size[2]; // Width and height
+
+    GrassInstance(Vec3 position, float yaw, Vec2 size);
+
+    Vec2 GetSize() const { return Vec2{ size[0] / SIZE_SCALE, size[1] / SIZE_SCALE }; }
+};
+
+// Square cell of the ground with the tufts standing in it, a contiguous
+// range of the instance buffer
+struct GrassChunk {
+    Vec3 boundsMin, boundsMax;
+    size_t first = 0, count = 0;
+};
+
+// Instances of the instance buffer to draw, and the lightMask of the
+// layered shadow passes (-1 without)
+struct GrassRange {
+    size_t first = 0, count = 0;
+    int lightMask = -1;
+};
+
+// Every grass tuft, drawn as instanced draws of the tuft mesh. All vertex
+// streams (see Shader::GetVertexStream()) read the same tuft mesh, it is
+// only a few vertices.
+//
+// The tufts are sorted into chunks of CHUNK_SIZE, nearby chunks next to
+// each other. Within a chunk they are sorted along a Morton curve and then
+// stored in bit reversed order of that, so every prefix of a chunk is
+// spread evenly over it and a thinned out chunk is just a shorter range.
+class GrassBatch {
+public:
+    static constexpr float CHUNK_SIZE = 16.0f;
+
 private:
-    Matrix4 m_Transform;
-    Vec2 m_Size;
+    std::vector<GrassInstance> m_Instances;
+    std::vector<GrassChunk> m_Chunks;
+    GLuint m_VAO = 0, m_MeshVBO = 0, m_EBO = 0, m_InstanceVBO = 0;
+    size_t m_Capacity = 0; // In instances
+    bool m_Dirty = false;
+
 public:
-    GrassQuad(Vec3 position, Vec2 size, Vec3 rotation);
+    GrassBatch() = default;
+    ~GrassBatch();
+    GrassBatch(const GrassBatch&) = delete;
+    GrassBatch& operator=(const GrassBatch&) = delete;
 
-    const Matrix4& GetTransform() const;
+    void Add(const GrassInstance& instance);
+    size_t GetSize() const { return m_Instances.size(); }
+    // Up to date after Upload()
+    const std::vector<GrassChunk>& GetChunks() const { return m_Chunks; }
+    void GetBounds(Vec3& min, Vec3& max) const;
 
-    Vec2 GetSize() const { return m_Size; }
-};
+    // Sorts the tufts into chunks again and uploads them when tufts were
+    // added since the last call
+    void Upload();
+    // Draws the ranges with the grass variant of the shader, one draw per
+    // run of adjoining ranges with the same lightMask (as in Model::Draw()).
+    // Returns false when nothing was drawn since the variant is compiling.
+    bool Draw(Shader& shader, Texture texture, Texture normalMap, int nextActiveTexture, const std::vector<GrassRange>& ranges,
+              MaterialFilter filter = MATERIAL_FILTER_ALL);
 
-void batchDrawGrass(std::vector<GrassQuad>& quads, Shader& shader, Texture texture, Texture normalMap, int nextActiveTexture);
\ No newline at end of file
+private:
+    void Destroy();
+    void CreateMesh();
+    void SortIntoChunks();
+};
\ No newline at end of file
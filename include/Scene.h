@@ -1,34 +1,129 @@
 #pragma once
 
 #include <vector>
+#include <functional>
 
 #include "Quad.h"
 #include "Global.h"
+#include "LightClusters.h"
+#include "GBuffer.h"
+#include "ShadowMask.h"
+#include "ShadowAtlas.h"
+#include "PointShadowPool.h"
+#include "Shader.h"
 
-class Shader;
 class Model;
 
+// Shadow maps are cached. They are only drawn again when the light's
+// matrices or the static casters changed. With dynamic casters in the
+// scene the static ones go into a separate map, which is copied into
+// the shadow map every frame before the dynamic casters are drawn.
+struct ShadowCache {
+    Matrix4 proj, view;
+    uint32_t staticCasterVersion = 0; // 0 when nothing is cached
+    bool inStaticMap = false;
+};
+
+// How the shadow of a spot or directional light is looked up. Moment maps
+// are made from the depth map after it's drawn (see Scene::DrawShadowMoments()),
+// blurred and mipmapped, so one filtered tap gives a soft shadow of
+// about the same width anywhere. VSM keeps the mean depth and depth
+// squared, EVSM those of two exponentially warped depths, which bleeds
+// less light where casters overlap. See shadow-moments.glsl.
+enum ShadowMapType {
+    SHADOW_MAP_DEPTH, // Depth compares, filtered by the light type's ShadowFilter
+    SHADOW_MAP_VSM,
+    SHADOW_MAP_EVSM,
+    SHADOW_MAP_TYPE_COUNT
+};
+
+// Shadow of a spot light, a tile of the scene's shadow atlas. The
+// static casters are cached in the same tile of the static atlas.
 struct DepthMapInfo {
-    GLuint shadowMapFBO = 0;
-    GLuint shadowMapTexture = 0;
+    ShadowAtlas::Rect atlasRect; // Size 0 when the light got no tile this frame
     Matrix4 proj, view;
     bool cast = true;
+    int shadowSlot = -1; // Index in the shadow arrays of the current main pass
+    ShadowCache cache;
+    ShadowMapType mapType = SHADOW_MAP_DEPTH;
+    ShadowMapType momentType = SHADOW_MAP_DEPTH; // The tile's moments were made for
 };
 
-struct DepthMapInfo3D {
+// Cascaded shadow map of a directional light. The view frustum up to the
+// cascade distance is split in depth and every slice gets a layer of the
+// texture array, fitted around the slice's bounding sphere so it doesn't
+// change while the camera turns. See Scene::FitCascades().
+const int MAX_SHADOW_CASCADES = 4; // Same as in lighting.glsl
+const int MAX_LAYERED_SHADOWS = 16; // Lights per layered shadow pass, same as in depth-layered.geo
+struct CascadedDepthMapInfo {
     GLuint shadowMapFBO = 0;
-    GLuint shadowCubeMap = 0;
+    GLuint shadowMapTexture = 0; // Texture array, one layer per cascade
+    GLuint staticFBO = 0, staticTexture = 0; // Only with dynamic casters
+    int numCascades = 0;
+    Matrix4 cascades[MAX_SHADOW_CASCADES]; // World to clip space of each cascade
+    float bias[MAX_SHADOW_CASCADES];       // Depth bias in each cascade's depth range
+    bool cast = true;
+    int shadowMapUnit = -1; // Texture unit in the current main pass
+    ShadowCache cache[MAX_SHADOW_CASCADES]; // Only proj is used
+    ShadowMapType mapType = SHADOW_MAP_DEPTH;
+    // First of the light's layers in the scene's moment array, a layer
+    // per cascade, see Scene::AllocateDirMoments()
+    int momentLayer = -1;
+    ShadowMapType momentType = SHADOW_MAP_DEPTH; // The layers were made for
+};
+
+// A point light shadow is six cube faces, or two hemispheres of a dual
+// paraboloid map at about a third of the cost. The paraboloid projection
+// bends straight edges, the geometry shader tessellates casters that
+// span a wide angle from the light and the depth is traced against the
+// triangle's plane per texel, but silhouettes stay less accurate.
+enum PointShadowMode {
+    POINT_SHADOW_CUBE,
+    POINT_SHADOW_PARABOLOID,
+};
+
+// Shadow of a point light, a slot of one of the scene's point shadow
+// pools. The static casters are cached in the same slot of the static
+// pool. Faces are the cube faces or the paraboloid hemispheres.
+//
+// Faces are drawn one by one as they go stale, a few per frame across
+// all point lights (see Scene::SchedulePointShadowFaces()). A face the
+// budget can't fit keeps what it had and waits for a later frame. Faces
+// hold distances from where the light was, so a light that moved redraws
+// all its faces and the shaders measure from the slot's origin.
+struct DepthMapInfo3D {
     Matrix4 proj;
-    Matrix4 viewTransforms[6];
+    Matrix4 viewTransforms[6]; // Cube faces only
     bool cast = true;
+    // Without cube map arrays the lights fall back to paraboloids
+    PointShadowMode mode = POINT_SHADOW_CUBE;
+    PointShadowMode slotMode = POINT_SHADOW_CUBE; // Pool the slot is in
+    int shadowSlot = -1; // Slot in the pool, kept while the light casts
+    ShadowCache cache[6]; // The view is the light position as a translation
+    // Bit per face, in viewTransforms order or lower hemisphere first
+    int missingFaces = 0;  // Hold nothing of this light yet, drawn regardless of the budget
+    int dynamicFaces = 0;  // A dynamic caster moved in them since they were drawn
+    int drawFaces = 0;     // Picked by the scheduler this frame
+    int staleFrames[6] = {}; // Frames each face has waited for the budget
+
+    int GetNumFaces() const { return slotMode == POINT_SHADOW_CUBE ? 6 : 2; }
+    int GetAllFaces() const { return (1 << GetNumFaces()) - 1; }
 };
 
+// Lights that are disabled, or whose importance is below the scene's
+// threshold, get no shadow map, texture unit or shading that frame.
+// Importance is intensity times brightest color channel times the share
+// of the screen the light can reach, see Scene::UpdateLightImportance().
+
 struct DirectionalLight {
     float intensity = 1.f;
     Vec3 diffuse = { 1.0f, 1.0f, 1.0f };
     Vec3 specular = { 1.f, 1.f, 0.9f };
     Vec3 direction = { .7f, -1.f, -1.f };
-    DepthMapInfo depthMapInfo;
+    CascadedDepthMapInfo depthMapInfo;
+    bool enabled = true;
+    float importance = 0.0f; // Set every frame by the scene
+    bool active = false;
 };
 
 struct SpotLight {
@@ -40,6 +135,9 @@ struct SpotLight {
     float cutOff = PI32 * .06125f;
     float outerCutOff = PI32 * .06125f * 1.5f;
     DepthMapInfo depthMapInfo;
+    bool enabled = true;
+    float importance = 0.0f; // Set every frame by the scene
+    bool active = false;
 };
 
 struct PointLight {
@@ -50,10 +148,76 @@ struct PointLight {
     float innerRadius = 10.0f;
     float outerRadius = 20.0f;
     DepthMapInfo3D depthMapInfo;
+    bool enabled = true;
+    float importance = 0.0f; // Set every frame by the scene
+    bool active = false;
+};
+
+// Active lights and shadow maps drawn in the last frame. Cached shadow
+// maps skipped drawing the static casters.
+struct LightActivity {
+    int activePointLights = 0, numPointLights = 0;
+    int activeSpotLights = 0, numSpotLights = 0;
+    int activeDirLights = 0, numDirLights = 0;
+    int shadowMapsDrawn = 0, shadowMapsCached = 0;
+    // Point light cube faces drawn, and stale ones left for a later frame
+    int pointFacesDrawn = 0, pointFacesWaiting = 0;
+
+    bool operator==(const LightActivity& other) const {
+        return activePointLights == other.activePointLights && numPointLights == other.numPointLights
+            && activeSpotLights == other.activeSpotLights && numSpotLights == other.numSpotLights
+            && activeDirLights == other.activeDirLights && numDirLights == other.numDirLights
+            && shadowMapsDrawn == other.shadowMapsDrawn && shadowMapsCached == other.shadowMapsCached
+            && pointFacesDrawn == other.pointFacesDrawn && pointFacesWaiting == other.pointFacesWaiting;
+    }
+    bool operator!=(const LightActivity& other) const { return !(*this == other); }
+};
+
+// Draws each pass left out by render layers (see RenderLayer), by layer
+// bit. A model left out as a whole counts each of its meshes.
+struct RenderLayerStats {
+    int skippedDraws[RENDER_LAYER_COUNT] = {};
+
+    bool operator==(const RenderLayerStats& other) const {
+        for (int i = 0; i < RENDER_LAYER_COUNT; i++) {
+            if (skippedDraws[i] != other.skippedDraws[i]) return false;
+        }
+        return true;
+    }
+    bool operator!=(const RenderLayerStats& other) const { return !(*this == other); }
+};
+
+// Grass of the last main view pass. Chunks outside of the view and tufts
+// thinned out with distance (see Scene::SetGrassDensityLod()) are left out.
+struct GrassStats {
+    int drawnChunks = 0, numChunks = 0;
+    size_t drawnTufts = 0, numTufts = 0;
+
+    bool operator==(const GrassStats& other) const {
+        return drawnChunks == other.drawnChunks && numChunks == other.numChunks
+            && drawnTufts == other.drawnTufts && numTufts == other.numTufts;
+    }
+    bool operator!=(const GrassStats& other) const { return !(*this == other); }
+};
+
+// Which models a geometry pass draws, grass counts as static
+enum CasterFilter {
+    CASTERS_ALL,
+    CASTERS_STATIC,
+    CASTERS_DYNAMIC,
 };
 
 struct DrawContext {
-    Shader *objShader, *depthMapShader, *depthMapShader3D, *skyboxShader;
+    Shader *objShader, *depthMapShader, *depthMapShader3D, *depthParaboloidShader, *skyboxShader;
+    // Deferred shading, see Scene::DrawDeferred()
+    Shader *gBufferShader = nullptr, *deferredCompositeShader = nullptr;
+    Shader *deferredDirShader = nullptr, *deferredPointShader = nullptr, *deferredSpotShader = nullptr;
+    // Screen space shadow mask of forward shading, see Scene::DrawShadowMask()
+    Shader *shadowMaskShader = nullptr;
+    // Needed once a light has a moment shadow map, see Scene::DrawShadowMoments()
+    Shader *shadowMomentsShader = nullptr;
+    // Layered shadow passes, see Scene::SetLayeredShadows()
+    Shader *depthLayeredShader = nullptr;
     Texture grassTexture;
     Texture grassNormalMap = Texture();
 };
@@ -64,13 +228,139 @@ private:
     std::vector<DirectionalLight> m_DirLights;
     std::vector<SpotLight> m_SpotLights;
     std::vector<Model*> m_Models;
-    std::vector<GrassQuad> m_Quads;
+    GrassBatch m_Grass;
 
     GLuint m_SkyboxCubemap;
     GLuint m_SkyboxVAO, m_SkyboxVBO;
     GLuint m_QuadVAO, m_QuadVBO; // Quad geometry for debug draw texture
+    // Light volumes of deferred shading, unit sphere and a cone
+    // from the origin to a unit circle at z = -1.
+    GLuint m_SphereVAO, m_SphereVBO, m_ConeVAO, m_ConeVBO;
+    GLsizei m_SphereVertexCount = 0, m_ConeVertexCount = 0;
+
+    GBuffer m_GBuffer;
+
+    // Screen space shadow mask, drawn after the depth prepass of forward
+    // shading. Channels go to the active directional lights, then the
+    // spot shadow slots, then the point shadow slots.
+    ShadowMask m_ShadowMask;
+    bool m_UseShadowMask = false;
+    bool m_ShadowMaskInUse = false; // Drawn this frame, the opaque forward pass reads it
+    int m_ShadowMaskUnit = -1, m_ShadowMaskViewDepthUnit = -1;
+    int m_ShadowMaskSpotBase = 0, m_ShadowMaskPointBase = 0, m_NumShadowMaskChannels = 0;
+    int m_ShadowMaskRecords[ShadowMask::MAX_CHANNELS] = {}; // Light cluster record of the spot and point channels
 
     int m_NextActiveTexture = 0;
+    int m_NumPointShadows = 0, m_NumSpotShadows = 0;
+    int m_NumParaboloidShadows = 0; // Of the point shadows
+
+    ShadowAtlas m_ShadowAtlas;
+    int m_ShadowAtlasUnit = -1; // Texture unit of the atlas in the current pass
+    int m_ShadowMomentAtlasUnit = -1;
+    PointShadowPool m_PointShadowPool{ GL_TEXTURE_CUBE_MAP_ARRAY, 6 };
+    PointShadowPool m_ParaboloidShadowPool{ GL_TEXTURE_2D_ARRAY, 2 };
+    // Texture units of the pools and their slot origins in the current pass
+    int m_PointShadowUnit = -1, m_PointShadowOriginUnit = -1;
+    int m_ParaboloidShadowUnit = -1, m_ParaboloidShadowOriginUnit = -1;
+    int m_PointShadowFaceBudget = 12; // Cube faces drawn per frame, 0 for no limit
+
+    // Point and spot lights per froxel of the main view
+    LightClusters m_LightClusters;
+    LightActivity m_LightActivity;
+    RenderLayerStats m_RenderLayerStats;
+    uint32_t m_GrassRenderLayers = RENDER_LAYERS_ALL;
+    GrassStats m_GrassStats;
+    float m_GrassLodStart = 80.0f, m_GrassLodEnd = 300.0f;
+    std::vector<GrassRange> m_GrassRanges; // Of the current pass
+
+    // Static casters as of the last frame, any change bumps the version
+    struct StaticCasterState {
+        Model* model;
+        Matrix4 transform;
+        uint32_t version;
+    };
+    std::vector<StaticCasterState> m_StaticCasters;
+    // Dynamic casters as of the last frame, and the boxes each one that
+    // moved this frame left and entered
+    struct DynamicCasterState {
+        Model* model;
+        Matrix4 transform;
+        uint32_t version;
+        Vec3 min, max;
+    };
+    struct CasterBounds {
+        Vec3 min, max;
+    };
+    std::vector<DynamicCasterState> m_DynamicCasters;
+    std::vector<CasterBounds> m_MovedCasterBounds;
+    size_t m_StaticGrassCount = 0;
+    uint32_t m_StaticMaterialVersion = 0;
+    uint32_t m_StaticCasterVersion = 1;
+    int m_NumDynamicCasters = 0;
+    GLuint m_CopyFBOs[2] = {}; // Read and draw framebuffer for depth copies
+    // World space boxes around every model and the grass
+    Vec3 m_SceneBoundsMin, m_SceneBoundsMax;
+    Vec3 m_GrassBoundsMin, m_GrassBoundsMax;
+
+    int m_NumShadowCascades = 3;
+    // Blend of logarithmic (1) and uniform (0) cascade splits
+    float m_CascadeSplitLambda = 0.75f;
+    int m_CascadeFallbackUnit = -1; // For the samplers of unshadowed directional lights
+    GLuint m_DebugDepthFBO = 0, m_DebugDepthTexture = 0; // Cascade copied out for debug draw
+
+    ShadowFilters m_ShadowFilters;
+    // Bilinear depth compares, bound with the shadow maps of the light
+    // types whose filter isn't SHADOW_FILTER_BOX
+    GLuint m_ShadowCompareSampler = 0;
+    bool m_AdaptiveShadows = true;
+    bool m_ShadowDebugView = false;
+
+    // Moment shadow maps, the first blur pass goes to the scratch
+    // texture. The blur radius is in moment texels.
+    float m_ShadowBleedReduction = 0.2f;
+    int m_MomentBlurRadius = 2;
+    GLuint m_MomentScratchFBO = 0, m_MomentScratchTexture = 0;
+    int m_MomentScratchSize = 0;
+    // Cascade moments of all directional lights in one array at half the
+    // cascade size. One sampler for all of them, llvmpipe crashes on
+    // explicit level lookups of the samplers in the light structs.
+    GLuint m_DirMomentFBO = 0, m_DirMomentTexture = 0;
+    int m_DirMomentLayers = 0;
+    int m_DirMomentUnit = -1; // Texture unit in the current pass
+
+    // Shadow maps of a layered pass, clip space squeezed into the tile
+    // of the target's layer
+    struct LayeredShadow {
+        Matrix4 worldToClip;
+        ShadowAtlas::Rect rect;
+        int layer;
+    };
+    // The faces of a point light drawn by a pass, grass chunks are culled
+    // against the light's radius and those faces
+    struct PointShadowPass {
+        const DepthMapInfo3D* info;
+        Vec3 lightPos;
+        float radius;
+        int faces;
+    };
+    bool m_LayeredShadows = false;
+    // CPU time of the spot and directional shadow passes of the last frame
+    double m_ShadowSubmitMilliseconds = 0.0;
+
+    // Samples passing the depth test in the main geometry pass, that is
+    // how often the lighting shader ran. Results are read a frame late
+    // so the query never stalls.
+    GLuint m_SampleQueries[2] = {};
+    uint64_t m_SampleQueryArea[2] = {}; // Pixels times samples per pixel
+    int m_SampleQueryIndex = 0;
+    uint64_t m_ShadedSamples = 0;
+    float m_ShadedSamplesPerPixel = 0.0f;
+    // GPU time of the lit passes, the main pass of forward shading or
+    // the light passes of deferred shading. Read a frame late as well.
+    GLuint m_ShadingQueries[2] = {};
+    bool m_ShadingQueryIssued[2] = {};
+    int m_ShadingQueryIndex = 0;
+    float m_ShadingMilliseconds = 0.0f;
 
     Vec3 m_AmbientColor = Vec3{ 0.15f, 0.15f, 0.15f };
     Vec3 m_AccumulatedDirColor = Vec3(0.f, 0.f, 0.f);
@@ -78,13 +368,18 @@ private:
     Matrix4 m_ProjMatrix = Matrix4::CreatePerspective(PI32 * 0.4f, (float)SCREEN_WIDTH / (float)SCREEN_HEIGHT, 1.f, 700.0f);
     Matrix4 m_ViewMatrix = Matrix4::Identity();   
 
-    // Cubemap shadow resolution
-    const unsigned int SHADOW_WIDTH3D = 2048, SHADOW_HEIGHT3D = 2048;
-    // 2D shadow map resolution
-    const unsigned int SHADOW_WIDTH = 4096, SHADOW_HEIGHT = 4096;
+    // Resolution of each directional light cascade
+    const unsigned int SHADOW_CASCADE_SIZE = 2048;
 
-    const float SHADOW_DISTANCE = 100.0f;
     const float SHADOW_NEAR = 1.0f, SHADOW_FAR = 300.f;
+    // Directional light shadows end this far from the camera
+    const float SHADOW_CASCADE_DISTANCE = 200.0f;
+    // Depth bias of the cascades in texels, so it shrinks with the texels
+    const float SHADOW_CASCADE_BIAS = 8.0f;
+
+    // Lights below this importance are skipped, a full intensity
+    // light reaching this share of the screen is kept.
+    const float LIGHT_IMPORTANCE_THRESHOLD = 0.0005f;
 
 public:
     Scene();
@@ -108,7 +403,7 @@ public:
     Model* AddModel(Model* model);
     void DeleteModel(Model* model);
 
-    void AddQuad(const GrassQuad& quad);
+    // A tuft of grass standing at pos
     void AddGrass(Vec3 pos, float rotation, Vec2 size);
 
     void SetAmbientColor(const Vec3& color) { m_AmbientColor = color; }
@@ -117,15 +412,173 @@ public:
     Matrix4& GetProjectionMatrix() { return m_ProjMatrix; }
     Matrix4& GetViewMatrix() { return m_ViewMatrix; }
 
+    const LightClusters& GetLightClusters() const { return m_LightClusters; }
+    const LightActivity& GetLightActivity() const { return m_LightActivity; }
+    // Of the last frame
+    const RenderLayerStats& GetRenderLayerStats() const { return m_RenderLayerStats; }
+    // Passes the grass is drawn in, see Model::SetRenderLayers()
+    void SetGrassRenderLayers(uint32_t layers);
+    uint32_t GetGrassRenderLayers() const { return m_GrassRenderLayers; }
+    // The main view draws every tuft of the grass chunks up to start away
+    // from the camera, fewer and fewer beyond and none from end on. Shadow
+    // passes always draw all of them, so cached shadow maps stay valid.
+    // end <= start draws all tufts everywhere.
+    void SetGrassDensityLod(float start, float end) { m_GrassLodStart = start; m_GrassLodEnd = end; }
+    const GrassStats& GetGrassStats() const { return m_GrassStats; }
+    // Draws every shadow map again next frame, for changes the scene
+    // can't see like a material's shouldCastShadow
+    void InvalidateShadowCache() { m_StaticCasterVersion++; }
+    // Between 1 and MAX_SHADOW_CASCADES
+    void SetNumShadowCascades(int numCascades);
+    int GetNumShadowCascades() const { return m_NumShadowCascades; }
+    void SetCascadeSplitLambda(float lambda) { m_CascadeSplitLambda = lambda; }
+    // Memory of the spot light shadow atlas, see ShadowAtlas.h
+    void SetShadowAtlasBudget(size_t bytes) { m_ShadowAtlas.SetBudget(bytes); }
+    void SetShadowDepthFormat(ShadowDepthFormat format) { m_ShadowAtlas.SetFormat(format); }
+    const ShadowAtlas& GetShadowAtlas() const { return m_ShadowAtlas; }
+    // Cube face size of the point light shadows, see PointShadowPool.h
+    void SetPointShadowSize(int size) {
+        m_PointShadowPool.SetSlotSize(size);
+        m_ParaboloidShadowPool.SetSlotSize(size);
+    }
+    const PointShadowPool& GetPointShadowPool(PointShadowMode mode) const {
+        return mode == POINT_SHADOW_CUBE ? m_PointShadowPool : m_ParaboloidShadowPool;
+    }
+    PointShadowPool& GetPointShadowPool(PointShadowMode mode) {
+        return mode == POINT_SHADOW_CUBE ? m_PointShadowPool : m_ParaboloidShadowPool;
+    }
+    // Most point light cube faces drawn in a frame, 0 draws every stale one
+    void SetPointShadowFaceBudget(int faces) { m_PointShadowFaceBudget = faces; }
+    int GetPointShadowFaceBudget() const { return m_PointShadowFaceBudget; }
+    // Overdraw of the main geometry pass, 1 per pixel means no overdraw
+    uint64_t GetShadedSamples() const { return m_ShadedSamples; }
+    float GetShadedSamplesPerPixel() const { return m_ShadedSamplesPerPixel; }
+    // Filter tier of each light type's shadows, see ShadowFilter in Shader.h
+    void SetShadowFilters(const ShadowFilters& filters) { m_ShadowFilters = filters; }
+    const ShadowFilters& GetShadowFilters() const { return m_ShadowFilters; }
+    // Skip the filter kernel where its corners agree, see
+    // SHADOW_KERNEL_ADAPTIVE in lighting.glsl
+    void SetAdaptiveShadows(bool adaptive) { m_AdaptiveShadows = adaptive; }
+    bool GetAdaptiveShadows() const { return m_AdaptiveShadows; }
+    // Lit surfaces show green, shadowed blue and penumbra yellow, see
+    // shadow-debug.glsl
+    void SetShadowDebugView(bool enabled) { m_ShadowDebugView = enabled; }
+    bool GetShadowDebugView() const { return m_ShadowDebugView; }
+    // Moment shadow maps, see ShadowMapType. Bleed reduction cuts off
+    // light leaking through overlapping casters, 0 to 1, higher values
+    // also darken the penumbra. The blur radius sets the softness.
+    void SetShadowBleedReduction(float reduction);
+    float GetShadowBleedReduction() const { return m_ShadowBleedReduction; }
+    void SetMomentBlurRadius(int radius);
+    int GetMomentBlurRadius() const { return m_MomentBlurRadius; }
+    // Look the shadows of forward shading up at half resolution after the
+    // depth prepass, only takes effect while the prepass is on
+    void SetShadowMask(bool enabled) { m_UseShadowMask = enabled; }
+    bool GetShadowMask() const { return m_UseShadowMask; }
+    // GPU time of the lit passes of the last frame but one
+    float GetShadingMilliseconds() const { return m_ShadingMilliseconds; }
+    // Draw the spot light shadows into the atlas in one geometry
+    // submission, and the cascades of each directional light in another,
+    // instead of one submission per map. Needs ctx.depthLayeredShader.
+    void SetLayeredShadows(bool enabled) { m_LayeredShadows = enabled; }
+    bool GetLayeredShadows() const { return m_LayeredShadows; }
+    double GetShadowSubmitMilliseconds() const { return m_ShadowSubmitMilliseconds; }
+
     void Draw(const DrawContext& ctx);
 
 private:
     void DrawSkybox(const DrawContext& ctx);
+    // Estimates every light's importance for the camera and marks the
+    // ones above the threshold active. cameraView is world to view.
+    void UpdateLightImportance(const Matrix4& cameraView);
+    void BindLightTextures();
     void UploadLightData(Shader& shader);
-    void DrawGeometry(Shader& shader, Matrix4 view, Matrix4 proj, const DrawContext& ctx);
+    // Shader variant features, and light count buckets and shadow
+    // filters for the main pass
+    uint32_t GetPassFeatures() const;
+    // Adaptive kernel and debug view bits, the deferred light
+    // passes take them along with their own shadow bit
+    uint32_t GetShadowLookupFeatures() const;
+    ShaderSettings GetLightCountSettings() const;
+    // passUniforms is applied to every shader variant used in the pass.
+    // With a cull box, a world to clip space matrix, models and grass
+    // entirely outside of its clip space are skipped. With light boxes,
+    // the same per light, each draw gets the lights that see it as
+    // lightMask and draws no one sees are skipped. Only models, meshes and
+    // grass in the pass's layer are drawn. Grass chunks are always culled,
+    // see DrawGrass(). Returns false when draws were left out since their
+    // shader variants are still compiling.
+    bool DrawGeometry(Shader& shader, Matrix4 view, Matrix4 proj, const DrawContext& ctx, RenderLayer layer, const std::function<void(Shader&)>& passUniforms = nullptr,
+                      MaterialFilter filter = MATERIAL_FILTER_ALL, CasterFilter casters = CASTERS_ALL, const Matrix4* cullBox = nullptr,
+                      const Matrix4* lightBoxes = nullptr, int numLightBoxes = 0, const PointShadowPass* pointPass = nullptr);
+    // Every grass chunk seen by the pass, culled against the light boxes,
+    // the point light's faces or else the pass's world to clip space
+    // matrix. Returns false when the grass variant is still compiling.
+    bool DrawGrass(Shader& shader, const Matrix4& worldToClip, const DrawContext& ctx, RenderLayer layer, MaterialFilter filter,
+                   const Matrix4* lightBoxes, int numLightBoxes, const PointShadowPass* pointPass);
+    // Opaque geometry through the G-buffer and light volumes,
+    // blended geometry forward on top.
+    void DrawDeferred(const DrawContext& ctx);
+    // Opaque depth only, so the main pass shades visible fragments only
+    void DrawDepthPrepass(const DrawContext& ctx);
+    // Shadows of the shadowed lights into the shadow mask from the
+    // prepass depth. False when there is nothing to draw, the forward
+    // pass looks its shadows up itself then.
+    bool DrawShadowMask(const DrawContext& ctx);
+    void SetShadowMaskUniforms(Shader& shader);
+    void BeginSampleQuery();
+    void EndSampleQuery();
+    void BeginShadingQuery();
+    void EndShadingQuery();
+    void InitLightVolumes();
     void DebugDrawTexture(GLuint texture);
-    void DrawShadowMap(const DrawContext& ctx, DepthMapInfo& info);
-    void DrawShadowMap3D(const DrawContext& ctx, DepthMapInfo3D& info, Vec3 lightPos);
-    void InitLightDepthMap(DepthMapInfo& info);
-    void InitLightDepthMap3D(DepthMapInfo3D& info);
+    // Bumps the static caster version when a static model moved, was
+    // reloaded, added or removed, collects where the dynamic ones moved
+    // and updates the scene bounds
+    void UpdateStaticCasters();
+    // Hands out the atlas tiles of the spot lights, sized by importance
+    void AllocateShadowAtlas();
+    // Hands out the pool slots of the point lights, the most important
+    // ones first when there are more lights than the pool can hold
+    void AllocatePointShadows();
+    void AllocatePointShadowSlots(PointShadowMode mode, std::vector<PointLight*>& casters);
+    // Picks the stale cube faces drawn this frame within the budget.
+    // Moving lights weigh most, their whole cube at once and the budget
+    // may run over for it, then faces a dynamic caster moved in, then
+    // those behind on the static casters. Lights closer to the camera
+    // and faces that waited longer weigh more.
+    void SchedulePointShadowFaces();
+    // Splits the view frustum and fits a cascade to each slice
+    void FitCascades(CascadedDepthMapInfo& info, const Vec3& direction);
+    // Return false when the cached static casters were used
+    bool DrawShadowMap(const DrawContext& ctx, DepthMapInfo& info);
+    // Only the faces picked by the scheduler
+    bool DrawShadowMap3D(const DrawContext& ctx, DepthMapInfo3D& info, Vec3 lightPos, float radius);
+    bool DrawShadowCascade(const DrawContext& ctx, CascadedDepthMapInfo& info, int cascade);
+    // Copies a depth texture, one face of a cube map or one layer of a
+    // texture or cube map array (of whichever side is an array) of the given size.
+    // Only the rectangle at x, y is copied, in place.
+    void CopyDepth(GLuint source, GLenum sourceTarget, GLuint destination, GLenum destinationTarget, int width, int height, int layer = 0, int x = 0, int y = 0);
+    // Blurs the depth of a spot light's tile or one cascade into moments
+    // at half the size, in the same place of the moment target (of
+    // momentLayer for an array). The mip levels are left to the caller.
+    // False while the moments variant is still compiling, nothing is drawn.
+    bool DrawShadowMoments(const DrawContext& ctx, ShadowMapType type, GLuint depthTexture, GLenum depthTarget, int layer,
+                           const ShadowAtlas::Rect& depthRect, GLuint momentFBO, GLuint momentTexture, int momentLayer = 0);
+    // Layered counterparts of DrawShadowMap() and DrawShadowCascade(),
+    // with the same caching. drawn gets whether each map was drawn, the
+    // cascades come back as a bit per cascade.
+    void DrawShadowMapsLayered(const DrawContext& ctx, const std::vector<DepthMapInfo*>& infos, std::vector<bool>& drawn);
+    int DrawShadowCascadesLayered(const DrawContext& ctx, CascadedDepthMapInfo& info);
+    // One submission of the casters for up to MAX_LAYERED_SHADOWS maps at
+    // a time into texture, a 2D texture or array of the given size.
+    // Clears the maps' tiles first if asked to.
+    bool DrawLayeredShadows(const DrawContext& ctx, RenderLayer layer, GLuint fbo, GLuint texture, GLenum target, int size,
+                            const std::vector<LayeredShadow>& shadows, CasterFilter casters, bool clear);
+    // Gives the directional lights with moment shadow maps their layers,
+    // (re)creating the array when the layer count changes. Lights whose
+    // layers moved draw their cascades again.
+    void AllocateDirMoments();
+    // (Re)creates the texture array for the current cascade count
+    void InitCascadedDepthMap(CascadedDepthMapInfo& info);
 };
\ No newline at end of file
@@ -2,27 +2,143 @@
 
 #include <string>
 #include <fstream>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <functional>
+#include <memory>
 
 #include "Maths.h"
 #include "GLutils.h"
 
 
+// How a light type's shadow maps are filtered, a #define of each light
+// type's tier (see lighting.glsl). All tiers but SHADOW_FILTER_BOX sample
+// through a comparison sampler, where every tap is a bilinear 2x2 PCF
+// done by the texture unit. The Poisson tiers take that many taps of a
+// disk rotated per pixel, which trades banding for noise.
+enum ShadowFilter {
+    SHADOW_FILTER_BOX,        // Depth compares of a box of texels, the most taps
+    SHADOW_FILTER_HARDWARE,   // A single comparison tap
+    SHADOW_FILTER_POISSON_4,
+    SHADOW_FILTER_POISSON_8,
+    SHADOW_FILTER_POISSON_16,
+};
+const int SHADOW_FILTER_COUNT = 5;
+
+struct ShadowFilters {
+    ShadowFilter dir = SHADOW_FILTER_BOX;
+    ShadowFilter spot = SHADOW_FILTER_BOX;
+    ShadowFilter point = SHADOW_FILTER_BOX; // Cube and paraboloid shadows
+};
+
+// The point and spot light counts only cover the lights with shadow maps,
+// all other point and spot lights come from the light clusters.
 struct ShaderSettings {
     int maxNumPointLights = 8;
     int maxNumDirLights = 8;
     int maxNumSpotLights = 8;
+    ShadowFilters shadowFilters;
+};
+
+// Feature bits of a shader variant. Every set bit becomes a #define of the
+// same name (see FEATURE_DEFINES in Shader.cpp) so the shader source can
+// compile away the branches it doesn't need.
+enum ShaderFeature : uint32_t {
+    SHADER_FEATURE_DIFFUSE_MAP   = 1 << 0,
+    SHADER_FEATURE_SPECULAR_MAP  = 1 << 1,
+    SHADER_FEATURE_AMBIENT_MAP   = 1 << 2,
+    SHADER_FEATURE_NORMAL_MAP    = 1 << 3,
+    SHADER_FEATURE_REFLECTION    = 1 << 4,
+    SHADER_FEATURE_ALPHA_TEST    = 1 << 5,
+    SHADER_FEATURE_DIR_SHADOWS   = 1 << 6,
+    SHADER_FEATURE_SPOT_SHADOWS  = 1 << 7,
+    SHADER_FEATURE_POINT_SHADOWS = 1 << 8,  // Cube maps
+    SHADER_FEATURE_PARABOLOID_SHADOWS = 1 << 9,
+    SHADER_FEATURE_ADAPTIVE_SHADOWS = 1 << 10, // Kernel only in the penumbra
+    SHADER_FEATURE_SHADOW_DEBUG = 1 << 11,     // Color by shadow class
+    SHADER_FEATURE_SHADOW_MASK = 1 << 12,      // Shadows from the screen space mask
+    SHADER_FEATURE_DIR_MOMENTS = 1 << 13,      // Directional lights with moment shadow maps
+    SHADER_FEATURE_SPOT_MOMENTS = 1 << 14,     // Spot lights with moment shadow maps
+    SHADER_FEATURE_GRASS_INSTANCES = 1 << 15,  // Grass tufts, see grass.glsl
 };
+const int SHADER_FEATURE_COUNT = 16;
 
+struct ShaderVariant {
+    uint32_t features = 0;
+    ShaderSettings settings;
+};
+
+// Vertex buffers of meshes and the grass a variant reads from. Depth
+// passes only need positions, and UVs for the alpha test, so they read
+// tightly packed copies instead of the full Vertex (see Utils.h).
+enum VertexStream {
+    VERTEX_STREAM_FULL,
+    VERTEX_STREAM_POSITION,    // Vec3
+    VERTEX_STREAM_POSITION_UV, // PositionUV
+};
+// Attribute locations from here on are per instance, they don't need any
+// of the vertex streams
+const int FIRST_INSTANCE_LOCATION = 5;
 
+// A program being compiled, see Shader.cpp
+struct ShaderCompileJob;
 
 class Shader {
 private:
-    GLuint m_Program;
+    struct VariantProgram {
+        GLuint program = 0;
+        ShaderVariant variant;
+        uint32_t passEpoch = 0; // Pass the pass uniforms were last set in
+        bool isFallback = false;
+    };
+    struct Sources {
+        std::string vert, frag, geo;
+        std::vector<std::string> includes; // Every file pulled in with #include
+        uint32_t usedFeatures = 0;
+        bool usesPointLights = false, usesDirLights = false, usesSpotLights = false;
+        bool usesShadowFilters = false;
+        uint32_t vertexInputs = 0; // Bit per attribute location the vertex shader declares
+    };
+    struct QueuedCompile {
+        ShaderVariant variant;
+        bool isReload = false;
+    };
+
+    GLuint m_Program = 0; // Program of the selected variant
     std::string m_VertPath, m_FragPath, m_GeoPath; // Stored for hot reloading
+    std::string m_WatchNode; // Name in the AssetWatcher dependency graph
+    Sources m_Sources;
     ShaderSettings m_CurrentSettings;
     const bool m_HasGeoShader;
 
+    // Compiled variants by packed key, only features and light counts the
+    // sources actually reference are part of the key.
+    std::map<uint64_t, VariantProgram> m_Variants;
+    uint64_t m_CurrentKey = 0;
+
+    // Compiles that haven't been started yet, and the ones in flight
+    std::vector<QueuedCompile> m_CompileQueue;
+    std::vector<std::shared_ptr<ShaderCompileJob>> m_Compiling;
+    // Finished compiles of older sources or abandoned reloads are discarded
+    uint32_t m_SourceGeneration = 0, m_ReloadGeneration = 0;
+
+    // A hot reload builds a complete new set of variants next to the
+    // current one, which keeps rendering until all of them linked.
+    bool m_Reloading = false;
+    bool m_ReloadFailed = false;
+    int m_ReloadPending = 0;
+    Sources m_ReloadSources;
+    ShaderSettings m_ReloadSettings;
+    std::map<uint64_t, VariantProgram> m_ReloadVariants;
+
+    uint32_t m_PassFeatures = 0;
+    ShaderSettings m_PassSettings;
+    uint32_t m_PassEpoch = 0;
+    std::function<void(Shader&)> m_PassUniforms;
+
     static GLuint s_LastBound;
+    static std::string s_BinaryCacheDir;
 
 public:
     Shader(const std::string& vertSrcPath, const std::string& fragSrcPath, const std::string& geoSrcPath = "", ShaderSettings setting = ShaderSettings());
@@ -31,7 +147,29 @@ public:
     void Bind();
     void Unbind();
 
+    // Recompiles every variant that has been used so far in the
+    // background, see PollCompiles(). The current variants stay in use
+    // until all new ones linked, and are kept if any of them fails.
     void HotReload(ShaderSettings settings = ShaderSettings());
+    bool IsReloading() const { return m_Reloading; }
+
+    // Variants selected until EndPass() combine these features and light
+    // counts with the material features. The first time a variant is bound
+    // in the pass, passUniforms is called to set the pass-wide uniforms
+    // (camera, lights...) on it, so set those only through the callback.
+    void BeginPass(uint32_t passFeatures, ShaderSettings passSettings, std::function<void(Shader&)> passUniforms);
+    void EndPass();
+    // Selects the variant for the given material features and binds it if
+    // the shader is currently bound. Starts compiling it on first use unless
+    // a variant with room for more lights is already available. Returns
+    // false while the variant is still compiling, skip the draw then.
+    bool SetMaterialFeatures(uint32_t materialFeatures);
+
+    // Queue a variant to be compiled ahead of time by PollCompiles()
+    void Prewarm(uint32_t features, ShaderSettings settings);
+    // Puts finished compiles into use and starts up to maxNewCompiles
+    // queued ones, call once per frame outside of any pass.
+    void PollCompiles(int maxNewCompiles);
 
     void SetInt(const std::string& field, int value);
     void SetIntArray(const std::string& field, int* values, int count);
@@ -39,20 +177,70 @@ public:
     void SetVec2(const std::string& field, Vec2 value);
     void SetVec3(const std::string& field, Vec3 value);
     void SetVec4(const std::string& field, Vec4 value);
+    void SetMat3(const std::string& field, Matrix3 value);
     void SetMat4(const std::string& field, Matrix4 value);
     void SetMat4Array(const std::string& field, Matrix4* values, int count);
 
     GLuint GetProgramID() const { return m_Program; }
+    size_t GetNumVariants() const { return m_Variants.size(); }
 
     const ShaderSettings& GetSettings() const { return m_CurrentSettings; }
+    // Variant picked by the last SetMaterialFeatures(), it may have
+    // room for more lights than the pass asked for.
+    const ShaderVariant& GetVariant() const;
+    // Stream the selected variant reads, the position streams when the
+    // vertex shader declares no more than positions (location 0) and UVs
+    // (location 2) per vertex. UVs only come along for the alpha test.
+    VertexStream GetVertexStream() const;
+
+    // Light counts are rounded up to a power of two so the shader loops have
+    // constant bounds and small count changes reuse the same variant.
+    static int LightCountBucket(int numLights);
 
 private:
     GLuint GetLocation(const std::string& name);
     bool Load(ShaderSettings settings);
     void Unload();
-    bool ProcessSource(std::string& src, ShaderSettings settings);
+    Sources ReadSources();
+    std::vector<std::string> GetSourceFiles(const Sources& sources) const;
+    bool ProcessSource(std::string& src, const ShaderVariant& variant);
+
+    ShaderVariant MaskVariant(ShaderVariant variant, const Sources& sources) const;
+    uint64_t PackVariantKey(const ShaderVariant& variant) const;
+    VariantProgram* ResolveVariant(const ShaderVariant& variant);
+    void UseVariant(uint64_t key, VariantProgram& variantProgram);
+
+    bool IsCompiling(uint64_t variantKey) const;
+    std::shared_ptr<ShaderCompileJob> StartVariantCompile(const ShaderVariant& variant, bool isReload);
+    VariantProgram* FinishVariantCompile(ShaderCompileJob& job);
+    void FinishReload();
+    void DeleteVariants(std::map<uint64_t, VariantProgram>& variants);
+
+    // Compiling happens in three steps so drivers with parallel shader
+    // compile can work on it between frames. Without it StartCompile()
+    // blocks, unless the job is handed to the compile thread.
+    static void StartCompile(ShaderCompileJob& job);
+    static bool IsCompileDone(ShaderCompileJob& job);
+    static GLuint FinishCompile(ShaderCompileJob& job);
+    static void CancelCompile(ShaderCompileJob& job);
+    static void CompileThreadMain(std::function<void()> makeContextCurrent, std::function<void()> releaseContext);
+
+    // Program binary cache. One file per shader variant, the header stores a
+    // hash of everything the binary depends on so a mismatch means recompile.
+    uint64_t ComputeBinaryKey(const std::string& vertSrc, const std::string& fragSrc, const std::string& geoSrc, ShaderSettings settings) const;
+    std::string GetBinaryCachePath(uint64_t variantKey) const;
+    GLuint LoadProgramBinary(uint64_t variantKey, uint64_t key);
+    void SaveProgramBinary(GLuint program, uint64_t variantKey, uint64_t key);
 
 public:
     static Shader& Basic();
     static Shader& Basic2D();
+
+    // Directory for cached program binaries, empty disables the cache
+    static void SetBinaryCacheDirectory(const std::string& dir);
+
+    // Compiles on a thread with its own context sharing objects with the
+    // main one, for drivers without KHR_parallel_shader_compile.
+    static void StartCompileThread(std::function<void()> makeContextCurrent, std::function<void()> releaseContext);
+    static void StopCompileThread();
 };
\ No newline at end of file
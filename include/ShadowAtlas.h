@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include <glad/glad.h>
+
+// Depth format of the shadow atlas, 24 bit depth takes 32 bits in memory
+enum ShadowDepthFormat {
+    SHADOW_DEPTH_16,
+    SHADOW_DEPTH_24,
+    SHADOW_DEPTH_32F,
+};
+
+// One depth texture shared by the spot light shadows. Every frame the
+// lights ask for a square tile sized by their importance and get one from
+// a quadtree, the most important ones first. A tile that doesn't fit is
+// halved until it does or gets too small, then the light goes without a
+// shadow that frame. Tiles are handed out in the same order every frame,
+// so they only move when the lights or their sizes change.
+//
+// The atlas is the largest power of two square that fits the memory
+// budget, with dynamic casters in the scene the static casters need a
+// second atlas of the same size (see ShadowCache in Scene.h). Lights with
+// moment shadow maps (see ShadowMapType in Scene.h) need the moment atlas,
+// RGBA16F at half the size with a few mip levels. A tile's moments are in
+// the same place of it, at half the size, so the quadtree keeps the mip
+// levels of different tiles apart.
+class ShadowAtlas {
+public:
+    struct Rect {
+        int x = 0, y = 0, size = 0;
+
+        bool operator==(const Rect& other) const { return x == other.x && y == other.y && size == other.size; }
+        bool operator!=(const Rect& other) const { return !(*this == other); }
+    };
+
+    static const int MIN_TILE_SIZE = 128;
+    // Of the moment atlas, the smallest tile is 4x4 moment texels in the last
+    static const int MOMENT_MIP_LEVELS = 5;
+
+private:
+    struct Node {
+        Rect rect;
+        int firstChild = -1; // The 4 children are next to each other
+        bool used = false;
+    };
+    std::vector<Node> m_Nodes;
+
+    GLuint m_FBO = 0, m_Texture = 0;
+    GLuint m_StaticFBO = 0, m_StaticTexture = 0;
+    GLuint m_MomentFBO = 0, m_MomentTexture = 0;
+    int m_Size = 0;
+    bool m_HasStaticAtlas = false;
+    bool m_HasMomentAtlas = false;
+    size_t m_CreatedBudget = 0; // Budget and format the textures were made with
+    ShadowDepthFormat m_CreatedFormat = SHADOW_DEPTH_32F;
+
+    size_t m_Budget = 64 * 1024 * 1024;
+    ShadowDepthFormat m_Format = SHADOW_DEPTH_32F;
+
+public:
+    ShadowAtlas() = default;
+    ~ShadowAtlas();
+
+    // Takes effect at the next Reset()
+    void SetBudget(size_t bytes) { m_Budget = bytes; }
+    void SetFormat(ShadowDepthFormat format) { m_Format = format; }
+    size_t GetBudget() const { return m_Budget; }
+    ShadowDepthFormat GetFormat() const { return m_Format; }
+
+    // Frees every tile, call before the first Allocate() of a frame. The
+    // textures are recreated when the budget, format or the need for the
+    // static or moment atlas changed, returns true then as everything
+    // cached in them is gone.
+    bool Reset(bool withStaticAtlas, bool withMomentAtlas);
+    // Tile of the given size, smaller if that doesn't fit. Returns
+    // false when not even MIN_TILE_SIZE fits.
+    bool Allocate(int size, Rect& rect);
+
+    int GetSize() const { return m_Size; }
+    // Largest tile a light gets, so at least four lights have room
+    int GetMaxTileSize() const { return m_Size / 2; }
+    GLuint GetTexture() const { return m_Texture; }
+    GLuint GetFBO() const { return m_FBO; }
+    GLuint GetStaticTexture() const { return m_StaticTexture; }
+    GLuint GetStaticFBO() const { return m_StaticFBO; }
+    GLuint GetMomentTexture() const { return m_MomentTexture; }
+    GLuint GetMomentFBO() const { return m_MomentFBO; }
+    size_t GetMemoryUsage() const;
+
+    static int BytesPerTexel(ShadowDepthFormat format);
+
+private:
+    static size_t GetMemoryUsage(int size, ShadowDepthFormat format, bool withStaticAtlas, bool withMomentAtlas);
+    int Allocate(int nodeIndex, int size);
+    void Destroy();
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glad/glad.h>
+
+// Render targets of the screen space shadow mask of forward shading.
+// After the depth prepass the depth buffer is copied out, a pass at half
+// the resolution looks up the shadow of every shadowed light once per
+// 2x2 pixels and the main pass reads it back, upsampled by depth (see
+// shadow-mask.glsl).
+//
+//   depth       DEPTH24_STENCIL8  full resolution copy of the prepass depth
+//   view depth  R32F              half resolution, view space depth of
+//                                 the pixels the mask texels stand for
+//   mask        RGBA8 2D array    half resolution, a channel per light
+//
+// The view depth and the mask layers are drawn at once as color attachments.
+class ShadowMask {
+public:
+    static const int MAX_LAYERS = 7; // 8 draw buffers every driver has, one for the view depth
+    static const int MAX_CHANNELS = MAX_LAYERS * 4;
+
+private:
+    GLuint m_DepthFBO = 0, m_DepthTexture = 0;
+    GLuint m_MaskFBO = 0, m_ViewDepthTexture = 0, m_MaskTexture = 0;
+    int m_Width = 0, m_Height = 0; // Full resolution
+    int m_NumLayers = 0;
+
+public:
+    ShadowMask() = default;
+    ~ShadowMask();
+
+    // (Re)creates the targets when the size changed or more layers are
+    // needed, the layers never shrink
+    void Resize(int width, int height, int numLayers);
+
+    // Copies the depth of the default framebuffer, resolving multisampling
+    void CopyDepth();
+    // Binds the half resolution framebuffer with every layer as draw
+    // buffer and sets the viewport to it
+    void BindForMask();
+
+    int GetMaskWidth() const { return (m_Width + 1) / 2; }
+    int GetMaskHeight() const { return (m_Height + 1) / 2; }
+    GLuint GetDepthTexture() const { return m_DepthTexture; }
+    GLuint GetViewDepthTexture() const { return m_ViewDepthTexture; }
+    GLuint GetMaskTexture() const { return m_MaskTexture; }
+
+private:
+    void Destroy();
+};
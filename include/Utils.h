@@ -11,5 +11,10 @@ struct Vertex {
     Vec3 tangent;
     Vec3 bitangent;
 };
+// Vertex of the position and UV stream of the depth passes
+struct PositionUV {
+    Vec3 pos;
+    Vec2 uv;
+};
 struct Vec3;
 void computeTangentBitangent(const Vertex& v0, const Vertex& v1, const Vertex& v2, Vec3& tangent, Vec3& bitangent);
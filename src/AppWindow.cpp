@@ -39,6 +39,7 @@ AppWindow::AppWindow(const char* title, int width, int height) {
 }
 
 AppWindow::~AppWindow() {
+	if (m_SharedContextHandle) glfwDestroyWindow(m_SharedContextHandle);
 	glfwDestroyWindow(m_WindowHandle);
 }
 
@@ -72,3 +73,26 @@ void AppWindow::PollEvents() {
 void AppWindow::SwapBuffers() {
 	glfwSwapBuffers(m_WindowHandle);
 }
+
+bool AppWindow::CreateSharedContext() {
+	assert(!m_SharedContextHandle && "Shared context already created");
+
+	// GLFW contexts always come with a window, keep it hidden
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	m_SharedContextHandle = glfwCreateWindow(1, 1, "", NULL, m_WindowHandle);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+
+	if (!m_SharedContextHandle) {
+		std::cout << "Failed creating shared context\n";
+		return false;
+	}
+	return true;
+}
+
+void AppWindow::MakeSharedContextCurrent() {
+	glfwMakeContextCurrent(m_SharedContextHandle);
+}
+
+void AppWindow::ReleaseCurrentContext() {
+	glfwMakeContextCurrent(NULL);
+}
@@ -0,0 +1,175 @@
+#include <assert.h>
+#include <iostream>
+#include <deque>
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+#include "AssetWatcher.h"
+
+// How long file events have to stop before the changes are handled
+#define ASSET_BATCH_DELAY_MS 100.0
+
+AssetWatcher* AssetWatcher::s_Instance = NULL;
+AssetWatcher& AssetWatcher::Get() {
+    if (!s_Instance) s_Instance = new AssetWatcher();
+
+    return *s_Instance;
+}
+
+AssetWatcher::AssetWatcher() {
+    assert(!s_Instance && "Only one instance allowed");
+
+    s_Instance = this;
+}
+
+std::string assetPath(const std::string& path) {
+    return fs::absolute(fs::path(path)).lexically_normal().generic_string();
+}
+
+void AssetWatcher::Init(const std::string& rootDir) {
+#ifdef __linux__
+    assert(m_InotifyFd < 0 && "Asset watcher already initialized");
+
+    m_InotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_InotifyFd < 0) {
+        std::cerr << "Failed initializing inotify, assets won't be reloaded on change\n";
+        return;
+    }
+
+    AddWatchRecursive(assetPath(rootDir));
+    std::cout << "Watching " << m_WatchDirs.size() << " asset directories under '" << rootDir << "'\n";
+#else
+    std::cout << "Watching assets is only supported on Linux\n";
+#endif
+}
+
+void AssetWatcher::Shutdown() {
+#ifdef __linux__
+    if (m_InotifyFd >= 0) close(m_InotifyFd);
+    m_InotifyFd = -1;
+    m_WatchDirs.clear();
+#endif
+}
+
+void AssetWatcher::AddWatchRecursive(const std::string& dir) {
+#ifdef __linux__
+    // Watching directories instead of files also catches editors that
+    // save by writing a new file and renaming it over the old one.
+    int wd = inotify_add_watch(m_InotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd < 0) {
+        std::cerr << "Failed watching '" << dir << "'\n";
+        return;
+    }
+    m_WatchDirs[wd] = dir;
+
+    std::error_code error;
+    for (auto& entry : fs::directory_iterator(dir, error)) {
+        if (entry.is_directory()) AddWatchRecursive(entry.path().generic_string());
+    }
+#endif
+}
+
+void AssetWatcher::Watch(const std::string& node, std::function<void()> onChanged) {
+    m_Handlers[node] = onChanged;
+}
+
+void AssetWatcher::Unwatch(const std::string& node) {
+    m_Handlers.erase(node);
+    m_Dependencies.erase(node);
+}
+
+void AssetWatcher::AddDependency(const std::string& node, const std::string& dependency) {
+    m_Dependencies[node].insert(dependency);
+}
+
+void AssetWatcher::SetDependencies(const std::string& node, const std::vector<std::string>& dependencies) {
+    m_Dependencies[node] = std::set<std::string>(dependencies.begin(), dependencies.end());
+}
+
+void AssetWatcher::Poll() {
+#ifdef __linux__
+    if (m_InotifyFd < 0) return;
+
+    // Buffer aligned for inotify_event as the man page suggests
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        ssize_t length = read(m_InotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) break; // EAGAIN when there are no more events
+
+        for (char* ptr = buffer; ptr < buffer + length; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len) {
+            inotify_event* event = (inotify_event*)ptr;
+            if (event->len == 0) continue;
+
+            auto dirIt = m_WatchDirs.find(event->wd);
+            if (dirIt == m_WatchDirs.end()) continue;
+            std::string path = dirIt->second + "/" + event->name;
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) AddWatchRecursive(path);
+                continue;
+            }
+            // Creating a file is followed by a close-write once it has content
+            if (event->mask & IN_CREATE) continue;
+
+            m_Changed.insert(path);
+            m_LastEventTimer.Reset();
+        }
+    }
+
+    if (!m_Changed.empty() && m_LastEventTimer.Record().GetMilliseconds() >= ASSET_BATCH_DELAY_MS) {
+        ProcessChanges();
+    }
+#endif
+}
+
+std::set<std::string> AssetWatcher::CollectAffected(const std::set<std::string>& changed) const {
+    std::set<std::string> affected;
+    std::set<std::string> visited;
+    std::deque<std::string> queue(changed.begin(), changed.end());
+
+    while (!queue.empty()) {
+        std::string node = queue.front();
+        queue.pop_front();
+        if (!visited.insert(node).second) continue;
+
+        if (m_Handlers.find(node) != m_Handlers.end()) {
+            affected.insert(node);
+            continue;
+        }
+        for (auto& [dependent, dependencies] : m_Dependencies) {
+            if (dependencies.count(node)) queue.push_back(dependent);
+        }
+    }
+
+    return affected;
+}
+
+void AssetWatcher::ProcessChanges() {
+    Timer reloadTimer;
+
+    std::set<std::string> affected = CollectAffected(m_Changed);
+    size_t numChanged = m_Changed.size();
+    m_Changed.clear();
+
+    if (affected.empty()) return;
+
+    for (const std::string& node : affected) {
+        std::cout << "Asset changed: '" << node << "'\n";
+        // Copied, handlers may change what is watched
+        auto it = m_Handlers.find(node);
+        if (it == m_Handlers.end()) continue;
+        std::function<void()> handler = it->second;
+        handler();
+    }
+
+    std::cout << "Reloaded " << affected.size() << " assets for " << numChanged << " changed files in "
+              << reloadTimer.Record().GetMilliseconds() << "ms\n";
+}
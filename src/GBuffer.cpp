@@ -0,0 +1,80 @@
+#include "GBuffer.h"
+
+#include <assert.h>
+
+#include "GLutils.h"
+
+struct AttachmentFormat {
+    GLint internalFormat;
+    GLenum format, type;
+};
+static const AttachmentFormat ATTACHMENT_FORMATS[GBuffer::NUM_ATTACHMENTS] = {
+    { GL_RGBA32F, GL_RGBA, GL_FLOAT },         // POSITION
+    { GL_RGBA16F, GL_RGBA, GL_FLOAT },         // NORMAL
+    { GL_RGBA8,   GL_RGBA, GL_UNSIGNED_BYTE }, // ALBEDO
+    { GL_RGBA8,   GL_RGBA, GL_UNSIGNED_BYTE }, // SPECULAR
+    { GL_RGBA16F, GL_RGBA, GL_FLOAT },         // REFLECTION
+    { GL_RGBA16F, GL_RGBA, GL_FLOAT },         // LIGHT
+};
+
+GBuffer::~GBuffer() {
+    Destroy();
+}
+
+void GBuffer::Destroy() {
+    if (m_FBO == 0) return;
+    glDeleteFramebuffers(1, &m_FBO);
+    glDeleteTextures(NUM_ATTACHMENTS, m_Textures);
+    glDeleteTextures(1, &m_DepthTexture);
+    m_FBO = 0;
+}
+
+void GBuffer::Resize(int width, int height) {
+    if (m_FBO != 0 && width == m_Width && height == m_Height) return;
+    Destroy();
+    m_Width = width;
+    m_Height = height;
+
+    std::cout << "Creating G-buffer (" << width << "x" << height << ")...\n";
+
+    GL_CALL(glGenFramebuffers(1, &m_FBO));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_FBO));
+
+    GL_CALL(glGenTextures(NUM_ATTACHMENTS, m_Textures));
+    for (int i = 0; i < NUM_ATTACHMENTS; i++) {
+        const AttachmentFormat& format = ATTACHMENT_FORMATS[i];
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, m_Textures[i]));
+        GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, format.internalFormat, width, height, 0, format.format, format.type, NULL));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+        GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, m_Textures[i], 0));
+    }
+
+    GL_CALL(glGenTextures(1, &m_DepthTexture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, m_DepthTexture));
+    GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, m_DepthTexture, 0));
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+    std::cout << "Done!\n";
+}
+
+void GBuffer::BindForGeometry() {
+    static const GLenum drawBuffers[NUM_ATTACHMENTS] = {
+        GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2,
+        GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5,
+    };
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_FBO));
+    GL_CALL(glDrawBuffers(NUM_ATTACHMENTS, drawBuffers));
+}
+
+void GBuffer::BindForLighting() {
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_FBO));
+    GL_CALL(glDrawBuffer(GL_COLOR_ATTACHMENT0 + LIGHT));
+}
@@ -5,14 +5,87 @@
 
 #include "GLutils.h"
 
-Texture loadTexture(const std::string& path) {
-    Texture texture;
+#include <cstring>
 
-    void* data = stbi_load(path.c_str(), &texture.width, &texture.height, &texture.channels, 4);
+PFNGLGETPROGRAMBINARYPROC glext_glGetProgramBinary = NULL;
+PFNGLPROGRAMBINARYPROC glext_glProgramBinary = NULL;
+PFNGLPROGRAMPARAMETERIPROC glext_glProgramParameteri = NULL;
+PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glext_glMaxShaderCompilerThreadsKHR = NULL;
 
-    assert(data && "Texture loading failed");
+GLExtensions g_GLExtensions;
+
+bool isGLExtensionSupported(const char* name) {
+    GLint numExtensions = 0;
+    GL_CALL(glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions));
+    for (GLint i = 0; i < numExtensions; i++) {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+        if (ext && strcmp(ext, name) == 0) return true;
+    }
+    return false;
+}
+
+void loadGLExtensions(GLADloadproc load) {
+    GLint major = 0, minor = 0;
+    GL_CALL(glGetIntegerv(GL_MAJOR_VERSION, &major));
+    GL_CALL(glGetIntegerv(GL_MINOR_VERSION, &minor));
+    int version = major * 10 + minor;
+
+    if (version >= 41 || isGLExtensionSupported("GL_ARB_get_program_binary")) {
+        glext_glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)load("glGetProgramBinary");
+        glext_glProgramBinary = (PFNGLPROGRAMBINARYPROC)load("glProgramBinary");
+        glext_glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)load("glProgramParameteri");
+
+        // Drivers may expose the entry points but support zero formats,
+        // in which case binaries can never be retrieved.
+        GLint numFormats = 0;
+        GL_CALL(glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats));
+
+        g_GLExtensions.programBinary = glext_glGetProgramBinary && glext_glProgramBinary
+                                    && glext_glProgramParameteri && numFormats > 0;
+    }
+
+    // Both extensions share the enums, only the entry point is named differently
+    if (isGLExtensionSupported("GL_KHR_parallel_shader_compile")) {
+        glext_glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsKHR");
+    } else if (isGLExtensionSupported("GL_ARB_parallel_shader_compile")) {
+        glext_glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsARB");
+    }
+    if (glext_glMaxShaderCompilerThreadsKHR) {
+        // Let the driver use as many threads as it wants
+        GL_CALL(glMaxShaderCompilerThreadsKHR(0xFFFFFFFF));
+        g_GLExtensions.parallelShaderCompile = true;
+    }
+
+    g_GLExtensions.textureCubeMapArray = version >= 40 || isGLExtensionSupported("GL_ARB_texture_cube_map_array");
+
+    std::cout << "GL " << major << "." << minor
+              << " | program binary: " << (g_GLExtensions.programBinary ? "yes" : "no")
+              << " | parallel shader compile: " << (g_GLExtensions.parallelShaderCompile ? "yes" : "no")
+              << " | cube map arrays: " << (g_GLExtensions.textureCubeMapArray ? "yes" : "no") << "\n";
+}
+
+const GLExtensions& getGLExtensions() {
+    return g_GLExtensions;
+}
+
+// Decodes the image and uploads it into texture.id, leaves
+// the GL texture untouched if the image can't be read.
+static bool uploadTextureFile(Texture& texture, const std::string& path) {
+    void* data = stbi_load(path.c_str(), &texture.width, &texture.height, &texture.channels, 4);
+    if (!data) return false;
+
+    // Alpha testing is only compiled into shaders for
+    // textures that actually have transparent texels.
+    if (texture.channels == 2 || texture.channels == 4) {
+        unsigned char* pixels = (unsigned char*)data;
+        for (size_t i = 0; i < (size_t)texture.width * texture.height; i++) {
+            if (pixels[i * 4 + 3] < 255) {
+                texture.hasAlpha = true;
+                break;
+            }
+        }
+    }
 
-    GL_CALL(glGenTextures(1, &texture.id));
     GL_CALL(glBindTexture(GL_TEXTURE_2D, texture.id));
 
     GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
@@ -29,8 +102,29 @@ Texture loadTexture(const std::string& path) {
 
     stbi_image_free(data);
 
+    return true;
+}
+
+Texture loadTexture(const std::string& path) {
+    Texture texture;
+
+    GL_CALL(glGenTextures(1, &texture.id));
+    bool result = uploadTextureFile(texture, path);
+
+    assert(result && "Texture loading failed");
+
     return texture;
 }
+bool reloadTexture(Texture& texture, const std::string& path) {
+    Texture reloaded = texture;
+    reloaded.hasAlpha = false;
+    if (!uploadTextureFile(reloaded, path)) {
+        std::cerr << "Failed reloading texture '" << path << "', keeping the old one\n";
+        return false;
+    }
+    texture = reloaded;
+    return true;
+}
 void deleteTexture(const Texture& texture) {
     GL_CALL(glBindTexture(GL_TEXTURE_2D, texture.id));
     GL_CALL(glDeleteTextures(1, &texture.id));
@@ -70,34 +164,48 @@ void TextureBindContext::Init() {
     s_Slots.resize(s_MaxTextureSlots);
     for (int i = 0; i < s_MaxTextureSlots; i++) {
         s_Slots[i].type = 0;
+        s_Slots[i].sampler = 0;
     }
 }
 void TextureBindContext::ResetAll() {
     for (int i = 0; i < s_MaxTextureSlots; i++) {
         GL_CALL(glActiveTexture(GL_TEXTURE0 + i));
         GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
         GL_CALL(glBindTexture(GL_TEXTURE_CUBE_MAP, 0));
+        GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, 0));
+        if (g_GLExtensions.textureCubeMapArray) {
+            GL_CALL(glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0));
+        }
+        GL_CALL(glBindSampler(i, 0));
 
         s_Slots[i].type = 0;
+        s_Slots[i].sampler = 0;
     }
 }
-void TextureBindContext::Set(int slot, GLenum type, GLuint texture) {
+void TextureBindContext::Set(int slot, GLenum type, GLuint texture, GLuint sampler) {
     if (s_Slots[slot].type != 0) {
         std::cout << "[WARNING] Texture slot overwrite\n";
     }
-    s_Slots[slot] = { type, texture };
+    s_Slots[slot] = { type, texture, sampler };
 }
-void TextureBindContext::Overwrite(int slot, GLenum type, GLuint texture) {
-    s_Slots[slot] = { type, texture };
+void TextureBindContext::Overwrite(int slot, GLenum type, GLuint texture, GLuint sampler) {
+    s_Slots[slot] = { type, texture, sampler };
 }
 void TextureBindContext::ApplyAll() {
     
     for (int i = 0; i < s_MaxTextureSlots; i++) {
         GL_CALL(glActiveTexture(GL_TEXTURE0 + i));
         GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
         GL_CALL(glBindTexture(GL_TEXTURE_CUBE_MAP, 0));
+        GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, 0));
+        if (g_GLExtensions.textureCubeMapArray) {
+            GL_CALL(glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0));
+        }
         if (s_Slots[i].type != 0) {
             GL_CALL(glBindTexture(s_Slots[i].type, s_Slots[i].texture));
         }
+        GL_CALL(glBindSampler(i, s_Slots[i].sampler));
     }
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 
 bool g_ShouldDrawDepthMaps = false;
 int g_DrawDepthMapIndex = 0;
+bool g_UseDeferredShading = false;
+bool g_UseDepthPrepass = false;
 
 AppWindow* g_MainWindow;
 
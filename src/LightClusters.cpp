@@ -0,0 +1,385 @@
+#include "LightClusters.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLUSTERS_USE_SSE
+#endif
+
+#include "Scene.h"
+#include "Shader.h"
+#include "Timer.h"
+
+// Centers of the padding lanes are far enough away to never touch a cluster
+#define PADDING_CENTER 1e30f
+
+// Calls onHit(i) for every sphere in the padded arrays that touches the box
+template<typename F>
+static void forEachSphereInAABB(const float* x, const float* y, const float* z, const float* radius, size_t count,
+                                const Vec3& boxMin, const Vec3& boxMax, F onHit) {
+#ifdef CLUSTERS_USE_SSE
+    const __m128 minX = _mm_set1_ps(boxMin.x), minY = _mm_set1_ps(boxMin.y), minZ = _mm_set1_ps(boxMin.z);
+    const __m128 maxX = _mm_set1_ps(boxMax.x), maxY = _mm_set1_ps(boxMax.y), maxZ = _mm_set1_ps(boxMax.z);
+    const __m128 zero = _mm_setzero_ps();
+
+    for (size_t i = 0; i < count; i += 4) {
+        __m128 cx = _mm_loadu_ps(x + i);
+        __m128 cy = _mm_loadu_ps(y + i);
+        __m128 cz = _mm_loadu_ps(z + i);
+        __m128 r = _mm_loadu_ps(radius + i);
+
+        // Distance from the center to the box on each axis, 0 when inside
+        __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, cx), _mm_sub_ps(cx, maxX)), zero);
+        __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, cy), _mm_sub_ps(cy, maxY)), zero);
+        __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, cz), _mm_sub_ps(cz, maxZ)), zero);
+        __m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+        int mask = _mm_movemask_ps(_mm_cmple_ps(distSq, _mm_mul_ps(r, r)));
+        for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+            if (mask & 1) onHit(i + lane);
+        }
+    }
+#else
+    for (size_t i = 0; i < count; i++) {
+        float dx = std::max(std::max(boxMin.x - x[i], x[i] - boxMax.x), 0.0f);
+        float dy = std::max(std::max(boxMin.y - y[i], y[i] - boxMax.y), 0.0f);
+        float dz = std::max(std::max(boxMin.z - z[i], z[i] - boxMax.z), 0.0f);
+        if (dx * dx + dy * dy + dz * dz <= radius[i] * radius[i]) onHit(i);
+    }
+#endif
+}
+
+// Cone from the apex with the given half angle, against a sphere
+static bool coneTouchesSphere(const Vec3& position, const Vec3& direction, float cosAngle, float sinAngle,
+                              const Vec3& center, float radius) {
+    Vec3 v = center.Subtract(position);
+    float lengthSq = v.x * v.x + v.y * v.y + v.z * v.z;
+    float alongAxis = v.x * direction.x + v.y * direction.y + v.z * direction.z;
+    float distanceToAxis = std::sqrt(std::max(lengthSq - alongAxis * alongAxis, 0.0f));
+
+    // Behind the apex, only valid for cones narrower than a half sphere
+    if (cosAngle > 0.0f && alongAxis < -radius) return false;
+
+    float distanceToCone = cosAngle * distanceToAxis - alongAxis * sinAngle;
+    return distanceToCone <= radius;
+}
+
+static void padTo4(std::vector<float>& x, std::vector<float>& y, std::vector<float>& z, std::vector<float>& radius) {
+    while (x.size() % 4 != 0) {
+        x.push_back(PADDING_CENTER);
+        y.push_back(PADDING_CENTER);
+        z.push_back(PADDING_CENTER);
+        radius.push_back(0.0f);
+    }
+}
+
+LightClusters::LightClusters() {
+    m_ClusterBounds.resize(NUM_CLUSTERS);
+    m_Grid.resize(NUM_CLUSTERS * 2);
+
+    GL_CALL(glGenBuffers(1, &m_LightBuffer));
+    GL_CALL(glGenBuffers(1, &m_GridBuffer));
+    GL_CALL(glGenBuffers(1, &m_IndexBuffer));
+    GL_CALL(glGenTextures(1, &m_LightTexture));
+    GL_CALL(glGenTextures(1, &m_GridTexture));
+    GL_CALL(glGenTextures(1, &m_IndexTexture));
+
+    // The main thread works on the slices too while it waits for them
+    unsigned int numThreads = std::thread::hardware_concurrency();
+    int numWorkers = numThreads > 1 ? (int)std::min(numThreads - 1, 7u) : 0;
+    for (int i = 0; i < numWorkers; i++) {
+        m_Workers.emplace_back(&LightClusters::WorkerMain, this);
+    }
+}
+
+LightClusters::~LightClusters() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_WorkCondition.notify_all();
+    for (std::thread& worker : m_Workers) worker.join();
+
+    glDeleteBuffers(1, &m_LightBuffer);
+    glDeleteBuffers(1, &m_GridBuffer);
+    glDeleteBuffers(1, &m_IndexBuffer);
+    glDeleteTextures(1, &m_LightTexture);
+    glDeleteTextures(1, &m_GridTexture);
+    glDeleteTextures(1, &m_IndexTexture);
+}
+
+void LightClusters::UpdateClusterBounds(const Matrix4& proj) {
+    if (memcmp(m_ProjData, proj.data, sizeof(m_ProjData)) == 0) return;
+    memcpy(m_ProjData, proj.data, sizeof(m_ProjData));
+
+    m_Near = proj.data[14] / (proj.data[10] - 1.0f);
+    m_Far = proj.data[14] / (proj.data[10] + 1.0f);
+    // Half extents of the frustum at a depth of 1
+    float tanX = 1.0f / proj.data[0];
+    float tanY = 1.0f / proj.data[5];
+
+    for (int slice = 0; slice < GRID_Z; slice++) {
+        float sliceNear = m_Near * std::pow(m_Far / m_Near, (float)slice / GRID_Z);
+        float sliceFar = m_Near * std::pow(m_Far / m_Near, (float)(slice + 1) / GRID_Z);
+
+        m_SliceBounds[slice].min = Vec3(-tanX * sliceFar, -tanY * sliceFar, -sliceFar);
+        m_SliceBounds[slice].max = Vec3(tanX * sliceFar, tanY * sliceFar, -sliceNear);
+
+        for (int y = 0; y < GRID_Y; y++) {
+            for (int x = 0; x < GRID_X; x++) {
+                float x0 = (-1.0f + 2.0f * x / GRID_X) * tanX, x1 = (-1.0f + 2.0f * (x + 1) / GRID_X) * tanX;
+                float y0 = (-1.0f + 2.0f * y / GRID_Y) * tanY, y1 = (-1.0f + 2.0f * (y + 1) / GRID_Y) * tanY;
+
+                // The tile's corners at both ends of the slice
+                AABB& bounds = m_ClusterBounds[(slice * GRID_Y + y) * GRID_X + x];
+                bounds.min = Vec3(std::min(x0 * sliceNear, x0 * sliceFar), std::min(y0 * sliceNear, y0 * sliceFar), -sliceFar);
+                bounds.max = Vec3(std::max(x1 * sliceNear, x1 * sliceFar), std::max(y1 * sliceNear, y1 * sliceFar), -sliceNear);
+            }
+        }
+    }
+}
+
+void LightClusters::BeginBuild(const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights, const Matrix4& view, const Matrix4& proj) {
+    assert(!m_Building && "Previous build not finished");
+    assert(pointLights.size() + spotLights.size() <= MAX_LIGHTS && "Too many lights for 16 bit light indices");
+
+    UpdateClusterBounds(proj);
+
+    m_PointX.clear();
+    m_PointY.clear();
+    m_PointZ.clear();
+    m_PointRadius.clear();
+    m_PointIndex.clear();
+    size_t numPointLights = std::min(pointLights.size(), (size_t)MAX_LIGHTS);
+    for (size_t i = 0; i < numPointLights; i++) {
+        const PointLight& light = pointLights[i];
+        if (!light.active) continue;
+
+        Vec3 position = view.Multiply(light.position);
+        m_PointX.push_back(position.x);
+        m_PointY.push_back(position.y);
+        m_PointZ.push_back(position.z);
+        m_PointRadius.push_back(light.outerRadius);
+        m_PointIndex.push_back((uint16_t)i);
+    }
+    padTo4(m_PointX, m_PointY, m_PointZ, m_PointRadius);
+
+    m_Cones.clear();
+    for (size_t i = 0; i < spotLights.size() && numPointLights + i < MAX_LIGHTS; i++) {
+        const SpotLight& light = spotLights[i];
+        if (!light.active) continue;
+
+        Cone cone;
+        cone.position = view.Multiply(light.position);
+        cone.direction = view.TransformDirection(light.direction).Normalized();
+        cone.cosAngle = std::cos(light.outerCutOff);
+        cone.sinAngle = std::sin(light.outerCutOff);
+        cone.index = (uint16_t)(numPointLights + i);
+        m_Cones.push_back(cone);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_SlicesDone = 0;
+        m_NextSlice = 0;
+        m_BuildGeneration++;
+        m_Building = true;
+    }
+    m_WorkCondition.notify_all();
+}
+
+void LightClusters::WorkerMain() {
+    uint64_t seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_WorkCondition.wait(lock, [&] { return m_Quit || m_BuildGeneration != seenGeneration; });
+            if (m_Quit) return;
+            seenGeneration = m_BuildGeneration;
+        }
+        ProcessSlices();
+    }
+}
+
+void LightClusters::ProcessSlices() {
+    int slice;
+    while ((slice = m_NextSlice.fetch_add(1)) < GRID_Z) {
+        BuildSlice(slice);
+
+        if (m_SlicesDone.fetch_add(1) + 1 == GRID_Z) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_DoneCondition.notify_all();
+        }
+    }
+}
+
+void LightClusters::BuildSlice(int slice) {
+    Timer timer;
+    SliceOutput& out = m_Slices[slice];
+    out.indices.clear();
+    out.candX.clear();
+    out.candY.clear();
+    out.candZ.clear();
+    out.candRadius.clear();
+    out.candIndex.clear();
+    out.spotCandidates.clear();
+
+    // Lights that miss the whole slice don't need to be tested per cluster
+    const AABB& sliceBounds = m_SliceBounds[slice];
+    forEachSphereInAABB(m_PointX.data(), m_PointY.data(), m_PointZ.data(), m_PointRadius.data(), m_PointX.size(),
+                        sliceBounds.min, sliceBounds.max, [&](size_t i) {
+        out.candX.push_back(m_PointX[i]);
+        out.candY.push_back(m_PointY[i]);
+        out.candZ.push_back(m_PointZ[i]);
+        out.candRadius.push_back(m_PointRadius[i]);
+        out.candIndex.push_back(m_PointIndex[i]);
+    });
+    padTo4(out.candX, out.candY, out.candZ, out.candRadius);
+
+    Vec3 sliceCenter = sliceBounds.min.Add(sliceBounds.max).Multiply(0.5f);
+    float sliceRadius = sliceBounds.max.Subtract(sliceCenter).Length();
+    for (size_t i = 0; i < m_Cones.size(); i++) {
+        const Cone& cone = m_Cones[i];
+        if (coneTouchesSphere(cone.position, cone.direction, cone.cosAngle, cone.sinAngle, sliceCenter, sliceRadius)) {
+            out.spotCandidates.push_back((uint16_t)i);
+        }
+    }
+
+    for (int y = 0; y < GRID_Y; y++) {
+        for (int x = 0; x < GRID_X; x++) {
+            int cluster = (slice * GRID_Y + y) * GRID_X + x;
+            const AABB& bounds = m_ClusterBounds[cluster];
+            size_t offset = out.indices.size();
+
+            forEachSphereInAABB(out.candX.data(), out.candY.data(), out.candZ.data(), out.candRadius.data(), out.candX.size(),
+                                bounds.min, bounds.max, [&](size_t i) {
+                out.indices.push_back(out.candIndex[i]);
+            });
+
+            Vec3 center = bounds.min.Add(bounds.max).Multiply(0.5f);
+            float radius = bounds.max.Subtract(center).Length();
+            for (uint16_t candidate : out.spotCandidates) {
+                const Cone& cone = m_Cones[candidate];
+                if (coneTouchesSphere(cone.position, cone.direction, cone.cosAngle, cone.sinAngle, center, radius)) {
+                    out.indices.push_back(cone.index);
+                }
+            }
+
+            m_Grid[cluster * 2 + 0] = (uint32_t)offset;
+            m_Grid[cluster * 2 + 1] = (uint32_t)(out.indices.size() - offset);
+        }
+    }
+
+    out.milliseconds = timer.Record().GetMilliseconds();
+}
+
+void LightClusters::FinishBuild(const std::vector<PointLight>& pointLights, const std::vector<SpotLight>& spotLights) {
+    assert(m_Building && "BeginBuild() not called");
+
+    Timer waitTimer;
+    ProcessSlices();
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_DoneCondition.wait(lock, [&] { return m_SlicesDone == GRID_Z; });
+        m_Building = false;
+    }
+    m_WaitMilliseconds = waitTimer.Record().GetMilliseconds();
+
+    // Make the per slice offsets point into one index list
+    m_Indices.clear();
+    m_BuildMilliseconds = 0.0;
+    m_MaxLightsPerCluster = 0;
+    for (int slice = 0; slice < GRID_Z; slice++) {
+        uint32_t base = (uint32_t)m_Indices.size();
+        const SliceOutput& out = m_Slices[slice];
+        m_Indices.insert(m_Indices.end(), out.indices.begin(), out.indices.end());
+        m_BuildMilliseconds += out.milliseconds;
+
+        for (int cluster = slice * GRID_X * GRID_Y; cluster < (slice + 1) * GRID_X * GRID_Y; cluster++) {
+            m_Grid[cluster * 2 + 0] += base;
+            m_MaxLightsPerCluster = std::max(m_MaxLightsPerCluster, (int)m_Grid[cluster * 2 + 1]);
+        }
+    }
+
+    // 4 texels per light, see LightClusters.h and the shader
+    size_t numPointLights = std::min(pointLights.size(), (size_t)MAX_LIGHTS);
+    size_t numSpotLights = std::min(spotLights.size(), MAX_LIGHTS - numPointLights);
+    m_LightRecords.resize(std::max(numPointLights + numSpotLights, (size_t)1) * 16);
+    float* record = m_LightRecords.data();
+    for (size_t i = 0; i < numPointLights; i++, record += 16) {
+        const PointLight& light = pointLights[i];
+        float data[16] = {
+            light.position.x, light.position.y, light.position.z, (float)light.depthMapInfo.shadowSlot,
+            light.diffuse.x, light.diffuse.y, light.diffuse.z, light.intensity,
+            light.specular.x, light.specular.y, light.specular.z, light.innerRadius,
+            light.depthMapInfo.slotMode == POINT_SHADOW_PARABOLOID ? 1.0f : 0.0f, 0.0f, 0.0f, light.outerRadius,
+        };
+        memcpy(record, data, sizeof(data));
+    }
+    for (size_t i = 0; i < numSpotLights; i++, record += 16) {
+        const SpotLight& light = spotLights[i];
+        float data[16] = {
+            light.position.x, light.position.y, light.position.z, (float)light.depthMapInfo.shadowSlot,
+            light.diffuse.x, light.diffuse.y, light.diffuse.z, light.intensity,
+            light.specular.x, light.specular.y, light.specular.z, std::cos(light.cutOff),
+            light.direction.x, light.direction.y, light.direction.z, std::cos(light.outerCutOff),
+        };
+        memcpy(record, data, sizeof(data));
+    }
+
+    Upload();
+}
+
+void LightClusters::Upload() {
+    // Index list can't be empty, buffer textures need storage
+    if (m_Indices.empty()) m_Indices.push_back(0);
+
+    // Orphaning the buffers so the driver doesn't wait for the last frame to finish with them
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, m_LightBuffer));
+    GL_CALL(glBufferData(GL_TEXTURE_BUFFER, m_LightRecords.size() * sizeof(float), NULL, GL_STREAM_DRAW));
+    GL_CALL(glBufferSubData(GL_TEXTURE_BUFFER, 0, m_LightRecords.size() * sizeof(float), m_LightRecords.data()));
+
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, m_GridBuffer));
+    GL_CALL(glBufferData(GL_TEXTURE_BUFFER, m_Grid.size() * sizeof(uint32_t), NULL, GL_STREAM_DRAW));
+    GL_CALL(glBufferSubData(GL_TEXTURE_BUFFER, 0, m_Grid.size() * sizeof(uint32_t), m_Grid.data()));
+
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, m_IndexBuffer));
+    GL_CALL(glBufferData(GL_TEXTURE_BUFFER, m_Indices.size() * sizeof(uint16_t), NULL, GL_STREAM_DRAW));
+    GL_CALL(glBufferSubData(GL_TEXTURE_BUFFER, 0, m_Indices.size() * sizeof(uint16_t), m_Indices.data()));
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+
+    // Reattached every time since the storage changed
+    GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, m_LightTexture));
+    GL_CALL(glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_LightBuffer));
+    GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, m_GridTexture));
+    GL_CALL(glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, m_GridBuffer));
+    GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, m_IndexTexture));
+    GL_CALL(glTexBuffer(GL_TEXTURE_BUFFER, GL_R16UI, m_IndexBuffer));
+    GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, 0));
+}
+
+int LightClusters::BindTextures(int firstUnit) {
+    m_LightUnit = firstUnit;
+    m_GridUnit = firstUnit + 1;
+    m_IndexUnit = firstUnit + 2;
+    TextureBindContext::Set(m_LightUnit, GL_TEXTURE_BUFFER, m_LightTexture);
+    TextureBindContext::Set(m_GridUnit, GL_TEXTURE_BUFFER, m_GridTexture);
+    TextureBindContext::Set(m_IndexUnit, GL_TEXTURE_BUFFER, m_IndexTexture);
+    return firstUnit + 3;
+}
+
+void LightClusters::SetUniforms(Shader& shader, int viewportWidth, int viewportHeight) const {
+    shader.SetInt("clusterLights", m_LightUnit);
+    shader.SetInt("clusterGrid", m_GridUnit);
+    shader.SetInt("clusterLightIndices", m_IndexUnit);
+
+    // Pixel to tile, and view depth to slice with
+    // slice = log(depth) * scale - bias
+    shader.SetVec2("clusterTileScale", Vec2{ (float)GRID_X / viewportWidth, (float)GRID_Y / viewportHeight });
+    float depthScale = GRID_Z / std::log(m_Far / m_Near);
+    shader.SetVec2("clusterDepthParams", Vec2{ depthScale, depthScale * std::log(m_Near) });
+}
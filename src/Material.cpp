@@ -5,6 +5,7 @@
 #include "Material.h"
 #include "Utils.h"
 #include "Shader.h"
+#include "AssetWatcher.h"
 
 MaterialLibrary* MaterialLibrary::s_Instance = NULL;
 MaterialLibrary& MaterialLibrary::Get() {
@@ -19,12 +20,13 @@ MaterialLibrary::MaterialLibrary() {
     s_Instance = this;
 }
 
-void MaterialLibrary::LoadMaterialFile(const std::string& path) {
+std::vector<Material> MaterialLibrary::ParseMaterialFile(const std::string& path, std::vector<std::string>& texturePaths) {
     std::ifstream file(path);
     assert(file.is_open() && "Could not open file");
 
     std::cout << "Loading materials from '" << path << "...\n";
 
+    std::vector<Material> parsed;
     Material currentMaterial;
     std::string line;
     while (std::getline(file, line)) {
@@ -36,7 +38,7 @@ void MaterialLibrary::LoadMaterialFile(const std::string& path) {
             iss.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
         } else if (prefix == "newmtl") {
             if (!currentMaterial.name.empty()) {
-                AddMaterial(currentMaterial.name, currentMaterial);
+                parsed.push_back(currentMaterial);
                 currentMaterial = Material();
             }
             iss >> currentMaterial.name;
@@ -44,19 +46,23 @@ void MaterialLibrary::LoadMaterialFile(const std::string& path) {
         } else if (prefix == "map_Kd") {
             std::string diffusePath;
             iss >> diffusePath;
-            currentMaterial.diffuseMap = loadTexture(sameDirPath(path, diffusePath)); // Relative to mtl path
+            currentMaterial.diffuseMap = GetTexture(sameDirPath(path, diffusePath)); // Relative to mtl path
+            texturePaths.push_back(assetPath(sameDirPath(path, diffusePath)));
         } else if (prefix == "map_Ks") {
             std::string specularPath;
             iss >> specularPath;
-            currentMaterial.specularMap = loadTexture(sameDirPath(path, specularPath)); // Relative to mtl path
+            currentMaterial.specularMap = GetTexture(sameDirPath(path, specularPath)); // Relative to mtl path
+            texturePaths.push_back(assetPath(sameDirPath(path, specularPath)));
         } else if (prefix == "map_bump") {
             std::string normalPath;
             iss >> normalPath;
-            currentMaterial.normalMap = loadTexture(sameDirPath(path, normalPath)); // Relative to mtl path
+            currentMaterial.normalMap = GetTexture(sameDirPath(path, normalPath)); // Relative to mtl path
+            texturePaths.push_back(assetPath(sameDirPath(path, normalPath)));
         } else if (prefix == "map_Ka") {
             std::string ambientPath;
             iss >> ambientPath;
-            currentMaterial.ambientMap = loadTexture(sameDirPath(path, ambientPath)); // Relative to mtl path
+            currentMaterial.ambientMap = GetTexture(sameDirPath(path, ambientPath)); // Relative to mtl path
+            texturePaths.push_back(assetPath(sameDirPath(path, ambientPath)));
         } else if (prefix == "Ka") {
             iss >> currentMaterial.ambientColor.x >> currentMaterial.ambientColor.y >> currentMaterial.ambientColor.z;
         } else if (prefix == "Kd") {
@@ -90,11 +96,42 @@ void MaterialLibrary::LoadMaterialFile(const std::string& path) {
     }
 
     if (!currentMaterial.name.empty()) {
-        materials[currentMaterial.name] = currentMaterial;
+        parsed.push_back(currentMaterial);
+    }
+
+    return parsed;
+}
+
+void MaterialLibrary::LoadMaterialFile(const std::string& path) {
+    std::string node = assetPath(path);
+    if (!materialFiles.insert(node).second) return;
+
+    std::vector<std::string> texturePaths;
+    for (Material& material : ParseMaterialFile(path, texturePaths)) {
+        AddMaterial(material.name, material);
     }
 
+    AssetWatcher::Get().SetDependencies(node, texturePaths);
+    AssetWatcher::Get().Watch(node, [this, path]() { ReloadMaterialFile(path); });
     std::cout << "Materials loaded OK!\n";
 }
+
+void MaterialLibrary::ReloadMaterialFile(const std::string& path) {
+    std::vector<std::string> texturePaths;
+    for (Material& material : ParseMaterialFile(path, texturePaths)) {
+        // Meshes look materials up by name so nothing else needs
+        // reloading, only keep what the app set outside the file.
+        auto it = materials.find(material.name);
+        if (it != materials.end()) {
+            material.reflectiveness = it->second.reflectiveness;
+            material.shouldCastShadow = it->second.shouldCastShadow;
+        }
+        materials[material.name] = material;
+    }
+    AssetWatcher::Get().SetDependencies(assetPath(path), texturePaths);
+    version++;
+    std::cout << "Materials reloaded OK!\n";
+}
 Material* MaterialLibrary::GetMaterial(const std::string& name) {
     assert(materials.find(name) != materials.end() && "No such material");
     return &materials.at(name);
@@ -109,16 +146,67 @@ bool MaterialLibrary::ExistsMaterial(const std::string& name) {
     return materials.find(name) != materials.end();
 }
 
-void setMaterialInShader(Material& material, Shader& shader, int fromActiveTexture) {
+Texture MaterialLibrary::GetTexture(const std::string& path) {
+    std::string node = assetPath(path);
+    auto it = textures.find(node);
+    if (it != textures.end()) return it->second;
+
+    Texture texture = loadTexture(path);
+    textures[node] = texture;
+    AssetWatcher::Get().Watch(node, [this, node]() { ReloadTexture(node); });
+    return texture;
+}
+
+void MaterialLibrary::ReloadTexture(const std::string& path) {
+    Texture& texture = textures.at(assetPath(path));
+    if (!reloadTexture(texture, path)) return;
+    version++;
+
+    // Materials keep copies, the id stays the same but the size and
+    // alpha (which picks the shader variant) may have changed.
+    for (auto& [name, material] : materials) {
+        for (Texture* map : { &material.diffuseMap, &material.specularMap, &material.ambientMap, &material.normalMap }) {
+            if (map->id == texture.id) *map = texture;
+        }
+    }
+}
+
+uint32_t getMaterialFeatures(const Material& material) {
+    uint32_t features = 0;
+
+    if (material.diffuseMap.id) features |= SHADER_FEATURE_DIFFUSE_MAP;
+    if (material.specularMap.id) features |= SHADER_FEATURE_SPECULAR_MAP;
+    if (material.ambientMap.id) features |= SHADER_FEATURE_AMBIENT_MAP;
+    if (material.normalMap.id) features |= SHADER_FEATURE_NORMAL_MAP;
+    if (material.reflectiveness > 0.0f) features |= SHADER_FEATURE_REFLECTION;
+
+    bool transparentMap = (material.diffuseMap.id && material.diffuseMap.hasAlpha)
+                        || (material.ambientMap.id && material.ambientMap.hasAlpha);
+    if (material.alpha < 1.0f || transparentMap) features |= SHADER_FEATURE_ALPHA_TEST;
+
+    return features;
+}
+
+uint32_t getMaterialRenderLayers(const Material& material) {
+    return material.shouldCastShadow ? RENDER_LAYERS_ALL : RENDER_LAYERS_ALL & ~RENDER_LAYERS_SHADOWS;
+}
+
+bool materialPassesFilter(const Material& material, MaterialFilter filter) {
+    switch (filter) {
+        case MATERIAL_FILTER_OPAQUE:  return material.alpha >= 1.0f;
+        case MATERIAL_FILTER_BLENDED: return material.alpha < 1.0f;
+        default:                      return true;
+    }
+}
+
+bool setMaterialInShader(Material& material, Shader& shader, int fromActiveTexture, uint32_t extraFeatures) {
 
     int nextActiveTexture = fromActiveTexture;
 
-    shader.SetFloat("material.alpha", material.alpha);
+    // Picks the shader variant, so it must come before any uniforms
+    if (!shader.SetMaterialFeatures(getMaterialFeatures(material) | extraFeatures)) return false;
 
-    shader.SetInt("material.hasDiffuseMap", material.diffuseMap.id != 0);
-    shader.SetInt("material.hasSpecularMap", material.specularMap.id != 0);
-    shader.SetInt("material.hasAmbientMap", material.ambientMap.id != 0);
-    shader.SetInt("material.hasNormalMap", material.normalMap.id != 0);
+    shader.SetFloat("material.alpha", material.alpha);
 
     shader.SetVec3("material.diffuseColor", material.diffuseColor);
     if (material.diffuseMap.id) {
@@ -150,5 +238,6 @@ void setMaterialInShader(Material& material, Shader& shader, int fromActiveTextu
     shader.SetFloat("material.specularExponent", material.specularExponent);
     shader.SetFloat("material.specularStrength", 0.5f);
     shader.SetFloat("material.reflectiveness", material.reflectiveness);
-    shader.SetFloat("material.shouldCastShadow", material.shouldCastShadow);
+
+    return true;
 }
\ No newline at end of file
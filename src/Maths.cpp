@@ -1,5 +1,10 @@
 #include "Maths.h"
 
+Matrix3::Matrix3() {
+    for (int i = 0; i < 9; ++i) data[i] = 0.0f;
+    data[0] = data[4] = data[8] = 1.0f;
+}
+
 Matrix4::Matrix4() {
     for (int i = 0; i < 16; ++i) data[i] = 0.0f;
     data[0] = data[5] = data[10] = data[15] = 1.0f; 
@@ -308,4 +313,30 @@ Vec3 Matrix4::GetTranslation() const {
     v.z = data[14];
     
     return v;
+}
+
+Matrix3 Matrix4::GetNormalMatrix() const {
+    Vec3 c0 = { data[0], data[1], data[2] };
+    Vec3 c1 = { data[4], data[5], data[6] };
+    Vec3 c2 = { data[8], data[9], data[10] };
+
+    // The rows of the inverse are the cross products of the columns
+    // divided by the determinant, so they're the columns of the transpose.
+    Vec3 r0 = Vec3::Cross(c1, c2);
+    Vec3 r1 = Vec3::Cross(c2, c0);
+    Vec3 r2 = Vec3::Cross(c0, c1);
+
+    float det = c0.x * r0.x + c0.y * r0.y + c0.z * r0.z;
+    if (det == 0) return Matrix3();
+    float invDet = 1.0f / det;
+
+    Matrix3 mat;
+    Vec3 columns[3] = { r0, r1, r2 };
+    for (int i = 0; i < 3; i++) {
+        mat.data[i * 3 + 0] = columns[i].x * invDet;
+        mat.data[i * 3 + 1] = columns[i].y * invDet;
+        mat.data[i * 3 + 2] = columns[i].z * invDet;
+    }
+
+    return mat;
 }
\ No newline at end of file
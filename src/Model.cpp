@@ -4,12 +4,14 @@
 #include <iostream>
 #include <map>
 #include <limits>
+#include <algorithm>
 #include <filesystem>
 namespace fs = std::filesystem;
 
 #include "Model.h"
 #include "Utils.h"
 #include "Scene.h"
+#include "AssetWatcher.h"
 
 
 Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::string name, std::string materialName) {
@@ -45,6 +47,34 @@ Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std:
     GL_CALL(glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bitangent)));
     GL_CALL(glEnableVertexAttribArray(4));
 
+    // The depth streams share the index buffer
+    std::vector<Vec3> positions(m_Vertices.size());
+    std::vector<PositionUV> positionUVs(m_Vertices.size());
+    for (size_t i = 0; i < m_Vertices.size(); i++) {
+        positions[i] = m_Vertices[i].pos;
+        positionUVs[i] = { m_Vertices[i].pos, m_Vertices[i].uv };
+    }
+
+    GL_CALL(glGenVertexArrays(1, &m_PositionVAO));
+    GL_CALL(glBindVertexArray(m_PositionVAO));
+    GL_CALL(glGenBuffers(1, &m_PositionVBO));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_PositionVBO));
+    GL_CALL(glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(Vec3), positions.data(), GL_STATIC_DRAW));
+    GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO));
+    GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
+    GL_CALL(glEnableVertexAttribArray(0));
+
+    GL_CALL(glGenVertexArrays(1, &m_PositionUVVAO));
+    GL_CALL(glBindVertexArray(m_PositionUVVAO));
+    GL_CALL(glGenBuffers(1, &m_PositionUVVBO));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_PositionUVVBO));
+    GL_CALL(glBufferData(GL_ARRAY_BUFFER, positionUVs.size() * sizeof(PositionUV), positionUVs.data(), GL_STATIC_DRAW));
+    GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO));
+    GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PositionUV), (void*)offsetof(PositionUV, pos)));
+    GL_CALL(glEnableVertexAttribArray(0));
+    GL_CALL(glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(PositionUV), (void*)offsetof(PositionUV, uv)));
+    GL_CALL(glEnableVertexAttribArray(2));
+
     GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
     GL_CALL(glBindVertexArray(0));
     GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
@@ -55,6 +85,10 @@ Mesh::~Mesh() {
     GL_CALL(glDeleteVertexArrays(1, &m_VAO));
     GL_CALL(glDeleteBuffers(1, &m_VBO));
     GL_CALL(glDeleteBuffers(1, &m_EBO));
+    GL_CALL(glDeleteVertexArrays(1, &m_PositionVAO));
+    GL_CALL(glDeleteBuffers(1, &m_PositionVBO));
+    GL_CALL(glDeleteVertexArrays(1, &m_PositionUVVAO));
+    GL_CALL(glDeleteBuffers(1, &m_PositionUVVBO));
 }
 
 void Mesh::DrawCall(Shader& shader) {
@@ -63,9 +97,18 @@ void Mesh::DrawCall(Shader& shader) {
 
     checkProgram(shader.GetProgramID());
 
-    GL_CALL(glBindVertexArray(m_VAO));
+    GLuint vao = m_VAO, vbo = m_VBO;
+    VertexStream stream = shader.GetVertexStream();
+    if (stream == VERTEX_STREAM_POSITION) {
+        vao = m_PositionVAO;
+        vbo = m_PositionVBO;
+    } else if (stream == VERTEX_STREAM_POSITION_UV) {
+        vao = m_PositionUVVAO;
+        vbo = m_PositionUVVBO;
+    }
+    GL_CALL(glBindVertexArray(vao));
     GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO));
-    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_VBO));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, vbo));
     GL_CALL(glDrawElements(GL_TRIANGLES, (GLsizei)m_Indicies.size(), GL_UNSIGNED_INT, 0));
 
     GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
@@ -74,7 +117,45 @@ void Mesh::DrawCall(Shader& shader) {
 }
 
 
-Model::Model(const std::string& objPath) {
+Model::Model(const std::string& filepath) {
+    m_Path = filepath;
+    Load();
+
+    AssetWatcher::Get().Watch(assetPath(m_Path), [this]() { Reload(); });
+}
+
+void Model::Reload() {
+    std::map<std::string, uint32_t> meshLayers;
+    for (auto mesh : m_Meshes) {
+        if (mesh->GetRenderLayers() != RENDER_LAYERS_ALL) meshLayers[mesh->GetName()] = mesh->GetRenderLayers();
+        delete mesh;
+    }
+    m_Meshes.clear();
+
+    Load();
+    for (auto mesh : m_Meshes) {
+        auto it = meshLayers.find(mesh->GetName());
+        if (it != meshLayers.end()) mesh->SetRenderLayers(it->second);
+    }
+    m_Version++;
+}
+
+void Model::SetRenderLayers(uint32_t layers) {
+    if (layers == m_RenderLayers) return;
+    m_RenderLayers = layers;
+    m_Version++;
+}
+
+void Model::SetMeshRenderLayers(const std::string& meshName, uint32_t layers) {
+    for (auto mesh : m_Meshes) {
+        if (mesh->GetName() != meshName || mesh->GetRenderLayers() == layers) continue;
+        mesh->SetRenderLayers(layers);
+        m_Version++;
+    }
+}
+
+void Model::Load() {
+    const std::string& objPath = m_Path;
     std::ifstream file(objPath);
     assert(file.is_open() && "Failed to open file");
 
@@ -117,7 +198,9 @@ Model::Model(const std::string& objPath) {
         } else if (prefix == "mtllib") {
             std::string path;
             iss >> path;
+            // Materials reload on their own, the model only needs them loaded
             MaterialLibrary::Get().LoadMaterialFile(sameDirPath(objPath, path));
+            AssetWatcher::Get().AddDependency(assetPath(objPath), assetPath(sameDirPath(objPath, path)));
         } else if (prefix == "usemtl") {
             std::string name;
             iss >> name;
@@ -219,26 +302,61 @@ Model::Model(const std::string& objPath) {
         m_Meshes.push_back(new Mesh(currentVertices, currentIndices, currentMeshName, currentMaterialName));
     }
 
+    m_BoundsMin = m_BoundsMax = Vec3(0, 0, 0);
+    if (positions.size() > 0) m_BoundsMin = m_BoundsMax = positions[0];
+    for (const Vec3& pos : positions) {
+        m_BoundsMin = Vec3(std::min(m_BoundsMin.x, pos.x), std::min(m_BoundsMin.y, pos.y), std::min(m_BoundsMin.z, pos.z));
+        m_BoundsMax = Vec3(std::max(m_BoundsMax.x, pos.x), std::max(m_BoundsMax.y, pos.y), std::max(m_BoundsMax.z, pos.z));
+    }
+
     std::cout << "Model loading OK!\n";
 }
 
 Model::~Model() {
+    AssetWatcher::Get().Unwatch(assetPath(m_Path));
     for (auto mesh : m_Meshes) {
         delete mesh;
     }
 }
 
-void Model::Draw(Scene& scene, Shader& shader, int fromActiveTexture) {
-    Vec3 sunDir{ 1.f, 1.f, 1.f };
+void Model::GetWorldBounds(Vec3& min, Vec3& max) const {
+    min = Vec3(INFINITY, INFINITY, INFINITY);
+    max = Vec3(-INFINITY, -INFINITY, -INFINITY);
+    for (int i = 0; i < 8; i++) {
+        Vec3 corner((i & 1) ? m_BoundsMax.x : m_BoundsMin.x,
+                    (i & 2) ? m_BoundsMax.y : m_BoundsMin.y,
+                    (i & 4) ? m_BoundsMax.z : m_BoundsMin.z);
+        corner = m_Transform.Multiply(corner);
+        min = Vec3(std::min(min.x, corner.x), std::min(min.y, corner.y), std::min(min.z, corner.z));
+        max = Vec3(std::max(max.x, corner.x), std::max(max.y, corner.y), std::max(max.z, corner.z));
+    }
+}
 
-    shader.SetMat4("model", m_Transform);
+SkippedDraws Model::Draw(Scene& scene, Shader& shader, int fromActiveTexture, RenderLayer layer, MaterialFilter filter, int lightMask) {
+    Vec3 sunDir{ 1.f, 1.f, 1.f };
+    Matrix3 normalMatrix = m_Transform.GetNormalMatrix();
 
+    SkippedDraws skipped;
     for (Mesh* mesh : m_Meshes) {
 
         Material* materialPtr = mesh->GetMaterialPtr();
+        if (!materialPassesFilter(*materialPtr, filter)) continue;
+        if ((m_RenderLayers & mesh->GetRenderLayers() & getMaterialRenderLayers(*materialPtr) & layer) == 0) {
+            skipped.byLayer++;
+            continue;
+        }
+
+        if (!setMaterialInShader(*materialPtr, shader, fromActiveTexture)) {
+            skipped.compiling++;
+            continue;
+        }
 
-        setMaterialInShader(*materialPtr, shader, fromActiveTexture);
+        // After the material since each material may use a different variant
+        shader.SetMat4("model", m_Transform);
+        shader.SetMat3("normalMatrix", normalMatrix);
+        if (lightMask >= 0) shader.SetInt("lightMask", lightMask);
 
         mesh->DrawCall(shader);
     }
+    return skipped;
 }
@@ -0,0 +1,134 @@
+#include "PointShadowPool.h"
+
+#include <assert.h>
+#include <iostream>
+#include <algorithm>
+
+#include "GLutils.h"
+
+static void createDepthArray(GLuint& fbo, GLuint& texture, GLenum target, int size, int numLayers) {
+    GL_CALL(glGenTextures(1, &texture));
+    GL_CALL(glBindTexture(target, texture));
+    GL_CALL(glTexImage3D(target, 0, GL_DEPTH_COMPONENT32F, size, size, numLayers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL));
+    GL_CALL(glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+
+    GL_CALL(glGenFramebuffers(1, &fbo));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    GL_CALL(glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0));
+    GL_CALL(glDrawBuffer(GL_NONE));
+    GL_CALL(glReadBuffer(GL_NONE));
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindTexture(target, 0));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+PointShadowPool::PointShadowPool(GLenum target, int layersPerSlot)
+    : m_Target(target), m_LayersPerSlot(layersPerSlot) {
+}
+
+PointShadowPool::~PointShadowPool() {
+    Destroy();
+}
+
+void PointShadowPool::Destroy() {
+    if (m_FBO != 0) {
+        glDeleteFramebuffers(1, &m_FBO);
+        glDeleteTextures(1, &m_Texture);
+        m_FBO = m_Texture = 0;
+    }
+    if (m_StaticFBO != 0) {
+        glDeleteFramebuffers(1, &m_StaticFBO);
+        glDeleteTextures(1, &m_StaticTexture);
+        m_StaticFBO = m_StaticTexture = 0;
+    }
+    if (m_OriginBuffer != 0) {
+        glDeleteBuffers(1, &m_OriginBuffer);
+        glDeleteTextures(1, &m_OriginTexture);
+        m_OriginBuffer = m_OriginTexture = 0;
+    }
+}
+
+int PointShadowPool::GetMaxSlots() const {
+    GLint maxLayers = 0;
+    GL_CALL(glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers));
+    return maxLayers / m_LayersPerSlot;
+}
+
+size_t PointShadowPool::GetMemoryUsage() const {
+    size_t bytes = (size_t)m_CreatedSlotSize * m_CreatedSlotSize * 4 * m_LayersPerSlot * GetCapacity();
+    return m_HasStaticPool ? bytes * 2 : bytes;
+}
+
+bool PointShadowPool::Reserve(int numSlots, bool withStaticPool) {
+    int capacity = std::max(GetCapacity(), 1);
+    while (capacity < numSlots) capacity *= 2;
+    capacity = std::min(capacity, GetMaxSlots());
+
+    bool recreate = m_FBO == 0 || capacity != GetCapacity() || m_SlotSize != m_CreatedSlotSize || withStaticPool != m_HasStaticPool;
+    if (!recreate) return false;
+
+    Destroy();
+    m_SlotUsed.resize(capacity, false);
+    m_CreatedSlotSize = m_SlotSize;
+    m_HasStaticPool = withStaticPool;
+
+    std::cout << "Creating point shadow pool (" << capacity << (m_Target == GL_TEXTURE_2D_ARRAY ? " paraboloid" : " cube") << " slots of "
+              << m_SlotSize << "x" << m_SlotSize << ", " << GetMemoryUsage() / (1024 * 1024) << "MB)...\n";
+    createDepthArray(m_FBO, m_Texture, m_Target, m_SlotSize, capacity * m_LayersPerSlot);
+    if (withStaticPool) createDepthArray(m_StaticFBO, m_StaticTexture, m_Target, m_SlotSize, capacity * m_LayersPerSlot);
+
+    GL_CALL(glGenBuffers(1, &m_OriginBuffer));
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, m_OriginBuffer));
+    GL_CALL(glBufferData(GL_TEXTURE_BUFFER, capacity * 4 * sizeof(float), NULL, GL_DYNAMIC_DRAW));
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+    GL_CALL(glGenTextures(1, &m_OriginTexture));
+    GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, m_OriginTexture));
+    GL_CALL(glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_OriginBuffer));
+    GL_CALL(glBindTexture(GL_TEXTURE_BUFFER, 0));
+    std::cout << "Done!\n";
+    return true;
+}
+
+int PointShadowPool::Acquire() {
+    for (int slot = 0; slot < GetCapacity(); slot++) {
+        if (!m_SlotUsed[slot]) {
+            m_SlotUsed[slot] = true;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void PointShadowPool::Release(int slot) {
+    assert(slot >= 0 && slot < GetCapacity());
+    m_SlotUsed[slot] = false;
+}
+
+void PointShadowPool::SetOrigin(int slot, const Vec3& origin) {
+    assert(slot >= 0 && slot < GetCapacity());
+    float texel[4] = { origin.x, origin.y, origin.z, 0.0f };
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, m_OriginBuffer));
+    GL_CALL(glBufferSubData(GL_TEXTURE_BUFFER, slot * sizeof(texel), sizeof(texel), texel));
+    GL_CALL(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+}
+
+void PointShadowPool::Bind(int slot, bool staticPool, int clearFaces) {
+    GLuint fbo = staticPool ? m_StaticFBO : m_FBO;
+    GLuint texture = staticPool ? m_StaticTexture : m_Texture;
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    // Clearing a layered attachment would clear every slot
+    if (clearFaces != 0) {
+        for (int face = 0; face < m_LayersPerSlot; face++) {
+            if ((clearFaces & (1 << face)) == 0) continue;
+            GL_CALL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, slot * m_LayersPerSlot + face));
+            GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
+        }
+        GL_CALL(glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0));
+    }
+}
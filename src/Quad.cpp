@@ -1,16 +1,50 @@
 
 #include "Quad.h"
 
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <cstddef>
+#include <climits>
+
 #include "Material.h"
 #include "Shader.h"
-#include "Utils.h"
 
-GrassQuad::GrassQuad(Vec3 position, Vec2 size, Vec3 rotation) {
-    m_Transform = Matrix4::CreateTranslation(position)
-                .Rotate(rotation.x, { 1, 0, 0 })
-                .Rotate(rotation.y, { 0, 1, 0 })
-                .Rotate(rotation.z, { 0, 0, 1 });
+GrassInstance::GrassInstance(Vec3 position, float yaw, Vec2 size) : position(position), yaw(yaw) {
+    assert(size.x >= 0.0f && size.y >= 0.0f && size.x * SIZE_SCALE < 65536.0f && size.y * SIZE_SCALE < 65536.0f);
+    this->size[0] = (uint16_t)std::lround(size.x * SIZE_SCALE);
+    this->size[1] = (uint16_t)std::lround(size.y * SIZE_SCALE);
+}
+static_assert(sizeof(GrassInstance) == 20, "GrassInstance isn't tightly packed");
+
+// The tuft mesh, in units of the tuft's size. Back to back blades are a
+// little apart so they don't fight over depth, and the foot sinks into the
+// ground a bit.
+struct TuftVertex {
+    Vec3 pos;
+    Vec3 normal;
+    Vec2 uv;
+};
+struct TuftBlade {
+    float angle;
+    float offsetX, offsetZ;
+};
+static const TuftBlade TUFT_BLADES[] = {
+    { 0.0f,              0.0f,  0.0f },
+    { PI32,              0.0f,  0.03f },
+    { PI32 / 2.f,        0.0f,  0.0f },
+    { PI32 / 2.f + PI32, 0.03f, 0.0f },
+};
+const int TUFT_BLADE_COUNT = 4;
+const float TUFT_SINK = 0.02f;
+const size_t BLADE_VERTEX_COUNT = 4;
+const size_t BLADE_INDEX_COUNT = 6;
+
+GrassBatch::~GrassBatch() {
+    Destroy();
+}
 
+void GrassBatch::Add(const GrassInstance& instance) {
     if (!MaterialLibrary::Get().ExistsMaterial("basicQuad")) {
         Material quadMaterial;
 
@@ -19,121 +53,221 @@ GrassQuad::GrassQuad(Vec3 position, Vec2 size, Vec3 rotation) {
         MaterialLibrary::Get().AddMaterial("basicQuad", quadMaterial);
     }
 
-    m_Size = size;
+    m_Instances.push_back(instance);
+    m_Dirty = true;
+}
+
+void GrassBatch::Destroy() {
+    if (m_VAO == 0) return;
+    glDeleteVertexArrays(1, &m_VAO);
+    glDeleteBuffers(1, &m_MeshVBO);
+    glDeleteBuffers(1, &m_EBO);
+    glDeleteBuffers(1, &m_InstanceVBO);
+    m_VAO = m_MeshVBO = m_EBO = m_InstanceVBO = 0;
+    m_Capacity = 0;
 }
 
-const Matrix4& GrassQuad::GetTransform() const  {
-    return m_Transform;
+// Points the per instance attributes of the bound VAO at the instance
+// first, there is no base instance in GL 3.3
+static void setInstanceAttributes(size_t first) {
+    size_t offset = first * sizeof(GrassInstance);
+    GL_CALL(glVertexAttribPointer(FIRST_INSTANCE_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(GrassInstance), (void*)(offset + offsetof(GrassInstance, position))));
+    GL_CALL(glVertexAttribPointer(FIRST_INSTANCE_LOCATION + 1, 2, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(GrassInstance), (void*)(offset + offsetof(GrassInstance, size))));
 }
 
-std::vector<Vertex> g_AllVertices;
-GLuint g_QuadsVAO = 0, g_QuadsVBO = 0, g_QuadsEBO = 0;
-size_t currentBufferSize = 0;
-const size_t MAX_QUADS = 30000; // Maximum number of quads that can be batched
-const size_t QUAD_VERTEX_COUNT = 4;
-const size_t QUAD_INDEX_COUNT = 6;
-const size_t MAX_INDICES = MAX_QUADS * QUAD_INDEX_COUNT;
+// Blade corners as the vertices of a quad used to be, the tangent frame
+// follows from them in grass.glsl
+void GrassBatch::CreateMesh() {
+    std::vector<TuftVertex> vertices;
+    std::vector<GLuint> indices;
+    for (int blade = 0; blade < TUFT_BLADE_COUNT; blade++) {
+        const TuftBlade& info = TUFT_BLADES[blade];
+        Vec3 axis = { cosf(info.angle), 0.0f, -sinf(info.angle) };
+        Vec3 normal = { -sinf(info.angle), 0.0f, -cosf(info.angle) };
+
+        GLuint offset = (GLuint)vertices.size();
+        for (int j = 0; j < 4; ++j) {
+            float x = (j == 0 || j == 1) ? -0.5f : 0.5f;
+            float y = (j == 0 || j == 3) ? -0.5f : 0.5f;
+            TuftVertex vert;
+            vert.pos = { axis.x * x + info.offsetX, y + 0.5f - TUFT_SINK, axis.z * x + info.offsetZ };
+            vert.normal = normal;
+            vert.uv = Vec2{(float)(j == 2 || j == 3), (float)(j == 0 || j == 3)};
+            vertices.push_back(vert);
+        }
+        GLuint quadIndices[BLADE_INDEX_COUNT] = { 0, 1, 2, 2, 3, 0 };
+        for (GLuint index : quadIndices) indices.push_back(offset + index);
+    }
 
-void batchDrawGrass(std::vector<GrassQuad>& quads, Shader& shader, Texture texture, Texture normalMap, int nextActiveTexture) {
-    g_AllVertices.clear();
+    GL_CALL(glGenVertexArrays(1, &m_VAO));
+    GL_CALL(glGenBuffers(1, &m_MeshVBO));
+    GL_CALL(glGenBuffers(1, &m_EBO));
+    GL_CALL(glGenBuffers(1, &m_InstanceVBO));
 
-    // Initialize buffers if they are zero
-    if (g_QuadsVAO == 0) {
-        glGenVertexArrays(1, &g_QuadsVAO);
-        glGenBuffers(1, &g_QuadsVBO);
-        glGenBuffers(1, &g_QuadsEBO);
+    GL_CALL(glBindVertexArray(m_VAO));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_MeshVBO));
+    GL_CALL(glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(TuftVertex), vertices.data(), GL_STATIC_DRAW));
+    GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO));
+    GL_CALL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW));
 
-        glBindVertexArray(g_QuadsVAO);
-        glBindBuffer(GL_ARRAY_BUFFER, g_QuadsVBO);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_QuadsEBO);
-        GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, pos)));
-        GL_CALL(glEnableVertexAttribArray(0));
+    GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(TuftVertex), (void*)offsetof(TuftVertex, pos)));
+    GL_CALL(glEnableVertexAttribArray(0));
+    GL_CALL(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(TuftVertex), (void*)offsetof(TuftVertex, normal)));
+    GL_CALL(glEnableVertexAttribArray(1));
+    GL_CALL(glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(TuftVertex), (void*)offsetof(TuftVertex, uv)));
+    GL_CALL(glEnableVertexAttribArray(2));
 
-        GL_CALL(glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal)));
-        GL_CALL(glEnableVertexAttribArray(1));
+    // Per instance, see grass.glsl
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_InstanceVBO));
+    setInstanceAttributes(0);
+    GL_CALL(glEnableVertexAttribArray(FIRST_INSTANCE_LOCATION));
+    GL_CALL(glVertexAttribDivisor(FIRST_INSTANCE_LOCATION, 1));
+    GL_CALL(glEnableVertexAttribArray(FIRST_INSTANCE_LOCATION + 1));
+    GL_CALL(glVertexAttribDivisor(FIRST_INSTANCE_LOCATION + 1, 1));
 
-        GL_CALL(glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv)));
-        GL_CALL(glEnableVertexAttribArray(2));
+    GL_CALL(glBindVertexArray(0));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+    GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+}
+
+// Interleaves the lower 16 bits of x with zeros
+static uint32_t spreadBits(uint32_t x) {
+    x &= 0xFFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
 
-        GL_CALL(glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tangent)));
-        GL_CALL(glEnableVertexAttribArray(3));
+static uint32_t mortonCode(uint32_t x, uint32_t z) {
+    return spreadBits(x) | (spreadBits(z) << 1);
+}
 
-        GL_CALL(glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bitangent)));
-        GL_CALL(glEnableVertexAttribArray(4));
+static uint32_t reverseBits(uint32_t x, int numBits) {
+    uint32_t reversed = 0;
+    for (int bit = 0; bit < numBits; bit++) {
+        reversed = (reversed << 1) | ((x >> bit) & 1);
     }
+    return reversed;
+}
 
-    GL_CALL(glBindVertexArray(g_QuadsVAO));
+// Same extent as the whole tuft can reach, whichever way it is turned
+static void growTuftBounds(Vec3& boundsMin, Vec3& boundsMax, const GrassInstance& grass) {
+    Vec2 size = grass.GetSize();
+    Vec3 center = grass.position.Add(Vec3(0, size.y * 0.5f, 0));
+    float extent = std::max(size.x, size.y) * 0.5f;
+    boundsMin = Vec3(std::min(boundsMin.x, center.x - extent), std::min(boundsMin.y, center.y - extent), std::min(boundsMin.z, center.z - extent));
+    boundsMax = Vec3(std::max(boundsMax.x, center.x + extent), std::max(boundsMax.y, center.y + extent), std::max(boundsMax.z, center.z + extent));
+}
 
-    // Resize buffers if necessary
-    size_t requiredBufferSize = quads.size() * sizeof(Vertex) * QUAD_VERTEX_COUNT;
-    if (requiredBufferSize > currentBufferSize) {
-        size_t newBufferSize = std::max(requiredBufferSize, (size_t)(currentBufferSize * 1.5));
-        GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, g_QuadsVBO));
-        GL_CALL(glBufferData(GL_ARRAY_BUFFER, newBufferSize, NULL, GL_DYNAMIC_DRAW)); // Resizing buffer
-        currentBufferSize = newBufferSize;
+void GrassBatch::SortIntoChunks() {
+    // Chunk coords from the lowest one on, so they fit the Morton code
+    int minX = INT_MAX, minZ = INT_MAX;
+    for (const GrassInstance& grass : m_Instances) {
+        minX = std::min(minX, (int)floorf(grass.position.x / CHUNK_SIZE));
+        minZ = std::min(minZ, (int)floorf(grass.position.z / CHUNK_SIZE));
     }
 
-    // Update VBO with quad data
-    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, g_QuadsVBO));
-    for (size_t i = 0; i < quads.size(); ++i) {
-        GrassQuad& quad = quads[i];
-        const Matrix4& transform = quad.GetTransform();
-        Vec3 size = { quad.GetSize().x, quad.GetSize().y, 0 };
-        Vec3 normTransformed = transform.TransformDirection(Vec3{ 0, 0, -1 });
+    // Chunk in the upper half of the key, the place in the chunk in
+    // 1/65536 of its size in the lower half
+    std::vector<std::pair<uint64_t, size_t>> keys;
+    keys.reserve(m_Instances.size());
+    for (size_t i = 0; i < m_Instances.size(); i++) {
+        Vec3 position = m_Instances[i].position.Multiply(1.0f / CHUNK_SIZE);
+        float chunkX = floorf(position.x), chunkZ = floorf(position.z);
+        uint32_t chunk = mortonCode((uint32_t)((int)chunkX - minX), (uint32_t)((int)chunkZ - minZ));
+        uint32_t x = (uint32_t)std::min((position.x - chunkX) * 65536.0f, 65535.0f);
+        uint32_t z = (uint32_t)std::min((position.z - chunkZ) * 65536.0f, 65535.0f);
+        keys.push_back({ ((uint64_t)chunk << 32) | mortonCode(x, z), i });
+    }
+    std::sort(keys.begin(), keys.end());
 
-        // Add vertices of the quad
-        for (int j = 0; j < 4; ++j) {
-            Vertex vert;
-            vert.pos = transform.Multiply(Vec3{ (j == 0 || j == 1) ? -size.x/2.f : size.x/2.f, 
-                                                (j == 0 || j == 3) ? -size.y/2.f : size.y/2.f, 0 });
-            vert.uv = Vec2{(float)(j == 2 || j == 3), (float)(j == 0 || j == 3)};
-            vert.normal = normTransformed;
-            g_AllVertices.push_back(vert);
-        }
+    std::vector<GrassInstance> sorted;
+    sorted.reserve(m_Instances.size());
+    m_Chunks.clear();
+    for (size_t start = 0; start < keys.size();) {
+        size_t end = start;
+        while (end < keys.size() && (keys[end].first >> 32) == (keys[start].first >> 32)) end++;
 
-        // Compute Tangent and Bitangent for the last quad added
-        Vec3 tangent, bitangent;
-        computeTangentBitangent(g_AllVertices[g_AllVertices.size() - 4],
-                                g_AllVertices[g_AllVertices.size() - 3],
-                                g_AllVertices[g_AllVertices.size() - 2], 
-                                tangent, bitangent);
-
-        // Update the tangent and bitangent for the last 4 vertices (the quad)
-        for (size_t j = g_AllVertices.size() - 4; j < g_AllVertices.size(); ++j) {
-            g_AllVertices[j].tangent = tangent;
-            g_AllVertices[j].bitangent = bitangent;
+        GrassChunk chunk;
+        chunk.first = sorted.size();
+        chunk.count = end - start;
+        chunk.boundsMin = Vec3(INFINITY, INFINITY, INFINITY);
+        chunk.boundsMax = Vec3(-INFINITY, -INFINITY, -INFINITY);
+        int numBits = 0;
+        while (((size_t)1 << numBits) < chunk.count) numBits++;
+        for (uint32_t i = 0; i < (1u << numBits); i++) {
+            uint32_t index = reverseBits(i, numBits);
+            if (index >= chunk.count) continue;
+            const GrassInstance& grass = m_Instances[keys[start + index].second];
+            growTuftBounds(chunk.boundsMin, chunk.boundsMax, grass);
+            sorted.push_back(grass);
         }
+        m_Chunks.push_back(chunk);
+        start = end;
     }
-    GL_CALL(glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vertex) * g_AllVertices.size(), g_AllVertices.data()));
-
-    // Set up indices for EBO
-    GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_QuadsEBO));
-    GLuint indices[MAX_INDICES];
-    for (int i = 0, offset = 0; i < quads.size(); ++i, offset += (int)QUAD_VERTEX_COUNT) {
-        indices[i * QUAD_INDEX_COUNT] = offset + 0;
-        indices[i * QUAD_INDEX_COUNT + 1] = offset + 1;
-        indices[i * QUAD_INDEX_COUNT + 2] = offset + 2;
-        indices[i * QUAD_INDEX_COUNT + 3] = offset + 2;
-        indices[i * QUAD_INDEX_COUNT + 4] = offset + 3;
-        indices[i * QUAD_INDEX_COUNT + 5] = offset + 0;
+    m_Instances.swap(sorted);
+}
+
+void GrassBatch::GetBounds(Vec3& min, Vec3& max) const {
+    min = Vec3(INFINITY, INFINITY, INFINITY);
+    max = Vec3(-INFINITY, -INFINITY, -INFINITY);
+    for (const GrassChunk& chunk : m_Chunks) {
+        min = Vec3(std::min(min.x, chunk.boundsMin.x), std::min(min.y, chunk.boundsMin.y), std::min(min.z, chunk.boundsMin.z));
+        max = Vec3(std::max(max.x, chunk.boundsMax.x), std::max(max.y, chunk.boundsMax.y), std::max(max.z, chunk.boundsMax.z));
     }
-    GL_CALL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, quads.size() * QUAD_INDEX_COUNT * sizeof(GLuint), indices, GL_STATIC_DRAW));
+}
+
+// The chunks are sorted again as a whole, so the buffer is too
+void GrassBatch::Upload() {
+    if (!m_Dirty) return;
+    m_Dirty = false;
+    SortIntoChunks();
 
+    if (m_VAO == 0) CreateMesh();
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_InstanceVBO));
+    if (m_Instances.size() > m_Capacity) {
+        m_Capacity = std::max(m_Instances.size(), (size_t)(m_Capacity * 1.5));
+        GL_CALL(glBufferData(GL_ARRAY_BUFFER, m_Capacity * sizeof(GrassInstance), NULL, GL_STATIC_DRAW));
+    }
+    GL_CALL(glBufferSubData(GL_ARRAY_BUFFER, 0, m_Instances.size() * sizeof(GrassInstance), m_Instances.data()));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+}
 
+bool GrassBatch::Draw(Shader& shader, Texture texture, Texture normalMap, int nextActiveTexture, const std::vector<GrassRange>& ranges,
+                      MaterialFilter filter) {
+    if (ranges.empty()) return true;
     Material* materialPtr = MaterialLibrary::Get().GetMaterial("basicQuad");
+    if (!materialPassesFilter(*materialPtr, filter)) return true;
+
     materialPtr->ambientMap = texture;
     materialPtr->diffuseMap = texture;
     materialPtr->normalMap = normalMap;
 
-    setMaterialInShader(*materialPtr, shader, nextActiveTexture);
+    if (!setMaterialInShader(*materialPtr, shader, nextActiveTexture, SHADER_FEATURE_GRASS_INSTANCES)) {
+        return false;
+    }
 
     TextureBindContext::ApplyAll();
     checkProgram(shader.GetProgramID());
 
-    // Draw for each side
-    shader.SetMat4("model", Matrix4::Identity());
-    GL_CALL(glDrawElements(GL_TRIANGLES, (GLsizei)quads.size() * QUAD_INDEX_COUNT, GL_UNSIGNED_INT, 0));
+    // The instances carry their transforms, see grass.glsl
+    GL_CALL(glBindVertexArray(m_VAO));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, m_InstanceVBO));
+    for (size_t i = 0; i < ranges.size();) {
+        GrassRange run = ranges[i++];
+        while (i < ranges.size() && ranges[i].first == run.first + run.count && ranges[i].lightMask == run.lightMask) {
+            run.count += ranges[i++].count;
+        }
+        if (run.lightMask >= 0) shader.SetInt("lightMask", run.lightMask);
+        setInstanceAttributes(run.first);
+        GL_CALL(glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)(TUFT_BLADE_COUNT * BLADE_INDEX_COUNT), GL_UNSIGNED_INT, 0,
+                                        (GLsizei)run.count));
+    }
 
     // Unbind VAO
     glBindVertexArray(0);
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+    return true;
 }
\ No newline at end of file
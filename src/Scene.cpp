@@ -2,8 +2,15 @@
 
 #include "Shader.h"
 #include "Model.h"
+#include "Timer.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+
+static void createDepthMap(GLuint& fbo, GLuint& texture, int width, int height);
+static void generateMipmaps(GLenum target, GLuint texture);
 
 Scene::Scene() {
     //
@@ -112,7 +119,65 @@ Scene::Scene() {
     GL_CALL(glBindVertexArray(0));
     GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
 
-    
+    InitLightVolumes();
+
+    GL_CALL(glGenSamplers(1, &m_ShadowCompareSampler));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE));
+    GL_CALL(glSamplerParameteri(m_ShadowCompareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL));
+}
+
+void Scene::InitLightVolumes() {
+    // Both meshes are slightly larger than the shapes they stand for,
+    // so the flat faces never cut into the light's reach.
+    const int rings = 12, segments = 24;
+    const float grow = 1.0f / cos(PI32 / rings);
+
+    auto spherePoint = [&](int ring, int segment) {
+        float theta = PI32 * ring / rings;
+        float phi = 2.0f * PI32 * segment / segments;
+        return Vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)).Multiply(grow);
+    };
+    std::vector<Vec3> sphereVertices;
+    for (int ring = 0; ring < rings; ring++) {
+        for (int segment = 0; segment < segments; segment++) {
+            Vec3 a = spherePoint(ring, segment), b = spherePoint(ring, segment + 1);
+            Vec3 c = spherePoint(ring + 1, segment), d = spherePoint(ring + 1, segment + 1);
+            sphereVertices.insert(sphereVertices.end(), { a, b, d, a, d, c });
+        }
+    }
+
+    std::vector<Vec3> coneVertices;
+    for (int segment = 0; segment < segments; segment++) {
+        float phi0 = 2.0f * PI32 * segment / segments, phi1 = 2.0f * PI32 * (segment + 1) / segments;
+        Vec3 a = Vec3(cos(phi0), sin(phi0), 0.0f).Multiply(grow);
+        Vec3 b = Vec3(cos(phi1), sin(phi1), 0.0f).Multiply(grow);
+        a.z = b.z = -1.0f;
+        coneVertices.insert(coneVertices.end(), { Vec3(0, 0, 0), a, b, Vec3(0, 0, -1), b, a });
+    }
+
+    m_SphereVertexCount = (GLsizei)sphereVertices.size();
+    m_ConeVertexCount = (GLsizei)coneVertices.size();
+
+    GLuint* vaos[] = { &m_SphereVAO, &m_ConeVAO };
+    GLuint* vbos[] = { &m_SphereVBO, &m_ConeVBO };
+    std::vector<Vec3>* vertices[] = { &sphereVertices, &coneVertices };
+    for (int i = 0; i < 2; i++) {
+        GL_CALL(glGenVertexArrays(1, vaos[i]));
+        GL_CALL(glGenBuffers(1, vbos[i]));
+        GL_CALL(glBindVertexArray(*vaos[i]));
+        GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, *vbos[i]));
+        GL_CALL(glBufferData(GL_ARRAY_BUFFER, vertices[i]->size() * sizeof(Vec3), vertices[i]->data(), GL_STATIC_DRAW));
+        GL_CALL(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), 0));
+        GL_CALL(glEnableVertexAttribArray(0));
+    }
+
+    GL_CALL(glBindVertexArray(0));
+    GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
 }
 Scene::~Scene() {
 
@@ -131,6 +196,21 @@ size_t Scene::AddSpotLight(const SpotLight& light) {
     return m_SpotLights.size() -1;
 }
 
+void Scene::SetNumShadowCascades(int numCascades) {
+    m_NumShadowCascades = std::max(1, std::min(numCascades, MAX_SHADOW_CASCADES));
+}
+
+void Scene::SetShadowBleedReduction(float reduction) {
+    m_ShadowBleedReduction = std::max(0.0f, std::min(reduction, 0.99f));
+}
+
+// Moment maps are only made when drawn, changing the blur redraws them
+void Scene::SetMomentBlurRadius(int radius) {
+    radius = std::max(0, std::min(radius, 8));
+    if (radius != m_MomentBlurRadius) InvalidateShadowCache();
+    m_MomentBlurRadius = radius;
+}
+
 Model* Scene::AddModel(Model* model) {
     m_Models.push_back(model);
 
@@ -149,18 +229,25 @@ void Scene::DeleteModel(Model* model) {
     }
 }
 
-void Scene::AddQuad(const GrassQuad& quad) {
-    m_Quads.push_back(quad);
+void Scene::SetGrassRenderLayers(uint32_t layers) {
+    if (layers == m_GrassRenderLayers) return;
+    m_GrassRenderLayers = layers;
+    // Grass is a static caster
+    m_StaticCasterVersion++;
 }
 
 void Scene::AddGrass(Vec3 pos, float rotation, Vec2 size) {
-    AddQuad(GrassQuad({ pos.x,        pos.y + size.y / 2.f - 0.1f, pos.z },        size, { 0, 0.f + rotation, 0 }));
-    AddQuad(GrassQuad({ pos.x,        pos.y + size.y / 2.f - 0.1f, pos.z + 0.1f }, size, { 0, PI32 + rotation, 0 }));
-    AddQuad(GrassQuad({ pos.x,        pos.y + size.y / 2.f - 0.1f, pos.z },        size, { 0, PI32 / 2.f + rotation, 0 }));
-    AddQuad(GrassQuad({ pos.x + 0.1f, pos.y + size.y / 2.f - 0.1f, pos.z },        size, { 0, PI32 / 2.f + PI32 + rotation, 0 }));
+    m_Grass.Add(GrassInstance(pos, rotation, size));
 }
 
 void Scene::Draw(const DrawContext& ctx) {
+    // Lights are assigned to clusters on the worker
+    // threads while the shadow maps are drawn.
+    Matrix4 cameraView = m_ViewMatrix;
+    cameraView.Invert();
+    UpdateLightImportance(cameraView);
+    m_LightClusters.BeginBuild(m_PointLights, m_SpotLights, cameraView, m_ProjMatrix);
+
     m_NextActiveTexture = 0;
     TextureBindContext::ResetAll();
 
@@ -177,40 +264,110 @@ void Scene::Draw(const DrawContext& ctx) {
     //
     // Draw shadowmaps
     //
+    UpdateStaticCasters();
+    m_LightActivity.shadowMapsDrawn = 0;
+    m_LightActivity.shadowMapsCached = 0;
+    m_RenderLayerStats = RenderLayerStats();
+    // Every cascade counts as a shadow map
+    // Moments are made again wherever the depth was drawn. Without
+    // dynamic casters a cached map is left alone, with them the dynamic
+    // casters are drawn over the static copy every frame. Moments left
+    // out while their variant compiles drop the depth cache, so both are
+    // drawn again.
+    AllocateDirMoments();
+    Timer shadowTimer;
+    bool dirMomentsDrawn = false;
     for (auto& dirLight : m_DirLights) {
-        if (!dirLight.depthMapInfo.cast) continue;
-        dirLight.depthMapInfo.proj = Matrix4::CreateOrtho(-SHADOW_DISTANCE, SHADOW_DISTANCE, -SHADOW_DISTANCE, SHADOW_DISTANCE, SHADOW_NEAR, SHADOW_FAR);
-        dirLight.depthMapInfo.view = Matrix4::CreateLookAt(dirLight.direction.Invert().Multiply(SHADOW_DISTANCE * 1.5f), 
-                                    dirLight.direction, 
-                                    Vec3( 0.0f, 1.0f,  0.0f));
-        dirLight.depthMapInfo.view.Invert();
-
-        if (dirLight.depthMapInfo.shadowMapFBO == 0) {
-            InitLightDepthMap(dirLight.depthMapInfo);
+        if (!dirLight.depthMapInfo.cast || !dirLight.active) continue;
+        CascadedDepthMapInfo& info = dirLight.depthMapInfo;
+        if (info.numCascades != m_NumShadowCascades) {
+            InitCascadedDepthMap(info);
+        }
+        FitCascades(info, dirLight.direction);
+        int drawnCascades = 0;
+        if (m_LayeredShadows) {
+            drawnCascades = DrawShadowCascadesLayered(ctx, info);
+            m_NextActiveTexture = 0;
+            TextureBindContext::ResetAll();
+        }
+        for (int cascade = 0; cascade < info.numCascades; cascade++) {
+            bool drawn = m_LayeredShadows ? (drawnCascades & (1 << cascade)) != 0 : DrawShadowCascade(ctx, info, cascade);
+            if (drawn) m_LightActivity.shadowMapsDrawn++;
+            else m_LightActivity.shadowMapsCached++;
+            if (info.momentLayer >= 0 && (drawn || m_NumDynamicCasters > 0)) {
+                if (DrawShadowMoments(ctx, info.mapType, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, cascade,
+                                      { 0, 0, (int)SHADOW_CASCADE_SIZE }, m_DirMomentFBO, m_DirMomentTexture, info.momentLayer + cascade)) {
+                    dirMomentsDrawn = true;
+                } else {
+                    info.cache[cascade].staticCasterVersion = 0;
+                }
+            }
+            m_NextActiveTexture = 0;
+            TextureBindContext::ResetAll();
         }
-        DrawShadowMap(ctx, dirLight.depthMapInfo);
-        m_NextActiveTexture = 0;
-        TextureBindContext::ResetAll();
     }
+    if (dirMomentsDrawn) generateMipmaps(GL_TEXTURE_2D_ARRAY, m_DirMomentTexture);
     m_NextActiveTexture = 0;
     TextureBindContext::ResetAll();
+    AllocateShadowAtlas();
+    bool atlasMomentsDrawn = false;
+    std::vector<DepthMapInfo*> spotShadows;
     for (auto& spotLight : m_SpotLights) {
-        spotLight.depthMapInfo.proj = Matrix4::CreatePerspective(spotLight.outerCutOff * 2.0f, (float)SHADOW_WIDTH / (float)SHADOW_HEIGHT, SHADOW_NEAR, SHADOW_FAR);
-        spotLight.depthMapInfo.view = Matrix4::CreateLookAt(spotLight.position, 
+        if (spotLight.depthMapInfo.atlasRect.size == 0) continue;
+        DepthMapInfo& info = spotLight.depthMapInfo;
+        info.proj = Matrix4::CreatePerspective(spotLight.outerCutOff * 2.0f, 1.0f, SHADOW_NEAR, SHADOW_FAR);
+        info.view = Matrix4::CreateLookAt(spotLight.position, 
                                     spotLight.position.Add(spotLight.direction), 
                                     Vec3( 0.0f, 1.0f,  0.0f));
-        spotLight.depthMapInfo.view.Invert();
-        if (spotLight.depthMapInfo.shadowMapFBO == 0) {
-            InitLightDepthMap(spotLight.depthMapInfo);
+        info.view.Invert();
+        // Moments of another type need the depth of the tile again
+        if (info.mapType != info.momentType) {
+            info.cache.staticCasterVersion = 0;
+            info.momentType = info.mapType;
         }
-        DrawShadowMap(ctx, spotLight.depthMapInfo);
+        spotShadows.push_back(&info);
+    }
+    std::vector<bool> spotShadowsDrawn(spotShadows.size());
+    if (m_LayeredShadows) {
+        DrawShadowMapsLayered(ctx, spotShadows, spotShadowsDrawn);
         m_NextActiveTexture = 0;
         TextureBindContext::ResetAll();
+    } else {
+        for (size_t i = 0; i < spotShadows.size(); i++) {
+            spotShadowsDrawn[i] = DrawShadowMap(ctx, *spotShadows[i]);
+            m_NextActiveTexture = 0;
+            TextureBindContext::ResetAll();
+        }
     }
+    // Dir and spot submission, dir moments included
+    m_ShadowSubmitMilliseconds = shadowTimer.Record().GetMilliseconds();
+    for (size_t i = 0; i < spotShadows.size(); i++) {
+        DepthMapInfo& info = *spotShadows[i];
+        bool drawn = spotShadowsDrawn[i];
+        if (drawn) m_LightActivity.shadowMapsDrawn++;
+        else m_LightActivity.shadowMapsCached++;
+        if (info.mapType != SHADOW_MAP_DEPTH && (drawn || m_NumDynamicCasters > 0)) {
+            if (DrawShadowMoments(ctx, info.mapType, m_ShadowAtlas.GetTexture(), GL_TEXTURE_2D, 0,
+                                  info.atlasRect, m_ShadowAtlas.GetMomentFBO(), m_ShadowAtlas.GetMomentTexture())) {
+                atlasMomentsDrawn = true;
+            } else {
+                info.cache.staticCasterVersion = 0;
+            }
+        }
+        m_NextActiveTexture = 0;
+        TextureBindContext::ResetAll();
+    }
+    if (atlasMomentsDrawn) generateMipmaps(GL_TEXTURE_2D, m_ShadowAtlas.GetMomentTexture());
+    AllocatePointShadows();
     for (auto& pointLight : m_PointLights) {
-        
-        float aspect = (float)SHADOW_WIDTH3D/(float)SHADOW_HEIGHT3D;
-        pointLight.depthMapInfo.proj = Matrix4::CreatePerspective(PI32 * 0.5f /*90deg*/, aspect, SHADOW_NEAR, SHADOW_FAR);
+        if (pointLight.depthMapInfo.shadowSlot < 0) continue;
+        // The paraboloid projection happens in the geometry shader
+        if (pointLight.depthMapInfo.slotMode == POINT_SHADOW_PARABOLOID) {
+            pointLight.depthMapInfo.proj = Matrix4::Identity();
+            continue;
+        }
+
+        pointLight.depthMapInfo.proj = Matrix4::CreatePerspective(PI32 * 0.5f /*90deg*/, 1.0f, SHADOW_NEAR, SHADOW_FAR);
 
         pointLight.depthMapInfo.viewTransforms[0] = Matrix4::CreateLookAt(pointLight.position, pointLight.position.Add(Vec3( 1.0, 0.0, 0.0)), Vec3(0.0,-1.0, 0.0));
         pointLight.depthMapInfo.viewTransforms[1] = Matrix4::CreateLookAt(pointLight.position, pointLight.position.Add(Vec3(-1.0, 0.0, 0.0)), Vec3(0.0,-1.0, 0.0));
@@ -218,11 +375,12 @@ void Scene::Draw(const DrawContext& ctx) {
         pointLight.depthMapInfo.viewTransforms[3] = Matrix4::CreateLookAt(pointLight.position, pointLight.position.Add(Vec3( 0.0, 1.0, 0.0)), Vec3(0.0, 0.0, 1.0));
         pointLight.depthMapInfo.viewTransforms[4] = Matrix4::CreateLookAt(pointLight.position, pointLight.position.Add(Vec3( 0.0, 0.0, 1.0)), Vec3(0.0,-1.0, 0.0));
         pointLight.depthMapInfo.viewTransforms[5] = Matrix4::CreateLookAt(pointLight.position, pointLight.position.Add(Vec3( 0.0, 0.0,-1.0)), Vec3(0.0,-1.0, 0.0));
-
-        if (pointLight.depthMapInfo.shadowMapFBO == 0) {
-            InitLightDepthMap3D(pointLight.depthMapInfo);
-        }
-        DrawShadowMap3D(ctx, pointLight.depthMapInfo, pointLight.position);
+    }
+    SchedulePointShadowFaces();
+    for (auto& pointLight : m_PointLights) {
+        if (pointLight.depthMapInfo.shadowSlot < 0) continue;
+        if (DrawShadowMap3D(ctx, pointLight.depthMapInfo, pointLight.position, pointLight.outerRadius)) m_LightActivity.shadowMapsDrawn++;
+        else m_LightActivity.shadowMapsCached++;
         m_NextActiveTexture = 0;
         TextureBindContext::ResetAll();
     }
@@ -234,23 +392,85 @@ void Scene::Draw(const DrawContext& ctx) {
     //
     ctx.objShader->Bind();
 
-    UploadLightData(*ctx.objShader);
+    BindLightTextures();
+    m_LightClusters.FinishBuild(m_PointLights, m_SpotLights);
+    m_NextActiveTexture = m_LightClusters.BindTextures(m_NextActiveTexture);
     AppWindow* window = GetMainWindow();
     GL_CALL(glViewport(0, 0, window->GetWidth(), window->GetHeight()));
-    DrawGeometry(*ctx.objShader, this->GetViewMatrix(), this->GetProjectionMatrix(), ctx);
+    if (g_UseDeferredShading && ctx.gBufferShader) {
+        DrawDeferred(ctx);
+    } else {
+        // After the depth prepass only the visible opaque fragments pass
+        // the GL_EQUAL test, blended geometry is drawn after as usual.
+        MaterialFilter filter = MATERIAL_FILTER_ALL;
+        int firstFreeUnit = m_NextActiveTexture;
+        if (g_UseDepthPrepass) {
+            DrawDepthPrepass(ctx);
+            ctx.objShader->Bind();
+            GL_CALL(glDepthFunc(GL_EQUAL));
+            GL_CALL(glDepthMask(GL_FALSE));
+            filter = MATERIAL_FILTER_OPAQUE;
+        }
+
+        auto uploadLights = [this](Shader& variant) {
+            UploadLightData(variant);
+            if (m_ShadowMaskInUse) SetShadowMaskUniforms(variant);
+        };
+        BeginShadingQuery();
+        if (g_UseDepthPrepass && m_UseShadowMask && ctx.shadowMaskShader) {
+            m_ShadowMaskInUse = DrawShadowMask(ctx);
+            ctx.objShader->Bind();
+        }
+        BeginSampleQuery();
+        DrawGeometry(*ctx.objShader, this->GetViewMatrix(), this->GetProjectionMatrix(), ctx, RENDER_LAYER_MAIN, uploadLights, filter);
+        m_ShadowMaskInUse = false;
+
+        if (g_UseDepthPrepass) {
+            GL_CALL(glDepthFunc(GL_LESS));
+            GL_CALL(glDepthMask(GL_TRUE));
+            m_NextActiveTexture = firstFreeUnit;
+            DrawGeometry(*ctx.objShader, this->GetViewMatrix(), this->GetProjectionMatrix(), ctx, RENDER_LAYER_MAIN, uploadLights, MATERIAL_FILTER_BLENDED);
+        }
+        EndSampleQuery();
+        EndShadingQuery();
+    }
 
     ctx.objShader->Unbind();
 
+    // Put finished shader compiles to use and start one queued
+    // compile per shader per frame, so reloads and new variants
+    // never hold up a frame for long.
+    ctx.objShader->PollCompiles(1);
+    ctx.depthMapShader->PollCompiles(1);
+    ctx.depthMapShader3D->PollCompiles(1);
+    ctx.depthParaboloidShader->PollCompiles(1);
+    ctx.skyboxShader->PollCompiles(1);
+    for (Shader* shader : { ctx.gBufferShader, ctx.deferredCompositeShader, ctx.deferredDirShader, ctx.deferredPointShader, ctx.deferredSpotShader,
+                            ctx.shadowMaskShader, ctx.shadowMomentsShader, ctx.depthLayeredShader }) {
+        if (shader) shader->PollCompiles(1);
+    }
+
     m_NextActiveTexture = 0;
 
     if (g_ShouldDrawDepthMaps) {
         GL_CALL(glViewport(0, 0, window->GetWidth(), window->GetHeight()));
 
+        // Each cascade is copied out of the texture array first
         TextureBindContext::ResetAll();
-        if (g_DrawDepthMapIndex < m_DirLights.size()) {
-            DebugDrawTexture(m_DirLights[g_DrawDepthMapIndex].depthMapInfo.shadowMapTexture);
-        } else if ((g_DrawDepthMapIndex - m_DirLights.size()) < m_SpotLights.size()) {
-            DebugDrawTexture(m_SpotLights[g_DrawDepthMapIndex - m_DirLights.size()].depthMapInfo.shadowMapTexture);
+        int numCascadeMaps = (int)m_DirLights.size() * m_NumShadowCascades;
+        if (g_DrawDepthMapIndex < numCascadeMaps) {
+            CascadedDepthMapInfo& info = m_DirLights[g_DrawDepthMapIndex / m_NumShadowCascades].depthMapInfo;
+            int cascade = g_DrawDepthMapIndex % m_NumShadowCascades;
+            if (info.shadowMapTexture && cascade < info.numCascades) {
+                if (m_DebugDepthTexture == 0) {
+                    createDepthMap(m_DebugDepthFBO, m_DebugDepthTexture, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE);
+                }
+                CopyDepth(info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, m_DebugDepthTexture, GL_TEXTURE_2D, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE, cascade);
+                GL_CALL(glViewport(0, 0, window->GetWidth(), window->GetHeight()));
+                DebugDrawTexture(m_DebugDepthTexture);
+            }
+        } else if (g_DrawDepthMapIndex == numCascadeMaps && m_ShadowAtlas.GetTexture()) {
+            DebugDrawTexture(m_ShadowAtlas.GetTexture());
         }
         
     }
@@ -271,6 +491,7 @@ void Scene::DrawSkybox(const DrawContext& ctx) {
     m_AccumulatedDirColor = { 0, 0, 0 };
     for (size_t i = 0; i < this->GetDirLights().size(); i++ ) {
         auto& light = this->GetDirLights()[i];
+        if (!light.active) continue;
         m_AccumulatedDirColor = m_AccumulatedDirColor.Add(light.diffuse.Multiply(light.intensity));
     }
 
@@ -289,130 +510,684 @@ void Scene::DrawSkybox(const DrawContext& ctx) {
     GL_CALL(glCullFace(GL_BACK));
 }
 
-void Scene::UploadLightData(Shader& shader) {
-    // If num lights are more than the generated constant
-    // in the shaders from shader settings, then we need
-    // to recompile the shader to support more lights.
-    ShaderSettings newSettings = shader.GetSettings();
-    bool needReload = false;
-    if (shader.GetSettings().maxNumPointLights < this->GetPointLights().size()) {
-        newSettings.maxNumPointLights = (int)this->GetPointLights().size();
-        needReload = true;
+// Share of the screen a view space sphere covers, 0 outside the frustum
+static float sphereScreenCoverage(const Vec3& center, float radius, const Matrix4& proj) {
+    float xScale = proj.data[0], yScale = proj.data[5];
+    float nearPlane = proj.data[14] / (proj.data[10] - 1.0f);
+    float farPlane = proj.data[14] / (proj.data[10] + 1.0f);
+
+    if (-center.z + radius < nearPlane || -center.z - radius > farPlane) return 0.0f;
+    if ((xScale * fabs(center.x) + center.z) / std::sqrt(xScale * xScale + 1.0f) > radius) return 0.0f;
+    if ((yScale * fabs(center.y) + center.z) / std::sqrt(yScale * yScale + 1.0f) > radius) return 0.0f;
+
+    float distance = center.Length();
+    if (distance <= radius) return 1.0f;
+
+    // Projected ellipse against the 2x2 of normalized device coordinates
+    float tangent = radius / std::sqrt(distance * distance - radius * radius);
+    float area = PI32 * tangent * xScale * tangent * yScale;
+    return std::min(area / 4.0f, 1.0f);
+}
+
+static float brightestChannel(const Vec3& diffuse, const Vec3& specular) {
+    return std::max({ diffuse.x, diffuse.y, diffuse.z, specular.x, specular.y, specular.z });
+}
+
+void Scene::UpdateLightImportance(const Matrix4& cameraView) {
+    m_LightActivity.numPointLights = (int)m_PointLights.size();
+    m_LightActivity.numSpotLights = (int)m_SpotLights.size();
+    m_LightActivity.numDirLights = (int)m_DirLights.size();
+    m_LightActivity.activePointLights = 0;
+    m_LightActivity.activeSpotLights = 0;
+    m_LightActivity.activeDirLights = 0;
+
+    for (auto& light : m_PointLights) {
+        light.importance = 0.0f;
+        if (light.enabled && light.intensity > 0.0f) {
+            float coverage = sphereScreenCoverage(cameraView.Multiply(light.position), light.outerRadius, m_ProjMatrix);
+            light.importance = light.intensity * brightestChannel(light.diffuse, light.specular) * coverage;
+        }
+        light.active = light.importance >= LIGHT_IMPORTANCE_THRESHOLD;
+        m_LightActivity.activePointLights += light.active;
     }
-    if (shader.GetSettings().maxNumDirLights < this->GetDirLights().size()) {
-        newSettings.maxNumDirLights = (int)this->GetDirLights().size();
-        needReload = true;
+
+    // Spot lights have no range, their reach is taken as far as
+    // the shadow map goes. The cone is tested by its bounding sphere.
+    for (auto& light : m_SpotLights) {
+        light.importance = 0.0f;
+        if (light.enabled && light.intensity > 0.0f) {
+            float angle = std::min(light.outerCutOff, PI32 * 0.49f);
+            float slant = SHADOW_FAR / cos(angle);
+            Vec3 direction = cameraView.TransformDirection(light.direction).Normalized();
+            float offset, radius;
+            if (angle > PI32 * 0.25f) {
+                offset = slant * cos(angle);
+                radius = slant * sin(angle);
+            } else {
+                offset = radius = slant / (2.0f * cos(angle));
+            }
+            Vec3 center = cameraView.Multiply(light.position).Add(direction.Multiply(offset));
+            float coverage = sphereScreenCoverage(center, radius, m_ProjMatrix);
+            light.importance = light.intensity * brightestChannel(light.diffuse, light.specular) * coverage;
+        }
+        light.active = light.importance >= LIGHT_IMPORTANCE_THRESHOLD;
+        m_LightActivity.activeSpotLights += light.active;
     }
-    if (shader.GetSettings().maxNumSpotLights < this->GetSpotLights().size()) {
-        newSettings.maxNumPointLights = (int)this->GetSpotLights().size();
-        needReload = true;
+
+    // Directional lights reach everything
+    for (auto& light : m_DirLights) {
+        light.importance = light.enabled ? light.intensity * brightestChannel(light.diffuse, light.specular) : 0.0f;
+        light.active = light.importance >= LIGHT_IMPORTANCE_THRESHOLD;
+        m_LightActivity.activeDirLights += light.active;
     }
-    if (needReload) {
-        shader.HotReload(newSettings);
+}
+
+void Scene::BindLightTextures() {
+    // Samplers that are never set stay on unit 0. GL refuses to draw when
+    // samplers of different types share a unit, so keep shadow maps off it.
+    if (m_NextActiveTexture == 0) m_NextActiveTexture = 1;
+
+    // Units are assigned once per pass, the light uniforms
+    // may be uploaded to several shader variants. Shadow slots
+    // index the shadow arrays, the light clusters carry them
+    // for the point and spot lights.
+    m_NumPointShadows = 0;
+    m_NumSpotShadows = 0;
+    // All point light shadows share the pools, the slots were
+    // handed out with the shadow maps (see AllocatePointShadows)
+    m_NumParaboloidShadows = 0;
+    GLuint dirSampler = m_ShadowFilters.dir != SHADOW_FILTER_BOX ? m_ShadowCompareSampler : 0;
+    GLuint spotSampler = m_ShadowFilters.spot != SHADOW_FILTER_BOX ? m_ShadowCompareSampler : 0;
+    GLuint pointSampler = m_ShadowFilters.point != SHADOW_FILTER_BOX ? m_ShadowCompareSampler : 0;
+    m_PointShadowUnit = -1;
+    m_PointShadowOriginUnit = -1;
+    m_ParaboloidShadowUnit = -1;
+    m_ParaboloidShadowOriginUnit = -1;
+    for (auto& light : m_PointLights) {
+        if (light.depthMapInfo.shadowSlot < 0) continue;
+        m_NumPointShadows++;
+        if (light.depthMapInfo.slotMode == POINT_SHADOW_PARABOLOID) m_NumParaboloidShadows++;
     }
+    if (m_NumPointShadows > m_NumParaboloidShadows) {
+        m_PointShadowUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_PointShadowUnit, GL_TEXTURE_CUBE_MAP_ARRAY, m_PointShadowPool.GetTexture(), pointSampler);
+        m_PointShadowOriginUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_PointShadowOriginUnit, GL_TEXTURE_BUFFER, m_PointShadowPool.GetOriginTexture());
+    }
+    if (m_NumParaboloidShadows > 0) {
+        m_ParaboloidShadowUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_ParaboloidShadowUnit, GL_TEXTURE_2D_ARRAY, m_ParaboloidShadowPool.GetTexture(), pointSampler);
+        m_ParaboloidShadowOriginUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_ParaboloidShadowOriginUnit, GL_TEXTURE_BUFFER, m_ParaboloidShadowPool.GetOriginTexture());
+    }
+    m_CascadeFallbackUnit = -1;
+    m_DirMomentUnit = -1;
+    bool dirMoments = false;
+    for (auto& light : m_DirLights) {
+        light.depthMapInfo.shadowMapUnit = -1;
+        if (light.depthMapInfo.cast && light.depthMapInfo.shadowMapFBO && light.active) {
+            light.depthMapInfo.shadowMapUnit = m_NextActiveTexture++;
+            TextureBindContext::Set(light.depthMapInfo.shadowMapUnit, GL_TEXTURE_2D_ARRAY, light.depthMapInfo.shadowMapTexture, dirSampler);
+            if (m_CascadeFallbackUnit < 0) m_CascadeFallbackUnit = light.depthMapInfo.shadowMapUnit;
+            if (light.depthMapInfo.momentLayer >= 0) dirMoments = true;
+        }
+    }
+    if (dirMoments && m_DirMomentTexture) {
+        m_DirMomentUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_DirMomentUnit, GL_TEXTURE_2D_ARRAY, m_DirMomentTexture);
+    }
+    // All spot light shadows share the atlas
+    m_ShadowAtlasUnit = -1;
+    m_ShadowMomentAtlasUnit = -1;
+    bool spotMoments = false;
+    for (auto& light : m_SpotLights) {
+        light.depthMapInfo.shadowSlot = -1;
+        if (light.depthMapInfo.atlasRect.size > 0) {
+            light.depthMapInfo.shadowSlot = m_NumSpotShadows++;
+            if (light.depthMapInfo.mapType != SHADOW_MAP_DEPTH) spotMoments = true;
+        }
+    }
+    if (m_NumSpotShadows > 0) {
+        m_ShadowAtlasUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_ShadowAtlasUnit, GL_TEXTURE_2D, m_ShadowAtlas.GetTexture(), spotSampler);
+    }
+    if (spotMoments && m_ShadowAtlas.GetMomentTexture()) {
+        m_ShadowMomentAtlasUnit = m_NextActiveTexture++;
+        TextureBindContext::Set(m_ShadowMomentAtlasUnit, GL_TEXTURE_2D, m_ShadowAtlas.GetMomentTexture());
+    }
+}
 
-    std::string uniformString;
-    std::string subScriptString;
-    std::string fullString;
+uint32_t Scene::GetPassFeatures() const {
+    uint32_t features = 0;
+    if (m_NumPointShadows > m_NumParaboloidShadows) features |= SHADER_FEATURE_POINT_SHADOWS;
+    if (m_NumParaboloidShadows > 0) features |= SHADER_FEATURE_PARABOLOID_SHADOWS;
+    for (auto& light : m_DirLights) {
+        if (light.depthMapInfo.shadowMapUnit >= 0) features |= SHADER_FEATURE_DIR_SHADOWS;
+    }
+    if (m_DirMomentUnit >= 0) features |= SHADER_FEATURE_DIR_MOMENTS;
+    if (m_NumSpotShadows > 0) features |= SHADER_FEATURE_SPOT_SHADOWS;
+    if (m_ShadowMomentAtlasUnit >= 0) features |= SHADER_FEATURE_SPOT_MOMENTS;
+    if (m_ShadowMaskInUse) features |= SHADER_FEATURE_SHADOW_MASK;
+    return features | GetShadowLookupFeatures();
+}
 
+uint32_t Scene::GetShadowLookupFeatures() const {
+    uint32_t features = 0;
+    if (m_AdaptiveShadows) features |= SHADER_FEATURE_ADAPTIVE_SHADOWS;
+    if (m_ShadowDebugView) features |= SHADER_FEATURE_SHADOW_DEBUG;
+    return features;
+}
 
-    uniformString = "pointLights";
-    for (size_t i = 0; i < this->GetPointLights().size(); i++ ) {
-        subScriptString = "[" + std::to_string(i) + "]";
-        fullString = uniformString + subScriptString;
+ShaderSettings Scene::GetLightCountSettings() const {
+    ShaderSettings settings;
+    settings.maxNumPointLights = Shader::LightCountBucket(m_NumPointShadows);
+    settings.maxNumDirLights = Shader::LightCountBucket(m_LightActivity.activeDirLights);
+    settings.maxNumSpotLights = Shader::LightCountBucket(m_NumSpotShadows);
+    settings.shadowFilters = m_ShadowFilters;
+    return settings;
+}
 
-        auto& light = this->GetPointLights()[i];
+// Tile offset and size in texture coordinates of the atlas
+static Vec4 atlasRectUniform(const ShadowAtlas::Rect& rect, int atlasSize) {
+    float scale = 1.0f / (float)atlasSize;
+    return Vec4{ rect.x * scale, rect.y * scale, rect.size * scale, rect.size * scale };
+}
 
-        shader.SetFloat(fullString + ".intensity", light.intensity);
-        shader.SetVec3(fullString + ".diffuse", light.diffuse);
-        shader.SetVec3(fullString + ".specular", light.specular);
-        shader.SetVec3(fullString + ".position", light.position);
-        shader.SetFloat(fullString + ".innerRadius", light.innerRadius);
-        shader.SetFloat(fullString + ".outerRadius", light.outerRadius);
-        
+void Scene::UploadLightData(Shader& shader) {
+    std::string uniformString;
+    std::string subScriptString;
+    std::string fullString;
 
-        if (light.depthMapInfo.cast && light.depthMapInfo.shadowCubeMap) {
-            int lightActiveTexture = m_NextActiveTexture++;
-            TextureBindContext::Set(lightActiveTexture, GL_TEXTURE_CUBE_MAP, light.depthMapInfo.shadowCubeMap);
-            shader.SetInt(fullString + ".shadowMap", lightActiveTexture);
-        }
-        shader.SetInt(fullString + ".shouldCast", (int)light.depthMapInfo.cast);
+
+    // Point and spot lights themselves come from the light clusters,
+    // only their shadows are uniforms. Point shadows need nothing
+    // but the pool, the slot is in the light's record.
+    if (m_PointShadowUnit >= 0) {
+        shader.SetInt("pointShadowMaps", m_PointShadowUnit);
+        shader.SetInt("pointShadowOrigins", m_PointShadowOriginUnit);
+    }
+    if (m_ParaboloidShadowUnit >= 0) {
+        shader.SetInt("paraboloidShadowMaps", m_ParaboloidShadowUnit);
+        shader.SetInt("paraboloidShadowOrigins", m_ParaboloidShadowOriginUnit);
     }
-    shader.SetInt("numPointLights", (int)this->GetPointLights().size());
+    shader.SetInt("numPointLights", (int)std::min(this->GetPointLights().size(), (size_t)LightClusters::MAX_LIGHTS));
 
+    // Inactive directional lights are left out of the array. Array
+    // samplers can't stay on unit 0 either, the ones of unshadowed
+    // lights and unused slots use another light's cascades.
+    shader.SetFloat("shadowBleedReduction", m_ShadowBleedReduction);
+    if (m_DirMomentUnit >= 0) shader.SetInt("dirMomentMaps", m_DirMomentUnit);
     uniformString = "dirLights";
+    int numDirLights = 0;
     for (size_t i = 0; i < this->GetDirLights().size(); i++ ) {
-        subScriptString = "[" + std::to_string(i) + "]";
-        fullString = uniformString + subScriptString;
-
         auto& light = this->GetDirLights()[i];
+        if (!light.active) continue;
+
+        subScriptString = "[" + std::to_string(numDirLights++) + "]";
+        fullString = uniformString + subScriptString;
 
         shader.SetFloat(fullString + ".intensity", light.intensity);
         shader.SetVec3(fullString + ".diffuse", light.diffuse);
         shader.SetVec3(fullString + ".specular", light.specular);
         shader.SetVec3(fullString + ".direction", light.direction);
 
-        if (light.depthMapInfo.cast && light.depthMapInfo.shadowMapFBO) {
-            int lightActiveTexture = m_NextActiveTexture++;
-            TextureBindContext::Set(lightActiveTexture, GL_TEXTURE_2D, light.depthMapInfo.shadowMapTexture);
-            shader.SetInt(fullString + ".depthMapInfo.shadowMap", lightActiveTexture);
-            shader.SetMat4(fullString + ".depthMapInfo.proj", light.depthMapInfo.proj);
-            auto viewInverse = light.depthMapInfo.view;
-            viewInverse.Invert();
-            shader.SetMat4(fullString + ".depthMapInfo.view", viewInverse);
+        if (light.depthMapInfo.shadowMapUnit >= 0) {
+            shader.SetInt(fullString + ".depthMapInfo.shadowMap", light.depthMapInfo.shadowMapUnit);
+            shader.SetInt(fullString + ".depthMapInfo.numCascades", light.depthMapInfo.numCascades);
+            for (int cascade = 0; cascade < light.depthMapInfo.numCascades; cascade++) {
+                std::string cascadeString = "[" + std::to_string(cascade) + "]";
+                shader.SetMat4(fullString + ".depthMapInfo.cascades" + cascadeString, light.depthMapInfo.cascades[cascade]);
+                shader.SetFloat(fullString + ".depthMapInfo.bias" + cascadeString, light.depthMapInfo.bias[cascade]);
+            }
+        } else if (m_CascadeFallbackUnit >= 0) {
+            shader.SetInt(fullString + ".depthMapInfo.shadowMap", m_CascadeFallbackUnit);
         }
-        shader.SetInt(fullString + ".depthMapInfo.shouldCast", light.depthMapInfo.cast);
+        shader.SetInt(fullString + ".depthMapInfo.shouldCast", light.depthMapInfo.shadowMapUnit >= 0);
+        bool moments = m_DirMomentUnit >= 0 && light.depthMapInfo.shadowMapUnit >= 0 && light.depthMapInfo.momentLayer >= 0;
+        shader.SetInt(fullString + ".depthMapInfo.mapType", moments ? light.depthMapInfo.mapType : SHADOW_MAP_DEPTH);
+        shader.SetInt(fullString + ".depthMapInfo.momentLayer", moments ? light.depthMapInfo.momentLayer : 0);
     }
-    shader.SetInt("numDirLights", (int)this->GetDirLights().size());
+    for (int i = numDirLights; i < shader.GetVariant().settings.maxNumDirLights && m_CascadeFallbackUnit >= 0; i++) {
+        shader.SetInt(uniformString + "[" + std::to_string(i) + "].depthMapInfo.shadowMap", m_CascadeFallbackUnit);
+    }
+    shader.SetInt("numDirLights", numDirLights);
+
+    uniformString = "spotShadows";
+    for (auto& light : this->GetSpotLights()) {
+        if (light.depthMapInfo.shadowSlot < 0) continue;
+        fullString = uniformString + "[" + std::to_string(light.depthMapInfo.shadowSlot) + "]";
+
+        auto viewInverse = light.depthMapInfo.view;
+        shader.SetMat4(fullString + ".proj", light.depthMapInfo.proj);
+        viewInverse.Invert();
+        shader.SetMat4(fullString + ".view", viewInverse);
+        shader.SetVec4(fullString + ".atlasRect", atlasRectUniform(light.depthMapInfo.atlasRect, m_ShadowAtlas.GetSize()));
+        shader.SetInt(fullString + ".mapType", m_ShadowMomentAtlasUnit >= 0 ? light.depthMapInfo.mapType : SHADOW_MAP_DEPTH);
+    }
+    if (m_ShadowAtlasUnit >= 0) shader.SetInt("shadowAtlas", m_ShadowAtlasUnit);
+    if (m_ShadowMomentAtlasUnit >= 0) shader.SetInt("shadowMomentAtlas", m_ShadowMomentAtlasUnit);
 
-    uniformString = "spotLights";
-    for (size_t i = 0; i < this->GetSpotLights().size(); i++ ) {
-        subScriptString = "[" + std::to_string(i) + "]";
-        fullString = uniformString + subScriptString;
+    AppWindow* window = GetMainWindow();
+    m_LightClusters.SetUniforms(shader, window->GetWidth(), window->GetHeight());
+}
 
-        auto& light = this->GetSpotLights()[i];
+// Whether a world space box may overlap the clip space of a projection,
+// orthographic or perspective. Only boxes with all corners beyond the same
+// clip plane are rejected, so this is conservative.
+static bool boundsInClipBox(const Vec3& min, const Vec3& max, const Matrix4& clip) {
+    int outside[6] = {};
+    for (int i = 0; i < 8; i++) {
+        Vec4 corner = clip.Multiply(Vec4{ (i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z, 1.0f });
+        float axes[3] = { corner.x, corner.y, corner.z };
+        for (int axis = 0; axis < 3; axis++) {
+            if (axes[axis] < -corner.w) outside[axis * 2]++;
+            if (axes[axis] > corner.w) outside[axis * 2 + 1]++;
+        }
+    }
+    for (int plane = 0; plane < 6; plane++) {
+        if (outside[plane] == 8) return false;
+    }
+    return true;
+}
 
-        shader.SetFloat(fullString + ".intensity", light.intensity);
-        shader.SetVec3(fullString + ".diffuse", light.diffuse);
-        shader.SetVec3(fullString + ".specular", light.specular);
-        shader.SetVec3(fullString + ".direction", light.direction);
-        shader.SetVec3(fullString + ".position", light.position);
-        shader.SetFloat(fullString + ".cutOff", cos(light.cutOff));
-        shader.SetFloat(fullString + ".outerCutOff", cos(light.outerCutOff));
+// Direction each face sees in, in viewTransforms order. The view
+// transforms aren't inverted, which mirrors them (the shaders flip x
+// back when sampling).
+static const Vec3 CUBE_FACE_DIRECTIONS[6] = {
+    Vec3(-1.0f, 0.0f, 0.0f), Vec3( 1.0f, 0.0f, 0.0f),
+    Vec3( 0.0f, 1.0f, 0.0f), Vec3( 0.0f,-1.0f, 0.0f),
+    Vec3( 0.0f, 0.0f, 1.0f), Vec3( 0.0f, 0.0f,-1.0f),
+};
+// Axis of each paraboloid hemisphere, same as in point-shadows.glsl
+static const Vec3 PARABOLOID_DIRECTIONS[2] = {
+    Vec3( 0.0f,-1.0f, 0.0f), Vec3( 0.0f, 1.0f, 0.0f),
+};
+
+// Faces of a point light that may see a box, conservatively every face
+// looking towards some part of it. Casters beyond the radius can only
+// shadow what the light doesn't reach.
+static int facesSeeingBox(const DepthMapInfo3D& info, const Vec3& lightPos, float radius, const Vec3& min, const Vec3& max) {
+    Vec3 closest(std::max(min.x, std::min(lightPos.x, max.x)),
+                 std::max(min.y, std::min(lightPos.y, max.y)),
+                 std::max(min.z, std::min(lightPos.z, max.z)));
+    if (closest.Subtract(lightPos).Length() > radius) return 0;
+
+    Vec3 toMin = min.Subtract(lightPos), toMax = max.Subtract(lightPos);
+    const Vec3* directions = info.slotMode == POINT_SHADOW_CUBE ? CUBE_FACE_DIRECTIONS : PARABOLOID_DIRECTIONS;
+    int faces = 0;
+    for (int face = 0; face < info.GetNumFaces(); face++) {
+        const Vec3& d = directions[face];
+        float farthest = std::max(d.x * toMin.x, d.x * toMax.x) + std::max(d.y * toMin.y, d.y * toMax.y) + std::max(d.z * toMin.z, d.z * toMax.z);
+        if (farthest > 0.0f) faces |= 1 << face;
+    }
+    return faces;
+}
 
-        if (light.depthMapInfo.cast && light.depthMapInfo.shadowMapFBO) {
-            int lightActiveTexture = m_NextActiveTexture++;
-            TextureBindContext::Set(lightActiveTexture, GL_TEXTURE_2D, light.depthMapInfo.shadowMapTexture);
-            shader.SetInt(fullString + ".depthMapInfo.shadowMap", lightActiveTexture);
-            auto viewInverse = light.depthMapInfo.view;
-            shader.SetMat4(fullString + ".depthMapInfo.proj", light.depthMapInfo.proj);
-            viewInverse.Invert();
-            shader.SetMat4(fullString + ".depthMapInfo.view", viewInverse);
-        }
-        shader.SetInt(fullString + ".depthMapInfo.shouldCast", light.depthMapInfo.cast);
+// Bit per light box the bounds touch
+static int lightBoxMask(const Vec3& min, const Vec3& max, const Matrix4* lightBoxes, int numLightBoxes) {
+    int mask = 0;
+    for (int i = 0; i < numLightBoxes; i++) {
+        if (boundsInClipBox(min, max, lightBoxes[i])) mask |= 1 << i;
     }
-    shader.SetInt("numSpotLights", (int)this->GetSpotLights().size());
+    return mask;
 }
 
-void Scene::DrawGeometry(Shader& shader, Matrix4 view, Matrix4 proj, const DrawContext& ctx) {
+static int renderLayerIndex(RenderLayer layer) {
+    int index = 0;
+    while ((1u << index) != layer) index++;
+    return index;
+}
+
+bool Scene::DrawGeometry(Shader& shader, Matrix4 view, Matrix4 proj, const DrawContext& ctx, RenderLayer layer, const std::function<void(Shader&)>& passUniforms,
+                         MaterialFilter filter, CasterFilter casters, const Matrix4* cullBox,
+                         const Matrix4* lightBoxes, int numLightBoxes, const PointShadowPass* pointPass) {
     Matrix4 viewInverse = view;
     viewInverse.Invert();
-    shader.SetMat4("view", viewInverse);
-    shader.SetMat4("projection", proj);
-
-    shader.SetVec3("ambientColor", this->GetAmbientColor());
-    shader.SetVec3("skyboxAmbient", m_AccumulatedDirColor);
-    shader.SetFloat("shadowFarPlane", SHADOW_FAR);
 
+    // Deferred shading draws geometry twice in the same
+    // pass, this unit may hold a material texture already.
     int skyboxActiveTexture = m_NextActiveTexture++;
-    TextureBindContext::Set(skyboxActiveTexture, GL_TEXTURE_CUBE_MAP, m_SkyboxCubemap);
-    shader.SetInt("skybox", skyboxActiveTexture);
+    TextureBindContext::Overwrite(skyboxActiveTexture, GL_TEXTURE_CUBE_MAP, m_SkyboxCubemap);
+
+    shader.BeginPass(GetPassFeatures(), GetLightCountSettings(), [&](Shader& variant) {
+        variant.SetMat4("view", viewInverse);
+        variant.SetMat4("projection", proj);
+        variant.SetVec3("viewPos", view.GetTranslation());
+
+        variant.SetVec3("ambientColor", this->GetAmbientColor());
+        variant.SetVec3("skyboxAmbient", m_AccumulatedDirColor);
+        variant.SetFloat("shadowFarPlane", SHADOW_FAR);
+        variant.SetInt("skybox", skyboxActiveTexture);
+
+        if (passUniforms) passUniforms(variant);
+    });
 
+    int& skippedDraws = m_RenderLayerStats.skippedDraws[renderLayerIndex(layer)];
+    bool complete = true;
     for (auto model : m_Models) {
-        model->Draw(*this, shader, m_NextActiveTexture);
+        if (casters == CASTERS_STATIC && model->IsDynamic()) continue;
+        if (casters == CASTERS_DYNAMIC && !model->IsDynamic()) continue;
+        if ((model->GetRenderLayers() & layer) == 0) {
+            skippedDraws += (int)model->GetNumMeshes();
+            continue;
+        }
+        if (cullBox) {
+            Vec3 min, max;
+            model->GetWorldBounds(min, max);
+            if (!boundsInClipBox(min, max, *cullBox)) continue;
+        }
+        int lightMask = -1;
+        if (lightBoxes) {
+            Vec3 min, max;
+            model->GetWorldBounds(min, max);
+            lightMask = lightBoxMask(min, max, lightBoxes, numLightBoxes);
+            if (lightMask == 0) continue;
+        }
+        SkippedDraws skipped = model->Draw(*this, shader, m_NextActiveTexture, layer, filter, lightMask);
+        skippedDraws += skipped.byLayer;
+        if (skipped.compiling > 0) complete = false;
     }
 
-    if (m_Quads.size() > 0) batchDrawGrass(m_Quads, shader, ctx.grassTexture, ctx.grassNormalMap, m_NextActiveTexture);
+    bool drawGrass = m_Grass.GetSize() > 0 && casters != CASTERS_DYNAMIC;
+    if (drawGrass) {
+        uint32_t grassLayers = m_GrassRenderLayers & getMaterialRenderLayers(*MaterialLibrary::Get().GetMaterial("basicQuad"));
+        if ((grassLayers & layer) == 0) {
+            skippedDraws++;
+            drawGrass = false;
+        }
+    }
+    if (drawGrass && !DrawGrass(shader, cullBox ? *cullBox : viewInverse * proj, ctx, layer, filter, lightBoxes, numLightBoxes, pointPass)) {
+        complete = false;
+    }
+
+    shader.EndPass();
+    return complete;
+}
+
+bool Scene::DrawGrass(Shader& shader, const Matrix4& worldToClip, const DrawContext& ctx, RenderLayer layer, MaterialFilter filter,
+                      const Matrix4* lightBoxes, int numLightBoxes, const PointShadowPass* pointPass) {
+    bool thinOut = layer == RENDER_LAYER_MAIN && m_GrassLodEnd > m_GrassLodStart;
+    Vec3 cameraPos = m_ViewMatrix.GetTranslation();
+    size_t drawnTufts = 0;
+    m_GrassRanges.clear();
+    for (const GrassChunk& chunk : m_Grass.GetChunks()) {
+        GrassRange range;
+        range.first = chunk.first;
+        range.count = chunk.count;
+        if (lightBoxes) {
+            range.lightMask = lightBoxMask(chunk.boundsMin, chunk.boundsMax, lightBoxes, numLightBoxes);
+            if (range.lightMask == 0) continue;
+        } else if (pointPass) {
+            int faces = facesSeeingBox(*pointPass->info, pointPass->lightPos, pointPass->radius, chunk.boundsMin, chunk.boundsMax);
+            if ((faces & pointPass->faces) == 0) continue;
+        } else if (!boundsInClipBox(chunk.boundsMin, chunk.boundsMax, worldToClip)) {
+            continue;
+        }
+        // By the closest point of the chunk, a prefix of it is spread
+        // evenly over it
+        if (thinOut) {
+            Vec3 closest(std::clamp(cameraPos.x, chunk.boundsMin.x, chunk.boundsMax.x),
+                         std::clamp(cameraPos.y, chunk.boundsMin.y, chunk.boundsMax.y),
+                         std::clamp(cameraPos.z, chunk.boundsMin.z, chunk.boundsMax.z));
+            float distance = closest.Subtract(cameraPos).Length();
+            float density = std::clamp((m_GrassLodEnd - distance) / (m_GrassLodEnd - m_GrassLodStart), 0.0f, 1.0f);
+            range.count = (size_t)ceilf(density * chunk.count);
+            if (range.count == 0) continue;
+        }
+        drawnTufts += range.count;
+        m_GrassRanges.push_back(range);
+    }
+    if (layer == RENDER_LAYER_MAIN) {
+        m_GrassStats.drawnChunks = (int)m_GrassRanges.size();
+        m_GrassStats.numChunks = (int)m_Grass.GetChunks().size();
+        m_GrassStats.drawnTufts = drawnTufts;
+        m_GrassStats.numTufts = m_Grass.GetSize();
+    }
+
+    return m_Grass.Draw(shader, ctx.grassTexture, ctx.grassNormalMap, m_NextActiveTexture, m_GrassRanges, filter);
+}
+
+// Light volume with local -Z along forward, for the spot light cones
+static Matrix4 createVolumeTransform(const Vec3& position, const Vec3& forward, const Vec3& scale) {
+    Vec3 up = fabs(forward.y) > 0.99f ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(0.0f, 1.0f, 0.0f);
+    Vec3 right = Vec3::Cross(forward, up).Normalized();
+    up = Vec3::Cross(right, forward);
+
+    Matrix4 transform = Matrix4::Identity();
+    transform.data[0] = right.x * scale.x;
+    transform.data[1] = right.y * scale.x;
+    transform.data[2] = right.z * scale.x;
+    transform.data[4] = up.x * scale.y;
+    transform.data[5] = up.y * scale.y;
+    transform.data[6] = up.z * scale.y;
+    transform.data[8] = -forward.x * scale.z;
+    transform.data[9] = -forward.y * scale.z;
+    transform.data[10] = -forward.z * scale.z;
+    transform.SetTranslation(position);
+    return transform;
+}
+
+void Scene::DrawDeferred(const DrawContext& ctx) {
+    AppWindow* window = GetMainWindow();
+    int width = window->GetWidth(), height = window->GetHeight();
+    Matrix4 viewInverse = m_ViewMatrix;
+    viewInverse.Invert();
+    int firstFreeUnit = m_NextActiveTexture;
+
+    //
+    // G-buffer pass, opaque geometry only and nothing blends
+    //
+    m_GBuffer.Resize(width, height);
+    m_GBuffer.BindForGeometry();
+    GL_CALL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+    GL_CALL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT));
+    GL_CALL(glDisable(GL_BLEND));
+
+    ctx.gBufferShader->Bind();
+    BeginSampleQuery();
+    DrawGeometry(*ctx.gBufferShader, m_ViewMatrix, m_ProjMatrix, ctx, RENDER_LAYER_MAIN, nullptr, MATERIAL_FILTER_OPAQUE);
+    EndSampleQuery();
+    ctx.gBufferShader->Unbind();
+
+    //
+    // Light passes, added to the light accumulation
+    //
+    m_GBuffer.BindForLighting();
+    GL_CALL(glEnable(GL_BLEND));
+    GL_CALL(glBlendFunc(GL_ONE, GL_ONE));
+    // The debug view keeps the highest shadow class of the lights
+    if (m_ShadowDebugView) {
+        GL_CALL(glBlendEquation(GL_MAX));
+    }
+    GL_CALL(glDepthMask(GL_FALSE));
+
+    const char* gBufferSamplers[] = { "gPosition", "gNormal", "gAlbedo", "gSpecular", "gReflection" };
+    int gBufferUnit = m_NextActiveTexture;
+    for (int i = 0; i < 5; i++) {
+        TextureBindContext::Overwrite(gBufferUnit + i, GL_TEXTURE_2D, m_GBuffer.GetTexture((GBuffer::Attachment)i));
+    }
+    TextureBindContext::ApplyAll();
+
+    auto lightPassUniforms = [&](Shader& variant) {
+        variant.SetMat4("view", viewInverse);
+        variant.SetMat4("projection", m_ProjMatrix);
+        variant.SetVec3("viewPos", m_ViewMatrix.GetTranslation());
+        variant.SetFloat("shadowFarPlane", SHADOW_FAR);
+        variant.SetFloat("shadowBleedReduction", m_ShadowBleedReduction);
+        for (int i = 0; i < 5; i++) variant.SetInt(gBufferSamplers[i], gBufferUnit + i);
+        if (m_PointShadowUnit >= 0) {
+            variant.SetInt("pointShadowMaps", m_PointShadowUnit);
+            variant.SetInt("pointShadowOrigins", m_PointShadowOriginUnit);
+        }
+        if (m_ParaboloidShadowUnit >= 0) {
+            variant.SetInt("paraboloidShadowMaps", m_ParaboloidShadowUnit);
+            variant.SetInt("paraboloidShadowOrigins", m_ParaboloidShadowOriginUnit);
+        }
+        m_LightClusters.SetUniforms(variant, width, height);
+    };
+    uint32_t passFeatures = GetPassFeatures();
+    uint32_t lookupFeatures = GetShadowLookupFeatures();
+
+    // Directional lights on a fullscreen quad at the far plane,
+    // the depth test skips pixels without geometry.
+    BeginShadingQuery();
+    GL_CALL(glDisable(GL_CULL_FACE));
+    GL_CALL(glDepthFunc(GL_GREATER));
+    ctx.deferredDirShader->Bind();
+    uint32_t dirShadowFeatures = passFeatures & (SHADER_FEATURE_DIR_SHADOWS | SHADER_FEATURE_DIR_MOMENTS);
+    ctx.deferredDirShader->BeginPass(dirShadowFeatures | lookupFeatures, GetLightCountSettings(), [&](Shader& variant) {
+        lightPassUniforms(variant);
+        UploadLightData(variant);
+    });
+    if (ctx.deferredDirShader->SetMaterialFeatures(0)) {
+        GL_CALL(glBindVertexArray(m_QuadVAO));
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+    }
+    ctx.deferredDirShader->EndPass();
+    ctx.deferredDirShader->Unbind();
+    GL_CALL(glDepthFunc(GL_LESS));
+
+    // Point and spot lights draw their volume twice. The first draw
+    // counts the faces behind the surface in the stencil buffer, the
+    // surface is inside the volume where front and back faces differ.
+    // The second one shades those pixels and clears the stencil again.
+    // Depth clamp keeps volumes past the far plane closed.
+    Shader& stencilShader = Shader::Basic();
+    stencilShader.Bind();
+    stencilShader.SetMat4("view", viewInverse);
+    stencilShader.SetMat4("projection", m_ProjMatrix);
+    GL_CALL(glEnable(GL_STENCIL_TEST));
+    GL_CALL(glEnable(GL_DEPTH_CLAMP));
+
+    auto drawLightVolume = [&](Shader& lightShader, const Matrix4& model, GLuint vao, GLsizei vertexCount, const std::function<void()>& lightUniforms) {
+        GL_CALL(glBindVertexArray(vao));
+
+        stencilShader.Bind();
+        stencilShader.SetMat4("model", model);
+        GL_CALL(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE));
+        GL_CALL(glEnable(GL_DEPTH_TEST));
+        GL_CALL(glDisable(GL_CULL_FACE));
+        GL_CALL(glStencilFunc(GL_ALWAYS, 0, 0));
+        GL_CALL(glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP));
+        GL_CALL(glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP));
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, vertexCount));
+
+        lightShader.Bind();
+        lightShader.SetMat4("model", model);
+        lightUniforms();
+        GL_CALL(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE));
+        GL_CALL(glDisable(GL_DEPTH_TEST));
+        GL_CALL(glEnable(GL_CULL_FACE));
+        GL_CALL(glCullFace(GL_FRONT));
+        GL_CALL(glStencilFunc(GL_NOTEQUAL, 0, 0xFF));
+        GL_CALL(glStencilOp(GL_KEEP, GL_ZERO, GL_ZERO));
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, vertexCount));
+    };
+
+    // Lights with and without shadows use different shader variants
+    size_t numPointRecords = std::min(m_PointLights.size(), (size_t)LightClusters::MAX_LIGHTS);
+    uint32_t pointShadowFeatures = GetPassFeatures() & (SHADER_FEATURE_POINT_SHADOWS | SHADER_FEATURE_PARABOLOID_SHADOWS);
+    for (bool shadowed : { false, true }) {
+        Shader& shader = *ctx.deferredPointShader;
+        shader.Bind();
+        shader.BeginPass((shadowed ? pointShadowFeatures : 0) | lookupFeatures, GetLightCountSettings(), lightPassUniforms);
+        if (shader.SetMaterialFeatures(0)) {
+            for (size_t i = 0; i < numPointRecords; i++) {
+                auto& light = m_PointLights[i];
+                if (!light.active || (light.depthMapInfo.shadowSlot >= 0) != shadowed) continue;
+
+                Matrix4 model = Matrix4::Identity();
+                model.SetScale(Vec3(light.outerRadius, light.outerRadius, light.outerRadius)).SetTranslation(light.position);
+                drawLightVolume(shader, model, m_SphereVAO, m_SphereVertexCount, [&]() {
+                    shader.SetInt("lightIndex", (int)i);
+                });
+            }
+        }
+        shader.EndPass();
+    }
+
+    // Spot lights have no range, their cones reach past the far plane. The
+    // apex is moved behind the light, a camera right at it (flashlight)
+    // would see the side faces edge on and the stencil count breaks.
+    float farPlane = m_ProjMatrix.data[14] / (m_ProjMatrix.data[10] + 1.0f);
+    const float apexOffset = 1.0f;
+    uint32_t spotShadowFeatures = passFeatures & (SHADER_FEATURE_SPOT_SHADOWS | SHADER_FEATURE_SPOT_MOMENTS);
+    for (bool shadowed : { false, true }) {
+        Shader& shader = *ctx.deferredSpotShader;
+        shader.Bind();
+        shader.BeginPass((shadowed ? spotShadowFeatures : 0) | lookupFeatures, GetLightCountSettings(), lightPassUniforms);
+        if (shader.SetMaterialFeatures(0)) {
+            for (size_t i = 0; i < m_SpotLights.size() && numPointRecords + i < LightClusters::MAX_LIGHTS; i++) {
+                auto& light = m_SpotLights[i];
+                if (!light.active || (light.depthMapInfo.shadowSlot >= 0) != shadowed) continue;
+
+                Vec3 forward = light.direction.Normalized();
+                Vec3 apex = light.position.Subtract(forward.Multiply(apexOffset));
+                float length = apex.Subtract(m_ViewMatrix.GetTranslation()).Length() + farPlane;
+                float radius = length * tan(std::min(light.outerCutOff, PI32 * 0.49f));
+                Matrix4 model = createVolumeTransform(apex, forward, Vec3(radius, radius, length));
+                drawLightVolume(shader, model, m_ConeVAO, m_ConeVertexCount, [&]() {
+                    shader.SetInt("lightIndex", (int)(numPointRecords + i));
+                    if (shadowed) {
+                        Matrix4 lightView = light.depthMapInfo.view;
+                        lightView.Invert();
+                        shader.SetInt("shadowAtlas", m_ShadowAtlasUnit);
+                        shader.SetMat4("spotShadow.proj", light.depthMapInfo.proj);
+                        shader.SetMat4("spotShadow.view", lightView);
+                        shader.SetVec4("spotShadow.atlasRect", atlasRectUniform(light.depthMapInfo.atlasRect, m_ShadowAtlas.GetSize()));
+                        bool moments = m_ShadowMomentAtlasUnit >= 0;
+                        shader.SetInt("spotShadow.mapType", moments ? light.depthMapInfo.mapType : SHADOW_MAP_DEPTH);
+                        if (moments) shader.SetInt("shadowMomentAtlas", m_ShadowMomentAtlasUnit);
+                    }
+                });
+            }
+        }
+        shader.EndPass();
+    }
+
+    EndShadingQuery();
+    GL_CALL(glDisable(GL_DEPTH_CLAMP));
+    GL_CALL(glDisable(GL_STENCIL_TEST));
+    GL_CALL(glEnable(GL_DEPTH_TEST));
+    GL_CALL(glDisable(GL_CULL_FACE));
+    GL_CALL(glCullFace(GL_BACK));
+    GL_CALL(glDepthMask(GL_TRUE));
+    GL_CALL(glBlendEquation(GL_FUNC_ADD));
+    GL_CALL(glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+    //
+    // Light accumulation and depth to the screen
+    //
+    int compositeUnit = gBufferUnit;
+    TextureBindContext::Overwrite(compositeUnit, GL_TEXTURE_2D, m_GBuffer.GetTexture(GBuffer::LIGHT));
+    TextureBindContext::Overwrite(compositeUnit + 1, GL_TEXTURE_2D, m_GBuffer.GetDepthTexture());
+    TextureBindContext::ApplyAll();
+
+    GL_CALL(glDepthFunc(GL_ALWAYS));
+    ctx.deferredCompositeShader->Bind();
+    ctx.deferredCompositeShader->BeginPass(lookupFeatures & SHADER_FEATURE_SHADOW_DEBUG, ShaderSettings(), [&](Shader& variant) {
+        variant.SetInt("gLight", compositeUnit);
+        variant.SetInt("gDepth", compositeUnit + 1);
+    });
+    if (ctx.deferredCompositeShader->SetMaterialFeatures(0)) {
+        GL_CALL(glBindVertexArray(m_QuadVAO));
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+    }
+    ctx.deferredCompositeShader->EndPass();
+    ctx.deferredCompositeShader->Unbind();
+    GL_CALL(glDepthFunc(GL_LESS));
+    GL_CALL(glEnable(GL_CULL_FACE));
+    GL_CALL(glBindVertexArray(0));
+
+    //
+    // Blended geometry forward, on top of the deferred result
+    //
+    m_NextActiveTexture = firstFreeUnit;
+    ctx.objShader->Bind();
+    DrawGeometry(*ctx.objShader, m_ViewMatrix, m_ProjMatrix, ctx, RENDER_LAYER_MAIN, [this](Shader& variant) {
+        UploadLightData(variant);
+    }, MATERIAL_FILTER_BLENDED);
 }
 
 void Scene::DebugDrawTexture(GLuint texture) {
@@ -440,103 +1215,1024 @@ void Scene::DebugDrawTexture(GLuint texture) {
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
 }
-void Scene::DrawShadowMap(const DrawContext& ctx, DepthMapInfo& info) {
-    GL_CALL(glCullFace(GL_FRONT));
+void Scene::DrawDepthPrepass(const DrawContext& ctx) {
+    int firstFreeUnit = m_NextActiveTexture;
+
+    GL_CALL(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE));
     ctx.depthMapShader->Bind();
-    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO));
-    GL_CALL(glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT));
-    GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
-    DrawGeometry(*ctx.depthMapShader, info.view, info.proj, ctx);
-    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    DrawGeometry(*ctx.depthMapShader, m_ViewMatrix, m_ProjMatrix, ctx, RENDER_LAYER_MAIN, nullptr, MATERIAL_FILTER_OPAQUE);
     ctx.depthMapShader->Unbind();
-    GL_CALL(glCullFace(GL_BACK));
+    GL_CALL(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE));
+
+    m_NextActiveTexture = firstFreeUnit;
 }
-void Scene::DrawShadowMap3D(const DrawContext& ctx, DepthMapInfo3D& info, Vec3 lightPos) {
-    GL_CALL(glCullFace(GL_FRONT));
-    ctx.depthMapShader3D->Bind();
-    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO));
-    GL_CALL(glViewport(0, 0, SHADOW_WIDTH3D, SHADOW_HEIGHT3D));
-    GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
-    ctx.depthMapShader3D->SetMat4Array("lightTransforms", info.viewTransforms, 6);
-    ctx.depthMapShader3D->SetMat4("lightProj", info.proj);
-    ctx.depthMapShader3D->SetVec3("lightPos", lightPos);
-    ctx.depthMapShader3D->SetFloat("farPlane", SHADOW_FAR);
-    DrawGeometry(*ctx.depthMapShader3D, Matrix4::Identity(), Matrix4::Identity(), ctx);
-    GL_CALL(glCullFace(GL_BACK));
-    ctx.depthMapShader3D->Unbind();
+
+bool Scene::DrawShadowMask(const DrawContext& ctx) {
+    uint32_t shadowFeatures = SHADER_FEATURE_DIR_SHADOWS | SHADER_FEATURE_SPOT_SHADOWS | SHADER_FEATURE_POINT_SHADOWS | SHADER_FEATURE_PARABOLOID_SHADOWS;
+    uint32_t momentFeatures = SHADER_FEATURE_DIR_MOMENTS | SHADER_FEATURE_SPOT_MOMENTS;
+    uint32_t maskFeatures = GetPassFeatures() & (shadowFeatures | momentFeatures | SHADER_FEATURE_ADAPTIVE_SHADOWS);
+    if ((maskFeatures & shadowFeatures) == 0) return false;
+
+    // Channels in the order of UploadLightData(), the lights that
+    // don't fit look their shadows up in the forward pass
+    int numDirLights = 0;
+    for (auto& light : m_DirLights) {
+        if (light.active) numDirLights++;
+    }
+    m_ShadowMaskSpotBase = std::min(numDirLights, ShadowMask::MAX_CHANNELS);
+    m_ShadowMaskPointBase = std::min(m_ShadowMaskSpotBase + m_NumSpotShadows, ShadowMask::MAX_CHANNELS);
+    m_NumShadowMaskChannels = m_ShadowMaskPointBase;
+    std::fill(std::begin(m_ShadowMaskRecords), std::end(m_ShadowMaskRecords), -1);
+    size_t numPointRecords = std::min(m_PointLights.size(), (size_t)LightClusters::MAX_LIGHTS);
+    for (size_t i = 0; i < m_SpotLights.size() && numPointRecords + i < LightClusters::MAX_LIGHTS; i++) {
+        int slot = m_SpotLights[i].depthMapInfo.shadowSlot;
+        if (!m_SpotLights[i].active || slot < 0 || m_ShadowMaskSpotBase + slot >= m_ShadowMaskPointBase) continue;
+        m_ShadowMaskRecords[m_ShadowMaskSpotBase + slot] = (int)(numPointRecords + i);
+    }
+    for (size_t i = 0; i < numPointRecords; i++) {
+        int slot = m_PointLights[i].depthMapInfo.shadowSlot;
+        if (!m_PointLights[i].active || slot < 0 || m_ShadowMaskPointBase + slot >= ShadowMask::MAX_CHANNELS) continue;
+        m_ShadowMaskRecords[m_ShadowMaskPointBase + slot] = (int)i;
+        m_NumShadowMaskChannels = std::max(m_NumShadowMaskChannels, m_ShadowMaskPointBase + slot + 1);
+    }
+    if (m_NumShadowMaskChannels == 0) return false;
+
+    AppWindow* window = GetMainWindow();
+    int width = window->GetWidth(), height = window->GetHeight();
+    m_ShadowMask.Resize(width, height, (m_NumShadowMaskChannels + 3) / 4);
+    m_ShadowMask.CopyDepth();
+
+    // The mask pass reads the depth, the forward pass the view depth and
+    // the mask. The units stay bound until then.
+    int depthUnit = m_NextActiveTexture++;
+    m_ShadowMaskViewDepthUnit = m_NextActiveTexture++;
+    m_ShadowMaskUnit = m_NextActiveTexture++;
+    TextureBindContext::Overwrite(depthUnit, GL_TEXTURE_2D, m_ShadowMask.GetDepthTexture());
+    TextureBindContext::Overwrite(m_ShadowMaskViewDepthUnit, GL_TEXTURE_2D, 0);
+    TextureBindContext::Overwrite(m_ShadowMaskUnit, GL_TEXTURE_2D_ARRAY, 0);
+    TextureBindContext::ApplyAll();
+
+    Matrix4 projectionInverse = m_ProjMatrix;
+    projectionInverse.Invert();
+    m_ShadowMask.BindForMask();
+    GL_CALL(glDisable(GL_DEPTH_TEST));
+    GL_CALL(glDisable(GL_CULL_FACE));
+    GL_CALL(glDisable(GL_BLEND));
+    Shader& shader = *ctx.shadowMaskShader;
+    shader.Bind();
+    shader.BeginPass(maskFeatures, GetLightCountSettings(), [&](Shader& variant) {
+        variant.SetFloat("shadowFarPlane", SHADOW_FAR);
+        UploadLightData(variant);
+        variant.SetInt("shadowMaskDepth", depthUnit);
+        variant.SetMat4("projectionInverse", projectionInverse);
+        variant.SetMat4("viewToWorld", m_ViewMatrix);
+        variant.SetInt("numShadowMaskChannels", m_NumShadowMaskChannels);
+        variant.SetInt("shadowMaskSpotBase", m_ShadowMaskSpotBase);
+        variant.SetInt("shadowMaskPointBase", m_ShadowMaskPointBase);
+        variant.SetIntArray("shadowMaskRecords", m_ShadowMaskRecords, ShadowMask::MAX_CHANNELS);
+    });
+    bool drawn = shader.SetMaterialFeatures(0);
+    if (drawn) {
+        GL_CALL(glBindVertexArray(m_QuadVAO));
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+    }
+    shader.EndPass();
+    shader.Unbind();
+
     GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    GL_CALL(glViewport(0, 0, width, height));
+    GL_CALL(glEnable(GL_DEPTH_TEST));
+    GL_CALL(glEnable(GL_CULL_FACE));
+    GL_CALL(glEnable(GL_BLEND));
+    TextureBindContext::Overwrite(m_ShadowMaskViewDepthUnit, GL_TEXTURE_2D, m_ShadowMask.GetViewDepthTexture());
+    TextureBindContext::Overwrite(m_ShadowMaskUnit, GL_TEXTURE_2D_ARRAY, m_ShadowMask.GetMaskTexture());
+    return drawn;
+}
 
+void Scene::SetShadowMaskUniforms(Shader& shader) {
+    shader.SetInt("shadowMask", m_ShadowMaskUnit);
+    shader.SetInt("shadowMaskViewDepth", m_ShadowMaskViewDepthUnit);
+    shader.SetInt("numShadowMaskChannels", m_NumShadowMaskChannels);
+    shader.SetInt("shadowMaskSpotBase", m_ShadowMaskSpotBase);
+    shader.SetInt("shadowMaskPointBase", m_ShadowMaskPointBase);
+}
 
-    /*
-    // Ultra slow sanity checking the shadow map
-    glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO);
+void Scene::BeginSampleQuery() {
+    if (m_SampleQueries[0] == 0) {
+        GL_CALL(glGenQueries(2, m_SampleQueries));
+    }
+    GL_CALL(glBeginQuery(GL_SAMPLES_PASSED, m_SampleQueries[m_SampleQueryIndex]));
+}
 
-    float* pixels = new float[SHADOW_WIDTH3D * SHADOW_HEIGHT3D];
+void Scene::EndSampleQuery() {
+    GL_CALL(glEndQuery(GL_SAMPLES_PASSED));
 
-    for (int face = 0; face < 6; ++face) {
-        glReadPixels(0, 0, SHADOW_WIDTH3D, SHADOW_HEIGHT3D, GL_DEPTH_COMPONENT, GL_FLOAT, pixels);
+    // Multisampled targets count every covered sample
+    GLint samples = 0;
+    GL_CALL(glGetIntegerv(GL_SAMPLES, &samples));
+    AppWindow* window = GetMainWindow();
+    m_SampleQueryArea[m_SampleQueryIndex] = (uint64_t)window->GetWidth() * window->GetHeight() * std::max(samples, 1);
+
+    // The other query is from the last frame
+    m_SampleQueryIndex = 1 - m_SampleQueryIndex;
+    if (m_SampleQueryArea[m_SampleQueryIndex] == 0) return;
+    GLuint64 shadedSamples = 0;
+    GL_CALL(glGetQueryObjectui64v(m_SampleQueries[m_SampleQueryIndex], GL_QUERY_RESULT, &shadedSamples));
+    m_ShadedSamples = shadedSamples;
+    m_ShadedSamplesPerPixel = (float)((double)shadedSamples / (double)m_SampleQueryArea[m_SampleQueryIndex]);
+}
 
-        for (int x = 0; x < (int)SHADOW_WIDTH3D; x++) {
-            for (int y = 0; y < (int)SHADOW_HEIGHT3D; y++) {
-                float px = pixels[(y * SHADOW_WIDTH3D) + x];
-                if (px < 0.0 || px > 1.0) {
-                    CRASH();
-                }
-            }   
-        }
+void Scene::BeginShadingQuery() {
+    if (m_ShadingQueries[0] == 0) {
+        GL_CALL(glGenQueries(2, m_ShadingQueries));
     }
+    GL_CALL(glBeginQuery(GL_TIME_ELAPSED, m_ShadingQueries[m_ShadingQueryIndex]));
+}
+
+void Scene::EndShadingQuery() {
+    GL_CALL(glEndQuery(GL_TIME_ELAPSED));
+    m_ShadingQueryIssued[m_ShadingQueryIndex] = true;
+
+    m_ShadingQueryIndex = 1 - m_ShadingQueryIndex;
+    if (!m_ShadingQueryIssued[m_ShadingQueryIndex]) return;
+    GLuint64 nanoseconds = 0;
+    GL_CALL(glGetQueryObjectui64v(m_ShadingQueries[m_ShadingQueryIndex], GL_QUERY_RESULT, &nanoseconds));
+    m_ShadingMilliseconds = (float)((double)nanoseconds / 1e6);
+}
+
+static bool sameMatrix(const Matrix4& a, const Matrix4& b) {
+    return memcmp(a.data, b.data, sizeof(a.data)) == 0;
+}
 
-    delete[] pixels;
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    */
+static bool shadowCacheValid(const ShadowCache& cache, const Matrix4& proj, const Matrix4& view, uint32_t staticCasterVersion, bool inStaticMap) {
+    return cache.staticCasterVersion == staticCasterVersion && cache.inStaticMap == inStaticMap
+        && sameMatrix(cache.proj, proj) && sameMatrix(cache.view, view);
 }
-void Scene::InitLightDepthMap(DepthMapInfo& info) {
 
-    std::cout << "Creating Light Depth Map...\n";
+// Returns whether the cached static casters are still valid and
+// remembers what the shadow map is about to be drawn with. Callers drop
+// the cache again when the draw left casters out, see DrawGeometry().
+static bool updateShadowCache(ShadowCache& cache, const Matrix4& proj, const Matrix4& view, uint32_t staticCasterVersion, bool inStaticMap) {
+    bool valid = shadowCacheValid(cache, proj, view, staticCasterVersion, inStaticMap);
+    cache.proj = proj;
+    cache.view = view;
+    cache.staticCasterVersion = staticCasterVersion;
+    cache.inStaticMap = inStaticMap;
+    return valid;
+}
 
-    GL_CALL(glGenFramebuffers(1, &info.shadowMapFBO));
+static void createDepthMap(GLuint& fbo, GLuint& texture, int width, int height) {
+    GL_CALL(glGenFramebuffers(1, &fbo));
 
-    GL_CALL(glGenTextures(1, &info.shadowMapTexture));
-    GL_CALL(glBindTexture(GL_TEXTURE_2D, info.shadowMapTexture));
+    GL_CALL(glGenTextures(1, &texture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, texture));
     GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 
-                SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL));
+                width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL));
     GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
     GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
     GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER)); 
     GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER)); 
 
-    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
     // Attach the texture as a depth attachment
-    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, info.shadowMapTexture, 0));
+    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0));
     GL_CALL(glDrawBuffer(GL_NONE)); // No color buffer is drawn to
     GL_CALL(glReadBuffer(GL_NONE)); // No color buffer is read from
     GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0)); 
+}
 
-    std::cout << "Done!\n";
+static void createDepthMapArray(GLuint& fbo, GLuint& texture, int width, int height, int layers) {
+    GL_CALL(glGenTextures(1, &texture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, texture));
+    GL_CALL(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT,
+                width, height, layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+    // The layer drawn to is attached before each draw
+    GL_CALL(glGenFramebuffers(1, &fbo));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    GL_CALL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, 0));
+    GL_CALL(glDrawBuffer(GL_NONE));
+    GL_CALL(glReadBuffer(GL_NONE));
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
 }
 
-void Scene::InitLightDepthMap3D(DepthMapInfo3D& info) {
-    std::cout << "Creating Light Depth Map 3D...\n";
-    GL_CALL(glGenTextures(1, &info.shadowCubeMap));
-    GL_CALL(glBindTexture(GL_TEXTURE_CUBE_MAP, info.shadowCubeMap));
-    for (unsigned int i = 0; i < 6; ++i) {
-        GL_CALL(glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, 
-                     SHADOW_WIDTH3D, SHADOW_HEIGHT3D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL));
+// Moments of the cascades, mipmapped like the spot lights' moment atlas
+static void createMomentMapArray(GLuint& fbo, GLuint& texture, int size, int layers) {
+    GL_CALL(glGenTextures(1, &texture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, texture));
+    GL_CALL(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA16F, size, size, layers, 0, GL_RGBA, GL_FLOAT, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL_CALL(glGenerateMipmap(GL_TEXTURE_2D_ARRAY));
+
+    // The layer drawn to is attached before each draw
+    GL_CALL(glGenFramebuffers(1, &fbo));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    GL_CALL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, 0));
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+static void generateMipmaps(GLenum target, GLuint texture) {
+    GL_CALL(glBindTexture(target, texture));
+    GL_CALL(glGenerateMipmap(target));
+    GL_CALL(glBindTexture(target, 0));
+}
+
+static void growBounds(Vec3& boundsMin, Vec3& boundsMax, const Vec3& min, const Vec3& max) {
+    boundsMin = Vec3(std::min(boundsMin.x, min.x), std::min(boundsMin.y, min.y), std::min(boundsMin.z, min.z));
+    boundsMax = Vec3(std::max(boundsMax.x, max.x), std::max(boundsMax.y, max.y), std::max(boundsMax.z, max.z));
+}
+
+void Scene::UpdateStaticCasters() {
+    bool changed = m_Grass.GetSize() != m_StaticGrassCount;
+    m_StaticGrassCount = m_Grass.GetSize();
+
+    // Grass is only ever added, its chunks and buffers change with the count
+    if (changed) {
+        m_Grass.Upload();
+        m_Grass.GetBounds(m_GrassBoundsMin, m_GrassBoundsMax);
+    }
+    m_SceneBoundsMin = m_GrassBoundsMin;
+    m_SceneBoundsMax = m_GrassBoundsMax;
+    for (auto model : m_Models) {
+        Vec3 min, max;
+        model->GetWorldBounds(min, max);
+        growBounds(m_SceneBoundsMin, m_SceneBoundsMax, min, max);
     }
 
-    GL_CALL(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-    GL_CALL(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-    GL_CALL(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-    GL_CALL(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-    GL_CALL(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+    uint32_t materialVersion = MaterialLibrary::Get().GetVersion();
+    changed |= materialVersion != m_StaticMaterialVersion;
+    m_StaticMaterialVersion = materialVersion;
 
-    GL_CALL(glGenFramebuffers(1, &info.shadowMapFBO));
-    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO));
-    GL_CALL(glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, info.shadowCubeMap, 0));
-    GL_CALL(glDrawBuffer(GL_NONE));
+    size_t numStatic = 0, numDynamic = 0;
+    m_MovedCasterBounds.clear();
+    for (auto model : m_Models) {
+        if (model->IsDynamic()) {
+            DynamicCasterState current;
+            current.model = model;
+            current.transform = model->GetTransform();
+            current.version = model->GetVersion();
+            model->GetWorldBounds(current.min, current.max);
+            if (numDynamic == m_DynamicCasters.size()) {
+                m_DynamicCasters.push_back(current);
+                m_MovedCasterBounds.push_back({ current.min, current.max });
+            } else {
+                DynamicCasterState& state = m_DynamicCasters[numDynamic];
+                if (state.model != model || state.version != current.version || !sameMatrix(state.transform, current.transform)) {
+                    m_MovedCasterBounds.push_back({ state.min, state.max });
+                    m_MovedCasterBounds.push_back({ current.min, current.max });
+                    state = current;
+                }
+            }
+            numDynamic++;
+            continue;
+        }
+        const Matrix4& transform = model->GetTransform();
+        if (numStatic == m_StaticCasters.size()) {
+            m_StaticCasters.push_back({ model, transform, model->GetVersion() });
+            changed = true;
+        } else {
+            StaticCasterState& state = m_StaticCasters[numStatic];
+            if (state.model != model || state.version != model->GetVersion() || !sameMatrix(state.transform, transform)) {
+                state = { model, transform, model->GetVersion() };
+                changed = true;
+            }
+        }
+        numStatic++;
+    }
+    if (numStatic != m_StaticCasters.size()) {
+        m_StaticCasters.resize(numStatic);
+        changed = true;
+    }
+    for (size_t i = numDynamic; i < m_DynamicCasters.size(); i++) {
+        m_MovedCasterBounds.push_back({ m_DynamicCasters[i].min, m_DynamicCasters[i].max });
+    }
+    m_DynamicCasters.resize(numDynamic);
+    m_NumDynamicCasters = (int)numDynamic;
+
+    if (changed) m_StaticCasterVersion++;
+}
+
+static void attachDepth(GLenum framebuffer, GLuint texture, GLenum target, int layer) {
+    if (target == GL_TEXTURE_2D_ARRAY || target == GL_TEXTURE_CUBE_MAP_ARRAY) {
+        GL_CALL(glFramebufferTextureLayer(framebuffer, GL_DEPTH_ATTACHMENT, texture, 0, layer));
+    } else {
+        GL_CALL(glFramebufferTexture2D(framebuffer, GL_DEPTH_ATTACHMENT, target, texture, 0));
+    }
+}
+
+void Scene::CopyDepth(GLuint source, GLenum sourceTarget, GLuint destination, GLenum destinationTarget, int width, int height, int layer, int x, int y) {
+    if (m_CopyFBOs[0] == 0) {
+        GL_CALL(glGenFramebuffers(2, m_CopyFBOs));
+    }
+
+    GL_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER, m_CopyFBOs[0]));
+    attachDepth(GL_READ_FRAMEBUFFER, source, sourceTarget, layer);
     GL_CALL(glReadBuffer(GL_NONE));
+    GL_CALL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_CopyFBOs[1]));
+    attachDepth(GL_DRAW_FRAMEBUFFER, destination, destinationTarget, layer);
+    GL_CALL(glDrawBuffer(GL_NONE));
 
-    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+    GL_CALL(glBlitFramebuffer(x, y, x + width, y + height, x, y, x + width, y + height, GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+bool Scene::DrawShadowMap(const DrawContext& ctx, DepthMapInfo& info) {
+    // Without dynamic casters the shadow map itself is the cache
+    bool inStaticMap = m_NumDynamicCasters > 0;
+    bool cached = updateShadowCache(info.cache, info.proj, info.view, m_StaticCasterVersion, inStaticMap);
+    if (cached && !inStaticMap) return false;
+
+    // The scissor keeps the clears inside the tile
+    const ShadowAtlas::Rect& rect = info.atlasRect;
+    GL_CALL(glCullFace(GL_FRONT));
+    ctx.depthMapShader->Bind();
+    GL_CALL(glViewport(rect.x, rect.y, rect.size, rect.size));
+    GL_CALL(glScissor(rect.x, rect.y, rect.size, rect.size));
+    GL_CALL(glEnable(GL_SCISSOR_TEST));
+    if (!inStaticMap) {
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_ShadowAtlas.GetFBO()));
+        GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
+        if (!DrawGeometry(*ctx.depthMapShader, info.view, info.proj, ctx, RENDER_LAYER_SPOT_SHADOW, nullptr)) {
+            info.cache.staticCasterVersion = 0;
+        }
+    } else {
+        if (!cached) {
+            GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_ShadowAtlas.GetStaticFBO()));
+            GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
+            if (!DrawGeometry(*ctx.depthMapShader, info.view, info.proj, ctx, RENDER_LAYER_SPOT_SHADOW, nullptr, MATERIAL_FILTER_ALL, CASTERS_STATIC)) {
+                info.cache.staticCasterVersion = 0;
+            }
+            m_NextActiveTexture = 0;
+        }
+        CopyDepth(m_ShadowAtlas.GetStaticTexture(), GL_TEXTURE_2D, m_ShadowAtlas.GetTexture(), GL_TEXTURE_2D, rect.size, rect.size, 0, rect.x, rect.y);
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_ShadowAtlas.GetFBO()));
+        DrawGeometry(*ctx.depthMapShader, info.view, info.proj, ctx, RENDER_LAYER_SPOT_SHADOW, nullptr, MATERIAL_FILTER_ALL, CASTERS_DYNAMIC);
+    }
+    GL_CALL(glDisable(GL_SCISSOR_TEST));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    ctx.depthMapShader->Unbind();
+    GL_CALL(glCullFace(GL_BACK));
+    return !cached;
+}
+static void dropFaceCaches(DepthMapInfo3D& info, int faces) {
+    for (int face = 0; face < info.GetNumFaces(); face++) {
+        if (faces & (1 << face)) info.cache[face].staticCasterVersion = 0;
+    }
+}
+
+// The geometry shader draws the faces in the mask into their layers of
+// the slot, cube faces or paraboloid hemispheres
+bool Scene::DrawShadowMap3D(const DrawContext& ctx, DepthMapInfo3D& info, Vec3 lightPos, float radius) {
+    if (info.drawFaces == 0) return false;
+
+    Matrix4 view = Matrix4::Identity();
+    view.SetTranslation(lightPos);
+    bool inStaticMap = m_NumDynamicCasters > 0;
+    int staticFaces = 0;
+    for (int face = 0; face < info.GetNumFaces(); face++) {
+        if ((info.drawFaces & (1 << face)) == 0) continue;
+        if (!updateShadowCache(info.cache[face], info.proj, view, m_StaticCasterVersion, inStaticMap)) staticFaces |= 1 << face;
+    }
+
+    PointShadowPool& pool = GetPointShadowPool(info.slotMode);
+    bool paraboloid = info.slotMode == POINT_SHADOW_PARABOLOID;
+    Shader& shader = paraboloid ? *ctx.depthParaboloidShader : *ctx.depthMapShader3D;
+    int size = pool.GetSlotSize();
+    int faceMask = 0;
+    auto passUniforms = [&](Shader& variant) {
+        if (paraboloid) {
+            variant.SetFloat("mapSize", (float)size);
+        } else {
+            variant.SetMat4Array("lightTransforms", info.viewTransforms, 6);
+            variant.SetMat4("lightProj", info.proj);
+        }
+        variant.SetVec3("lightPos", lightPos);
+        variant.SetFloat("farPlane", SHADOW_FAR);
+        variant.SetInt("firstLayer", info.shadowSlot * pool.GetLayersPerSlot());
+        variant.SetInt("faceMask", faceMask);
+    };
+    PointShadowPass pointPass = { &info, lightPos, radius, 0 };
+
+    GL_CALL(glCullFace(GL_FRONT));
+    shader.Bind();
+    GL_CALL(glViewport(0, 0, size, size));
+    if (!inStaticMap) {
+        faceMask = info.drawFaces;
+        pointPass.faces = faceMask;
+        pool.Bind(info.shadowSlot, false, faceMask);
+        if (!DrawGeometry(shader, Matrix4::Identity(), Matrix4::Identity(), ctx, RENDER_LAYER_POINT_SHADOW, passUniforms, MATERIAL_FILTER_ALL, CASTERS_ALL,
+                          nullptr, nullptr, 0, &pointPass)) {
+            dropFaceCaches(info, faceMask);
+        }
+    } else {
+        if (staticFaces != 0) {
+            faceMask = staticFaces;
+            pointPass.faces = faceMask;
+            pool.Bind(info.shadowSlot, true, faceMask);
+            if (!DrawGeometry(shader, Matrix4::Identity(), Matrix4::Identity(), ctx, RENDER_LAYER_POINT_SHADOW, passUniforms, MATERIAL_FILTER_ALL, CASTERS_STATIC,
+                              nullptr, nullptr, 0, &pointPass)) {
+                dropFaceCaches(info, faceMask);
+            }
+            m_NextActiveTexture = 0;
+        }
+        for (int face = 0; face < info.GetNumFaces(); face++) {
+            if ((info.drawFaces & (1 << face)) == 0) continue;
+            CopyDepth(pool.GetStaticTexture(), pool.GetTarget(), pool.GetTexture(), pool.GetTarget(),
+                      size, size, info.shadowSlot * pool.GetLayersPerSlot() + face);
+        }
+        faceMask = info.drawFaces;
+        pool.Bind(info.shadowSlot, false, 0);
+        DrawGeometry(shader, Matrix4::Identity(), Matrix4::Identity(), ctx, RENDER_LAYER_POINT_SHADOW, passUniforms, MATERIAL_FILTER_ALL, CASTERS_DYNAMIC);
+    }
+    GL_CALL(glCullFace(GL_BACK));
+    shader.Unbind();
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+    pool.SetOrigin(info.shadowSlot, lightPos);
+    info.missingFaces &= ~info.drawFaces;
+    info.dynamicFaces &= ~info.drawFaces;
+    return staticFaces != 0;
+}
+bool Scene::DrawShadowCascade(const DrawContext& ctx, CascadedDepthMapInfo& info, int cascade) {
+    const Matrix4& cascadeMatrix = info.cascades[cascade];
+    bool inStaticMap = m_NumDynamicCasters > 0;
+    bool cached = updateShadowCache(info.cache[cascade], cascadeMatrix, Matrix4::Identity(), m_StaticCasterVersion, inStaticMap);
+    if (cached && !inStaticMap) return false;
+
+    // The cascade matrix goes from world to clip space on its own
+    auto drawCasters = [&](CasterFilter casters) {
+        return DrawGeometry(*ctx.depthMapShader, Matrix4::Identity(), cascadeMatrix, ctx, RENDER_LAYER_DIR_SHADOW, nullptr, MATERIAL_FILTER_ALL, casters, &cascadeMatrix);
+    };
+
+    GL_CALL(glCullFace(GL_FRONT));
+    ctx.depthMapShader->Bind();
+    GL_CALL(glViewport(0, 0, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE));
+    if (!inStaticMap) {
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO));
+        attachDepth(GL_FRAMEBUFFER, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, cascade);
+        GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
+        if (!drawCasters(CASTERS_ALL)) info.cache[cascade].staticCasterVersion = 0;
+    } else {
+        if (info.staticFBO == 0) {
+            createDepthMapArray(info.staticFBO, info.staticTexture, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE, info.numCascades);
+        }
+        if (!cached) {
+            GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.staticFBO));
+            attachDepth(GL_FRAMEBUFFER, info.staticTexture, GL_TEXTURE_2D_ARRAY, cascade);
+            GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
+            if (!drawCasters(CASTERS_STATIC)) info.cache[cascade].staticCasterVersion = 0;
+            m_NextActiveTexture = 0;
+        }
+        CopyDepth(info.staticTexture, GL_TEXTURE_2D_ARRAY, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE, cascade);
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, info.shadowMapFBO));
+        attachDepth(GL_FRAMEBUFFER, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, cascade);
+        drawCasters(CASTERS_DYNAMIC);
+    }
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    ctx.depthMapShader->Unbind();
+    GL_CALL(glCullFace(GL_BACK));
+    return !cached;
+}
+
+// Every batch of lights is one pass of the geometry, the geometry shader
+// sends each triangle to the lights whose frustum it touches
+bool Scene::DrawLayeredShadows(const DrawContext& ctx, RenderLayer layer, GLuint fbo, GLuint texture, GLenum target, int size,
+                               const std::vector<LayeredShadow>& shadows, CasterFilter casters, bool clear) {
+    if (shadows.empty()) return true;
+
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    if (clear) {
+        // The scissor keeps the clears inside the tiles, and clearing a
+        // layered attachment would clear every layer
+        GL_CALL(glEnable(GL_SCISSOR_TEST));
+        for (const LayeredShadow& shadow : shadows) {
+            if (target == GL_TEXTURE_2D_ARRAY) attachDepth(GL_FRAMEBUFFER, texture, target, shadow.layer);
+            GL_CALL(glScissor(shadow.rect.x, shadow.rect.y, shadow.rect.size, shadow.rect.size));
+            GL_CALL(glClear(GL_DEPTH_BUFFER_BIT));
+        }
+        GL_CALL(glDisable(GL_SCISSOR_TEST));
+    }
+    if (target == GL_TEXTURE_2D_ARRAY) {
+        GL_CALL(glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0));
+    }
+
+    GL_CALL(glViewport(0, 0, size, size));
+    for (int plane = 0; plane < 4; plane++) {
+        GL_CALL(glEnable(GL_CLIP_DISTANCE0 + plane));
+    }
+    GL_CALL(glCullFace(GL_FRONT));
+    ctx.depthLayeredShader->Bind();
+    bool complete = true;
+    for (size_t first = 0; first < shadows.size(); first += MAX_LAYERED_SHADOWS) {
+        int count = (int)std::min(shadows.size() - first, (size_t)MAX_LAYERED_SHADOWS);
+        Matrix4 matrices[MAX_LAYERED_SHADOWS];
+        Vec4 tiles[MAX_LAYERED_SHADOWS];
+        int layers[MAX_LAYERED_SHADOWS];
+        for (int i = 0; i < count; i++) {
+            const LayeredShadow& shadow = shadows[first + i];
+            matrices[i] = shadow.worldToClip;
+            float tileSize = (float)shadow.rect.size / size;
+            tiles[i] = Vec4{ (2.0f * shadow.rect.x + shadow.rect.size) / size - 1.0f, (2.0f * shadow.rect.y + shadow.rect.size) / size - 1.0f, tileSize, tileSize };
+            layers[i] = shadow.layer;
+        }
+        auto passUniforms = [&](Shader& variant) {
+            variant.SetMat4Array("lightMatrices", matrices, count);
+            for (int i = 0; i < count; i++) {
+                variant.SetVec4("lightTiles[" + std::to_string(i) + "]", tiles[i]);
+            }
+            variant.SetIntArray("lightLayers", layers, count);
+            variant.SetInt("numLights", count);
+        };
+        if (!DrawGeometry(*ctx.depthLayeredShader, Matrix4::Identity(), Matrix4::Identity(), ctx, layer, passUniforms, MATERIAL_FILTER_ALL, casters,
+                          nullptr, matrices, count)) {
+            complete = false;
+        }
+        m_NextActiveTexture = 0;
+    }
+    ctx.depthLayeredShader->Unbind();
+    GL_CALL(glCullFace(GL_BACK));
+    for (int plane = 0; plane < 4; plane++) {
+        GL_CALL(glDisable(GL_CLIP_DISTANCE0 + plane));
+    }
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    return complete;
+}
+
+void Scene::DrawShadowMapsLayered(const DrawContext& ctx, const std::vector<DepthMapInfo*>& infos, std::vector<bool>& drawn) {
+    // Without dynamic casters the shadow map itself is the cache
+    bool inStaticMap = m_NumDynamicCasters > 0;
+    std::vector<LayeredShadow> shadows, staleShadows;
+    std::vector<ShadowCache*> staleCaches;
+    drawn.assign(infos.size(), false);
+    for (size_t i = 0; i < infos.size(); i++) {
+        DepthMapInfo& info = *infos[i];
+        bool cached = updateShadowCache(info.cache, info.proj, info.view, m_StaticCasterVersion, inStaticMap);
+        drawn[i] = !cached;
+        if (cached && !inStaticMap) continue;
+        // Same transform as the vertex shader, proj * inverse(view)
+        Matrix4 view = info.view;
+        view.Invert();
+        LayeredShadow shadow = { view * info.proj, info.atlasRect, 0 };
+        shadows.push_back(shadow);
+        if (!cached) {
+            staleShadows.push_back(shadow);
+            staleCaches.push_back(&info.cache);
+        }
+    }
 
+    // A batch left out casters of any of the lights, all of them draw again
+    int atlasSize = m_ShadowAtlas.GetSize();
+    if (!inStaticMap) {
+        if (!DrawLayeredShadows(ctx, RENDER_LAYER_SPOT_SHADOW, m_ShadowAtlas.GetFBO(), m_ShadowAtlas.GetTexture(), GL_TEXTURE_2D, atlasSize, shadows, CASTERS_ALL, true)) {
+            for (ShadowCache* cache : staleCaches) cache->staticCasterVersion = 0;
+        }
+        return;
+    }
+    if (!DrawLayeredShadows(ctx, RENDER_LAYER_SPOT_SHADOW, m_ShadowAtlas.GetStaticFBO(), m_ShadowAtlas.GetStaticTexture(), GL_TEXTURE_2D, atlasSize, staleShadows, CASTERS_STATIC, true)) {
+        for (ShadowCache* cache : staleCaches) cache->staticCasterVersion = 0;
+    }
+    for (const LayeredShadow& shadow : shadows) {
+        const ShadowAtlas::Rect& rect = shadow.rect;
+        CopyDepth(m_ShadowAtlas.GetStaticTexture(), GL_TEXTURE_2D, m_ShadowAtlas.GetTexture(), GL_TEXTURE_2D, rect.size, rect.size, 0, rect.x, rect.y);
+    }
+    DrawLayeredShadows(ctx, RENDER_LAYER_SPOT_SHADOW, m_ShadowAtlas.GetFBO(), m_ShadowAtlas.GetTexture(), GL_TEXTURE_2D, atlasSize, shadows, CASTERS_DYNAMIC, false);
+}
+
+int Scene::DrawShadowCascadesLayered(const DrawContext& ctx, CascadedDepthMapInfo& info) {
+    bool inStaticMap = m_NumDynamicCasters > 0;
+    std::vector<LayeredShadow> shadows, staleShadows;
+    int drawnCascades = 0;
+    for (int cascade = 0; cascade < info.numCascades; cascade++) {
+        // The cascade matrix goes from world to clip space on its own
+        const Matrix4& cascadeMatrix = info.cascades[cascade];
+        bool cached = updateShadowCache(info.cache[cascade], cascadeMatrix, Matrix4::Identity(), m_StaticCasterVersion, inStaticMap);
+        if (!cached) drawnCascades |= 1 << cascade;
+        if (cached && !inStaticMap) continue;
+        LayeredShadow shadow = { cascadeMatrix, { 0, 0, (int)SHADOW_CASCADE_SIZE }, cascade };
+        shadows.push_back(shadow);
+        if (!cached) staleShadows.push_back(shadow);
+    }
+
+    auto dropStaleCaches = [&]() {
+        for (const LayeredShadow& shadow : staleShadows) info.cache[shadow.layer].staticCasterVersion = 0;
+    };
+    if (!inStaticMap) {
+        if (!DrawLayeredShadows(ctx, RENDER_LAYER_DIR_SHADOW, info.shadowMapFBO, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, SHADOW_CASCADE_SIZE, shadows, CASTERS_ALL, true)) {
+            dropStaleCaches();
+        }
+        return drawnCascades;
+    }
+    if (info.staticFBO == 0) {
+        createDepthMapArray(info.staticFBO, info.staticTexture, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE, info.numCascades);
+    }
+    if (!DrawLayeredShadows(ctx, RENDER_LAYER_DIR_SHADOW, info.staticFBO, info.staticTexture, GL_TEXTURE_2D_ARRAY, SHADOW_CASCADE_SIZE, staleShadows, CASTERS_STATIC, true)) {
+        dropStaleCaches();
+    }
+    for (const LayeredShadow& shadow : shadows) {
+        CopyDepth(info.staticTexture, GL_TEXTURE_2D_ARRAY, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE, shadow.layer);
+    }
+    DrawLayeredShadows(ctx, RENDER_LAYER_DIR_SHADOW, info.shadowMapFBO, info.shadowMapTexture, GL_TEXTURE_2D_ARRAY, SHADOW_CASCADE_SIZE, shadows, CASTERS_DYNAMIC, false);
+    return drawnCascades;
+}
+
+void Scene::AllocateShadowAtlas() {
+    std::vector<SpotLight*> casters;
+    for (auto& light : m_SpotLights) {
+        if (light.depthMapInfo.cast && light.active) casters.push_back(&light);
+        else light.depthMapInfo.atlasRect = ShadowAtlas::Rect();
+    }
+    // The atlas is only created once a spot light casts a shadow
+    if (casters.empty() && m_ShadowAtlas.GetTexture() == 0) return;
+
+    bool withMomentAtlas = false;
+    for (SpotLight* light : casters) {
+        if (light->depthMapInfo.mapType != SHADOW_MAP_DEPTH) withMomentAtlas = true;
+    }
+    bool recreated = m_ShadowAtlas.Reset(m_NumDynamicCasters > 0, withMomentAtlas);
+
+    // A full importance light (covering the screen) gets the largest
+    // tile, the tile side shrinks with the square root of the importance
+    // so the texels per screen pixel stay about the same. The most
+    // important lights pick first and get the tiles they asked for.
+    std::stable_sort(casters.begin(), casters.end(), [](const SpotLight* a, const SpotLight* b) {
+        return a->importance > b->importance;
+    });
+    int maxTileSize = m_ShadowAtlas.GetMaxTileSize();
+    for (SpotLight* light : casters) {
+        DepthMapInfo& info = light->depthMapInfo;
+        ShadowAtlas::Rect lastRect = info.atlasRect;
+        float share = std::sqrt(std::min(light->importance, 1.0f));
+        int size = ShadowAtlas::MIN_TILE_SIZE;
+        while (size < maxTileSize && (float)size < share * maxTileSize) size *= 2;
+
+        if (!m_ShadowAtlas.Allocate(size, info.atlasRect)) info.atlasRect = ShadowAtlas::Rect();
+        // Whatever was cached for the light is somewhere else now
+        if (recreated || info.atlasRect != lastRect) info.cache.staticCasterVersion = 0;
+    }
+}
+
+void Scene::AllocatePointShadows() {
+    // Without cube map arrays every light gets a paraboloid
+    bool canCube = getGLExtensions().textureCubeMapArray;
+    std::vector<PointLight*> cubeCasters, paraboloidCasters;
+    for (auto& light : m_PointLights) {
+        DepthMapInfo3D& info = light.depthMapInfo;
+        PointShadowMode mode = canCube ? info.mode : POINT_SHADOW_PARABOLOID;
+        bool casts = info.cast && light.active;
+        if (info.shadowSlot >= 0 && (!casts || mode != info.slotMode)) {
+            GetPointShadowPool(info.slotMode).Release(info.shadowSlot);
+            info.shadowSlot = -1;
+        }
+        if (!casts) continue;
+        info.slotMode = mode;
+        if (mode == POINT_SHADOW_CUBE) cubeCasters.push_back(&light);
+        else paraboloidCasters.push_back(&light);
+    }
+    AllocatePointShadowSlots(POINT_SHADOW_CUBE, cubeCasters);
+    AllocatePointShadowSlots(POINT_SHADOW_PARABOLOID, paraboloidCasters);
+}
+
+void Scene::AllocatePointShadowSlots(PointShadowMode mode, std::vector<PointLight*>& casters) {
+    if (casters.empty()) return;
+    PointShadowPool& pool = GetPointShadowPool(mode);
+
+    // Past the most slots the pool can have, the least important lights
+    // give theirs up before the others look for one
+    std::stable_sort(casters.begin(), casters.end(), [](const PointLight* a, const PointLight* b) {
+        return a->importance > b->importance;
+    });
+    size_t numSlots = std::min(casters.size(), (size_t)pool.GetMaxSlots());
+    for (size_t i = numSlots; i < casters.size(); i++) {
+        DepthMapInfo3D& info = casters[i]->depthMapInfo;
+        if (info.shadowSlot >= 0) pool.Release(info.shadowSlot);
+        info.shadowSlot = -1;
+    }
+    casters.resize(numSlots);
+
+    // A new slot, or any slot of a recreated pool, holds nothing of the light
+    bool recreated = pool.Reserve((int)numSlots, m_NumDynamicCasters > 0);
+    for (PointLight* light : casters) {
+        DepthMapInfo3D& info = light->depthMapInfo;
+        if (info.shadowSlot >= 0 && !recreated) continue;
+        if (info.shadowSlot < 0) info.shadowSlot = pool.Acquire();
+        info.missingFaces = info.GetAllFaces();
+        for (auto& cache : info.cache) cache.staticCasterVersion = 0;
+    }
+}
+
+static int countFaces(int faces) {
+    int count = 0;
+    for (int face = 0; face < 6; face++) {
+        if (faces & (1 << face)) count++;
+    }
+    return count;
+}
+
+void Scene::SchedulePointShadowFaces() {
+    struct FaceUpdate {
+        DepthMapInfo3D* info;
+        int faces;
+        float priority;
+    };
+    std::vector<FaceUpdate> updates;
+
+    bool inStaticMap = m_NumDynamicCasters > 0;
+    int budget = m_PointShadowFaceBudget > 0 ? m_PointShadowFaceBudget : INT_MAX;
+    Vec3 cameraPos = m_ViewMatrix.GetTranslation();
+    m_LightActivity.pointFacesDrawn = 0;
+    m_LightActivity.pointFacesWaiting = 0;
+
+    for (auto& light : m_PointLights) {
+        DepthMapInfo3D& info = light.depthMapInfo;
+        info.drawFaces = 0;
+        if (info.shadowSlot < 0) continue;
+
+        // Moves are remembered until the face is drawn, the
+        // caster may be standing still by the time it is
+        if (inStaticMap) {
+            for (const CasterBounds& bounds : m_MovedCasterBounds) {
+                info.dynamicFaces |= facesSeeingBox(info, light.position, light.outerRadius, bounds.min, bounds.max);
+            }
+        }
+        // Faces without anything of the light are drawn no matter the budget
+        if (info.missingFaces != 0) {
+            info.drawFaces = info.GetAllFaces();
+            budget -= info.GetNumFaces();
+            continue;
+        }
+
+        Matrix4 view = Matrix4::Identity();
+        view.SetTranslation(light.position);
+        float distance = cameraPos.Subtract(light.position).Length() / light.outerRadius;
+        bool moved = false;
+        int waited = 0;
+        for (int face = 0; face < info.GetNumFaces(); face++) {
+            moved = moved || !sameMatrix(info.cache[face].view, view);
+            waited = std::max(waited, info.staleFrames[face]);
+        }
+        if (moved) {
+            updates.push_back({ &info, info.GetAllFaces(), 4.0f * (1.0f + waited) / (1.0f + distance) });
+            continue;
+        }
+
+        for (int face = 0; face < info.GetNumFaces(); face++) {
+            int bit = 1 << face;
+            bool staticStale = !shadowCacheValid(info.cache[face], info.proj, view, m_StaticCasterVersion, inStaticMap);
+            bool dynamicStale = (info.dynamicFaces & bit) != 0;
+            if (!staticStale && !dynamicStale) {
+                info.staleFrames[face] = 0;
+                continue;
+            }
+            float urgency = (staticStale ? 1.0f : 0.0f) + (dynamicStale ? 2.0f : 0.0f);
+            updates.push_back({ &info, bit, urgency * (1.0f + info.staleFrames[face]) / (1.0f + distance) });
+        }
+    }
+
+    std::stable_sort(updates.begin(), updates.end(), [](const FaceUpdate& a, const FaceUpdate& b) {
+        return a.priority > b.priority;
+    });
+    for (const FaceUpdate& update : updates) {
+        for (int face = 0; face < 6; face++) {
+            if ((update.faces & (1 << face)) == 0) continue;
+            if (budget > 0) update.info->staleFrames[face] = 0;
+            else update.info->staleFrames[face]++;
+        }
+        if (budget > 0) {
+            update.info->drawFaces |= update.faces;
+            budget -= countFaces(update.faces);
+        } else {
+            m_LightActivity.pointFacesWaiting += countFaces(update.faces);
+        }
+    }
+
+    for (auto& light : m_PointLights) {
+        m_LightActivity.pointFacesDrawn += countFaces(light.depthMapInfo.drawFaces);
+    }
+}
+
+void Scene::FitCascades(CascadedDepthMapInfo& info, const Vec3& direction) {
+    // Light space axes, depth grows along the light direction
+    Vec3 forward = direction.Normalized();
+    Vec3 up = fabs(forward.y) > 0.99f ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(0.0f, 1.0f, 0.0f);
+    Vec3 right = Vec3::Cross(forward, up).Normalized();
+    up = Vec3::Cross(right, forward);
+
+    // Casters anywhere in the scene can shadow a slice, so the depth
+    // range of every cascade starts at the closest point of the scene.
+    // Nothing past the scene's farthest point needs a shadow either.
+    float sceneNear = INFINITY, sceneFar = INFINITY;
+    if (m_SceneBoundsMin.x <= m_SceneBoundsMax.x) {
+        sceneFar = -INFINITY;
+        for (int i = 0; i < 8; i++) {
+            Vec3 corner((i & 1) ? m_SceneBoundsMax.x : m_SceneBoundsMin.x,
+                        (i & 2) ? m_SceneBoundsMax.y : m_SceneBoundsMin.y,
+                        (i & 4) ? m_SceneBoundsMax.z : m_SceneBoundsMin.z);
+            float depth = Vec3::Dot(forward, corner);
+            sceneNear = std::min(sceneNear, depth);
+            sceneFar = std::max(sceneFar, depth);
+        }
+    }
+
+    float xScale = m_ProjMatrix.data[0], yScale = m_ProjMatrix.data[5];
+    float cameraNear = m_ProjMatrix.data[14] / (m_ProjMatrix.data[10] - 1.0f);
+    float cameraFar = m_ProjMatrix.data[14] / (m_ProjMatrix.data[10] + 1.0f);
+    float shadowFar = std::min(cameraFar, SHADOW_CASCADE_DISTANCE);
+    // Squared distance of the frustum corners from the view axis per unit of depth
+    float cornerSlope = 1.0f / (xScale * xScale) + 1.0f / (yScale * yScale);
+    Vec3 cameraPos = m_ViewMatrix.GetTranslation();
+    Vec3 cameraForward = m_ViewMatrix.TransformDirection(Vec3(0.0f, 0.0f, -1.0f)).Normalized();
+
+    float sliceNear = cameraNear;
+    for (int i = 0; i < info.numCascades; i++) {
+        // Practical split scheme, logarithmic splits blended with uniform ones
+        float t = (float)(i + 1) / (float)info.numCascades;
+        float logSplit = cameraNear * std::pow(shadowFar / cameraNear, t);
+        float uniformSplit = cameraNear + (shadowFar - cameraNear) * t;
+        float sliceFar = m_CascadeSplitLambda * logSplit + (1.0f - m_CascadeSplitLambda) * uniformSplit;
+
+        // Bounding sphere of the slice. Its center is on the view axis where
+        // the near and far corners are equally far, its size only depends on
+        // the projection. Rounding it up keeps it from jittering.
+        float center = std::min((sliceNear + sliceFar) * (1.0f + cornerSlope) * 0.5f, sliceFar);
+        float radius = std::sqrt((sliceFar - center) * (sliceFar - center) + sliceFar * sliceFar * cornerSlope);
+        radius = std::ceil(radius * 16.0f) / 16.0f;
+        Vec3 sphereCenter = cameraPos.Add(cameraForward.Multiply(center));
+        sliceNear = sliceFar;
+
+        // The cascade only moves in whole texels, so the shadow
+        // edges don't crawl when the camera moves
+        float texelSize = 2.0f * radius / (float)SHADOW_CASCADE_SIZE;
+        float x = std::floor(Vec3::Dot(right, sphereCenter) / texelSize) * texelSize;
+        float y = std::floor(Vec3::Dot(up, sphereCenter) / texelSize) * texelSize;
+        float depth = Vec3::Dot(forward, sphereCenter);
+        float nearDepth = std::floor(std::min(depth - radius, sceneNear) / texelSize) * texelSize;
+        float farDepth = std::ceil(std::min(depth + radius, sceneFar) / texelSize) * texelSize;
+        farDepth = std::max(farDepth, nearDepth + texelSize);
+
+        // Orthographic projection of the light space box
+        float depthScale = 2.0f / (farDepth - nearDepth);
+        Matrix4& cascade = info.cascades[i];
+        cascade = Matrix4::Identity();
+        cascade.data[0] = right.x / radius;
+        cascade.data[4] = right.y / radius;
+        cascade.data[8] = right.z / radius;
+        cascade.data[12] = -x / radius;
+        cascade.data[1] = up.x / radius;
+        cascade.data[5] = up.y / radius;
+        cascade.data[9] = up.z / radius;
+        cascade.data[13] = -y / radius;
+        cascade.data[2] = forward.x * depthScale;
+        cascade.data[6] = forward.y * depthScale;
+        cascade.data[10] = forward.z * depthScale;
+        cascade.data[14] = -nearDepth * depthScale - 1.0f;
+
+        info.bias[i] = SHADOW_CASCADE_BIAS * texelSize / (farDepth - nearDepth);
+    }
+}
+
+void Scene::InitCascadedDepthMap(CascadedDepthMapInfo& info) {
+    std::cout << "Creating Cascaded Light Depth Map (" << m_NumShadowCascades << " cascades)...\n";
+    if (info.shadowMapFBO) {
+        GL_CALL(glDeleteFramebuffers(1, &info.shadowMapFBO));
+        GL_CALL(glDeleteTextures(1, &info.shadowMapTexture));
+    }
+    if (info.staticFBO) {
+        GL_CALL(glDeleteFramebuffers(1, &info.staticFBO));
+        GL_CALL(glDeleteTextures(1, &info.staticTexture));
+        info.staticFBO = info.staticTexture = 0;
+    }
+    for (auto& cache : info.cache) cache = ShadowCache();
+
+    info.numCascades = m_NumShadowCascades;
+    createDepthMapArray(info.shadowMapFBO, info.shadowMapTexture, SHADOW_CASCADE_SIZE, SHADOW_CASCADE_SIZE, info.numCascades);
+    std::cout << "Done!\n";
+}
+
+void Scene::AllocateDirMoments() {
+    int numLayers = 0;
+    for (auto& light : m_DirLights) {
+        CascadedDepthMapInfo& info = light.depthMapInfo;
+        int lastLayer = info.momentLayer;
+        info.momentLayer = -1;
+        if (info.cast && light.active && info.mapType != SHADOW_MAP_DEPTH) {
+            info.momentLayer = numLayers;
+            numLayers += m_NumShadowCascades;
+        }
+        // The depth is drawn again, the moments with it
+        if (info.momentLayer >= 0 && (info.momentLayer != lastLayer || info.mapType != info.momentType)) {
+            for (auto& cache : info.cache) cache = ShadowCache();
+            info.momentType = info.mapType;
+        }
+    }
+    if (numLayers == m_DirMomentLayers) return;
+
+    if (m_DirMomentFBO) {
+        GL_CALL(glDeleteFramebuffers(1, &m_DirMomentFBO));
+        GL_CALL(glDeleteTextures(1, &m_DirMomentTexture));
+        m_DirMomentFBO = m_DirMomentTexture = 0;
+    }
+    m_DirMomentLayers = numLayers;
+    if (numLayers == 0) return;
+    std::cout << "Creating directional light moment maps (" << numLayers << " layers)...\n";
+    createMomentMapArray(m_DirMomentFBO, m_DirMomentTexture, SHADOW_CASCADE_SIZE / 2, numLayers);
+    for (auto& light : m_DirLights) {
+        if (light.depthMapInfo.momentLayer < 0) continue;
+        for (auto& cache : light.depthMapInfo.cache) cache = ShadowCache();
+    }
+    std::cout << "Done!\n";
+}
+
+bool Scene::DrawShadowMoments(const DrawContext& ctx, ShadowMapType type, GLuint depthTexture, GLenum depthTarget, int layer,
+                               const ShadowAtlas::Rect& depthRect, GLuint momentFBO, GLuint momentTexture, int momentLayer) {
+    assert(ctx.shadowMomentsShader);
+    int size = depthRect.size / 2;
+    if (size > m_MomentScratchSize) {
+        if (m_MomentScratchFBO) {
+            GL_CALL(glDeleteFramebuffers(1, &m_MomentScratchFBO));
+            GL_CALL(glDeleteTextures(1, &m_MomentScratchTexture));
+        }
+        m_MomentScratchSize = size;
+        GL_CALL(glGenTextures(1, &m_MomentScratchTexture));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, m_MomentScratchTexture));
+        GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size, size, 0, GL_RGBA, GL_FLOAT, NULL));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+        GL_CALL(glGenFramebuffers(1, &m_MomentScratchFBO));
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_MomentScratchFBO));
+        GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_MomentScratchTexture, 0));
+        assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    }
+
+    // The scratch texture is only bound once it's no longer drawn to
+    bool cascade = depthTarget == GL_TEXTURE_2D_ARRAY;
+    int depthUnit = m_NextActiveTexture++;
+    int scratchUnit = m_NextActiveTexture++;
+    TextureBindContext::Overwrite(depthUnit, depthTarget, depthTexture);
+    TextureBindContext::Overwrite(scratchUnit, GL_TEXTURE_2D, 0);
+    TextureBindContext::ApplyAll();
+
+    GL_CALL(glDisable(GL_DEPTH_TEST));
+    GL_CALL(glDisable(GL_CULL_FACE));
+    GL_CALL(glDisable(GL_BLEND));
+    GL_CALL(glBindVertexArray(m_QuadVAO));
+    Shader& shader = *ctx.shadowMomentsShader;
+    shader.Bind();
+    shader.BeginPass(cascade ? SHADER_FEATURE_DIR_SHADOWS : SHADER_FEATURE_SPOT_SHADOWS, ShaderSettings(), [&](Shader& variant) {
+        variant.SetInt("depthMap", depthUnit);
+        variant.SetInt("blurSource", scratchUnit);
+        variant.SetFloat("shadowNearPlane", SHADOW_NEAR);
+        variant.SetFloat("shadowFarPlane", SHADOW_FAR);
+    });
+    bool drawn = shader.SetMaterialFeatures(0);
+    if (drawn) {
+        shader.SetInt("mapType", type);
+        shader.SetInt("layer", layer);
+        shader.SetInt("tileSize", size);
+        shader.SetInt("blurRadius", m_MomentBlurRadius);
+
+        // Across, from the depth into the scratch texture
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_MomentScratchFBO));
+        GL_CALL(glViewport(0, 0, size, size));
+        shader.SetInt("fromDepth", 1);
+        shader.SetVec2("sourceOffset", { (float)depthRect.x, (float)depthRect.y });
+        shader.SetVec2("targetOffset", { 0.0f, 0.0f });
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+
+        // Down, into the tile of the moment map
+        TextureBindContext::Overwrite(scratchUnit, GL_TEXTURE_2D, m_MomentScratchTexture);
+        TextureBindContext::ApplyAll();
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, momentFBO));
+        if (cascade) {
+            GL_CALL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, momentTexture, 0, momentLayer));
+        }
+        GL_CALL(glViewport(depthRect.x / 2, depthRect.y / 2, size, size));
+        shader.SetInt("fromDepth", 0);
+        shader.SetVec2("sourceOffset", { 0.0f, 0.0f });
+        shader.SetVec2("targetOffset", { (float)(depthRect.x / 2), (float)(depthRect.y / 2) });
+        GL_CALL(glDrawArrays(GL_TRIANGLES, 0, 6));
+    }
+    shader.EndPass();
+    shader.Unbind();
+
+    GL_CALL(glBindVertexArray(0));
     GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    GL_CALL(glEnable(GL_DEPTH_TEST));
+    GL_CALL(glEnable(GL_CULL_FACE));
+    GL_CALL(glEnable(GL_BLEND));
+    return drawn;
 }
\ No newline at end of file
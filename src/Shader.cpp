@@ -1,12 +1,23 @@
 #include "Shader.h"
+#include "AssetWatcher.h"
+#include "Utils.h"
 
 #include <iostream>
 #include <assert.h>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <regex>
 
 #include <filesystem>
 namespace fs = std::filesystem;
 
 GLuint Shader::s_LastBound = 0;
+std::string Shader::s_BinaryCacheDir = "";
 
 std::string g_FallbackVertPath = "assets/shaders/basic.vert";
 std::string g_FallbackFragPath = "assets/shaders/basic.frag";
@@ -16,6 +27,53 @@ std::string g_2DVertPath = "assets/shaders/basic2d.vert";
 std::string g_2DFragPath = "assets/shaders/basic2d.frag";
 Shader* g_2DShader = NULL;
 
+// Indexed by bit position in ShaderFeature
+static const char* FEATURE_DEFINES[SHADER_FEATURE_COUNT] = {
+    "FEATURE_DIFFUSE_MAP",
+    "FEATURE_SPECULAR_MAP",
+    "FEATURE_AMBIENT_MAP",
+    "FEATURE_NORMAL_MAP",
+    "FEATURE_REFLECTION",
+    "FEATURE_ALPHA_TEST",
+    "FEATURE_DIR_SHADOWS",
+    "FEATURE_SPOT_SHADOWS",
+    "FEATURE_POINT_SHADOWS",
+    "FEATURE_PARABOLOID_SHADOWS",
+    "FEATURE_ADAPTIVE_SHADOWS",
+    "FEATURE_SHADOW_DEBUG",
+    "FEATURE_SHADOW_MASK",
+    "FEATURE_DIR_MOMENTS",
+    "FEATURE_SPOT_MOMENTS",
+    "FEATURE_GRASS_INSTANCES",
+};
+
+// Everything needed to compile one variant. Jobs given to the compile
+// thread are shared with it, their done/cancelled/program fields are
+// then guarded by g_CompileMutex.
+struct ShaderCompileJob {
+    ShaderVariant variant;
+    uint64_t variantKey = 0;
+    uint64_t binaryKey = 0;
+    uint32_t generation = 0;
+    bool isReload = false;
+    bool retrievable = false; // Set the binary retrievable hint before linking
+
+    std::string vertSrc, fragSrc, geoSrc;
+    GLuint vertShader = 0, fragShader = 0, geoShader = 0;
+    GLuint program = 0;
+
+    bool fromBinary = false; // Linked from the binary cache, nothing to wait for
+    bool onThread = false;
+    bool done = false;       // Compile thread finished, program is the result
+    bool cancelled = false;  // Nobody wants the result, compile thread deletes it
+};
+
+std::thread g_CompileThread;
+std::mutex g_CompileMutex;
+std::condition_variable g_CompileCondition;
+std::deque<std::shared_ptr<ShaderCompileJob>> g_CompileThreadQueue;
+bool g_CompileThreadRunning = false;
+
 std::string readFileString(const std::string& path) {
     std::ifstream file(path);
     assert(file.is_open() && "Failed to open file");
@@ -27,14 +85,60 @@ std::string readFileString(const std::string& path) {
     return buffer.str();
 }
 
+// Reads a shader stage, replacing #include "file" lines with the contents
+// of the file (relative to the including one). Each file is included once
+// per stage, which also stops include cycles.
+static std::string readShaderSource(const std::string& path, std::vector<std::string>& includes, std::set<std::string>& included) {
+    std::istringstream lines(readFileString(path));
+    std::string source;
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+            source += line + "\n";
+            continue;
+        }
+
+        size_t open = line.find('"', start);
+        size_t close = open == std::string::npos ? std::string::npos : line.find('"', open + 1);
+        if (close == std::string::npos) {
+            std::cerr << "Malformed #include in '" << path << "': " << line << "\n";
+            continue;
+        }
+
+        std::string includePath = assetPath(sameDirPath(path, line.substr(open + 1, close - open - 1)));
+        if (std::find(includes.begin(), includes.end(), includePath) == includes.end()) {
+            includes.push_back(includePath); // Watched even if missing, so creating it fixes the shader
+        }
+        if (!fs::exists(includePath)) {
+            // Leaves the symbols undefined so compiling fails, not the app
+            std::cerr << "Included file '" << includePath << "' not found in '" << path << "'\n";
+            continue;
+        }
+        if (included.insert(includePath).second) {
+            source += readShaderSource(includePath, includes, included);
+        }
+    }
+    return source;
+}
+
 Shader::Shader(const std::string& vertSrcPath, const std::string& fragSrcPath, const std::string& geoSrcPath, ShaderSettings settings)
     : m_HasGeoShader(fs::exists(geoSrcPath)) {
     m_VertPath = vertSrcPath;
     m_FragPath = fragSrcPath;
     m_GeoPath = geoSrcPath;
     Load(settings); // If fail, fallback shader will be used
+
+    // Editing any of the source files or their includes reloads the shader
+    m_WatchNode = "shader:" + assetPath(m_VertPath) + ";" + assetPath(m_FragPath) + (m_HasGeoShader ? ";" + assetPath(m_GeoPath) : "");
+    AssetWatcher::Get().SetDependencies(m_WatchNode, GetSourceFiles(m_Sources));
+    AssetWatcher::Get().Watch(m_WatchNode, [this]() {
+        HotReload(m_CurrentSettings);
+        AssetWatcher::Get().SetDependencies(m_WatchNode, GetSourceFiles(m_ReloadSources));
+    });
 }
 Shader::~Shader() {
+    AssetWatcher::Get().Unwatch(m_WatchNode);
     Unload();
 }
 
@@ -50,11 +154,135 @@ void Shader::Unbind() {
 void Shader::HotReload(ShaderSettings settings) {
     std::cout << "Attempting hot reload on shader\n";
 
-    bool result = Load(settings);
+    // Pressing reload again starts over with the latest sources
+    DeleteVariants(m_ReloadVariants);
+    m_CompileQueue.erase(std::remove_if(m_CompileQueue.begin(), m_CompileQueue.end(),
+        [](const QueuedCompile& queued) { return queued.isReload; }), m_CompileQueue.end());
+    m_ReloadGeneration++;
+
+    m_Reloading = true;
+    m_ReloadFailed = false;
+    m_ReloadSettings = settings;
+    m_ReloadSources = ReadSources();
+
+    // Everything that was in use, plus the default variant
+    std::vector<ShaderVariant> variants = { MaskVariant({ 0, settings }, m_ReloadSources) };
+    for (auto& [key, variantProgram] : m_Variants) {
+        variants.push_back(MaskVariant(variantProgram.variant, m_ReloadSources));
+    }
+
+    std::vector<QueuedCompile> reloads;
+    std::set<uint64_t> keys;
+    for (const ShaderVariant& variant : variants) {
+        if (!keys.insert(PackVariantKey(variant)).second) continue;
+        reloads.push_back({ variant, true });
+    }
+    m_ReloadPending = (int)reloads.size();
+
+    // Ahead of prewarming, the current variants are the ones in use
+    m_CompileQueue.insert(m_CompileQueue.begin(), reloads.begin(), reloads.end());
+}
+
+void Shader::BeginPass(uint32_t passFeatures, ShaderSettings passSettings, std::function<void(Shader&)> passUniforms) {
+    m_PassFeatures = passFeatures;
+    m_PassSettings = passSettings;
+    m_PassUniforms = passUniforms;
+    m_PassEpoch++;
+}
+void Shader::EndPass() {
+    m_PassFeatures = 0;
+    m_PassSettings = m_CurrentSettings;
+    m_PassUniforms = nullptr;
+    m_PassEpoch++;
+}
+
+bool Shader::SetMaterialFeatures(uint32_t materialFeatures) {
+    ShaderVariant variant;
+    variant.features = m_PassFeatures | materialFeatures;
+    variant.settings = m_PassSettings;
+
+    VariantProgram* variantProgram = ResolveVariant(variant);
+    if (!variantProgram) return false;
+
+    UseVariant(PackVariantKey(variantProgram->variant), *variantProgram);
+    return true;
+}
+
+void Shader::UseVariant(uint64_t key, VariantProgram& variantProgram) {
+    bool isBound = s_LastBound != 0 && s_LastBound == m_Program;
+    bool changed = m_Program != variantProgram.program;
+
+    m_CurrentKey = key;
+    m_Program = variantProgram.program;
+
+    if (isBound && changed) {
+        Bind();
+    }
+    if (isBound && variantProgram.passEpoch != m_PassEpoch) {
+        variantProgram.passEpoch = m_PassEpoch;
+        if (m_PassUniforms) m_PassUniforms(*this);
+    }
+}
+
+const ShaderVariant& Shader::GetVariant() const {
+    auto it = m_Variants.find(m_CurrentKey);
+    assert(it != m_Variants.end() && "No variant selected");
+    return it->second.variant;
+}
+
+VertexStream Shader::GetVertexStream() const {
+    const uint32_t positionAndUV = (1u << 0) | (1u << 2);
+    const uint32_t perVertex = (1u << FIRST_INSTANCE_LOCATION) - 1;
+    if ((m_Sources.vertexInputs & perVertex & ~positionAndUV) != 0) return VERTEX_STREAM_FULL;
+    return (GetVariant().features & SHADER_FEATURE_ALPHA_TEST) ? VERTEX_STREAM_POSITION_UV : VERTEX_STREAM_POSITION;
+}
 
-    if (!result) {
-        std::cerr << "Hot reload failed; fallback basic shader.\n";
+void Shader::Prewarm(uint32_t features, ShaderSettings settings) {
+    ShaderVariant variant = MaskVariant({ features, settings }, m_Sources);
+    uint64_t key = PackVariantKey(variant);
+    if (m_Variants.find(key) != m_Variants.end() || IsCompiling(key)) return;
+    for (const QueuedCompile& queued : m_CompileQueue) {
+        if (!queued.isReload && PackVariantKey(queued.variant) == key) return;
     }
+    m_CompileQueue.push_back({ variant, false });
+}
+
+void Shader::PollCompiles(int maxNewCompiles) {
+    // Collect first, finishing a reload changes what's in flight
+    std::vector<std::shared_ptr<ShaderCompileJob>> finished;
+    for (auto it = m_Compiling.begin(); it != m_Compiling.end();) {
+        if (IsCompileDone(**it)) {
+            finished.push_back(*it);
+            it = m_Compiling.erase(it);
+        } else {
+            it++;
+        }
+    }
+    for (auto& job : finished) {
+        FinishVariantCompile(*job);
+    }
+
+    int started = 0;
+    while (started < maxNewCompiles && !m_CompileQueue.empty()) {
+        QueuedCompile queued = m_CompileQueue.front();
+        m_CompileQueue.erase(m_CompileQueue.begin());
+
+        if (!queued.isReload) {
+            uint64_t key = PackVariantKey(queued.variant);
+            if (m_Variants.find(key) != m_Variants.end() || IsCompiling(key)) continue;
+            std::cout << "Prewarming shader variant\n";
+        }
+        m_Compiling.push_back(StartVariantCompile(queued.variant, queued.isReload));
+        started++;
+    }
+}
+
+int Shader::LightCountBucket(int numLights) {
+    // Starts at 2, single element light arrays crash the
+    // shader compiler of Mesa's llvmpipe (22.3).
+    int bucket = 2;
+    while (bucket < numLights) bucket *= 2;
+    return bucket;
 }
 
 void Shader::SetInt(const std::string& field, int value) {
@@ -81,6 +309,10 @@ void Shader::SetVec4(const std::string& field, Vec4 value) {
     assert(s_LastBound == m_Program && "Shader is not bound");
     GL_CALL(glUniform4f(GetLocation(field), value.x, value.y, value.z, value.w));
 }
+void Shader::SetMat3(const std::string& field, Matrix3 value) {
+    assert(s_LastBound == m_Program && "Shader is not bound");
+    GL_CALL(glUniformMatrix3fv(GetLocation(field), 1, GL_FALSE, value.data));
+}
 void Shader::SetMat4(const std::string& field, Matrix4 value) {
     assert(s_LastBound == m_Program && "Shader is not bound");
     GL_CALL(glUniformMatrix4fv(GetLocation(field), 1, GL_FALSE, value.data));
@@ -100,102 +332,566 @@ bool Shader::Load(ShaderSettings settings) {
     assert(settings.maxNumDirLights > 0 && settings.maxNumPointLights > 0 && settings.maxNumSpotLights > 0);
 
     m_CurrentSettings = settings;
+    m_PassSettings = settings;
 
     std::cout << "Loading shader from '" << m_VertPath << "' and '" << m_FragPath << "'\n";
 
-    GLuint vertexShader;
-    std::string vertSrc = readFileString(m_VertPath);
-    if (!ProcessSource(vertSrc, settings)) return false;
-    GL_CALL(vertexShader = glCreateShader(GL_VERTEX_SHADER));
-    const GLchar* vertSrcPtr = vertSrc.c_str();
-    GL_CALL(glShaderSource(vertexShader, 1, &vertSrcPtr, NULL));
-    GL_CALL(glCompileShader(vertexShader));
+    m_Sources = ReadSources();
+
+    // Nothing is rendering yet, so wait for the default variant
+    std::shared_ptr<ShaderCompileJob> job = StartVariantCompile(MaskVariant({ 0, settings }, m_Sources), false);
+    while (!IsCompileDone(*job)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    VariantProgram* variantProgram = FinishVariantCompile(*job);
 
+    m_CurrentKey = job->variantKey;
+    m_Program = variantProgram->program;
 
-    GLuint fragmentShader;
-    std::string fragSrc = readFileString(m_FragPath);
-    if (!ProcessSource(fragSrc, settings)) return false;
-    const GLchar* fragSrcPtr = fragSrc.c_str();
-    GL_CALL(fragmentShader = glCreateShader(GL_FRAGMENT_SHADER));
-    GL_CALL(glShaderSource(fragmentShader, 1, &fragSrcPtr, NULL));
-    GL_CALL(glCompileShader(fragmentShader));
+    return !variantProgram->isFallback;
+}
 
-    GLuint geoShader = 0;
+Shader::Sources Shader::ReadSources() {
+    Sources sources;
+    std::set<std::string> vertIncluded, fragIncluded, geoIncluded;
+    sources.vert = readShaderSource(m_VertPath, sources.includes, vertIncluded);
+    sources.frag = readShaderSource(m_FragPath, sources.includes, fragIncluded);
     if (m_HasGeoShader) {
         std::cout << "Has geometry shader: " << m_GeoPath << "\n";
-        std::string geoSrc = readFileString(m_GeoPath);
-        if (!ProcessSource(geoSrc, settings)) return false;
-        GL_CALL(geoShader = glCreateShader(GL_GEOMETRY_SHADER));
-        const GLchar* geoSrcPtr = geoSrc.c_str();
-        GL_CALL(glShaderSource(geoShader, 1, &geoSrcPtr, NULL));
-        GL_CALL(glCompileShader(geoShader));
+        sources.geo = readShaderSource(m_GeoPath, sources.includes, geoIncluded);
     }
 
+    // Only features and light counts the sources mention are part of the
+    // variant key, so e.g. the depth shaders don't get a variant per light
+    // count.
+    std::string all = sources.vert + sources.frag + sources.geo;
+    for (int i = 0; i < SHADER_FEATURE_COUNT; i++) {
+        if (all.find(FEATURE_DEFINES[i]) != std::string::npos) sources.usedFeatures |= (1u << i);
+    }
+    sources.usesPointLights = all.find("##MAX_NUM_POINTLIGHTS") != std::string::npos;
+    sources.usesDirLights = all.find("##MAX_NUM_DIRLIGHTS") != std::string::npos;
+    sources.usesSpotLights = all.find("##MAX_NUM_SPOTLIGHTS") != std::string::npos;
+    sources.usesShadowFilters = all.find("SHADOW_FILTER") != std::string::npos;
+
+    static const std::regex vertexInput(R"(layout\s*\(\s*location\s*=\s*(\d+)\s*\)\s*in\s)");
+    for (auto it = std::sregex_iterator(sources.vert.begin(), sources.vert.end(), vertexInput); it != std::sregex_iterator(); ++it) {
+        sources.vertexInputs |= 1u << std::stoi((*it)[1].str());
+    }
 
-    bool anyError = false;
+    return sources;
+}
 
-    GLint success;
-    GLchar infoLog[512];
+std::vector<std::string> Shader::GetSourceFiles(const Sources& sources) const {
+    std::vector<std::string> files = { assetPath(m_VertPath), assetPath(m_FragPath) };
+    if (m_HasGeoShader) files.push_back(assetPath(m_GeoPath));
+    files.insert(files.end(), sources.includes.begin(), sources.includes.end());
+    return files;
+}
 
-    GL_CALL(glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success));
-    if(!success) {
-        GL_CALL(glGetShaderInfoLog(vertexShader, 512, NULL, infoLog));
-        std::cerr << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-        anyError = true;
+ShaderVariant Shader::MaskVariant(ShaderVariant variant, const Sources& sources) const {
+    variant.features &= sources.usedFeatures;
+    if (!sources.usesPointLights) variant.settings.maxNumPointLights = 1;
+    if (!sources.usesDirLights) variant.settings.maxNumDirLights = 1;
+    if (!sources.usesSpotLights) variant.settings.maxNumSpotLights = 1;
+    if (!sources.usesShadowFilters) variant.settings.shadowFilters = ShadowFilters();
+    return variant;
+}
+
+// The variant key has a byte per light count
+static const int MAX_LIGHT_COUNT_BUCKET = 128;
+
+static bool sameShadowFilters(const ShadowFilters& a, const ShadowFilters& b) {
+    return a.dir == b.dir && a.spot == b.spot && a.point == b.point;
+}
+
+uint64_t Shader::PackVariantKey(const ShaderVariant& variant) const {
+    const ShaderSettings& settings = variant.settings;
+    assert(settings.maxNumPointLights < 256 && settings.maxNumDirLights < 256 && settings.maxNumSpotLights < 256);
+
+    // The three tiers in the last byte
+    const ShadowFilters& filters = settings.shadowFilters;
+    uint64_t filterIndex = ((uint64_t)filters.point * SHADOW_FILTER_COUNT + filters.spot) * SHADOW_FILTER_COUNT + filters.dir;
+    static_assert(SHADOW_FILTER_COUNT * SHADOW_FILTER_COUNT * SHADOW_FILTER_COUNT <= 256, "Shadow filters don't fit the variant key");
+
+    return (uint64_t)variant.features
+        | ((uint64_t)settings.maxNumPointLights << 32)
+        | ((uint64_t)settings.maxNumDirLights << 40)
+        | ((uint64_t)settings.maxNumSpotLights << 48)
+        | (filterIndex << 56);
+}
+
+Shader::VariantProgram* Shader::ResolveVariant(const ShaderVariant& wanted) {
+    ShaderVariant variant = MaskVariant(wanted, m_Sources);
+    uint64_t key = PackVariantKey(variant);
+
+    auto it = m_Variants.find(key);
+    if (it != m_Variants.end()) return &it->second;
+
+    // A variant with the same features and room for more lights gives the
+    // same result, use the tightest one and compile the exact one later.
+    VariantProgram* best = NULL;
+    int bestTotal = 0;
+    for (auto& [otherKey, other] : m_Variants) {
+        const ShaderSettings& s = other.variant.settings;
+        if (other.variant.features != variant.features || other.isFallback) continue;
+        if (!sameShadowFilters(s.shadowFilters, variant.settings.shadowFilters)) continue;
+        if (s.maxNumPointLights < variant.settings.maxNumPointLights
+            || s.maxNumDirLights < variant.settings.maxNumDirLights
+            || s.maxNumSpotLights < variant.settings.maxNumSpotLights) continue;
+
+        int total = s.maxNumPointLights + s.maxNumDirLights + s.maxNumSpotLights;
+        if (!best || total < bestTotal) {
+            best = &other;
+            bestTotal = total;
+        }
+    }
+    if (best) {
+        Prewarm(variant.features, variant.settings);
+        return best;
     }
 
-    GL_CALL(glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success));
-    if(!success) {
-        GL_CALL(glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog));
-        std::cerr << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-        anyError = true;
+    // Nothing usable, start compiling it now and skip drawing until it's done
+    if (IsCompiling(key)) return NULL;
+
+    // Light counts tend to grow one at a time, so have the next
+    // bucket up ready before it's needed. There is none past the
+    // largest bucket the key holds.
+    if (m_Sources.usesPointLights || m_Sources.usesDirLights || m_Sources.usesSpotLights) {
+        ShaderSettings nextSettings = variant.settings;
+        nextSettings.maxNumPointLights = std::min(nextSettings.maxNumPointLights * 2, MAX_LIGHT_COUNT_BUCKET);
+        nextSettings.maxNumDirLights = std::min(nextSettings.maxNumDirLights * 2, MAX_LIGHT_COUNT_BUCKET);
+        nextSettings.maxNumSpotLights = std::min(nextSettings.maxNumSpotLights * 2, MAX_LIGHT_COUNT_BUCKET);
+        if (PackVariantKey(MaskVariant({ variant.features, nextSettings }, m_Sources)) != key) {
+            Prewarm(variant.features, nextSettings);
+        }
     }
 
+    std::shared_ptr<ShaderCompileJob> job = StartVariantCompile(variant, false);
+    // Compiling without a thread or with a driver that
+    // compiles right away is done already, so use it.
+    if (IsCompileDone(*job)) return FinishVariantCompile(*job);
+
+    m_Compiling.push_back(job);
+    return NULL;
+}
+
+bool Shader::IsCompiling(uint64_t variantKey) const {
+    for (auto& job : m_Compiling) {
+        if (!job->isReload && job->variantKey == variantKey) return true;
+    }
+    return false;
+}
+
+std::shared_ptr<ShaderCompileJob> Shader::StartVariantCompile(const ShaderVariant& variant, bool isReload) {
+    const Sources& sources = isReload ? m_ReloadSources : m_Sources;
+
+    std::shared_ptr<ShaderCompileJob> job = std::make_shared<ShaderCompileJob>();
+    job->variant = variant;
+    job->variantKey = PackVariantKey(variant);
+    job->isReload = isReload;
+    job->generation = isReload ? m_ReloadGeneration : m_SourceGeneration;
+    job->retrievable = getGLExtensions().programBinary && !s_BinaryCacheDir.empty();
+
+    job->vertSrc = sources.vert;
+    job->fragSrc = sources.frag;
+    ProcessSource(job->vertSrc, variant);
+    ProcessSource(job->fragSrc, variant);
     if (m_HasGeoShader) {
-        GL_CALL(glGetShaderiv(geoShader, GL_COMPILE_STATUS, &success));
-        if(!success) {
-            GL_CALL(glGetShaderInfoLog(geoShader, 512, NULL, infoLog));
-            std::cerr << "ERROR::SHADER::GEOMETRY::COMPILATION_FAILED\n" << infoLog << std::endl;
-            anyError = true;
-        }
+        job->geoSrc = sources.geo;
+        ProcessSource(job->geoSrc, variant);
+    }
+
+    job->binaryKey = ComputeBinaryKey(job->vertSrc, job->fragSrc, job->geoSrc, variant.settings);
+    job->program = LoadProgramBinary(job->variantKey, job->binaryKey);
+    if (job->program) {
+        std::cout << "Using cached program binary\n";
+        job->fromBinary = true;
+        return job;
     }
 
-    if (anyError) {
-        GL_CALL(glDeleteShader(vertexShader));
-        GL_CALL(glDeleteShader(fragmentShader));
-        if (m_HasGeoShader) { GL_CALL(glDeleteShader(geoShader)); }
+    if (g_CompileThreadRunning) {
+        job->onThread = true;
+        std::lock_guard<std::mutex> lock(g_CompileMutex);
+        g_CompileThreadQueue.push_back(job);
+        g_CompileCondition.notify_one();
     } else {
-        GL_CALL(m_Program = glCreateProgram());
-        GL_CALL(glAttachShader(m_Program, vertexShader));
-        GL_CALL(glAttachShader(m_Program, fragmentShader));
-        if (m_HasGeoShader) { GL_CALL(glAttachShader(m_Program, geoShader)); }
-        GL_CALL(glLinkProgram(m_Program));
-
-        GL_CALL(glGetProgramiv(m_Program, GL_LINK_STATUS, &success));
-        if(!success) {
-            GL_CALL(glGetProgramInfoLog(m_Program, 512, NULL, infoLog));
-            std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-            GL_CALL(glDeleteProgram(m_Program));
-            anyError = true;
+        StartCompile(*job);
+    }
+
+    return job;
+}
+
+Shader::VariantProgram* Shader::FinishVariantCompile(ShaderCompileJob& job) {
+    // The compile thread already finished it
+    GLuint program = job.onThread ? job.program : FinishCompile(job);
+
+    uint32_t generation = job.isReload ? m_ReloadGeneration : m_SourceGeneration;
+    if (job.generation != generation) {
+        // Compiled from sources that have been reloaded since
+        GL_CALL(glDeleteProgram(program));
+        return NULL;
+    }
+
+    if (program && !job.fromBinary) SaveProgramBinary(program, job.variantKey, job.binaryKey);
+
+    if (job.isReload) {
+        if (!program) {
+            // One broken variant fails the whole reload, drop the rest
+            m_ReloadFailed = true;
+            m_ReloadGeneration++;
+            m_CompileQueue.erase(std::remove_if(m_CompileQueue.begin(), m_CompileQueue.end(),
+                [](const QueuedCompile& queued) { return queued.isReload; }), m_CompileQueue.end());
+            FinishReload();
+            return NULL;
         }
 
-        GL_CALL(glDeleteShader(vertexShader));
-        GL_CALL(glDeleteShader(fragmentShader));
-        if (m_HasGeoShader) { GL_CALL(glDeleteShader(geoShader)); }
+        VariantProgram& variantProgram = m_ReloadVariants[job.variantKey];
+        variantProgram.variant = job.variant;
+        variantProgram.program = program;
+        if (--m_ReloadPending == 0) FinishReload();
+        return NULL;
     }
 
-    if (!anyError) {
-        std::cout << "Shader Loading OK!\n";
+    VariantProgram& variantProgram = m_Variants[job.variantKey];
+    variantProgram.variant = job.variant;
+    variantProgram.passEpoch = 0;
+    if (program) {
+        std::cout << "Shader Loading OK! (variant " << std::hex << job.variantKey << std::dec << ")\n";
+        variantProgram.program = program;
+        variantProgram.isFallback = false;
     } else {
         std::cout << "Fallback shader used\n";
+        variantProgram.program = Shader::Basic().m_Program;
+        variantProgram.isFallback = true;
+    }
+
+    return &variantProgram;
+}
 
-        m_Program = Shader::Basic().m_Program;
+void Shader::FinishReload() {
+    m_Reloading = false;
+
+    if (m_ReloadFailed) {
+        std::cerr << "Hot reload failed; keeping the previous shader.\n";
+        DeleteVariants(m_ReloadVariants);
+        return;
+    }
+
+    bool isBound = s_LastBound != 0 && s_LastBound == m_Program;
+
+    DeleteVariants(m_Variants);
+    m_Variants.swap(m_ReloadVariants);
+    m_Sources = m_ReloadSources;
+    m_CurrentSettings = m_ReloadSettings;
+    m_PassSettings = m_ReloadSettings;
+    m_SourceGeneration++;
+
+    // Queued prewarms were masked for the old sources
+    for (QueuedCompile& queued : m_CompileQueue) {
+        queued.variant = MaskVariant(queued.variant, m_Sources);
+    }
+
+    m_CurrentKey = PackVariantKey(MaskVariant({ 0, m_CurrentSettings }, m_Sources));
+    m_Program = m_Variants[m_CurrentKey].program;
+    if (isBound) Bind();
+
+    std::cout << "Hot reload OK! (" << m_Variants.size() << " variants)\n";
+}
+
+void Shader::DeleteVariants(std::map<uint64_t, VariantProgram>& variants) {
+    for (auto& [key, variantProgram] : variants) {
+        // Fallback program is owned by the fallback shader
+        if (!variantProgram.isFallback) {
+            GL_CALL(glDeleteProgram(variantProgram.program));
+        }
+    }
+    variants.clear();
+}
+
+void Shader::StartCompile(ShaderCompileJob& job) {
+    const GLchar* vertSrcPtr = job.vertSrc.c_str();
+    GL_CALL(job.vertShader = glCreateShader(GL_VERTEX_SHADER));
+    GL_CALL(glShaderSource(job.vertShader, 1, &vertSrcPtr, NULL));
+    GL_CALL(glCompileShader(job.vertShader));
+
+    const GLchar* fragSrcPtr = job.fragSrc.c_str();
+    GL_CALL(job.fragShader = glCreateShader(GL_FRAGMENT_SHADER));
+    GL_CALL(glShaderSource(job.fragShader, 1, &fragSrcPtr, NULL));
+    GL_CALL(glCompileShader(job.fragShader));
+
+    if (!job.geoSrc.empty()) {
+        const GLchar* geoSrcPtr = job.geoSrc.c_str();
+        GL_CALL(job.geoShader = glCreateShader(GL_GEOMETRY_SHADER));
+        GL_CALL(glShaderSource(job.geoShader, 1, &geoSrcPtr, NULL));
+        GL_CALL(glCompileShader(job.geoShader));
+    }
+
+    // Querying the compile status would wait for the compile, so link
+    // right away and look at the shaders only if linking failed.
+    GL_CALL(job.program = glCreateProgram());
+    GL_CALL(glAttachShader(job.program, job.vertShader));
+    GL_CALL(glAttachShader(job.program, job.fragShader));
+    if (job.geoShader) { GL_CALL(glAttachShader(job.program, job.geoShader)); }
+    if (job.retrievable) {
+        GL_CALL(glProgramParameteri(job.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+    }
+    GL_CALL(glLinkProgram(job.program));
+}
+
+bool Shader::IsCompileDone(ShaderCompileJob& job) {
+    if (job.fromBinary) return true;
+
+    if (job.onThread) {
+        std::lock_guard<std::mutex> lock(g_CompileMutex);
+        return job.done;
+    }
+
+    if (!getGLExtensions().parallelShaderCompile) return true;
+
+    GLint done = GL_FALSE;
+    GL_CALL(glGetProgramiv(job.program, GL_COMPLETION_STATUS_KHR, &done));
+    return done == GL_TRUE;
+}
+
+GLuint Shader::FinishCompile(ShaderCompileJob& job) {
+    if (job.fromBinary) return job.program;
+
+    GLint success;
+    GLchar infoLog[512];
+
+    GL_CALL(glGetProgramiv(job.program, GL_LINK_STATUS, &success));
+    if (!success) {
+        struct { GLuint shader; const char* name; } stages[] = {
+            { job.vertShader, "VERTEX" }, { job.fragShader, "FRAGMENT" }, { job.geoShader, "GEOMETRY" },
+        };
+
+        bool anyCompileError = false;
+        for (auto& stage : stages) {
+            if (!stage.shader) continue;
+            GL_CALL(glGetShaderiv(stage.shader, GL_COMPILE_STATUS, &success));
+            if (!success) {
+                GL_CALL(glGetShaderInfoLog(stage.shader, 512, NULL, infoLog));
+                std::cerr << "ERROR::SHADER::" << stage.name << "::COMPILATION_FAILED\n" << infoLog << std::endl;
+                anyCompileError = true;
+            }
+        }
+        if (!anyCompileError) {
+            GL_CALL(glGetProgramInfoLog(job.program, 512, NULL, infoLog));
+            std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        }
+
+        GL_CALL(glDeleteProgram(job.program));
+        job.program = 0;
     }
 
-    return !anyError;
+    GL_CALL(glDeleteShader(job.vertShader));
+    GL_CALL(glDeleteShader(job.fragShader));
+    if (job.geoShader) { GL_CALL(glDeleteShader(job.geoShader)); }
+    job.vertShader = job.fragShader = job.geoShader = 0;
+
+    return job.program;
 }
+
+void Shader::CancelCompile(ShaderCompileJob& job) {
+    if (job.onThread) {
+        std::lock_guard<std::mutex> lock(g_CompileMutex);
+        if (!job.done) {
+            job.cancelled = true;
+            return;
+        }
+    }
+
+    // Deleting zero is ignored, so this covers every stage the job is in
+    GL_CALL(glDeleteProgram(job.program));
+    GL_CALL(glDeleteShader(job.vertShader));
+    GL_CALL(glDeleteShader(job.fragShader));
+    GL_CALL(glDeleteShader(job.geoShader));
+    job.program = job.vertShader = job.fragShader = job.geoShader = 0;
+}
+
+void Shader::CompileThreadMain(std::function<void()> makeContextCurrent, std::function<void()> releaseContext) {
+    makeContextCurrent();
+
+    while (true) {
+        std::shared_ptr<ShaderCompileJob> job;
+        {
+            std::unique_lock<std::mutex> lock(g_CompileMutex);
+            g_CompileCondition.wait(lock, [] { return !g_CompileThreadRunning || !g_CompileThreadQueue.empty(); });
+            if (!g_CompileThreadRunning) break;
+
+            job = g_CompileThreadQueue.front();
+            g_CompileThreadQueue.pop_front();
+            if (job->cancelled) continue;
+        }
+
+        StartCompile(*job);
+        GLuint program = FinishCompile(*job);
+        // The main context may only use the program once it's complete
+        GL_CALL(glFinish());
+
+        std::lock_guard<std::mutex> lock(g_CompileMutex);
+        if (job->cancelled) {
+            GL_CALL(glDeleteProgram(program));
+        } else {
+            job->program = program;
+            job->done = true;
+        }
+    }
+
+    releaseContext();
+}
+
+void Shader::StartCompileThread(std::function<void()> makeContextCurrent, std::function<void()> releaseContext) {
+    assert(!g_CompileThreadRunning && "Compile thread already running");
+
+    g_CompileThreadRunning = true;
+    g_CompileThread = std::thread(CompileThreadMain, makeContextCurrent, releaseContext);
+
+    std::cout << "Compiling shaders on a separate thread\n";
+}
+
+void Shader::StopCompileThread() {
+    if (!g_CompileThreadRunning) return;
+    {
+        std::lock_guard<std::mutex> lock(g_CompileMutex);
+        g_CompileThreadRunning = false;
+    }
+    g_CompileCondition.notify_one();
+    g_CompileThread.join();
+}
+
+// 64-bit FNV-1a, good enough to tell sources and drivers apart
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+static uint64_t hashString(uint64_t hash, const std::string& str) {
+    // Include the terminator so "ab"+"c" and "a"+"bc" differ
+    return hashBytes(hash, str.c_str(), str.size() + 1);
+}
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+
+uint64_t Shader::ComputeBinaryKey(const std::string& vertSrc, const std::string& fragSrc, const std::string& geoSrc, ShaderSettings settings) const {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    hash = hashString(hash, vertSrc);
+    hash = hashString(hash, fragSrc);
+    hash = hashString(hash, geoSrc);
+
+    int settingValues[] = { settings.maxNumPointLights, settings.maxNumDirLights, settings.maxNumSpotLights,
+                            settings.shadowFilters.dir, settings.shadowFilters.spot, settings.shadowFilters.point };
+    hash = hashBytes(hash, settingValues, sizeof(settingValues));
+
+    // A driver update invalidates every binary
+    const char* driverStrings[] = {
+        (const char*)glGetString(GL_VENDOR),
+        (const char*)glGetString(GL_RENDERER),
+        (const char*)glGetString(GL_VERSION),
+    };
+    for (const char* str : driverStrings) {
+        hash = hashString(hash, str ? str : "");
+    }
+
+    return hash;
+}
+
+std::string Shader::GetBinaryCachePath(uint64_t variantKey) const {
+    // Named after the source files and variant so a variant always
+    // overwrites its own stale binary instead of leaving old ones behind.
+    uint64_t nameHash = hashString(hashString(hashString(FNV_OFFSET_BASIS, m_VertPath), m_FragPath), m_GeoPath);
+
+    std::stringstream ss;
+    ss << s_BinaryCacheDir << "/" << fs::path(m_FragPath).stem().string() << "-" << std::hex << nameHash << "-" << variantKey << ".bin";
+    return ss.str();
+}
+
+struct ProgramBinaryHeader {
+    char magic[4];
+    uint64_t key;
+    GLenum format;
+    GLsizei length;
+};
+static const char PROGRAM_BINARY_MAGIC[4] = { 'G', 'L', 'P', 'B' };
+
+GLuint Shader::LoadProgramBinary(uint64_t variantKey, uint64_t key) {
+    if (!getGLExtensions().programBinary || s_BinaryCacheDir.empty()) return 0;
+
+    std::string path = GetBinaryCachePath(variantKey);
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) return 0;
+
+    ProgramBinaryHeader header;
+    file.read((char*)&header, sizeof(header));
+    if (!file || memcmp(header.magic, PROGRAM_BINARY_MAGIC, sizeof(PROGRAM_BINARY_MAGIC)) != 0 || header.length <= 0) {
+        std::cout << "Discarding corrupt program binary '" << path << "'\n";
+        return 0;
+    }
+    if (header.key != key) {
+        std::cout << "Program binary out of date, recompiling\n";
+        return 0;
+    }
+
+    std::vector<char> binary(header.length);
+    file.read(binary.data(), header.length);
+    if (!file) return 0;
+
+    GLuint program;
+    GL_CALL(program = glCreateProgram());
+    GL_CALL(glProgramBinary(program, header.format, binary.data(), header.length));
+
+    // The driver may reject binaries for its own reasons, just recompile
+    GLint success;
+    GL_CALL(glGetProgramiv(program, GL_LINK_STATUS, &success));
+    if (!success) {
+        std::cout << "Driver rejected program binary, recompiling\n";
+        GL_CALL(glDeleteProgram(program));
+        return 0;
+    }
+
+    return program;
+}
+
+void Shader::SaveProgramBinary(GLuint program, uint64_t variantKey, uint64_t key) {
+    if (!getGLExtensions().programBinary || s_BinaryCacheDir.empty()) return;
+
+    GLint length = 0;
+    GL_CALL(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length));
+    if (length <= 0) return;
+
+    // Zeroed padding keeps the files the same for the same binary
+    ProgramBinaryHeader header = {};
+    memcpy(header.magic, PROGRAM_BINARY_MAGIC, sizeof(PROGRAM_BINARY_MAGIC));
+    header.key = key;
+
+    std::vector<char> binary(length);
+    GL_CALL(glGetProgramBinary(program, length, &header.length, &header.format, binary.data()));
+    if (header.length <= 0) return;
+
+    std::error_code error;
+    fs::create_directories(s_BinaryCacheDir, error);
+
+    std::string path = GetBinaryCachePath(variantKey);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Failed writing program binary '" << path << "'\n";
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write(binary.data(), header.length);
+}
+
 void Shader::Unload() {
-    GL_CALL(glDeleteProgram(m_Program));
+    for (auto& job : m_Compiling) {
+        CancelCompile(*job);
+    }
+    m_Compiling.clear();
+    m_CompileQueue.clear();
+
+    DeleteVariants(m_Variants);
+    DeleteVariants(m_ReloadVariants);
 }
 
 void tryReplaceAllInString(std::string& str, const std::string& oldSubstr, const std::string& newSubstr) {
@@ -206,11 +902,27 @@ void tryReplaceAllInString(std::string& str, const std::string& oldSubstr, const
     }
 }
 
-bool Shader::ProcessSource(std::string& src, ShaderSettings settings) {
+bool Shader::ProcessSource(std::string& src, const ShaderVariant& variant) {
 
-    tryReplaceAllInString(src, "##MAX_NUM_POINTLIGHTS", std::to_string(settings.maxNumPointLights));
-    tryReplaceAllInString(src, "##MAX_NUM_DIRLIGHTS", std::to_string(settings.maxNumDirLights));
-    tryReplaceAllInString(src, "##MAX_NUM_SPOTLIGHTS", std::to_string(settings.maxNumSpotLights));
+    tryReplaceAllInString(src, "##MAX_NUM_POINTLIGHTS", std::to_string(variant.settings.maxNumPointLights));
+    tryReplaceAllInString(src, "##MAX_NUM_DIRLIGHTS", std::to_string(variant.settings.maxNumDirLights));
+    tryReplaceAllInString(src, "##MAX_NUM_SPOTLIGHTS", std::to_string(variant.settings.maxNumSpotLights));
+
+    // Feature defines go right after #version, which must stay first
+    std::string defines;
+    for (int i = 0; i < SHADER_FEATURE_COUNT; i++) {
+        if (variant.features & (1u << i)) {
+            defines += std::string("#define ") + FEATURE_DEFINES[i] + "\n";
+        }
+    }
+    const ShadowFilters& filters = variant.settings.shadowFilters;
+    defines += "#define DIR_SHADOW_FILTER " + std::to_string(filters.dir) + "\n";
+    defines += "#define SPOT_SHADOW_FILTER " + std::to_string(filters.spot) + "\n";
+    defines += "#define POINT_SHADOW_FILTER " + std::to_string(filters.point) + "\n";
+    size_t versionPos = src.find("#version");
+    size_t insertPos = versionPos == std::string::npos ? 0 : src.find('\n', versionPos);
+    insertPos = insertPos == std::string::npos ? src.size() : insertPos + 1;
+    src.insert(insertPos, defines);
 
     return true;
 }
@@ -227,4 +939,8 @@ Shader& Shader::Basic2D() {
         g_2DShader = new Shader(g_2DVertPath, g_2DFragPath);
     }
     return *g_2DShader;
+}
+
+void Shader::SetBinaryCacheDirectory(const std::string& dir) {
+    s_BinaryCacheDir = dir;
 }
\ No newline at end of file
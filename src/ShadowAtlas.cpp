@@ -0,0 +1,170 @@
+#include "ShadowAtlas.h"
+
+#include <assert.h>
+#include <iostream>
+#include <algorithm>
+
+#include "GLutils.h"
+
+struct DepthFormat {
+    GLint internalFormat;
+    GLenum type;
+    int bytesPerTexel;
+};
+static const DepthFormat DEPTH_FORMATS[] = {
+    { GL_DEPTH_COMPONENT16,  GL_UNSIGNED_SHORT, 2 }, // SHADOW_DEPTH_16
+    { GL_DEPTH_COMPONENT24,  GL_UNSIGNED_INT,   4 }, // SHADOW_DEPTH_24
+    { GL_DEPTH_COMPONENT32F, GL_FLOAT,          4 }, // SHADOW_DEPTH_32F
+};
+
+static void createAtlasTexture(GLuint& fbo, GLuint& texture, int size, const DepthFormat& format) {
+    GL_CALL(glGenTextures(1, &texture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, texture));
+    GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, format.internalFormat, size, size, 0, GL_DEPTH_COMPONENT, format.type, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+    GL_CALL(glGenFramebuffers(1, &fbo));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0));
+    GL_CALL(glDrawBuffer(GL_NONE));
+    GL_CALL(glReadBuffer(GL_NONE));
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+// Moments of a tile are made by Scene::DrawShadowMoments(), which draws
+// the first level, the others are generated
+static void createMomentTexture(GLuint& fbo, GLuint& texture, int size) {
+    GL_CALL(glGenTextures(1, &texture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, texture));
+    GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size, size, 0, GL_RGBA, GL_FLOAT, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ShadowAtlas::MOMENT_MIP_LEVELS - 1));
+    GL_CALL(glGenerateMipmap(GL_TEXTURE_2D));
+
+    GL_CALL(glGenFramebuffers(1, &fbo));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0));
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+ShadowAtlas::~ShadowAtlas() {
+    Destroy();
+}
+
+void ShadowAtlas::Destroy() {
+    if (m_FBO != 0) {
+        glDeleteFramebuffers(1, &m_FBO);
+        glDeleteTextures(1, &m_Texture);
+        m_FBO = m_Texture = 0;
+    }
+    if (m_StaticFBO != 0) {
+        glDeleteFramebuffers(1, &m_StaticFBO);
+        glDeleteTextures(1, &m_StaticTexture);
+        m_StaticFBO = m_StaticTexture = 0;
+    }
+    if (m_MomentFBO != 0) {
+        glDeleteFramebuffers(1, &m_MomentFBO);
+        glDeleteTextures(1, &m_MomentTexture);
+        m_MomentFBO = m_MomentTexture = 0;
+    }
+    m_Size = 0;
+}
+
+int ShadowAtlas::BytesPerTexel(ShadowDepthFormat format) {
+    return DEPTH_FORMATS[format].bytesPerTexel;
+}
+
+size_t ShadowAtlas::GetMemoryUsage(int size, ShadowDepthFormat format, bool withStaticAtlas, bool withMomentAtlas) {
+    size_t atlasBytes = (size_t)size * size * BytesPerTexel(format);
+    size_t bytes = withStaticAtlas ? atlasBytes * 2 : atlasBytes;
+    // RGBA16F at half the size, the mip levels add up to another third
+    if (withMomentAtlas) bytes += (size_t)size / 2 * size / 2 * 8 * 4 / 3;
+    return bytes;
+}
+
+size_t ShadowAtlas::GetMemoryUsage() const {
+    return GetMemoryUsage(m_Size, m_CreatedFormat, m_HasStaticAtlas, m_HasMomentAtlas);
+}
+
+bool ShadowAtlas::Reset(bool withStaticAtlas, bool withMomentAtlas) {
+    bool recreate = m_FBO == 0 || m_Budget != m_CreatedBudget || m_Format != m_CreatedFormat || withStaticAtlas != m_HasStaticAtlas
+        || withMomentAtlas != m_HasMomentAtlas;
+    if (recreate) {
+        Destroy();
+        m_CreatedBudget = m_Budget;
+        m_CreatedFormat = m_Format;
+        m_HasStaticAtlas = withStaticAtlas;
+        m_HasMomentAtlas = withMomentAtlas;
+
+        int size = MIN_TILE_SIZE;
+        while (GetMemoryUsage(size * 2, m_Format, withStaticAtlas, withMomentAtlas) <= m_Budget) size *= 2;
+        m_Size = size;
+
+        std::cout << "Creating shadow atlas (" << size << "x" << size << (withMomentAtlas ? " with moments" : "") << ", "
+                  << GetMemoryUsage() / (1024 * 1024) << "MB)...\n";
+        createAtlasTexture(m_FBO, m_Texture, size, DEPTH_FORMATS[m_Format]);
+        if (withStaticAtlas) createAtlasTexture(m_StaticFBO, m_StaticTexture, size, DEPTH_FORMATS[m_Format]);
+        if (withMomentAtlas) createMomentTexture(m_MomentFBO, m_MomentTexture, size / 2);
+        std::cout << "Done!\n";
+    }
+
+    m_Nodes.clear();
+    Node root;
+    root.rect = { 0, 0, m_Size };
+    m_Nodes.push_back(root);
+    return recreate;
+}
+
+bool ShadowAtlas::Allocate(int size, Rect& rect) {
+    size = std::min(size, GetMaxTileSize());
+    for (; size >= MIN_TILE_SIZE; size /= 2) {
+        int node = Allocate(0, size);
+        if (node >= 0) {
+            rect = m_Nodes[node].rect;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Depth first, so tiles fill the atlas from its first corner
+int ShadowAtlas::Allocate(int nodeIndex, int size) {
+    if (m_Nodes[nodeIndex].used || m_Nodes[nodeIndex].rect.size < size) return -1;
+
+    if (m_Nodes[nodeIndex].firstChild < 0) {
+        if (m_Nodes[nodeIndex].rect.size == size) {
+            m_Nodes[nodeIndex].used = true;
+            return nodeIndex;
+        }
+        // Split, the vector may grow so the node is looked up by index
+        Rect rect = m_Nodes[nodeIndex].rect;
+        int half = rect.size / 2;
+        m_Nodes[nodeIndex].firstChild = (int)m_Nodes.size();
+        for (int i = 0; i < 4; i++) {
+            Node child;
+            child.rect = { rect.x + (i & 1) * half, rect.y + (i >> 1) * half, half };
+            m_Nodes.push_back(child);
+        }
+    }
+
+    int firstChild = m_Nodes[nodeIndex].firstChild;
+    for (int i = 0; i < 4; i++) {
+        int node = Allocate(firstChild + i, size);
+        if (node >= 0) return node;
+    }
+    return -1;
+}
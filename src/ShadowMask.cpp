@@ -0,0 +1,86 @@
+#include "ShadowMask.h"
+
+#include <assert.h>
+
+#include "GLutils.h"
+
+ShadowMask::~ShadowMask() {
+    Destroy();
+}
+
+void ShadowMask::Destroy() {
+    if (m_DepthFBO == 0) return;
+    glDeleteFramebuffers(1, &m_DepthFBO);
+    glDeleteTextures(1, &m_DepthTexture);
+    glDeleteFramebuffers(1, &m_MaskFBO);
+    glDeleteTextures(1, &m_ViewDepthTexture);
+    glDeleteTextures(1, &m_MaskTexture);
+    m_DepthFBO = m_MaskFBO = 0;
+}
+
+void ShadowMask::Resize(int width, int height, int numLayers) {
+    assert(numLayers > 0 && numLayers <= MAX_LAYERS);
+    if (m_DepthFBO != 0 && width == m_Width && height == m_Height && numLayers <= m_NumLayers) return;
+    Destroy();
+    m_Width = width;
+    m_Height = height;
+    m_NumLayers = numLayers;
+
+    std::cout << "Creating shadow mask (" << GetMaskWidth() << "x" << GetMaskHeight() << ", " << numLayers * 4 << " channels)...\n";
+
+    GL_CALL(glGenTextures(1, &m_DepthTexture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, m_DepthTexture));
+    GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL_CALL(glGenFramebuffers(1, &m_DepthFBO));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_DepthFBO));
+    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, m_DepthTexture, 0));
+    GL_CALL(glDrawBuffer(GL_NONE));
+    GL_CALL(glReadBuffer(GL_NONE));
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glGenTextures(1, &m_ViewDepthTexture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, m_ViewDepthTexture));
+    GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, GetMaskWidth(), GetMaskHeight(), 0, GL_RED, GL_FLOAT, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+
+    // Linear filtering, the main pass takes one bilinear tap where
+    // the depth of all four texels matches
+    GL_CALL(glGenTextures(1, &m_MaskTexture));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, m_MaskTexture));
+    GL_CALL(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, GetMaskWidth(), GetMaskHeight(), numLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL_CALL(glGenFramebuffers(1, &m_MaskFBO));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_MaskFBO));
+    GLenum drawBuffers[MAX_LAYERS + 1] = { GL_COLOR_ATTACHMENT0 };
+    GL_CALL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_ViewDepthTexture, 0));
+    for (int i = 0; i < numLayers; i++) {
+        GL_CALL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1 + i, m_MaskTexture, 0, i));
+        drawBuffers[i + 1] = GL_COLOR_ATTACHMENT1 + i;
+    }
+    GL_CALL(glDrawBuffers(numLayers + 1, drawBuffers));
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    GL_CALL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+    std::cout << "Done!\n";
+}
+
+void ShadowMask::CopyDepth() {
+    GL_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER, 0));
+    GL_CALL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_DepthFBO));
+    GL_CALL(glBlitFramebuffer(0, 0, m_Width, m_Height, 0, 0, m_Width, m_Height, GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+void ShadowMask::BindForMask() {
+    GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, m_MaskFBO));
+    GL_CALL(glViewport(0, 0, GetMaskWidth(), GetMaskHeight()));
+}
@@ -7,7 +7,9 @@
 #include "Timer.h"
 #include "Scene.h"
 #include "Global.h"
+#include "AssetWatcher.h"
 #include <assert.h>
+#include <cstring>
 #include <filesystem>
 namespace fs = std::filesystem;
 
@@ -27,6 +29,32 @@ float noisySin(float seed) {
     return (normSin(seed*.3f)+1.f) * (normSin(seed*.6f)+.1f) * (normSin(seed*2.5f)+2.f) * (normSin(seed*.1f)+.9f);
 }
 
+// Names of the ShadowFilter tiers on the command line and in reports
+const char* SHADOW_FILTER_NAMES[SHADOW_FILTER_COUNT] = { "box", "hardware", "poisson4", "poisson8", "poisson16" };
+ShadowFilter parseShadowFilter(const char* name) {
+    for (int i = 0; i < SHADOW_FILTER_COUNT; i++) {
+        if (strcmp(name, SHADOW_FILTER_NAMES[i]) == 0) return (ShadowFilter)i;
+    }
+    std::cout << "Unknown shadow filter '" << name << "', using box\n";
+    return SHADOW_FILTER_BOX;
+}
+ShadowFilter nextShadowFilter(ShadowFilter filter) {
+    return (ShadowFilter)((filter + 1) % SHADOW_FILTER_COUNT);
+}
+
+// Same for the ShadowMapType of spot and directional lights
+const char* SHADOW_MAP_TYPE_NAMES[SHADOW_MAP_TYPE_COUNT] = { "depth", "vsm", "evsm" };
+ShadowMapType parseShadowMapType(const char* name) {
+    for (int i = 0; i < SHADOW_MAP_TYPE_COUNT; i++) {
+        if (strcmp(name, SHADOW_MAP_TYPE_NAMES[i]) == 0) return (ShadowMapType)i;
+    }
+    std::cout << "Unknown shadow map type '" << name << "', using depth\n";
+    return SHADOW_MAP_DEPTH;
+}
+ShadowMapType nextShadowMapType(ShadowMapType type) {
+    return (ShadowMapType)((type + 1) % SHADOW_MAP_TYPE_COUNT);
+}
+
 
 class FileManager {
 private:
@@ -72,7 +100,7 @@ std::string FileManager::FromRoot(const std::string& relPath) {
     return s_Root + "/" + relPath;
 }
 
-int main(int , char** argv)  {
+int main(int argc, char** argv)  {
 
     /**********************************
  *     CONTROLS:
@@ -88,11 +116,97 @@ int main(int , char** argv)  {
  * CTRL + G: Spinning spotlight
  * CTRL + H: Moving pointlight
  *
+ *   RENDERING:
+ * CTRL + P: Switch between forward and deferred shading
+ * CTRL + Z: Toggle the depth prepass of forward shading
+ * CTRL + 1/2/3: Next shadow filter of directional/spot/point lights
+ * CTRL + 4: Toggle the adaptive shadow filter kernel
+ * CTRL + 5: Toggle the shadow debug view (lit, shadowed, penumbra)
+ * CTRL + M: Toggle the half resolution shadow mask (with the depth prepass)
+ * CTRL + 6/7: Next shadow map type (depth, VSM, EVSM) of the sun/spot lights
+ * CTRL + 8: Toggle layered shadow passes (all spot lights at once, all cascades at once)
+ *
  * If performance is bad, you can try to lower the "numGrasses"
  * variable to render less grass.
  *
+ *   COMMAND LINE:
+ * --lights N: Add N small point lights without shadows
+ *             over the grass, to stress the light clusters
+ * --shadowed-lights N: The first N of those cast shadows
+ * --deferred: Start with deferred shading
+ * --prepass: Start with the depth prepass
+ * --overdraw: Report the samples shaded per pixel every 5 seconds
+ * --cascades N: Shadow cascades of the sun, 1 to 4 (default 3)
+ * --shadow-budget MB: Memory of the spot light shadow atlas (default 64)
+ * --shadow-depth 16|24|32: Depth bits of the shadow atlas (default 32)
+ * --point-shadow-size N: Cube face size of point light shadows (default 2048)
+ * --point-shadow-faces N: Point light cube faces drawn per frame, 0 for no limit (default 12)
+ * --paraboloid-shadows: Stress lights cast dual paraboloid shadows instead of cube maps
+ * --dir-shadow-filter, --spot-shadow-filter, --point-shadow-filter
+ *     box|hardware|poisson4|poisson8|poisson16: Shadow filter of each light type (default box)
+ * --shading-timings: Report the GPU time of the lit passes every 5 seconds
+ * --no-adaptive-shadows: Run the full shadow filter kernel everywhere
+ * --shadow-debug: Start with the shadow debug view
+ * --shadow-mask: Start with the shadow mask, needs --prepass
+ * --sun-shadow-map, --spot-shadow-map depth|vsm|evsm: Shadow map type
+ *     of the sun and the spot lights (default depth)
+ * --shadow-bleed X: Light bleeding reduction of VSM and EVSM, 0 to 1 (default 0.2)
+ * --moment-blur N: Blur radius of VSM and EVSM in texels, 0 to 8 (default 2)
+ * --shadowed-spots N: Add N sweeping shadowed spot lights around the cottage
+ * --layered-shadows: Start with layered shadow passes
+ * --shadow-timings: Report the CPU time of the shadow passes every 5 seconds
+ * --no-grass-point-shadows: Leave the grass out of point light shadows
+ * --grass-radius R: Scatter the grass over a square of R instead of 120, as densely
+ * --grass-lod-start D, --grass-lod-end D: Thin the grass out from the start distance
+ *   to the camera on, until none is left at the end. An end of 0 draws all of it
+ *
  * *********************************/
 
+    int numStressLights = 0, numShadowedStressLights = 0, numShadowedSpots = 0;
+    int numShadowCascades = 0;
+    int shadowBudgetMB = 0, shadowDepthBits = 0, pointShadowSize = 0, pointShadowFaces = -1;
+    bool reportOverdraw = false, paraboloidShadows = false, reportShadingTimings = false;
+    bool adaptiveShadows = true, shadowDebugView = false, shadowMask = false;
+    bool layeredShadows = false, reportShadowTimings = false, grassPointShadows = true;
+    ShadowFilters shadowFilters;
+    ShadowMapType sunShadowMap = SHADOW_MAP_DEPTH, spotShadowMap = SHADOW_MAP_DEPTH;
+    float shadowBleed = -1.0f;
+    int momentBlur = -1;
+    float grassRadius = 120.f, grassLodStart = -1.0f, grassLodEnd = -1.0f;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--lights") == 0) numStressLights = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--shadowed-lights") == 0) numShadowedStressLights = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--cascades") == 0) numShadowCascades = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--shadow-budget") == 0) shadowBudgetMB = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--shadow-depth") == 0) shadowDepthBits = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--point-shadow-size") == 0) pointShadowSize = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--point-shadow-faces") == 0) pointShadowFaces = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--dir-shadow-filter") == 0) shadowFilters.dir = parseShadowFilter(argv[i + 1]);
+        if (strcmp(argv[i], "--spot-shadow-filter") == 0) shadowFilters.spot = parseShadowFilter(argv[i + 1]);
+        if (strcmp(argv[i], "--point-shadow-filter") == 0) shadowFilters.point = parseShadowFilter(argv[i + 1]);
+        if (strcmp(argv[i], "--sun-shadow-map") == 0) sunShadowMap = parseShadowMapType(argv[i + 1]);
+        if (strcmp(argv[i], "--spot-shadow-map") == 0) spotShadowMap = parseShadowMapType(argv[i + 1]);
+        if (strcmp(argv[i], "--shadow-bleed") == 0) shadowBleed = (float)atof(argv[i + 1]);
+        if (strcmp(argv[i], "--moment-blur") == 0) momentBlur = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--shadowed-spots") == 0) numShadowedSpots = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--grass-radius") == 0) grassRadius = (float)atof(argv[i + 1]);
+        if (strcmp(argv[i], "--grass-lod-start") == 0) grassLodStart = (float)atof(argv[i + 1]);
+        if (strcmp(argv[i], "--grass-lod-end") == 0) grassLodEnd = (float)atof(argv[i + 1]);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--deferred") == 0) g_UseDeferredShading = true;
+        if (strcmp(argv[i], "--prepass") == 0) g_UseDepthPrepass = true;
+        if (strcmp(argv[i], "--overdraw") == 0) reportOverdraw = true;
+        if (strcmp(argv[i], "--paraboloid-shadows") == 0) paraboloidShadows = true;
+        if (strcmp(argv[i], "--shading-timings") == 0) reportShadingTimings = true;
+        if (strcmp(argv[i], "--no-adaptive-shadows") == 0) adaptiveShadows = false;
+        if (strcmp(argv[i], "--shadow-debug") == 0) shadowDebugView = true;
+        if (strcmp(argv[i], "--shadow-mask") == 0) shadowMask = true;
+        if (strcmp(argv[i], "--layered-shadows") == 0) layeredShadows = true;
+        if (strcmp(argv[i], "--shadow-timings") == 0) reportShadowTimings = true;
+        if (strcmp(argv[i], "--no-grass-point-shadows") == 0) grassPointShadows = false;
+    }
+
     //
     // Initialization
     //
@@ -113,18 +227,61 @@ int main(int , char** argv)  {
         return -1;
     }
     std::cout << "OK!\n";
+    loadGLExtensions((GLADloadproc)glfwGetProcAddress);
 
     TextureBindContext::Init();
     FileManager::Init(argv[0]);
 
+    // Compiled programs are cached between runs, delete the
+    // directory to force a full recompile.
+    Shader::SetBinaryCacheDirectory(FileManager::FromRoot("cache/shaders"));
+
+    // Without parallel shader compile in the driver, compile on a
+    // thread with a shared context so rendering never waits on it.
+    if (!getGLExtensions().parallelShaderCompile && window.CreateSharedContext()) {
+        Shader::StartCompileThread([&window]() { window.MakeSharedContextCurrent(); },
+                                   [&window]() { window.ReleaseCurrentContext(); });
+    }
+
+    // Shaders, models, materials and textures reload when their files change
+    AssetWatcher::Get().Init(FileManager::FromRoot("assets"));
+
     // Load shaders
+    Timer shaderLoadTimer;
     Shader blinnPhongShader(FileManager::FromRoot("assets/shaders/blinn-phong.vert"), FileManager::FromRoot("assets/shaders/blinn-phong.frag"));
     Shader skyboxShader(FileManager::FromRoot("assets/shaders/skybox.vert"), FileManager::FromRoot("assets/shaders/skybox.frag"));
     Shader depthMapShader(FileManager::FromRoot("assets/shaders/depth-map.vert"), FileManager::FromRoot("assets/shaders/depth-map.frag"));
     Shader depthMapShader3D(FileManager::FromRoot("assets/shaders/depth-map3D.vert"), FileManager::FromRoot("assets/shaders/depth-map3D.frag"), FileManager::FromRoot("assets/shaders/depth-map3D.geo"));
+    Shader depthParaboloidShader(FileManager::FromRoot("assets/shaders/depth-map3D.vert"), FileManager::FromRoot("assets/shaders/depth-paraboloid.frag"), FileManager::FromRoot("assets/shaders/depth-paraboloid.geo"));
+    Shader gBufferShader(FileManager::FromRoot("assets/shaders/blinn-phong.vert"), FileManager::FromRoot("assets/shaders/gbuffer.frag"));
+    Shader deferredCompositeShader(FileManager::FromRoot("assets/shaders/fullscreen.vert"), FileManager::FromRoot("assets/shaders/deferred-composite.frag"));
+    Shader deferredDirShader(FileManager::FromRoot("assets/shaders/fullscreen.vert"), FileManager::FromRoot("assets/shaders/deferred-dir.frag"));
+    Shader deferredPointShader(FileManager::FromRoot("assets/shaders/deferred-volume.vert"), FileManager::FromRoot("assets/shaders/deferred-point.frag"));
+    Shader deferredSpotShader(FileManager::FromRoot("assets/shaders/deferred-volume.vert"), FileManager::FromRoot("assets/shaders/deferred-spot.frag"));
+    Shader shadowMaskShader(FileManager::FromRoot("assets/shaders/fullscreen.vert"), FileManager::FromRoot("assets/shaders/shadow-mask.frag"));
+    Shader shadowMomentsShader(FileManager::FromRoot("assets/shaders/fullscreen.vert"), FileManager::FromRoot("assets/shaders/shadow-moments.frag"));
+    Shader depthLayeredShader(FileManager::FromRoot("assets/shaders/depth-map3D.vert"), FileManager::FromRoot("assets/shaders/depth-layered.frag"), FileManager::FromRoot("assets/shaders/depth-layered.geo"));
+    std::cout << "Shaders loaded in " << shaderLoadTimer.Record().GetMilliseconds() << "ms\n";
 
     // Add 3D models to scene and set transform matrices
     Scene scene;
+    if (numShadowCascades > 0) scene.SetNumShadowCascades(numShadowCascades);
+    if (shadowBudgetMB > 0) scene.SetShadowAtlasBudget((size_t)shadowBudgetMB * 1024 * 1024);
+    if (shadowDepthBits == 16) scene.SetShadowDepthFormat(SHADOW_DEPTH_16);
+    if (shadowDepthBits == 24) scene.SetShadowDepthFormat(SHADOW_DEPTH_24);
+    if (pointShadowSize > 0) scene.SetPointShadowSize(pointShadowSize);
+    if (pointShadowFaces >= 0) scene.SetPointShadowFaceBudget(pointShadowFaces);
+    scene.SetShadowFilters(shadowFilters);
+    scene.SetAdaptiveShadows(adaptiveShadows);
+    scene.SetShadowDebugView(shadowDebugView);
+    scene.SetShadowMask(shadowMask);
+    scene.SetLayeredShadows(layeredShadows);
+    if (!grassPointShadows) scene.SetGrassRenderLayers(RENDER_LAYERS_ALL & ~RENDER_LAYER_POINT_SHADOW);
+    if (grassLodStart >= 0.0f || grassLodEnd >= 0.0f) {
+        scene.SetGrassDensityLod(grassLodStart >= 0.0f ? grassLodStart : 80.0f, grassLodEnd >= 0.0f ? grassLodEnd : 300.0f);
+    }
+    if (shadowBleed >= 0.0f) scene.SetShadowBleedReduction(shadowBleed);
+    if (momentBlur >= 0) scene.SetMomentBlurRadius(momentBlur);
     scene.AddModel(new Model(FileManager::FromRoot("assets/models/cottage/cottage.obj")))
         ->GetTransform().SetTranslation({ 0, -5, -100 });
     scene.AddModel(new Model(FileManager::FromRoot("assets/models/container/container.obj")))
@@ -158,24 +315,27 @@ int main(int , char** argv)  {
     dirLight.direction = { -.5f, -0.5f, 1.f };
     dirLight.intensity = 0.8f;
     dirLight.diffuse = { 1.0f, 0.8f, 0.3f };
+    dirLight.depthMapInfo.mapType = sunShadowMap;
     size_t sunIndex = scene.AddDirLight(dirLight);
 
     size_t flashLightIndex = scene.AddSpotLight();
     scene.GetSpotLightAt(flashLightIndex).cutOff = PI32 * 0.1f;
     scene.GetSpotLightAt(flashLightIndex).outerCutOff = PI32 * 0.1f * 1.5f;
+    scene.GetSpotLightAt(flashLightIndex).depthMapInfo.mapType = spotShadowMap;
 
     SpotLight spotLight;
     spotLight.position = { 5, 4.f, -80 };
     spotLight.cutOff = PI32 * 0.2f;
     spotLight.outerCutOff = spotLight.cutOff * 1.5f;
+    spotLight.depthMapInfo.mapType = spotShadowMap;
     size_t spinningLightindex = scene.AddSpotLight(spotLight);
 
     bool flashLightOn = false;
     bool spinningLightOn = false;
     bool pointLightOn = true;
 
-    Texture grassTexture = loadTexture(FileManager::FromRoot("assets/textures/grass.png"));
-    Texture grassNormalMap = loadTexture(FileManager::FromRoot("assets/textures/grass_normals.png"));
+    Texture grassTexture = MaterialLibrary::Get().GetTexture(FileManager::FromRoot("assets/textures/grass.png"));
+    Texture grassNormalMap = MaterialLibrary::Get().GetTexture(FileManager::FromRoot("assets/textures/grass_normals.png"));
 
     //
     // Generate grass quads 
@@ -189,7 +349,9 @@ int main(int , char** argv)  {
 #endif
 
     float grassY = -5.f;
-    float radius = 120.f;
+    float radius = grassRadius;
+    // Same density over a different field
+    numGrasses = (int)(numGrasses * (radius / 120.f) * (radius / 120.f));
 
     // Randomly place grass within radius
     for (int i = 0; i < numGrasses; ++i) {
@@ -206,6 +368,36 @@ int main(int , char** argv)  {
         scene.AddGrass({xPosition, yPosition, zPosition}, rotation, { 3.f, 5.f });
     }
 
+    // Stress lights are added after the grass so the grass placement stays the same
+    for (int i = 0; i < numStressLights; ++i) {
+        PointLight light;
+        light.position = { -59.f + (rand() % 1200) / 10.f, grassY + 1.f + (rand() % 40) / 10.f, -120.f + (rand() % 1200) / 10.f };
+        light.innerRadius = 1.f;
+        light.outerRadius = 4.f + (rand() % 40) / 10.f;
+        light.diffuse = { (rand() % 100) / 100.f, (rand() % 100) / 100.f, (rand() % 100) / 100.f };
+        light.specular = light.diffuse.Multiply(0.4f);
+        light.depthMapInfo.cast = i < numShadowedStressLights;
+        if (paraboloidShadows) light.depthMapInfo.mode = POINT_SHADOW_PARABOLOID;
+        scene.AddPointLight(light);
+    }
+    if (numStressLights > 0) std::cout << "Added " << numStressLights << " stress lights\n";
+
+    // Shadowed spot lights in a ring around the cottage, looking in
+    std::vector<size_t> shadowedSpotIndices;
+    for (int i = 0; i < numShadowedSpots; ++i) {
+        SpotLight light;
+        float angle = PI32 * 2.0f * i / numShadowedSpots;
+        light.position = { 5.f + std::cos(angle) * 20.f, 6.f, -80.f + std::sin(angle) * 20.f };
+        light.cutOff = PI32 * 0.05f;
+        light.outerCutOff = light.cutOff * 1.5f;
+        light.diffuse = { (rand() % 100) / 100.f, (rand() % 100) / 100.f, (rand() % 100) / 100.f };
+        light.specular = light.diffuse.Multiply(0.4f);
+        light.intensity = 0.2f;
+        light.depthMapInfo.mapType = spotShadowMap;
+        shadowedSpotIndices.push_back(scene.AddSpotLight(light));
+    }
+    if (numShadowedSpots > 0) std::cout << "Added " << numShadowedSpots << " shadowed spot lights\n";
+
     // MaterialLibrary::Get().GetMaterial("Container")->shouldCastShadow = false;
 
     // scene.GetPointLightAt(pointLightIndex).depthMapInfo.cast = false;    
@@ -230,12 +422,46 @@ int main(int , char** argv)  {
     drawContext.skyboxShader = &skyboxShader;
     drawContext.depthMapShader = &depthMapShader;
     drawContext.depthMapShader3D = &depthMapShader3D;
+    drawContext.depthParaboloidShader = &depthParaboloidShader;
+    drawContext.gBufferShader = &gBufferShader;
+    drawContext.deferredCompositeShader = &deferredCompositeShader;
+    drawContext.deferredDirShader = &deferredDirShader;
+    drawContext.deferredPointShader = &deferredPointShader;
+    drawContext.deferredSpotShader = &deferredSpotShader;
+    drawContext.shadowMaskShader = &shadowMaskShader;
+    drawContext.shadowMomentsShader = &shadowMomentsShader;
+    drawContext.depthLayeredShader = &depthLayeredShader;
     drawContext.grassTexture = grassTexture;
     drawContext.grassNormalMap = grassNormalMap;
 
     Timer animationTimer; // Used for animating with std::sin
     Timer frameTimer; // Used for deltaTime
     Timer pointLightTimer; // Used for changing pointLight position
+    Timer reloadTimer; // Used for reporting how long a hot reload took
+    Timer clusterStatsTimer; // Used for reporting light cluster stats
+    Timer overdrawTimer; // Used for reporting overdraw
+    Timer shadingTimer; // Used for reporting the GPU time of the lit passes
+    Timer shadowTimingsTimer; // Used for reporting the CPU time of the shadow passes
+    bool shadersReloading = false;
+    // GPU time of the lit passes since the shadow filters, the
+    // adaptive kernel or the shadow mask last changed.
+    // Queries are read a frame late, the first frame after a change is
+    // left out.
+    double shadingMilliseconds = 0.0;
+    int shadingFrames = 0, shadingFramesToSkip = 1;
+    // CPU time of the directional and spot shadow passes since the
+    // last report or since layered passes were toggled
+    double shadowSubmitMilliseconds = 0.0;
+    int shadowSubmitFrames = 0;
+    auto reportShading = [&]() {
+        const ShadowFilters& filters = scene.GetShadowFilters();
+        std::cout << "Shading: " << (shadingFrames > 0 ? shadingMilliseconds / shadingFrames : 0.0) << "ms GPU over "
+                  << shadingFrames << " frames, shadow filters " << SHADOW_FILTER_NAMES[filters.dir] << " directional, "
+                  << SHADOW_FILTER_NAMES[filters.spot] << " spot, " << SHADOW_FILTER_NAMES[filters.point] << " point"
+                  << (scene.GetAdaptiveShadows() ? ", adaptive" : "")
+                  << (scene.GetShadowMask() && g_UseDepthPrepass && !g_UseDeferredShading ? ", shadow mask" : "") << "\n";
+    };
+    double longestReloadFrame = 0.0;
     while (window.IsRunning()) {
 
         Duration frameTime = frameTimer.Record();
@@ -300,7 +526,21 @@ int main(int , char** argv)  {
             blinnPhongShader.HotReload();
             depthMapShader.HotReload();
             depthMapShader3D.HotReload();
+            depthParaboloidShader.HotReload();
             skyboxShader.HotReload();
+            gBufferShader.HotReload();
+            deferredCompositeShader.HotReload();
+            deferredDirShader.HotReload();
+            deferredPointShader.HotReload();
+            deferredSpotShader.HotReload();
+            shadowMaskShader.HotReload();
+            shadowMomentsShader.HotReload();
+            depthLayeredShader.HotReload();
+
+            // Shaders compile in the background while the old ones keep rendering
+            reloadTimer.Reset();
+            shadersReloading = true;
+            longestReloadFrame = 0.0;
         }
         if (!window.IsKeyDown(GLFW_KEY_R)) wasRDown = false;
 
@@ -360,6 +600,123 @@ int main(int , char** argv)  {
             }
             if (!window.IsKeyDown(GLFW_KEY_H)) wasHDown = false;
 
+            // CTRL + P: Switch between forward and deferred shading
+            static bool wasPDown = false;
+            if (window.IsKeyDown(GLFW_KEY_P) && !wasPDown) {
+                wasPDown = true;
+
+                g_UseDeferredShading = !g_UseDeferredShading;
+                std::cout << (g_UseDeferredShading ? "Deferred" : "Forward") << " shading\n";
+            }
+            if (!window.IsKeyDown(GLFW_KEY_P)) wasPDown = false;
+
+            // CTRL + Z: Toggle depth prepass
+            static bool wasZDown = false;
+            if (window.IsKeyDown(GLFW_KEY_Z) && !wasZDown) {
+                wasZDown = true;
+
+                g_UseDepthPrepass = !g_UseDepthPrepass;
+                std::cout << "Depth prepass " << (g_UseDepthPrepass ? "on" : "off") << "\n";
+            }
+            if (!window.IsKeyDown(GLFW_KEY_Z)) wasZDown = false;
+
+            // CTRL + 1/2/3: Next directional/spot/point shadow filter,
+            // reports the GPU time of the one before
+            static bool wasFilterKeyDown[3] = {};
+            int filterKeys[3] = { GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3 };
+            for (int i = 0; i < 3; i++) {
+                if (window.IsKeyDown(filterKeys[i]) && !wasFilterKeyDown[i]) {
+                    wasFilterKeyDown[i] = true;
+
+                    reportShading();
+                    ShadowFilters filters = scene.GetShadowFilters();
+                    ShadowFilter& filter = i == 0 ? filters.dir : i == 1 ? filters.spot : filters.point;
+                    filter = nextShadowFilter(filter);
+                    scene.SetShadowFilters(filters);
+                    shadingMilliseconds = 0.0;
+                    shadingFrames = 0;
+                    shadingFramesToSkip = 1;
+                }
+                if (!window.IsKeyDown(filterKeys[i])) wasFilterKeyDown[i] = false;
+            }
+
+            // CTRL + 4: Toggle the adaptive shadow kernel, reports
+            // the GPU time with the one before
+            static bool was4Down = false;
+            if (window.IsKeyDown(GLFW_KEY_4) && !was4Down) {
+                was4Down = true;
+
+                reportShading();
+                scene.SetAdaptiveShadows(!scene.GetAdaptiveShadows());
+                shadingMilliseconds = 0.0;
+                shadingFrames = 0;
+                shadingFramesToSkip = 1;
+            }
+            if (!window.IsKeyDown(GLFW_KEY_4)) was4Down = false;
+
+            // CTRL + 5: Toggle the shadow debug view
+            static bool was5Down = false;
+            if (window.IsKeyDown(GLFW_KEY_5) && !was5Down) {
+                was5Down = true;
+
+                scene.SetShadowDebugView(!scene.GetShadowDebugView());
+                std::cout << "Shadow debug view " << (scene.GetShadowDebugView() ? "on" : "off") << "\n";
+            }
+            if (!window.IsKeyDown(GLFW_KEY_5)) was5Down = false;
+
+            // CTRL + M: Toggle the shadow mask, reports the GPU
+            // time with the one before
+            static bool wasMDown = false;
+            if (window.IsKeyDown(GLFW_KEY_M) && !wasMDown) {
+                wasMDown = true;
+
+                reportShading();
+                scene.SetShadowMask(!scene.GetShadowMask());
+                if (scene.GetShadowMask() && !g_UseDepthPrepass) std::cout << "The shadow mask needs the depth prepass (CTRL + Z)\n";
+                shadingMilliseconds = 0.0;
+                shadingFrames = 0;
+                shadingFramesToSkip = 1;
+            }
+            if (!window.IsKeyDown(GLFW_KEY_M)) wasMDown = false;
+
+            // CTRL + 6/7: Next shadow map type of the sun/spot lights,
+            // reports the GPU time of the one before
+            static bool wasMapKeyDown[2] = {};
+            int mapKeys[2] = { GLFW_KEY_6, GLFW_KEY_7 };
+            for (int i = 0; i < 2; i++) {
+                if (window.IsKeyDown(mapKeys[i]) && !wasMapKeyDown[i]) {
+                    wasMapKeyDown[i] = true;
+
+                    reportShading();
+                    ShadowMapType& sunMapType = scene.GetDirLightAt(sunIndex).depthMapInfo.mapType;
+                    ShadowMapType& flashMapType = scene.GetSpotLightAt(flashLightIndex).depthMapInfo.mapType;
+                    ShadowMapType type = nextShadowMapType(i == 0 ? sunMapType : flashMapType);
+                    if (i == 0) {
+                        sunMapType = type;
+                    } else {
+                        flashMapType = type;
+                        scene.GetSpotLightAt(spinningLightindex).depthMapInfo.mapType = type;
+                    }
+                    std::cout << (i == 0 ? "Sun" : "Spot light") << " shadow map: " << SHADOW_MAP_TYPE_NAMES[type] << "\n";
+                    shadingMilliseconds = 0.0;
+                    shadingFrames = 0;
+                    shadingFramesToSkip = 1;
+                }
+                if (!window.IsKeyDown(mapKeys[i])) wasMapKeyDown[i] = false;
+            }
+
+            // CTRL + 8: Toggle layered shadow passes
+            static bool was8Down = false;
+            if (window.IsKeyDown(GLFW_KEY_8) && !was8Down) {
+                was8Down = true;
+
+                scene.SetLayeredShadows(!scene.GetLayeredShadows());
+                std::cout << "Layered shadow passes " << (scene.GetLayeredShadows() ? "on" : "off") << "\n";
+                shadowSubmitMilliseconds = 0.0;
+                shadowSubmitFrames = 0;
+            }
+            if (!window.IsKeyDown(GLFW_KEY_8)) was8Down = false;
+
         }
 
         // Animation "seed" or time to use for animating stuff
@@ -369,17 +726,16 @@ int main(int , char** argv)  {
         // Flashlight animation
         //
 
+        auto& flashLight = scene.GetSpotLightAt(flashLightIndex);
+        flashLight.enabled = flashLightOn;
         if (flashLightOn) {
             // "Flicker" animation with a noisy sin function to make it look
             // like the flashlight is broken/low battery
-            auto& flashLight = scene.GetSpotLightAt(flashLightIndex);
             float flickerSpeed = 20.f;
             float flickerStrength = 0.1f;
             flashLight.intensity = 1.0f - (noisySin(animationSeed * flickerSpeed) * flickerStrength);
             flashLight.position = scene.GetViewMatrix().GetTranslation();
             flashLight.direction = scene.GetViewMatrix().TransformDirection({ 0, 0, -1 });
-        } else {
-            scene.GetSpotLightAt(flashLightIndex).intensity = 0.0f;
         }
 
         //
@@ -387,6 +743,7 @@ int main(int , char** argv)  {
         //
 
         auto& spinningLight = scene.GetSpotLightAt(spinningLightindex);
+        spinningLight.enabled = spinningLightOn;
         if (spinningLightOn) {
             // Spinning and blinking like a siren
             float base = 0.2f;
@@ -400,8 +757,13 @@ int main(int , char** argv)  {
             float angle = animationSeed * spinSpeed;
             spinningLight.direction.x = std::cos(angle);
             spinningLight.direction.z = std::sin(angle);
-        } else {
-            spinningLight.intensity = 0.0f;
+        }
+
+        // Shadowed spot lights sweep from side to side
+        for (size_t i = 0; i < shadowedSpotIndices.size(); i++) {
+            auto& light = scene.GetSpotLightAt(shadowedSpotIndices[i]);
+            float angle = PI32 * 2.0f * i / shadowedSpotIndices.size() + std::sin(animationSeed + i) * 0.3f;
+            light.direction = Vec3(-std::cos(angle), -0.3f, -std::sin(angle)).Normalized();
         }
 
         auto& sunLight = scene.GetDirLightAt(sunIndex);
@@ -427,13 +789,12 @@ int main(int , char** argv)  {
         pointLight.position.x = pointLightLastPos.x + progress * (pointLightTargetPos.x - pointLightLastPos.x);
         pointLight.position.z = pointLightLastPos.z + progress * (pointLightTargetPos.z - pointLightLastPos.z);
 
+        pointLight.enabled = pointLightOn;
         if (pointLightOn) {
             // Pulse animation
             float pulseSpeed = 5.0f;
             float pulseStrength = 0.7f;
             pointLight.intensity = 1.0f - (pulseStrength * normSin(std::sin(animationSeed * pulseSpeed)));
-        } else {
-            pointLight.intensity = 0.0f;    
         }
         
 
@@ -484,8 +845,93 @@ int main(int , char** argv)  {
 
         scene.Draw(drawContext);
 
+        if (shadingFramesToSkip > 0) {
+            shadingFramesToSkip--;
+        } else {
+            shadingMilliseconds += scene.GetShadingMilliseconds();
+            shadingFrames++;
+        }
+        if (reportShadingTimings && shadingTimer.Record().GetSecondsF() >= 5.0f) {
+            shadingTimer.Reset();
+            reportShading();
+        }
+
+        shadowSubmitMilliseconds += scene.GetShadowSubmitMilliseconds();
+        shadowSubmitFrames++;
+        if (reportShadowTimings && shadowTimingsTimer.Record().GetSecondsF() >= 5.0f) {
+            shadowTimingsTimer.Reset();
+            std::cout << "Shadow passes: " << shadowSubmitMilliseconds / shadowSubmitFrames << "ms CPU over "
+                      << shadowSubmitFrames << " frames, " << (scene.GetLayeredShadows() ? "layered" : "per map") << "\n";
+            shadowSubmitMilliseconds = 0.0;
+            shadowSubmitFrames = 0;
+        }
+
+        if (numStressLights > 0 && clusterStatsTimer.Record().GetSecondsF() >= 5.0f) {
+            clusterStatsTimer.Reset();
+            const LightClusters& clusters = scene.GetLightClusters();
+            std::cout << "Light clusters: " << clusters.GetBuildMilliseconds() << "ms build, "
+                      << clusters.GetWaitMilliseconds() << "ms wait, " << clusters.GetNumIndices()
+                      << " indices, max " << clusters.GetMaxLightsPerCluster() << " lights per cluster\n";
+        }
+
+        // Report whenever lights turn on or off, or leave the view
+        static LightActivity lastLightActivity;
+        const LightActivity& lightActivity = scene.GetLightActivity();
+        if (lightActivity != lastLightActivity) {
+            lastLightActivity = lightActivity;
+            std::cout << "Active lights: " << lightActivity.activePointLights << "/" << lightActivity.numPointLights << " point, "
+                      << lightActivity.activeSpotLights << "/" << lightActivity.numSpotLights << " spot, "
+                      << lightActivity.activeDirLights << "/" << lightActivity.numDirLights << " directional, "
+                      << lightActivity.shadowMapsDrawn << " shadow maps drawn, " << lightActivity.shadowMapsCached << " cached, "
+                      << lightActivity.pointFacesDrawn << " point shadow faces drawn, " << lightActivity.pointFacesWaiting << " waiting\n";
+        }
+
+        // Report whenever the grass drawn in the main view changes
+        static GrassStats lastGrassStats;
+        const GrassStats& grassStats = scene.GetGrassStats();
+        if (grassStats != lastGrassStats) {
+            lastGrassStats = grassStats;
+            std::cout << "Grass: " << grassStats.drawnChunks << "/" << grassStats.numChunks << " chunks, "
+                      << grassStats.drawnTufts << "/" << grassStats.numTufts << " tufts drawn\n";
+        }
+
+        // Report whenever the draws left out by render layers change
+        static RenderLayerStats lastRenderLayerStats;
+        const RenderLayerStats& renderLayerStats = scene.GetRenderLayerStats();
+        if (renderLayerStats != lastRenderLayerStats) {
+            lastRenderLayerStats = renderLayerStats;
+            std::cout << "Draws skipped by render layers: " << renderLayerStats.skippedDraws[0] << " main, "
+                      << renderLayerStats.skippedDraws[1] << " directional shadow, " << renderLayerStats.skippedDraws[2] << " spot shadow, "
+                      << renderLayerStats.skippedDraws[3] << " point shadow\n";
+        }
+
+        if (reportOverdraw && overdrawTimer.Record().GetSecondsF() >= 5.0f) {
+            overdrawTimer.Reset();
+            std::cout << "Overdraw: " << scene.GetShadedSamplesPerPixel() << " shaded samples per pixel ("
+                      << scene.GetShadedSamples() << " total), depth prepass "
+                      << (g_UseDeferredShading ? "unused" : g_UseDepthPrepass ? "on" : "off") << "\n";
+        }
+
+        if (shadersReloading) {
+            longestReloadFrame = std::max(longestReloadFrame, frameTimer.Record().GetMilliseconds());
+            if (!blinnPhongShader.IsReloading() && !depthMapShader.IsReloading()
+                && !depthMapShader3D.IsReloading() && !depthParaboloidShader.IsReloading() && !skyboxShader.IsReloading()
+                && !gBufferShader.IsReloading() && !deferredCompositeShader.IsReloading() && !deferredDirShader.IsReloading()
+                && !deferredPointShader.IsReloading() && !deferredSpotShader.IsReloading() && !shadowMaskShader.IsReloading()
+                && !shadowMomentsShader.IsReloading() && !depthLayeredShader.IsReloading()) {
+                shadersReloading = false;
+                std::cout << "Shaders reloaded in " << reloadTimer.Record().GetMilliseconds()
+                          << "ms, longest frame " << longestReloadFrame << "ms\n";
+            }
+        }
+
         // Poll events and swap window buffer
         window.PollEvents();
         window.SwapBuffers();
+
+        AssetWatcher::Get().Poll();
     }
+
+    AssetWatcher::Get().Shutdown();
+    Shader::StopCompileThread();
 }
\ No newline at end of file